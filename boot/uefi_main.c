@@ -3,6 +3,8 @@
 
 #define BOOT_INFO_MAGIC 0x4B414741
 #define BOOT_INFO_ADDR  0x90500
+#define MEMORY_MAP_ADDR 0x90600
+#define MEMORY_MAP_MAX  128
 #define KERNEL_LOAD_ADDR 0x100000
 #define KERNEL_RESERVED_SIZE (2 * 1024 * 1024) /* Reserve 2 MiB for kernel */
 
@@ -27,10 +29,79 @@ typedef struct {
     UINT32 framebuffer_height;
     UINT32 framebuffer_pitch;
     UINT32 framebuffer_bpp;
+    
+    /* ACPI */
+    UINT64 acpi_rsdp;
+
+    /* Ramdisk image */
+    UINT64 ramdisk_addr;
+    UINT64 ramdisk_size;
 } __attribute__((packed)) BOOT_INFO;
 
+typedef struct {
+    UINT64 base_addr;
+    UINT64 length;
+    UINT32 type;
+    UINT32 acpi_attr;
+} __attribute__((packed)) MEMORY_MAP_ENTRY;
+
 typedef void (*kernel_entry_t)(void);
 
+/* Translate the final EFI memory map into E820-style entries for the kernel.
+ * Boot services memory still holds our stack and page tables, so only
+ * conventional memory is reported usable. Runs after ExitBootServices. */
+static UINT32 export_memory_map(EFI_MEMORY_DESCRIPTOR *map, UINTN map_size, UINTN descriptor_size) {
+    MEMORY_MAP_ENTRY *out = (MEMORY_MAP_ENTRY *)MEMORY_MAP_ADDR;
+    UINT32 count = 0;
+
+    for (UINTN off = 0; off + descriptor_size <= map_size; off += descriptor_size) {
+        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)map + off);
+        UINT32 type;
+        switch (desc->Type) {
+            case EfiConventionalMemory:  type = 1; break;
+            case EfiACPIReclaimMemory:   type = 3; break;
+            case EfiACPIMemoryNVS:       type = 4; break;
+            default:                     type = 2; break;
+        }
+
+        UINT64 base = desc->PhysicalStart;
+        UINT64 length = desc->NumberOfPages * 4096;
+        if (count > 0 && out[count - 1].type == type &&
+            out[count - 1].base_addr + out[count - 1].length == base) {
+            out[count - 1].length += length;
+            continue;
+        }
+        if (count == MEMORY_MAP_MAX) {
+            break;
+        }
+        out[count].base_addr = base;
+        out[count].length = length;
+        out[count].type = type;
+        out[count].acpi_attr = 0;
+        count++;
+    }
+    return count;
+}
+
+/* Find the RSDP in the EFI configuration table, preferring ACPI 2.0+ */
+static UINT64 find_acpi_rsdp(EFI_SYSTEM_TABLE *SystemTable) {
+    EFI_GUID acpi20_guid = ACPI_20_TABLE_GUID;
+    EFI_GUID acpi10_guid = ACPI_TABLE_GUID;
+    UINT64 rsdp_v1 = 0;
+
+    for (UINTN i = 0; i < SystemTable->NumberOfTableEntries; i++) {
+        EFI_CONFIGURATION_TABLE *entry = &SystemTable->ConfigurationTable[i];
+        if (CompareGuid(&entry->VendorGuid, &acpi20_guid) == 0) {
+            return (UINT64)(UINTN)entry->VendorTable;
+        }
+        if (CompareGuid(&entry->VendorGuid, &acpi10_guid) == 0) {
+            rsdp_v1 = (UINT64)(UINTN)entry->VendorTable;
+        }
+    }
+
+    return rsdp_v1;
+}
+
 static EFI_STATUS load_kernel_from_fs(EFI_PHYSICAL_ADDRESS kernel_addr, UINTN max_size, UINTN *out_size) {
     EFI_STATUS status;
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Volume = NULL;
@@ -97,6 +168,97 @@ static EFI_STATUS load_kernel_from_fs(EFI_PHYSICAL_ADDRESS kernel_addr, UINTN ma
     return EFI_SUCCESS;
 }
 
+/* Size ramdisk.img from its FileInfo and read it into new pages. On
+ * success *addr and *size describe them; on failure nothing is left
+ * allocated except *info, which the caller frees. */
+static EFI_STATUS read_ramdisk(EFI_FILE_PROTOCOL *File, EFI_FILE_INFO **info,
+                               EFI_PHYSICAL_ADDRESS *addr, UINTN *size) {
+    EFI_STATUS status;
+    UINTN FileInfoSize = 0;
+
+    status = uefi_call_wrapper(File->GetInfo, 4, File, &gEfiFileInfoGuid, &FileInfoSize, NULL);
+    if (status != EFI_BUFFER_TOO_SMALL || FileInfoSize == 0) {
+        return EFI_ERROR(status) ? status : EFI_DEVICE_ERROR;
+    }
+    status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, FileInfoSize, (VOID**)info);
+    if (EFI_ERROR(status)) {
+        *info = NULL;
+        return status;
+    }
+    status = uefi_call_wrapper(File->GetInfo, 4, File, &gEfiFileInfoGuid, &FileInfoSize, *info);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    /* Below 4 GiB like the rest of the memory the kernel allocates */
+    if ((*info)->FileSize == 0 || (*info)->FileSize > 0xFFFFFFFFULL) {
+        Print(L"ERROR: ramdisk.img size invalid (%lu bytes)\n", (*info)->FileSize);
+        return EFI_BAD_BUFFER_SIZE;
+    }
+
+    UINTN bytes = (UINTN)(*info)->FileSize;
+    UINTN pages = (bytes + 4095) / 4096;
+    EFI_PHYSICAL_ADDRESS base = 0xFFFFFFFF;
+    status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateMaxAddress, EfiLoaderData, pages, &base);
+    if (EFI_ERROR(status)) {
+        Print(L"ERROR: No memory for ramdisk.img (%lu bytes)\n", bytes);
+        return status;
+    }
+
+    UINTN ReadSize = bytes;
+    status = uefi_call_wrapper(File->Read, 3, File, &ReadSize, (VOID*)(UINTN)base);
+    if (EFI_ERROR(status) || ReadSize != bytes) {
+        Print(L"ERROR: Read ramdisk.img failed (status: 0x%x, read %lu)\n", status, ReadSize);
+        uefi_call_wrapper(BS->FreePages, 2, base, pages);
+        return EFI_ERROR(status) ? status : EFI_DEVICE_ERROR;
+    }
+
+    *addr = base;
+    *size = bytes;
+    return EFI_SUCCESS;
+}
+
+/* Load the optional ramdisk.img from the ESP into loader pages, which the
+ * kernel sees as reserved and serves in place as a block device */
+static EFI_STATUS load_ramdisk_from_fs(UINT64 *out_addr, UINT64 *out_size) {
+    EFI_STATUS status;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Volume = NULL;
+    EFI_FILE_PROTOCOL *Root = NULL;
+    EFI_FILE_PROTOCOL *File = NULL;
+    EFI_FILE_INFO *FileInfo = NULL;
+    EFI_PHYSICAL_ADDRESS addr = 0;
+    UINTN size = 0;
+
+    *out_addr = 0;
+    *out_size = 0;
+
+    status = uefi_call_wrapper(BS->LocateProtocol, 3, &gEfiSimpleFileSystemProtocolGuid, NULL, (void**)&Volume);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    status = uefi_call_wrapper(Volume->OpenVolume, 2, Volume, &Root);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    status = uefi_call_wrapper(Root->Open, 5, Root, &File, L"ramdisk.img", EFI_FILE_MODE_READ, 0);
+    if (!EFI_ERROR(status)) {
+        status = read_ramdisk(File, &FileInfo, &addr, &size);
+        uefi_call_wrapper(File->Close, 1, File);
+    }
+
+    /* Every outcome past OpenVolume ends here */
+    if (FileInfo) {
+        uefi_call_wrapper(BS->FreePool, 1, FileInfo);
+    }
+    uefi_call_wrapper(Root->Close, 1, Root);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+
+    *out_addr = addr;
+    *out_size = size;
+    return EFI_SUCCESS;
+}
+
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     InitializeLib(ImageHandle, SystemTable);
 
@@ -154,6 +316,12 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
     }
     Print(L"KERNEL: Loaded %lu bytes at 0x%lx from FAT32\n", kernel_size, kernel_addr);
 
+    UINT64 ramdisk_addr = 0;
+    UINT64 ramdisk_size = 0;
+    if (!EFI_ERROR(load_ramdisk_from_fs(&ramdisk_addr, &ramdisk_size))) {
+        Print(L"RAMDISK: Loaded %lu bytes at 0x%lx from FAT32\n", ramdisk_size, ramdisk_addr);
+    }
+
     /* Now clear and show boot information */
     uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
     uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_TEXT_ATTR(EFI_LIGHTGREEN, EFI_BLACK));
@@ -306,6 +474,13 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
     Print(L"TOTAL MEMORY: %u MB\n", total_memory / (1024 * 1024));
     Print(L"KERNEL: Loaded at 0x%lx from FAT32\n", kernel_addr);
     
+    UINT64 acpi_rsdp = find_acpi_rsdp(SystemTable);
+    if (acpi_rsdp != 0) {
+        Print(L"ACPI: RSDP at 0x%lx\n", acpi_rsdp);
+    } else {
+        Print(L"WARNING: No ACPI RSDP in configuration table\n");
+    }
+    
     /* Setup boot info structure */
     BOOT_INFO *info = (BOOT_INFO*)BOOT_INFO_ADDR;
     info->magic = BOOT_INFO_MAGIC;
@@ -339,6 +514,10 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
         info->framebuffer_bpp = 0;
     }
     
+    info->acpi_rsdp = acpi_rsdp;
+    info->ramdisk_addr = ramdisk_addr;
+    info->ramdisk_size = ramdisk_size;
+    
     info->checksum = info->magic + info->boot_drive + info->memory_size_kb;
     
     Print(L"BOOT INFO: Ready at 0x90500\n");
@@ -348,6 +527,7 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
     
     /* Exit boot services - NO Print() between GetMemoryMap and ExitBootServices! */
     int attempts = 0;
+    UINTN final_map_size = 0;
     
     while (attempts < 10) {
         UINTN temp_size = buffer_size;
@@ -365,6 +545,8 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
             while(1) { __asm__ __volatile__("hlt"); }
         }
         
+        final_map_size = temp_size;
+
         /* IMMEDIATELY call ExitBootServices - NO Print() here! */
         status = uefi_call_wrapper(BS->ExitBootServices, 2, ImageHandle, map_key);
         if (!EFI_ERROR(status)) {
@@ -382,6 +564,10 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
     
     /* SUCCESS! */
     __asm__ __volatile__("cli");
+
+    /* The map filled by the last GetMemoryMap is the one now in force */
+    info->memory_regions = export_memory_map(memory_map, final_map_size, descriptor_size);
+    info->memory_map_addr = MEMORY_MAP_ADDR;
     
     __asm__ __volatile__(
         "mov %0, %%rax\n"
@@ -4,13 +4,52 @@
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA    0xCFC
 
+/* PCIe enhanced configuration space (from ACPI MCFG), 0 = port I/O only */
+static uint64_t ecam_base = 0;
+static uint8_t ecam_start_bus = 0;
+static uint8_t ecam_end_bus = 0;
+
+static volatile uint32_t *pci_ecam_reg(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus) {
+        return 0;
+    }
+    /* The MCFG base is where bus 0 would be, even when decoding starts later */
+    uint64_t addr = ecam_base +
+                    ((uint64_t)bus << 20) +
+                    ((uint64_t)(slot & 0x1F) << 15) +
+                    ((uint64_t)(func & 0x07) << 12) +
+                    (offset & 0xFC);
+    return (volatile uint32_t *)(uintptr_t)addr;
+}
+
+void pci_set_ecam(uint64_t base, uint8_t start_bus, uint8_t end_bus) {
+    ecam_base = base;
+    ecam_start_bus = start_bus;
+    ecam_end_bus = end_bus;
+}
+
+int pci_using_ecam(void) {
+    return ecam_base != 0;
+}
+
 uint32_t pci_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    volatile uint32_t *reg = pci_ecam_reg(bus, slot, func, offset);
+    if (reg) {
+        return *reg;
+    }
+
     uint32_t address = (uint32_t)(1U << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC);
     outl(PCI_CONFIG_ADDRESS, address);
     return inl(PCI_CONFIG_DATA);
 }
 
 void pci_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    volatile uint32_t *reg = pci_ecam_reg(bus, slot, func, offset);
+    if (reg) {
+        *reg = value;
+        return;
+    }
+
     uint32_t address = (uint32_t)(1U << 31) | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC);
     outl(PCI_CONFIG_ADDRESS, address);
     outl(PCI_CONFIG_DATA, value);
@@ -18,6 +18,10 @@ typedef struct {
 uint32_t pci_read32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 void pci_write32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
 
+/* Switch config access to memory-mapped ECAM (segment 0) for these buses */
+void pci_set_ecam(uint64_t base, uint8_t start_bus, uint8_t end_bus);
+int pci_using_ecam(void);
+
 int pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, PciDevice *out);
 int pci_enumerate(PciDevice *out, int max);
 
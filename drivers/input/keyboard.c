@@ -1,9 +1,12 @@
 #include "keyboard.h"
 #include "klog.h"
+#include "irqflags.h"
 
 static KEYBOARD_STATE kb_state = {
     .read_pos = 0,
     .write_pos = 0,
+    .raw_read_pos = 0,
+    .raw_write_pos = 0,
     .shift_pressed = 0,
     .ctrl_pressed = 0,
     .alt_pressed = 0
@@ -93,6 +96,8 @@ unsigned char keyboard_wait_for_enter(void) {
 void keyboard_init(void) {
     kb_state.read_pos = 0;
     kb_state.write_pos = 0;
+    kb_state.raw_read_pos = 0;
+    kb_state.raw_write_pos = 0;
     kb_state.shift_pressed = 0;
     kb_state.ctrl_pressed = 0;
     kb_state.alt_pressed = 0;
@@ -192,6 +197,33 @@ void keyboard_process_scancode(uint8_t scancode) {
     }
 }
 
+/* Bottom half for IRQ1: keep the raw code and decode it */
+void keyboard_push_scancode(uint8_t scancode) {
+    size_t next_write = (kb_state.raw_write_pos + 1) % KB_RAW_BUFFER_SIZE;
+    if (next_write != kb_state.raw_read_pos) {
+        kb_state.raw[kb_state.raw_write_pos] = scancode;
+        kb_state.raw_write_pos = next_write;
+    }
+    keyboard_process_scancode(scancode);
+}
+
+/* Next raw scancode, or 0. Reads the controller directly until IRQs are on. */
+uint8_t keyboard_poll_scancode(void) {
+    if (!irqs_enabled()) {
+        if (inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_BUFFER) {
+            return inb(PS2_DATA_PORT);
+        }
+        return 0;
+    }
+
+    if (kb_state.raw_read_pos == kb_state.raw_write_pos) {
+        return 0;
+    }
+    uint8_t scancode = kb_state.raw[kb_state.raw_read_pos];
+    kb_state.raw_read_pos = (kb_state.raw_read_pos + 1) % KB_RAW_BUFFER_SIZE;
+    return scancode;
+}
+
 uint8_t keyboard_has_key(void) {
     return kb_state.read_pos != kb_state.write_pos;
 }
@@ -4,6 +4,7 @@
 #include "types.h"
 
 #define KB_BUFFER_SIZE 128
+#define KB_RAW_BUFFER_SIZE 64
 
 #define KEY_BACKSPACE 0x08
 #define KEY_TAB       0x09
@@ -14,6 +15,9 @@ typedef struct {
     uint8_t buffer[KB_BUFFER_SIZE];
     volatile size_t read_pos;
     volatile size_t write_pos;
+    uint8_t raw[KB_RAW_BUFFER_SIZE];   /* Scancodes for the shell's own decoder */
+    volatile size_t raw_read_pos;
+    volatile size_t raw_write_pos;
     volatile uint8_t shift_pressed;
     volatile uint8_t ctrl_pressed;
     volatile uint8_t alt_pressed;
@@ -23,6 +27,8 @@ void keyboard_init(void);
 unsigned char keyboard_wait_for_enter(void);
 uint8_t keyboard_has_controller(void);
 void keyboard_process_scancode(uint8_t scancode);
+void keyboard_push_scancode(uint8_t scancode);
+uint8_t keyboard_poll_scancode(void);
 uint8_t keyboard_has_key(void);
 uint8_t keyboard_getchar(void);
 uint8_t keyboard_getchar_nonblock(void);
@@ -2,6 +2,7 @@
 #include "drivers/bus/pci.h"
 #include "core/io.h"
 #include "serial.h"
+#include "irqflags.h"
 
 #define RTL8139_VENDOR 0x10EC
 #define RTL8139_DEVICE 0x8139
@@ -17,7 +18,8 @@
 #define RTL_REG_RCR    0x44
 #define RTL_REG_CONFIG1 0x52
 
-#define RTL_CR_RST 0x10
+#define RTL_CR_RST  0x10
+#define RTL_CR_BUFE 0x01
 #define RTL_CR_RE  0x08
 #define RTL_CR_TE  0x04
 
@@ -123,6 +125,7 @@ int rtl8139_init(Rtl8139Device *dev) {
     }
 
     dev->io_base = io_base;
+    dev->irq_line = (uint8_t)(pci_read32(bus, slot, func, 0x3C) & 0xFF);
     rx_offset = 0;
     tx_cur = 0;
 
@@ -135,6 +138,9 @@ int rtl8139_send(Rtl8139Device *dev, const void *data, uint32_t length) {
         return 0;
     }
 
+    /* The RX bottom half sends replies from IRQ exit; with interrupts off
+     * it cannot take the same descriptor in the middle of a task's send */
+    uint64_t flags = local_irq_save();
     for (uint32_t i = 0; i < length; i++) {
         tx_buffer[tx_cur][i] = ((const uint8_t *)data)[i];
     }
@@ -144,6 +150,7 @@ int rtl8139_send(Rtl8139Device *dev, const void *data, uint32_t length) {
     rtl_write32(dev->io_base, RTL_REG_TSD0 + (tx_cur * 4), length);
 
     tx_cur = (tx_cur + 1) % 4;
+    local_irq_restore(flags);
     return 1;
 }
 
@@ -152,13 +159,11 @@ int rtl8139_poll(Rtl8139Device *dev, uint8_t *out_buf, uint32_t max_len, uint32_
         return 0;
     }
 
-    uint16_t isr = rtl_read16(dev->io_base, RTL_REG_ISR);
-    if (!(isr & RTL_ISR_ROK)) {
+    /* Ring state rather than ISR.ROK, so one interrupt can drain many frames */
+    if (rtl_read8(dev->io_base, RTL_REG_CR) & RTL_CR_BUFE) {
         return 0;
     }
 
-    rtl_write16(dev->io_base, RTL_REG_ISR, RTL_ISR_ROK);
-
     uint16_t offset = rx_offset;
     uint16_t *header = (uint16_t *)(rx_buffer + offset);
     uint16_t status = header[0];
@@ -188,3 +193,15 @@ int rtl8139_poll(Rtl8139Device *dev, uint8_t *out_buf, uint32_t max_len, uint32_
 
     return 1;
 }
+
+/* Read and clear the interrupt status; returns the bits that were set */
+uint16_t rtl8139_irq_ack(Rtl8139Device *dev) {
+    if (!dev) {
+        return 0;
+    }
+    uint16_t isr = rtl_read16(dev->io_base, RTL_REG_ISR);
+    if (isr) {
+        rtl_write16(dev->io_base, RTL_REG_ISR, isr);
+    }
+    return isr;
+}
@@ -8,10 +8,12 @@
 typedef struct {
     uint8_t mac[6];
     uint32_t io_base;
+    uint8_t irq_line;   /* PIC line from PCI config, 0xFF if unrouted */
 } Rtl8139Device;
 
 int rtl8139_init(Rtl8139Device *dev);
 int rtl8139_send(Rtl8139Device *dev, const void *data, uint32_t length);
 int rtl8139_poll(Rtl8139Device *dev, uint8_t *out_buf, uint32_t max_len, uint32_t *out_len);
+uint16_t rtl8139_irq_ack(Rtl8139Device *dev);
 
 #endif
@@ -3,6 +3,10 @@
 #include "drivers/bus/pci.h"
 #include "serial.h"
 #include "klog.h"
+#include "idt.h"
+#include "irqflags.h"
+#include "softirq.h"
+#include "pmm.h"
 
 #define AHCI_CLASS 0x01
 #define AHCI_SUBCLASS 0x06
@@ -11,12 +15,49 @@
 #define SATA_SIG_ATAPI 0xEB140101
 #define SATA_SIG_ATA   0x00000101
 
-#define HBA_PxIS_TFES (1 << 30)
+#define HBA_CAP_SNCQ  (1U << 30)
+#define HBA_CAP_S64A  (1U << 31)
+#define HBA_GHC_IE    (1U << 1)
+#define HBA_PxIS_TFES (1U << 30)
+#define HBA_PxIE_DHRE (1U << 0)
+#define HBA_PxIE_SDBE (1U << 3)
+#define HBA_PxIE_TFEE (1U << 30)
 #define HBA_PxCMD_ST  0x0001
 #define HBA_PxCMD_FRE 0x0010
 #define HBA_PxCMD_FR  0x4000
 #define HBA_PxCMD_CR  0x8000
 
+#define ATA_CMD_DSM             0x06    /* DATA SET MANAGEMENT */
+#define ATA_DSM_TRIM            0x01    /* Feature bit 0 */
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_READ_LOG_EXT    0x2F
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_IDENTIFY        0xEC
+#define ATA_CMD_FLUSH_EXT       0xEA
+#define ATA_LOG_NCQ_ERROR       0x10
+
+/* IDENTIFY DEVICE words */
+#define ATA_ID_MODEL            27      /* 20 words, two characters each */
+#define ATA_ID_LBA28_SECTORS    60
+#define ATA_ID_QUEUE_DEPTH      75
+#define ATA_ID_SATA_CAP         76
+#define ATA_ID_SATA_CAP_NCQ     (1U << 8)
+#define ATA_ID_CMD_SET2         83
+#define ATA_ID_CMD_SET2_LBA48   (1U << 10)
+#define ATA_ID_CMD_ENABLED1     85
+#define ATA_ID_WCACHE_ENABLED   (1U << 5)
+#define ATA_ID_LBA48_SECTORS    100
+#define ATA_ID_SECTOR_SIZE      106
+#define ATA_ID_LOGICAL_LONG     (1U << 12)  /* Words 117-118 hold the size */
+#define ATA_ID_PHYS_MULTIPLE    (1U << 13)  /* 2^bits 3:0 logical per physical */
+#define ATA_ID_LOGICAL_WORDS    117
+#define ATA_ID_DSM              169
+#define ATA_ID_DSM_TRIM         (1U << 0)
+
+#define AHCI_POLL_SPINS 10000000
+
 typedef volatile struct {
     uint32_t cap;
     uint32_t ghc;
@@ -103,22 +144,58 @@ typedef struct {
     uint8_t  rsv1[4];
 } FIS_REG_H2D;
 
+/* Command tables are 1 KiB: 128 bytes of FIS area plus 56 PRDT entries.
+ * Each entry moves up to 4 MiB and every segment may start a new one, so
+ * a request of BLOCK_MAX_SEGMENTS segments fits when it is at most
+ * (56 - 16) * 4 MiB: all of AHCI_MAX_SECTORS with 512-byte sectors, but
+ * only 40960 sectors of 4 KiB (see ahci_max_sectors). */
+#define AHCI_CMD_TBL_SIZE  1024
+#define AHCI_PRDT_PER_CMD  56
+#define AHCI_PRDT_MAX_BYTES (4U * 1024 * 1024)
+#define AHCI_MAX_SLOTS     32
+#define AHCI_MAX_SECTORS   65536            /* 48-bit count; 0 encodes 65536 */
+
+/* Per port, one allocation: the command list, received-FIS area and
+ * TRIM range block in the first page, then a command table for every slot */
+#define AHCI_CMD_LIST_SIZE 1024
+#define AHCI_TRIM_OFFSET   2048
+
+/* One 512-byte DSM block of 8-byte ranges: LBA in bits 47:0, length in
+ * 63:48. A length of 0 ends the list. */
+#define AHCI_TRIM_RANGES   64
+#define AHCI_TRIM_RANGE_MAX 65535
+#define AHCI_PORT_PAGES    (1 + AHCI_MAX_SLOTS * AHCI_CMD_TBL_SIZE / PMM_PAGE_SIZE)
+
 typedef struct {
     uint8_t  cfis[64];
     uint8_t  acmd[16];
     uint8_t  rsv[48];
-    HBA_PRDT_ENTRY prdt_entry[1];
+    HBA_PRDT_ENTRY prdt_entry[AHCI_PRDT_PER_CMD];
 } HBA_CMD_TBL;
 
 typedef struct {
     HBA_MEM *abar;
     HBA_PORT *port;
     BlockDevice dev;
+    AhciInfo info;
     uint8_t port_index;
+    uint8_t ncq;                         /* HBA and device both queue */
+    uint8_t s64a;                        /* HBA takes 64-bit addresses */
+    HBA_CMD_HEADER *cmd_list;
+    uint8_t *cmd_tables;                 /* AHCI_CMD_TBL_SIZE per slot */
+    uint64_t *trim_ranges;               /* Shared, so one TRIM at a time */
+    uint32_t trimming;                   /* Slot of the TRIM in flight, as a bit */
+    uint32_t slot_mask;                  /* Slots usable as commands (and NCQ tags) */
+    uint32_t busy;                       /* Slots issued, not yet reaped */
+    uint32_t queued;                     /* Busy slots issued as FPDMA commands */
+    volatile uint32_t irq_status;        /* PxIS bits latched by the top half */
+    BlockRequest *slot_req[AHCI_MAX_SLOTS];
 } AhciDevice;
 
-static AhciDevice g_ahci;
-static int g_ahci_ready = 0;
+static AhciDevice g_ahci[AHCI_MAX_DEVICES];
+static int g_ahci_count = 0;
+static HBA_MEM *g_hba;
+static const char *device_names[AHCI_MAX_DEVICES] = { "ahci0", "ahci1", "ahci2", "ahci3" };
 
 static void stop_cmd(HBA_PORT *port) {
     port->cmd &= ~HBA_PxCMD_ST;
@@ -134,51 +211,160 @@ static void start_cmd(HBA_PORT *port) {
     port->cmd |= HBA_PxCMD_ST;
 }
 
-static int ahci_port_rebase(HBA_PORT *port, int portno) {
-    stop_cmd(port);
+/* Whether the HBA can reach len bytes at addr */
+static int ahci_dma_ok(AhciDevice *ahci, uint64_t addr, uint64_t len) {
+    return ahci->s64a || addr + len <= 0x100000000ULL;
+}
+
+static HBA_CMD_TBL *ahci_cmd_table(AhciDevice *ahci, int slot) {
+    return (HBA_CMD_TBL *)(ahci->cmd_tables + slot * AHCI_CMD_TBL_SIZE);
+}
+
+/* Largest request whose PRDT fits in one command table */
+static uint32_t ahci_max_sectors(uint32_t sector_size) {
+    uint32_t fit = (AHCI_PRDT_PER_CMD - BLOCK_MAX_SEGMENTS) * (AHCI_PRDT_MAX_BYTES / sector_size);
+    return fit < AHCI_MAX_SECTORS ? fit : AHCI_MAX_SECTORS;
+}
 
-    static uint8_t clb[32][1024] __attribute__((aligned(1024)));
-    static uint8_t fb[32][256] __attribute__((aligned(256)));
-    static uint8_t ctba[32][256] __attribute__((aligned(128)));
+static int ahci_port_rebase(AhciDevice *ahci) {
+    HBA_PORT *port = ahci->port;
+    uint8_t *mem = (uint8_t *)pmm_alloc_pages(AHCI_PORT_PAGES);
+    uint64_t base = (uint64_t)(uintptr_t)mem;
+    if (!mem || !ahci_dma_ok(ahci, base, (uint64_t)AHCI_PORT_PAGES * PMM_PAGE_SIZE)) {
+        serial_write("AHCI: no memory for command tables\n");
+        return 0;
+    }
 
-    port->clb = (uint32_t)(uint64_t)clb[portno];
-    port->clbu = 0;
-    port->fb = (uint32_t)(uint64_t)fb[portno];
-    port->fbu = 0;
+    stop_cmd(port);
 
-    HBA_CMD_HEADER *cmd_header = (HBA_CMD_HEADER *)(uint64_t)port->clb;
-    for (int i = 0; i < 32; i++) {
-        cmd_header[i].prdtl = 1;
-        cmd_header[i].ctba = (uint32_t)(uint64_t)(ctba[portno] + (i * 256));
-        cmd_header[i].ctbau = 0;
+    ahci->cmd_list = (HBA_CMD_HEADER *)mem;
+    ahci->cmd_tables = mem + PMM_PAGE_SIZE;
+    ahci->trim_ranges = (uint64_t *)(mem + AHCI_TRIM_OFFSET);
+
+    uint64_t fb = base + AHCI_CMD_LIST_SIZE;
+    port->clb = (uint32_t)base;
+    port->clbu = (uint32_t)(base >> 32);
+    port->fb = (uint32_t)fb;
+    port->fbu = (uint32_t)(fb >> 32);
+
+    for (int i = 0; i < AHCI_MAX_SLOTS; i++) {
+        uint64_t ctba = (uint64_t)(uintptr_t)ahci_cmd_table(ahci, i);
+        ahci->cmd_list[i].prdtl = 1;
+        ahci->cmd_list[i].ctba = (uint32_t)ctba;
+        ahci->cmd_list[i].ctbau = (uint32_t)(ctba >> 32);
     }
 
     start_cmd(port);
     return 1;
 }
 
-static int ahci_read(HBA_PORT *port, uint64_t lba, uint32_t count, void *buffer) {
-    port->is = (uint32_t)-1;
+/* Describe req's memory to the HBA, splitting segments longer than one
+ * entry can carry. Returns the entry count, or 0 when the memory cannot
+ * be described: an odd address, or above 4 GiB without S64A. */
+static uint32_t ahci_build_prdt(AhciDevice *ahci, HBA_CMD_TBL *cmd_tbl, BlockRequest *req) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        uint64_t addr = (uint64_t)(uintptr_t)req->segments[i].buf;
+        uint32_t left = req->segments[i].len;
+        if ((addr & 1) || !ahci_dma_ok(ahci, addr, left)) {
+            return 0;
+        }
+        while (left) {
+            uint32_t len = left > AHCI_PRDT_MAX_BYTES ? AHCI_PRDT_MAX_BYTES : left;
+            if (n == AHCI_PRDT_PER_CMD) {
+                return 0;
+            }
+            HBA_PRDT_ENTRY *entry = &cmd_tbl->prdt_entry[n++];
+            entry->dba = (uint32_t)addr;
+            entry->dbau = (uint32_t)(addr >> 32);
+            entry->rsv0 = 0;
+            entry->dbc = len - 1;
+            entry->i = 0;
+            addr += len;
+            left -= len;
+        }
+    }
+    if (n) {
+        cmd_tbl->prdt_entry[n - 1].i = 1;
+    }
+    return n;
+}
 
-    HBA_CMD_HEADER *cmd_header = (HBA_CMD_HEADER *)(uint64_t)port->clb;
-    cmd_header[0].cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmd_header[0].w = 0;
-    cmd_header[0].prdtl = 1;
+/* Cover req's range with TRIM entries and point the slot's only PRDT
+ * entry at them. max_discard_sectors keeps it within one block. */
+static uint32_t ahci_build_trim(AhciDevice *ahci, HBA_CMD_TBL *cmd_tbl, BlockRequest *req) {
+    uint64_t lba = req->lba;
+    uint32_t left = req->count;
+    for (uint32_t i = 0; i < AHCI_TRIM_RANGES; i++) {
+        uint32_t len = left > AHCI_TRIM_RANGE_MAX ? AHCI_TRIM_RANGE_MAX : left;
+        ahci->trim_ranges[i] = len ? (lba | ((uint64_t)len << 48)) : 0;
+        lba += len;
+        left -= len;
+    }
+
+    uint64_t addr = (uint64_t)(uintptr_t)ahci->trim_ranges;
+    HBA_PRDT_ENTRY *entry = &cmd_tbl->prdt_entry[0];
+    entry->dba = (uint32_t)addr;
+    entry->dbau = (uint32_t)(addr >> 32);
+    entry->rsv0 = 0;
+    entry->dbc = AHCI_TRIM_RANGES * sizeof(uint64_t) - 1;
+    entry->i = 1;
+    return 1;
+}
+
+/* Fill command slot `slot` for req; the caller sets PxSACT for a queued
+ * command and then PxCI. Returns 0 if req's memory cannot be described. */
+static int ahci_build_cmd(AhciDevice *ahci, int slot, BlockRequest *req, int queued) {
+    HBA_CMD_HEADER *cmd_header = &ahci->cmd_list[slot];
+    HBA_CMD_TBL *cmd_tbl = ahci_cmd_table(ahci, slot);
+    uint32_t prdtl = 0;
+    if (req->op == BLOCK_OP_DISCARD) {
+        prdtl = ahci_build_trim(ahci, cmd_tbl, req);
+    } else if (req->op != BLOCK_OP_FLUSH) {
+        prdtl = ahci_build_prdt(ahci, cmd_tbl, req);
+        if (!prdtl) {
+            return 0;
+        }
+    }
+
+    cmd_header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    /* The TRIM ranges go to the device, so a discard is a write too */
+    cmd_header->w = (req->op == BLOCK_OP_WRITE || req->op == BLOCK_OP_DISCARD) ? 1 : 0;
+    cmd_header->prdtl = (uint16_t)prdtl;
+    cmd_header->prdbc = 0;
 
-    HBA_CMD_TBL *cmd_tbl = (HBA_CMD_TBL *)(uint64_t)cmd_header[0].ctba;
     for (int i = 0; i < 64; i++) {
         cmd_tbl->cfis[i] = 0;
     }
 
-    cmd_tbl->prdt_entry[0].dba = (uint32_t)(uint64_t)buffer;
-    cmd_tbl->prdt_entry[0].dbau = 0;
-    cmd_tbl->prdt_entry[0].dbc = (count * 512) - 1;
-    cmd_tbl->prdt_entry[0].i = 1;
-
+    uint64_t lba = req->lba;
     FIS_REG_H2D *cmd_fis = (FIS_REG_H2D *)cmd_tbl->cfis;
     cmd_fis->fis_type = 0x27;
     cmd_fis->c = 1;
-    cmd_fis->command = 0x25; /* READ DMA EXT */
+    if (req->op == BLOCK_OP_FLUSH) {
+        cmd_fis->command = ATA_CMD_FLUSH_EXT;    /* No data */
+        cmd_fis->device = 1 << 6;
+        return 1;
+    }
+    if (req->op == BLOCK_OP_DISCARD) {
+        cmd_fis->command = ATA_CMD_DSM;
+        cmd_fis->featurel = ATA_DSM_TRIM;
+        cmd_fis->countl = 1;                 /* 512-byte blocks of ranges */
+        cmd_fis->device = 1 << 6;
+        return 1;
+    }
+    if (queued) {
+        /* FPDMA QUEUED: the sector count moves to the feature field and
+         * the slot, which is the NCQ tag, to count bits 7:3 */
+        cmd_fis->command = (req->op == BLOCK_OP_WRITE) ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+        cmd_fis->featurel = req->count & 0xFF;
+        cmd_fis->featureh = (req->count >> 8) & 0xFF;
+        cmd_fis->countl = (uint8_t)(slot << 3);
+    } else {
+        cmd_fis->command = (req->op == BLOCK_OP_WRITE) ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        cmd_fis->countl = req->count & 0xFF;
+        cmd_fis->counth = (req->count >> 8) & 0xFF;
+    }
     cmd_fis->lba0 = (uint8_t)lba;
     cmd_fis->lba1 = (uint8_t)(lba >> 8);
     cmd_fis->lba2 = (uint8_t)(lba >> 16);
@@ -186,48 +372,35 @@ static int ahci_read(HBA_PORT *port, uint64_t lba, uint32_t count, void *buffer)
     cmd_fis->lba4 = (uint8_t)(lba >> 32);
     cmd_fis->lba5 = (uint8_t)(lba >> 40);
     cmd_fis->device = 1 << 6;
-    cmd_fis->countl = count & 0xFF;
-    cmd_fis->counth = (count >> 8) & 0xFF;
-
-    while (port->tfd & (0x80 | 0x08)) {
-    }
-
-    port->ci = 1;
-
-    while (1) {
-        if ((port->ci & 1) == 0) {
-            break;
-        }
-        if (port->is & HBA_PxIS_TFES) {
-            return 0;
-        }
-    }
-
     return 1;
 }
 
-static int ahci_write(HBA_PORT *port, uint64_t lba, uint32_t count, const void *buffer) {
-    port->is = (uint32_t)-1;
-
-    HBA_CMD_HEADER *cmd_header = (HBA_CMD_HEADER *)(uint64_t)port->clb;
-    cmd_header[0].cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmd_header[0].w = 1;
-    cmd_header[0].prdtl = 1;
-
-    HBA_CMD_TBL *cmd_tbl = (HBA_CMD_TBL *)(uint64_t)cmd_header[0].ctba;
+/* Run one non-queued command in slot 0 and spin until it ends. Only for
+ * an otherwise idle port: bring-up, and recovery with interrupts off. */
+static int ahci_exec_polled(AhciDevice *ahci, uint8_t command, uint64_t lba, uint16_t count,
+                            void *buf, uint32_t len) {
+    HBA_PORT *port = ahci->port;
+    HBA_CMD_HEADER *cmd_header = &ahci->cmd_list[0];
+    uint64_t addr = (uint64_t)(uintptr_t)buf;
+    cmd_header->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+    cmd_header->w = 0;
+    cmd_header->prdtl = 1;
+    cmd_header->prdbc = 0;
+
+    HBA_CMD_TBL *cmd_tbl = ahci_cmd_table(ahci, 0);
     for (int i = 0; i < 64; i++) {
         cmd_tbl->cfis[i] = 0;
     }
-
-    cmd_tbl->prdt_entry[0].dba = (uint32_t)(uint64_t)buffer;
-    cmd_tbl->prdt_entry[0].dbau = 0;
-    cmd_tbl->prdt_entry[0].dbc = (count * 512) - 1;
-    cmd_tbl->prdt_entry[0].i = 1;
+    cmd_tbl->prdt_entry[0].dba = (uint32_t)addr;
+    cmd_tbl->prdt_entry[0].dbau = (uint32_t)(addr >> 32);
+    cmd_tbl->prdt_entry[0].rsv0 = 0;
+    cmd_tbl->prdt_entry[0].dbc = len - 1;
+    cmd_tbl->prdt_entry[0].i = 0;
 
     FIS_REG_H2D *cmd_fis = (FIS_REG_H2D *)cmd_tbl->cfis;
     cmd_fis->fis_type = 0x27;
     cmd_fis->c = 1;
-    cmd_fis->command = 0x35; /* WRITE DMA EXT */
+    cmd_fis->command = command;
     cmd_fis->lba0 = (uint8_t)lba;
     cmd_fis->lba1 = (uint8_t)(lba >> 8);
     cmd_fis->lba2 = (uint8_t)(lba >> 16);
@@ -238,44 +411,346 @@ static int ahci_write(HBA_PORT *port, uint64_t lba, uint32_t count, const void *
     cmd_fis->countl = count & 0xFF;
     cmd_fis->counth = (count >> 8) & 0xFF;
 
-    while (port->tfd & (0x80 | 0x08)) {
+    port->is = (uint32_t)-1;
+    port->ci = 1;
+    for (uint32_t spin = 0; spin < AHCI_POLL_SPINS; spin++) {
+        if (port->is & HBA_PxIS_TFES) {
+            return 0;
+        }
+        if (!(port->ci & 1)) {
+            return 1;
+        }
+        __asm__ __volatile__("pause");
+    }
+    return 0;
+}
+
+static int ahci_submit(BlockDevice *dev, BlockRequest *req) {
+    AhciDevice *ahci = (AhciDevice *)dev->driver_data;
+    if (!ahci || !ahci->port) {
+        return BLOCK_EIO;
+    }
+    if (req->op >= BLOCK_OP_COUNT) {
+        return BLOCK_ENOTSUP;
+    }
+    if (req->op == BLOCK_OP_FLUSH && !ahci->info.write_cache) {
+        return BLOCK_ENOTSUP;            /* Nothing volatile to drain */
     }
 
-    port->ci = 1;
+    HBA_PORT *port = ahci->port;
+    int queued = ahci->ncq && (req->op == BLOCK_OP_READ || req->op == BLOCK_OP_WRITE);
+    uint64_t flags = local_irq_save();
 
-    while (1) {
-        if ((port->ci & 1) == 0) {
-            break;
+    /* An NCQ device takes queued commands or one non-queued command, never
+     * a mix, so a flush or TRIM waits for the queue to empty and vice versa */
+    uint32_t free_slots = ahci->slot_mask & ~ahci->busy;
+    if (ahci->ncq && ahci->busy && (!queued || ahci->queued != ahci->busy)) {
+        free_slots = 0;
+    }
+    if (req->op == BLOCK_OP_DISCARD && ahci->trimming) {
+        free_slots = 0;
+    }
+    if (!free_slots) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+    int slot = 0;
+    while (!(free_slots & (1U << slot))) {
+        slot++;
+    }
+
+    if (!ahci->busy) {
+        /* Idle port: drop stale status and let the device settle */
+        port->is = (uint32_t)-1;
+        ahci->irq_status = 0;
+        while (port->tfd & (0x80 | 0x08)) {
         }
-        if (port->is & HBA_PxIS_TFES) {
-            return 0;
+    }
+
+    if (!ahci_build_cmd(ahci, slot, req, queued)) {
+        local_irq_restore(flags);
+        return BLOCK_EINVAL;
+    }
+    ahci->slot_req[slot] = req;
+    ahci->busy |= 1U << slot;
+    if (req->op == BLOCK_OP_DISCARD) {
+        ahci->trimming = 1U << slot;
+    }
+    if (queued) {
+        ahci->queued |= 1U << slot;
+        port->sact = 1U << slot;
+    }
+    port->ci = 1U << slot;
+
+    local_irq_restore(flags);
+    return BLOCK_OK;
+}
+
+/* A task-file error stops the port; restart it so later commands can run.
+ * After a queued command fails the device aborts the rest and refuses new
+ * ones until the NCQ error log has been read. */
+static void ahci_port_recover(AhciDevice *ahci, int was_queued) {
+    static uint8_t log_buf[512] __attribute__((aligned(512)));
+    HBA_PORT *port = ahci->port;
+
+    stop_cmd(port);
+    port->serr = (uint32_t)-1;
+    port->is = (uint32_t)-1;
+    start_cmd(port);
+
+    if (was_queued && !ahci_exec_polled(ahci, ATA_CMD_READ_LOG_EXT, ATA_LOG_NCQ_ERROR, 1,
+                                        log_buf, sizeof(log_buf))) {
+        serial_write("AHCI: reading the NCQ error log failed\n");
+    }
+}
+
+static int ahci_poll(BlockDevice *dev) {
+    AhciDevice *ahci = (AhciDevice *)dev->driver_data;
+    BlockRequest *done[AHCI_MAX_SLOTS];
+    int status[AHCI_MAX_SLOTS];
+    int count = 0;
+
+    /* Reap with interrupts off so the softirq and a task-context waiter
+     * never both complete the same slot; callbacks run afterwards. */
+    uint64_t flags = local_irq_save();
+    if (ahci->busy) {
+        HBA_PORT *port = ahci->port;
+        uint32_t is = port->is | ahci->irq_status;
+        uint32_t finished;
+        uint32_t failed = 0;
+
+        /* A non-queued command is done once the HBA clears its PxCI bit; a
+         * queued one once the device's Set Device Bits FIS clears PxSACT */
+        if (is & HBA_PxIS_TFES) {
+            /* Whatever had already finished is good; the command that hit
+             * the error, and any the device aborted with it, failed */
+            finished = ahci->busy;
+            failed = ahci->busy & (port->sact | port->ci);
+            ahci_port_recover(ahci, ahci->queued != 0);
+            ahci->irq_status = 0;
+        } else {
+            finished = ahci->busy & ~(port->sact | port->ci);
+        }
+
+        for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+            if (finished & (1U << slot)) {
+                status[count] = (failed & (1U << slot)) ? BLOCK_EIO : BLOCK_OK;
+                done[count++] = ahci->slot_req[slot];
+                ahci->slot_req[slot] = 0;
+            }
+        }
+        ahci->busy &= ~finished;
+        ahci->queued &= ~finished;
+        ahci->trimming &= ~finished;
+    }
+    local_irq_restore(flags);
+
+    for (int i = 0; i < count; i++) {
+        block_complete(done[i], status[i]);
+    }
+    return count;
+}
+
+static void ahci_softirq(uint64_t arg) {
+    ahci_poll(&g_ahci[arg].dev);
+}
+
+/* Top half: the HBA shares one line between its ports; latch and
+ * acknowledge each port that raised it, leave reaping to the softirq */
+static void ahci_irq(uint8_t irq) {
+    (void)irq;
+    uint32_t pending = g_hba->is;
+    uint32_t handled = 0;
+
+    for (int i = 0; i < g_ahci_count; i++) {
+        AhciDevice *ahci = &g_ahci[i];
+        uint32_t bit = 1U << ahci->port_index;
+        if (!(pending & bit)) {
+            continue;
+        }
+        uint32_t is = ahci->port->is;
+        ahci->port->is = is;
+        ahci->irq_status |= is;
+        handled |= bit;
+        softirq_queue(ahci_softirq, (uint64_t)i);
+    }
+    if (handled) {
+        g_hba->is = handled;
+    }
+}
+
+/* Fill ahci->info from IDENTIFY DEVICE. The NCQ depth is only reported
+ * when the HBA can queue too. */
+static int ahci_identify(AhciDevice *ahci) {
+    static uint16_t id[256] __attribute__((aligned(512)));
+    AhciInfo *info = &ahci->info;
+
+    if (!ahci_exec_polled(ahci, ATA_CMD_IDENTIFY, 0, 0, id, sizeof(id))) {
+        serial_write("AHCI: IDENTIFY DEVICE failed\n");
+        ahci_port_recover(ahci, 0);
+        return 0;
+    }
+
+    /* Each word holds two characters, the first in the high byte;
+     * the string is padded with spaces */
+    int len = 0;
+    for (int i = 0; i < 20; i++) {
+        info->model[2 * i] = (char)(id[ATA_ID_MODEL + i] >> 8);
+        info->model[2 * i + 1] = (char)(id[ATA_ID_MODEL + i] & 0xFF);
+    }
+    for (int i = 0; i < 40; i++) {
+        if (info->model[i] != ' ') {
+            len = i + 1;
+        }
+    }
+    info->model[len] = 0;
+
+    if (id[ATA_ID_CMD_SET2] & ATA_ID_CMD_SET2_LBA48) {
+        info->sectors = (uint64_t)id[ATA_ID_LBA48_SECTORS] |
+                        ((uint64_t)id[ATA_ID_LBA48_SECTORS + 1] << 16) |
+                        ((uint64_t)id[ATA_ID_LBA48_SECTORS + 2] << 32) |
+                        ((uint64_t)id[ATA_ID_LBA48_SECTORS + 3] << 48);
+    } else {
+        info->sectors = (uint64_t)id[ATA_ID_LBA28_SECTORS] |
+                        ((uint64_t)id[ATA_ID_LBA28_SECTORS + 1] << 16);
+    }
+
+    /* Word 106 is valid when bit 14 is set and bit 15 clear */
+    uint16_t ss = id[ATA_ID_SECTOR_SIZE];
+    info->logical_sector_size = 512;
+    info->physical_sector_size = 512;
+    if ((ss & 0xC000) == 0x4000) {
+        if (ss & ATA_ID_LOGICAL_LONG) {
+            uint32_t words = (uint32_t)id[ATA_ID_LOGICAL_WORDS] | ((uint32_t)id[ATA_ID_LOGICAL_WORDS + 1] << 16);
+            info->logical_sector_size = words * 2;
+        }
+        info->physical_sector_size = info->logical_sector_size;
+        if (ss & ATA_ID_PHYS_MULTIPLE) {
+            info->physical_sector_size <<= ss & 0xF;
         }
     }
 
+    info->ncq_depth = 0;
+    if ((ahci->abar->cap & HBA_CAP_SNCQ) && (id[ATA_ID_SATA_CAP] & ATA_ID_SATA_CAP_NCQ)) {
+        info->ncq_depth = (id[ATA_ID_QUEUE_DEPTH] & 0x1F) + 1;
+    }
+    info->write_cache = (id[ATA_ID_CMD_ENABLED1] & ATA_ID_WCACHE_ENABLED) != 0;
+    info->trim = (id[ATA_ID_DSM] & ATA_ID_DSM_TRIM) != 0;
+    info->port = ahci->port_index;
     return 1;
 }
 
-static int ahci_block_read(BlockDevice *dev, uint64_t lba, uint32_t count, void *buffer) {
-    AhciDevice *ahci = (AhciDevice *)dev->driver_data;
-    if (!ahci || !ahci->port) {
+static void append_dec(char *buf, int *pos, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n) {
+        buf[(*pos)++] = digits[--n];
+    }
+}
+
+static void ahci_log_device(AhciDevice *ahci) {
+    char num[24];
+    int pos = 0;
+    serial_write("AHCI: ");
+    serial_write(ahci->dev.name);
+    serial_write(" port ");
+    append_dec(num, &pos, ahci->port_index);
+    num[pos] = 0;
+    serial_write(num);
+    serial_write(", ");
+    serial_write(ahci->info.model);
+    serial_write(", ");
+    pos = 0;
+    append_dec(num, &pos, ahci->info.sectors * ahci->info.logical_sector_size >> 20);
+    num[pos] = 0;
+    serial_write(num);
+    serial_write(" MB, ");
+    pos = 0;
+    append_dec(num, &pos, ahci->info.logical_sector_size);
+    num[pos++] = '/';
+    append_dec(num, &pos, ahci->info.physical_sector_size);
+    num[pos] = 0;
+    serial_write(num);
+    serial_write(ahci->ncq ? " byte sectors, NCQ\n" : " byte sectors\n");
+    KLOG("AHCI: SATA device ready");
+}
+
+/* Bring up one port with an ATA signature as ahci->dev. Returns 0 when
+ * the port cannot be used. */
+static int ahci_port_init(AhciDevice *ahci, HBA_MEM *hba, HBA_PORT *port, uint8_t index) {
+    ahci->abar = hba;
+    ahci->port = port;
+    ahci->port_index = index;
+    ahci->s64a = (hba->cap & HBA_CAP_S64A) != 0;
+    ahci->busy = 0;
+    ahci->queued = 0;
+    ahci->trimming = 0;
+    ahci->irq_status = 0;
+    if (!ahci_port_rebase(ahci) || !ahci_identify(ahci)) {
         return 0;
     }
-    return ahci_read(ahci->port, lba, count, buffer);
+
+    uint32_t sector_size = ahci->info.logical_sector_size;
+    if (sector_size < BLOCK_SECTOR_SIZE || sector_size > BLOCK_MAX_SECTOR_SIZE ||
+        (sector_size & (sector_size - 1))) {
+        serial_write("AHCI: unsupported logical sector size\n");
+        return 0;
+    }
+
+    /* With NCQ the slot is also the tag, so only as many slots as the
+     * device has queue entries are used */
+    uint32_t slots = ((hba->cap >> 8) & 0x1F) + 1;   /* CAP.NCS */
+    uint32_t depth = ahci->info.ncq_depth;
+    if (depth && depth < slots) {
+        slots = depth;
+    }
+    ahci->ncq = depth != 0;
+    ahci->slot_mask = (slots >= 32) ? 0xFFFFFFFFU : ((1U << slots) - 1);
+
+    ahci->dev.sector_size = sector_size;
+    ahci->dev.total_sectors = ahci->info.sectors;
+    ahci->dev.driver_data = ahci;
+    ahci->dev.max_segments = BLOCK_MAX_SEGMENTS;
+    ahci->dev.max_sectors = ahci_max_sectors(sector_size);
+    ahci->dev.queue_depth = slots;
+    if (ahci->info.trim) {
+        ahci->dev.max_discard_sectors = AHCI_TRIM_RANGES * AHCI_TRIM_RANGE_MAX;
+    }
+    ahci->dev.submit = ahci_submit;
+    ahci->dev.poll = ahci_poll;
+    return 1;
 }
 
-static int ahci_block_write(BlockDevice *dev, uint64_t lba, uint32_t count, const void *buffer) {
-    AhciDevice *ahci = (AhciDevice *)dev->driver_data;
-    if (!ahci || !ahci->port) {
+int ahci_count(void) {
+    return g_ahci_count;
+}
+
+BlockDevice *ahci_get(int index) {
+    if (index < 0 || index >= g_ahci_count) {
         return 0;
     }
-    return ahci_write(ahci->port, lba, count, buffer);
+    return &g_ahci[index].dev;
 }
 
 BlockDevice *ahci_get_device(void) {
-    if (!g_ahci_ready) {
+    return ahci_get(0);
+}
+
+int ahci_get_info(BlockDevice *dev, AhciInfo *out) {
+    if (!dev || !out || dev->submit != ahci_submit) {
         return 0;
     }
-    return &g_ahci.dev;
+    AhciDevice *ahci = (AhciDevice *)dev->driver_data;
+    const uint8_t *src = (const uint8_t *)&ahci->info;
+    uint8_t *dst = (uint8_t *)out;
+    for (uint32_t i = 0; i < sizeof(*out); i++) {
+        dst[i] = src[i];
+    }
+    return 1;
 }
 
 int ahci_init(void) {
@@ -299,38 +774,46 @@ int ahci_init(void) {
 
     HBA_MEM *hba = (HBA_MEM *)(uint64_t)abar;
     uint32_t ports = hba->pi;
+    g_hba = hba;
 
-    for (uint8_t i = 0; i < 32; i++) {
-        if ((ports & (1 << i)) == 0) {
+    /* Every implemented port with a disk becomes its own device, so
+     * several disks are driven in parallel */
+    for (uint8_t i = 0; i < 32 && g_ahci_count < AHCI_MAX_DEVICES; i++) {
+        if ((ports & (1U << i)) == 0) {
             continue;
         }
         HBA_PORT *port = (HBA_PORT *)((uint8_t *)hba + 0x100 + i * sizeof(HBA_PORT));
-        uint32_t sig = port->sig;
-        if (sig != SATA_SIG_ATA) {
+        if (port->sig != SATA_SIG_ATA) {
             continue;
         }
 
-        ahci_port_rebase(port, i);
-
-        g_ahci.abar = hba;
-        g_ahci.port = port;
-        g_ahci.port_index = i;
-
-        g_ahci.dev.name = "ahci0";
-        g_ahci.dev.sector_size = 512;
-        g_ahci.dev.total_sectors = 0;
-        g_ahci.dev.driver_data = &g_ahci;
-        g_ahci.dev.read = ahci_block_read;
-        g_ahci.dev.write = ahci_block_write;
+        AhciDevice *ahci = &g_ahci[g_ahci_count];
+        ahci->dev.name = device_names[g_ahci_count];
+        if (!ahci_port_init(ahci, hba, port, i)) {
+            continue;
+        }
+        if (!block_register(&ahci->dev)) {
+            break;
+        }
+        g_ahci_count++;
+        ahci_log_device(ahci);
+    }
 
-        g_ahci_ready = 1;
-        block_register(&g_ahci.dev);
-        serial_write("AHCI: SATA device ready\n");
-        KLOG("AHCI: SATA device ready");
-        return 1;
+    if (g_ahci_count == 0) {
+        serial_write("AHCI: no SATA device found\n");
+        KERR("AHCI: no SATA device found");
+        return 0;
     }
 
-    serial_write("AHCI: no SATA device found\n");
-    KERR("AHCI: no SATA device found");
-    return 0;
+    /* Completions also arrive by interrupt when the line is routed */
+    uint8_t irq_line = (uint8_t)(pci_read32(dev.bus, dev.slot, dev.func, 0x3C) & 0xFF);
+    if (irq_line < IRQ_LINES && irq_register(irq_line, ahci_irq)) {
+        for (int i = 0; i < g_ahci_count; i++) {
+            g_ahci[i].port->is = (uint32_t)-1;
+            g_ahci[i].port->ie = HBA_PxIE_DHRE | HBA_PxIE_SDBE | HBA_PxIE_TFEE;
+        }
+        hba->is = (uint32_t)-1;
+        hba->ghc |= HBA_GHC_IE;
+    }
+    return g_ahci_count;
 }
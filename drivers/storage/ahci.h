@@ -5,7 +5,29 @@
 
 typedef struct BlockDevice BlockDevice;
 
+/* SATA disks on the first AHCI controller register as ahci0, ahci1, ...
+ * in port order, each with its own command slots. */
+#define AHCI_MAX_DEVICES 4
+
+/* What IDENTIFY DEVICE reported for a disk */
+typedef struct {
+    char model[41];
+    uint8_t port;                       /* HBA port number */
+    uint8_t write_cache;                /* Volatile write cache enabled */
+    uint8_t trim;                       /* DATA SET MANAGEMENT TRIM supported */
+    uint32_t logical_sector_size;
+    uint32_t physical_sector_size;
+    uint32_t ncq_depth;                 /* 0 when the disk or HBA cannot queue */
+    uint64_t sectors;                   /* Logical sectors */
+} AhciInfo;
+
+/* Register every SATA disk found. Returns how many. */
 int ahci_init(void);
+int ahci_count(void);
+BlockDevice *ahci_get(int index);
+/* The first disk, or 0 */
 BlockDevice *ahci_get_device(void);
+/* Returns 0 if dev is not an AHCI disk */
+int ahci_get_info(BlockDevice *dev, AhciInfo *out);
 
 #endif
@@ -0,0 +1,1010 @@
+#include "bcache.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "klog.h"
+#include "irqflags.h"
+#include "softirq.h"
+
+#define BCACHE_MAGIC    0x454843414342474BULL   /* "KGBCACHE" */
+#define BCACHE_VERSION  1
+#define BCACHE_BATCH    32                      /* Member requests in flight */
+#define ENTRIES_PER_META (BCACHE_BLOCK_SIZE / sizeof(BcEntry))
+#define META_MAX        (BCACHE_MAX_BLOCKS / ENTRIES_PER_META)
+#define NO_SLOT         0xFFFFFFFFU
+
+/* Slot states, as stored on the cache device. BUSY marks a slot whose
+ * data is being replaced; it reads back as invalid. */
+#define BC_INVALID 0
+#define BC_CLEAN   1
+#define BC_DIRTY   2
+#define BC_BUSY    3
+
+/* What a write does with each block it covers */
+#define ACT_NONE    0
+#define ACT_FILL    1                   /* Slot gets new contents and a new state */
+#define ACT_INPLACE 2                   /* Already dirty; overwrite the data only */
+#define ACT_AROUND  3                   /* Straight to the backing disk */
+
+typedef struct {
+    uint64_t block;                     /* Backing disk block number */
+    uint32_t state;
+    uint32_t lru;                       /* Access tick, for replacement */
+} BcEntry;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t mode;
+    uint32_t block_size;
+    uint32_t ways;
+    uint64_t blocks;
+    uint64_t backing_sectors;
+    uint32_t backing_sector_size;
+    uint32_t checksum;                  /* FNV-1a of the superblock with this zeroed */
+    char backing_name[16];
+} BcSuper;
+
+typedef struct {
+    uint64_t next_lba;
+    uint64_t bytes;
+    uint32_t tick;
+} BcStream;
+
+typedef struct {
+    BlockDevice dev;
+    BlockDevice *backing;
+    BlockDevice *cache;
+    uint32_t mode;
+    uint32_t spb;                       /* Backing sectors per block */
+    uint32_t cspb;                      /* Cache sectors per block */
+    uint64_t blocks;
+    uint64_t sets;
+    uint64_t data_lba;                  /* First slot on the cache device */
+    BcEntry *entries;                   /* From pmm, page aligned like the table on disk */
+    uint32_t meta_blocks;
+    uint32_t meta_dirty[META_MAX / 32]; /* Table blocks changed since written */
+    uint32_t tick;
+    BcStream streams[BCACHE_STREAMS];
+
+    BlockRequest *batch;                /* BCACHE_BATCH, from pmm */
+    uint32_t batch_used;
+    int batch_error;
+    uint8_t *bounce;                    /* BCACHE_WB_BATCH blocks, from pmm */
+
+    uint32_t req_slot[BCACHE_MAX_REQ_BLOCKS + 1];
+    uint8_t req_act[BCACHE_MAX_REQ_BLOCKS + 1];
+
+    BlockRequest *slot_req[BCACHE_QUEUE_DEPTH];
+    uint32_t pending;                   /* Slot bitmap */
+    int unsynced;                       /* Slots settled since the last cache barrier */
+    int working;                        /* Someone is processing requests */
+    uint64_t last_writeback;            /* TSC */
+    BcacheStats stats;
+} Bcache;
+
+static Bcache caches[BCACHE_MAX_DEVICES];
+static int cache_count = 0;
+static const char *cache_names[BCACHE_MAX_DEVICES] = { "bcache0", "bcache1" };
+
+static void bc_log(const char *what, const char *why) {
+    serial_write("BCACHE: ");
+    serial_write(what);
+    serial_write(why);
+    serial_write("\n");
+}
+
+/* ---- Member I/O ---------------------------------------------------------- */
+
+static void batch_wait(Bcache *bc) {
+    for (uint32_t i = 0; i < bc->batch_used; i++) {
+        if (block_wait(&bc->batch[i]) != BLOCK_OK) {
+            bc->batch_error = 1;
+        }
+    }
+    bc->batch_used = 0;
+}
+
+/* Wait for everything queued; returns 1 if it all succeeded */
+static int batch_finish(Bcache *bc) {
+    batch_wait(bc);
+    int ok = !bc->batch_error;
+    bc->batch_error = 0;
+    return ok;
+}
+
+/* Queue bytes of I/O at lba on dev, to or from the memory described by
+ * segs starting skip bytes in. Splits wherever dev's limits require. */
+static void batch_segs(Bcache *bc, BlockDevice *dev, uint32_t op, uint64_t lba,
+                       const BlockSegment *segs, uint32_t nsegs, uint32_t skip, uint32_t bytes) {
+    uint32_t sector_size = dev->sector_size ? dev->sector_size : BLOCK_SECTOR_SIZE;
+    uint32_t s = 0;
+    while (s < nsegs && skip >= segs[s].len) {
+        skip -= segs[s].len;
+        s++;
+    }
+
+    BlockRequest *req = 0;
+    while (bytes && s < nsegs) {
+        uint32_t piece = segs[s].len - skip;
+        if (piece > bytes) {
+            piece = bytes;
+        }
+        if (!req) {
+            if (bc->batch_used == BCACHE_BATCH) {
+                batch_wait(bc);
+            }
+            req = &bc->batch[bc->batch_used++];
+            block_request_init(req, dev, op, lba);
+        }
+        if (dev->max_sectors && req->count + piece / sector_size > dev->max_sectors) {
+            piece = (dev->max_sectors - req->count) * sector_size;
+        }
+        if (piece == 0 || !block_request_add(req, (uint8_t *)segs[s].buf + skip, piece)) {
+            if (req->count == 0) {
+                bc->batch_used--;
+                bc->batch_error = 1;
+                return;
+            }
+            block_submit(req);
+            req = 0;
+            continue;
+        }
+        lba += piece / sector_size;
+        bytes -= piece;
+        skip += piece;
+        if (skip == segs[s].len) {
+            s++;
+            skip = 0;
+        }
+    }
+    if (req) {
+        block_submit(req);
+    }
+    if (bytes) {
+        bc->batch_error = 1;
+    }
+}
+
+static void batch_buf(Bcache *bc, BlockDevice *dev, uint32_t op, uint64_t lba, void *buf, uint32_t bytes) {
+    BlockSegment seg = { buf, bytes };
+    batch_segs(bc, dev, op, lba, &seg, 1, 0, bytes);
+}
+
+/* Order writes on dev: everything before is durable before anything after */
+static int barrier(BlockDevice *dev) {
+    return block_flush(dev);
+}
+
+/* ---- Slot table ---------------------------------------------------------- */
+
+static uint64_t slot_lba(Bcache *bc, uint32_t slot, uint32_t sector_in_block) {
+    uint32_t ratio = bc->dev.sector_size / bc->cache->sector_size;
+    return bc->data_lba + (uint64_t)slot * bc->cspb + sector_in_block * ratio;
+}
+
+static void set_state(Bcache *bc, uint32_t slot, uint32_t state) {
+    BcEntry *e = &bc->entries[slot];
+    int was_valid = e->state == BC_CLEAN || e->state == BC_DIRTY;
+    int now_valid = state == BC_CLEAN || state == BC_DIRTY;
+    bc->stats.valid += now_valid - was_valid;
+    bc->stats.dirty += (state == BC_DIRTY) - (e->state == BC_DIRTY);
+    e->state = state;
+    uint32_t meta = slot / ENTRIES_PER_META;
+    bc->meta_dirty[meta / 32] |= 1U << (meta % 32);
+}
+
+/* Write the changed table blocks; returns 1 on success */
+static int persist_meta(Bcache *bc) {
+    uint32_t per_block = BCACHE_BLOCK_SIZE / bc->cache->sector_size;
+    for (uint32_t m = 0; m < bc->meta_blocks; m++) {
+        if (!(bc->meta_dirty[m / 32] & (1U << (m % 32)))) {
+            continue;
+        }
+        bc->meta_dirty[m / 32] &= ~(1U << (m % 32));
+        batch_buf(bc, bc->cache, BLOCK_OP_WRITE, (uint64_t)per_block * (1 + m),
+                  (uint8_t *)bc->entries + (uint64_t)m * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    }
+    if (!batch_finish(bc)) {
+        bc->stats.errors++;
+        return 0;
+    }
+    return 1;
+}
+
+/* Make the table on the cache match memory. Data of slots settled since
+ * the last barrier is flushed first, so the table never gets ahead of it. */
+static int sync_meta(Bcache *bc) {
+    if (bc->unsynced) {
+        if (!barrier(bc->cache)) {
+            bc->stats.errors++;
+            return 0;
+        }
+        bc->unsynced = 0;
+    }
+    return persist_meta(bc) && barrier(bc->cache);
+}
+
+static uint32_t lookup(Bcache *bc, uint64_t block) {
+    BcEntry *set = &bc->entries[(block % bc->sets) * BCACHE_WAYS];
+    for (uint32_t w = 0; w < BCACHE_WAYS; w++) {
+        if ((set[w].state == BC_CLEAN || set[w].state == BC_DIRTY) && set[w].block == block) {
+            set[w].lru = ++bc->tick;
+            return (uint32_t)((block % bc->sets) * BCACHE_WAYS + w);
+        }
+    }
+    return NO_SLOT;
+}
+
+/* Slot for block, marked BUSY: a free one, else the least recently used
+ * clean one. Sets *was_valid if the slot held data. */
+static uint32_t allocate(Bcache *bc, uint64_t block, int *was_valid) {
+    uint32_t base = (uint32_t)((block % bc->sets) * BCACHE_WAYS);
+    uint32_t victim = NO_SLOT;
+    for (uint32_t w = 0; w < BCACHE_WAYS; w++) {
+        BcEntry *e = &bc->entries[base + w];
+        if (e->state == BC_INVALID) {
+            victim = base + w;
+            break;
+        }
+        if (e->state == BC_CLEAN && (victim == NO_SLOT || e->lru < bc->entries[victim].lru)) {
+            victim = base + w;
+        }
+    }
+    if (victim == NO_SLOT) {
+        return NO_SLOT;
+    }
+    *was_valid = bc->entries[victim].state == BC_CLEAN;
+    if (*was_valid) {
+        bc->stats.evictions++;
+    }
+    set_state(bc, victim, BC_BUSY);
+    bc->entries[victim].block = block;
+    bc->entries[victim].lru = ++bc->tick;
+    return victim;
+}
+
+/* Sequential stream detection; returns 1 when req continues a stream
+ * past the cutoff */
+static int sequential(Bcache *bc, BlockRequest *req) {
+    uint64_t bytes = (uint64_t)req->count * bc->dev.sector_size;
+    BcStream *oldest = &bc->streams[0];
+    for (uint32_t i = 0; i < BCACHE_STREAMS; i++) {
+        BcStream *st = &bc->streams[i];
+        if (st->bytes && st->next_lba == req->lba) {
+            st->bytes += bytes;
+            st->next_lba = req->lba + req->count;
+            st->tick = bc->tick;
+            return st->bytes >= BCACHE_SEQ_CUTOFF;
+        }
+        if (st->tick < oldest->tick) {
+            oldest = st;
+        }
+    }
+    oldest->next_lba = req->lba + req->count;
+    oldest->bytes = bytes;
+    oldest->tick = bc->tick;
+    return bytes >= BCACHE_SEQ_CUTOFF;
+}
+
+/* ---- Requests ------------------------------------------------------------ */
+
+/* Part of block first + i that req covers */
+typedef struct {
+    uint64_t block;
+    uint32_t skip;                      /* Bytes into the request */
+    uint32_t offset;                    /* Sectors into the block */
+    uint32_t sectors;
+} Piece;
+
+static void piece_of(Bcache *bc, BlockRequest *req, uint32_t i, Piece *p) {
+    uint64_t first = req->lba / bc->spb;
+    uint64_t start = (first + i) * bc->spb;
+    uint64_t from = start > req->lba ? start : req->lba;
+    uint64_t to = start + bc->spb < req->lba + req->count ? start + bc->spb : req->lba + req->count;
+    p->block = first + i;
+    p->skip = (uint32_t)(from - req->lba) * bc->dev.sector_size;
+    p->offset = (uint32_t)(from - start);
+    p->sectors = (uint32_t)(to - from);
+}
+
+static uint32_t request_blocks(Bcache *bc, BlockRequest *req) {
+    return (uint32_t)((req->lba + req->count - 1) / bc->spb - req->lba / bc->spb + 1);
+}
+
+static void cache_piece(Bcache *bc, BlockRequest *req, uint32_t op, uint32_t slot, Piece *p) {
+    batch_segs(bc, bc->cache, op, slot_lba(bc, slot, p->offset), req->segments, req->segment_count,
+               p->skip, p->sectors * bc->dev.sector_size);
+}
+
+static void backing_run(Bcache *bc, BlockRequest *req, uint32_t op, uint64_t lba, uint32_t skip, uint32_t bytes) {
+    if (bytes) {
+        batch_segs(bc, bc->backing, op, lba, req->segments, req->segment_count, skip, bytes);
+    }
+}
+
+/* Give the BUSY slots their final state once their data is written, or
+ * drop them if it was not. Only memory changes here: on the cache the
+ * slots still read as invalid until the next flush or writeback pass
+ * syncs the table. */
+static void settle(Bcache *bc, uint32_t n, int ok, uint32_t state) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (bc->req_act[i] == ACT_FILL && bc->req_slot[i] != NO_SLOT) {
+            set_state(bc, bc->req_slot[i], ok ? state : BC_INVALID);
+        }
+    }
+    if (ok) {
+        bc->unsynced = 1;
+    }
+}
+
+static int bc_read(Bcache *bc, BlockRequest *req) {
+    uint32_t n = request_blocks(bc, req);
+    int bypass = sequential(bc, req);
+    int dirty_hit = 0;
+    uint64_t run_lba = 0;
+    uint32_t run_skip = 0;
+    uint32_t run_bytes = 0;
+    Piece p;
+
+    for (uint32_t i = 0; i < n; i++) {
+        piece_of(bc, req, i, &p);
+        uint32_t slot = lookup(bc, p.block);
+        bc->req_slot[i] = slot;
+        bc->req_act[i] = ACT_NONE;
+        if (slot == NO_SLOT) {
+            bc->stats.read_misses++;
+            if (!run_bytes) {
+                run_lba = req->lba + p.skip / bc->dev.sector_size;
+                run_skip = p.skip;
+            }
+            run_bytes += p.sectors * bc->dev.sector_size;
+            continue;
+        }
+        bc->stats.read_hits++;
+        dirty_hit |= bc->entries[slot].state == BC_DIRTY;
+        backing_run(bc, req, BLOCK_OP_READ, run_lba, run_skip, run_bytes);
+        run_bytes = 0;
+        cache_piece(bc, req, BLOCK_OP_READ, slot, &p);
+    }
+    backing_run(bc, req, BLOCK_OP_READ, run_lba, run_skip, run_bytes);
+
+    if (!batch_finish(bc)) {
+        /* Clean data can still come from the disk */
+        bc->stats.errors++;
+        if (dirty_hit) {
+            return BLOCK_EIO;
+        }
+        backing_run(bc, req, BLOCK_OP_READ, req->lba, 0, req->count * bc->dev.sector_size);
+        return batch_finish(bc) ? BLOCK_OK : BLOCK_EIO;
+    }
+    if (bypass) {
+        bc->stats.bypassed++;
+        return BLOCK_OK;
+    }
+
+    /* Copy whole missed blocks into the cache before the caller can reuse
+     * the buffer. Slots that held other data are invalidated on the cache
+     * first. */
+    int invalidated = 0;
+    int filling = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        piece_of(bc, req, i, &p);
+        if (bc->req_slot[i] != NO_SLOT || p.sectors != bc->spb) {
+            continue;
+        }
+        int was_valid = 0;
+        bc->req_slot[i] = allocate(bc, p.block, &was_valid);
+        if (bc->req_slot[i] != NO_SLOT) {
+            bc->req_act[i] = ACT_FILL;
+            invalidated |= was_valid;
+            filling = 1;
+        }
+    }
+    if (!filling) {
+        return BLOCK_OK;
+    }
+    int ok = 1;
+    if (invalidated) {
+        ok = sync_meta(bc);
+    }
+    for (uint32_t i = 0; ok && i < n; i++) {
+        if (bc->req_act[i] == ACT_FILL) {
+            piece_of(bc, req, i, &p);
+            cache_piece(bc, req, BLOCK_OP_WRITE, bc->req_slot[i], &p);
+            bc->stats.fills++;
+        }
+    }
+    ok = ok && batch_finish(bc);
+    if (!ok) {
+        bc->stats.errors++;
+    }
+    settle(bc, n, ok, BC_CLEAN);
+    return BLOCK_OK;                    /* The caller's data is good either way */
+}
+
+static int bc_write(Bcache *bc, BlockRequest *req) {
+    uint32_t n = request_blocks(bc, req);
+    uint32_t sector_size = bc->dev.sector_size;
+    int writeback = bc->mode == BCACHE_WRITEBACK;
+    int hits = 0;
+    Piece p;
+
+    for (uint32_t i = 0; i < n; i++) {
+        piece_of(bc, req, i, &p);
+        bc->req_slot[i] = lookup(bc, p.block);
+        hits |= bc->req_slot[i] != NO_SLOT;
+    }
+
+    /* Long sequential writes skip the cache unless it holds their blocks */
+    if (sequential(bc, req) && !hits) {
+        bc->stats.bypassed++;
+        backing_run(bc, req, BLOCK_OP_WRITE, req->lba, 0, req->count * sector_size);
+        return batch_finish(bc) ? BLOCK_OK : BLOCK_EIO;
+    }
+
+    int invalidate = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        piece_of(bc, req, i, &p);
+        uint32_t slot = bc->req_slot[i];
+        if (slot != NO_SLOT) {
+            bc->stats.write_hits++;
+            if (bc->entries[slot].state == BC_DIRTY) {
+                bc->req_act[i] = ACT_INPLACE;
+            } else {
+                set_state(bc, slot, BC_BUSY);
+                bc->req_act[i] = ACT_FILL;
+                invalidate = 1;
+            }
+            continue;
+        }
+        bc->stats.write_misses++;
+        bc->req_act[i] = ACT_AROUND;
+        if (p.sectors == bc->spb) {
+            int was_valid = 0;
+            slot = allocate(bc, p.block, &was_valid);
+            if (slot != NO_SLOT) {
+                bc->req_slot[i] = slot;
+                bc->req_act[i] = ACT_FILL;
+                invalidate |= was_valid;
+            }
+        }
+    }
+    if (invalidate && !sync_meta(bc)) {
+        settle(bc, n, 0, BC_INVALID);
+        return BLOCK_EIO;
+    }
+
+    if (!writeback) {
+        backing_run(bc, req, BLOCK_OP_WRITE, req->lba, 0, req->count * sector_size);
+    }
+    uint64_t run_lba = 0;
+    uint32_t run_skip = 0;
+    uint32_t run_bytes = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        piece_of(bc, req, i, &p);
+        if (bc->req_act[i] == ACT_AROUND) {
+            if (!run_bytes) {
+                run_lba = req->lba + p.skip / sector_size;
+                run_skip = p.skip;
+            }
+            run_bytes += p.sectors * sector_size;
+            continue;
+        }
+        if (writeback) {
+            backing_run(bc, req, BLOCK_OP_WRITE, run_lba, run_skip, run_bytes);
+        }
+        run_bytes = 0;
+        cache_piece(bc, req, BLOCK_OP_WRITE, bc->req_slot[i], &p);
+    }
+    if (writeback) {
+        backing_run(bc, req, BLOCK_OP_WRITE, run_lba, run_skip, run_bytes);
+    }
+
+    int ok = batch_finish(bc);
+    /* Write-through data only counts as cached once the disk has it too */
+    settle(bc, n, ok, writeback ? BC_DIRTY : BC_CLEAN);
+    return ok ? BLOCK_OK : BLOCK_EIO;
+}
+
+/* Everything completed before the flush is durable on both devices, and
+ * so is the table describing it */
+static int bc_flush(Bcache *bc) {
+    int ok = barrier(bc->backing);
+    return sync_meta(bc) && ok ? BLOCK_OK : BLOCK_EIO;
+}
+
+/* Copy up to max dirty blocks to the backing disk, in disk order. Returns
+ * the number cleaned. */
+static uint32_t writeback_pass(Bcache *bc, uint32_t max) {
+    uint32_t *slots = bc->req_slot;
+    uint32_t n = 0;
+    if (max > BCACHE_WB_BATCH) {
+        max = BCACHE_WB_BATCH;
+    }
+    for (uint32_t s = 0; s < bc->blocks && n < max && n < BCACHE_MAX_REQ_BLOCKS; s++) {
+        if (bc->entries[s].state != BC_DIRTY) {
+            continue;
+        }
+        uint32_t j = n++;
+        while (j > 0 && bc->entries[slots[j - 1]].block > bc->entries[s].block) {
+            slots[j] = slots[j - 1];
+            j--;
+        }
+        slots[j] = s;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        batch_buf(bc, bc->cache, BLOCK_OP_READ, slot_lba(bc, slots[i], 0),
+                  bc->bounce + (uint64_t)i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    }
+    if (!batch_finish(bc)) {
+        bc->stats.errors++;
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        batch_buf(bc, bc->backing, BLOCK_OP_WRITE, bc->entries[slots[i]].block * bc->spb,
+                  bc->bounce + (uint64_t)i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    }
+    /* Only durable copies let the slots go clean */
+    if (!batch_finish(bc) || !barrier(bc->backing)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        set_state(bc, slots[i], BC_CLEAN);
+    }
+    sync_meta(bc);
+    bc->stats.writebacks += n;
+    return n;
+}
+
+/* ---- Driver -------------------------------------------------------------- */
+
+static int bc_acquire(Bcache *bc) {
+    uint64_t flags = local_irq_save();
+    int got = !bc->working;
+    bc->working = 1;
+    local_irq_restore(flags);
+    return got;
+}
+
+static void bc_release(Bcache *bc) {
+    uint64_t flags = local_irq_save();
+    bc->working = 0;
+    local_irq_restore(flags);
+}
+
+static int bc_poll(BlockDevice *dev) {
+    Bcache *bc = (Bcache *)dev->driver_data;
+    int completed = 0;
+
+    /* Serving a request waits on member I/O and flushes, too long for a
+     * bottom half; a stacked driver's softirq polling us gets nothing */
+    if (softirq_active()) {
+        return 0;
+    }
+
+    /* Whoever holds working drains the queue, including requests that
+     * arrive meanwhile; the recheck covers one queued as it let go */
+    while (bc->pending && bc_acquire(bc)) {
+        for (;;) {
+            BlockRequest *req = 0;
+            uint64_t flags = local_irq_save();
+            for (uint32_t i = 0; i < BCACHE_QUEUE_DEPTH; i++) {
+                if (bc->pending & (1U << i)) {
+                    req = bc->slot_req[i];
+                    bc->slot_req[i] = 0;
+                    bc->pending &= ~(1U << i);
+                    break;
+                }
+            }
+            local_irq_restore(flags);
+            if (!req) {
+                break;
+            }
+
+            int status;
+            if (req->op == BLOCK_OP_FLUSH) {
+                status = bc_flush(bc);
+            } else if (req->op == BLOCK_OP_READ) {
+                status = bc_read(bc, req);
+            } else {
+                status = bc_write(bc, req);
+            }
+            block_complete(req, status);
+            completed++;
+        }
+        if (bc->mode == BCACHE_WRITEBACK && bc->stats.dirty * 100 > (uint64_t)bc->blocks * BCACHE_DIRTY_HIGH) {
+            writeback_pass(bc, BCACHE_WB_BATCH);
+        }
+        bc_release(bc);
+    }
+    return completed;
+}
+
+static int bc_submit(BlockDevice *dev, BlockRequest *req) {
+    Bcache *bc = (Bcache *)dev->driver_data;
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE && req->op != BLOCK_OP_FLUSH) {
+        return BLOCK_EINVAL;
+    }
+
+    uint64_t flags = local_irq_save();
+    int slot = -1;
+    for (int i = 0; i < BCACHE_QUEUE_DEPTH; i++) {
+        if (!(bc->pending & (1U << i))) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+    /* Served by block_wait() on us or a device stacked on us, or by
+     * bcache_background() from the idle loop */
+    bc->slot_req[slot] = req;
+    bc->pending |= 1U << slot;
+    local_irq_restore(flags);
+    return BLOCK_OK;
+}
+
+/* ---- Setup --------------------------------------------------------------- */
+
+static uint32_t super_checksum(const BcSuper *sb) {
+    const uint8_t *p = (const uint8_t *)sb;
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < sizeof(BcSuper); i++) {
+        uint8_t byte = p[i];
+        if (i >= __builtin_offsetof(BcSuper, checksum) && i < __builtin_offsetof(BcSuper, checksum) + 4) {
+            byte = 0;
+        }
+        hash = (hash ^ byte) * 16777619U;
+    }
+    return hash;
+}
+
+static int names_equal(const char *a, const char *b) {
+    uint32_t i = 0;
+    while (i < 15 && a[i] && a[i] == b[i]) {
+        i++;
+    }
+    return i == 15 || a[i] == b[i];
+}
+
+static int write_super(Bcache *bc) {
+    BcSuper *sb = (BcSuper *)bc->bounce;
+    for (uint32_t i = 0; i < BCACHE_BLOCK_SIZE; i++) {
+        bc->bounce[i] = 0;
+    }
+    sb->magic = BCACHE_MAGIC;
+    sb->version = BCACHE_VERSION;
+    sb->mode = bc->mode;
+    sb->block_size = BCACHE_BLOCK_SIZE;
+    sb->ways = BCACHE_WAYS;
+    sb->blocks = bc->blocks;
+    sb->backing_sectors = bc->backing->total_sectors;
+    sb->backing_sector_size = bc->dev.sector_size;
+    const char *name = bc->backing->name ? bc->backing->name : "";
+    for (uint32_t i = 0; i < 15 && name[i]; i++) {
+        sb->backing_name[i] = name[i];
+    }
+    sb->checksum = super_checksum(sb);
+    return block_write(bc->cache, 0, BCACHE_BLOCK_SIZE / bc->cache->sector_size, bc->bounce) &&
+           barrier(bc->cache);
+}
+
+/* Superblock in buf is ours and intact */
+static int super_valid(const BcSuper *sb) {
+    return sb->magic == BCACHE_MAGIC && sb->version == BCACHE_VERSION && sb->checksum == super_checksum(sb);
+}
+
+/* Take the table from the cache device. Anything not clean or dirty, or
+ * outside the disk, is treated as empty. */
+static int load_entries(Bcache *bc) {
+    uint32_t per_block = BCACHE_BLOCK_SIZE / bc->cache->sector_size;
+    if (!block_read(bc->cache, per_block, per_block * bc->meta_blocks, bc->entries)) {
+        return 0;
+    }
+    uint64_t disk_blocks = bc->backing->total_sectors / bc->spb;
+    for (uint32_t s = 0; s < bc->blocks; s++) {
+        BcEntry *e = &bc->entries[s];
+        if ((e->state != BC_CLEAN && e->state != BC_DIRTY) || e->block >= disk_blocks ||
+            e->block % bc->sets != s / BCACHE_WAYS) {
+            e->state = BC_INVALID;
+        }
+        bc->stats.valid += e->state != BC_INVALID;
+        bc->stats.dirty += e->state == BC_DIRTY;
+        if (e->lru > bc->tick) {
+            bc->tick = e->lru;
+        }
+    }
+    return 1;
+}
+
+static int format_entries(Bcache *bc) {
+    uint8_t *raw = (uint8_t *)bc->entries;
+    for (uint64_t i = 0; i < (uint64_t)bc->meta_blocks * BCACHE_BLOCK_SIZE; i++) {
+        raw[i] = 0;
+    }
+    uint32_t per_block = BCACHE_BLOCK_SIZE / bc->cache->sector_size;
+    return block_write(bc->cache, per_block, per_block * bc->meta_blocks, bc->entries);
+}
+
+static BlockDevice *bc_reject(const char *why) {
+    bc_log("not attached: ", why);
+    KERR("BCACHE: cache not attached");
+    return 0;
+}
+
+static int is_stacked(BlockDevice *dev) {
+    for (int i = 0; i < cache_count; i++) {
+        if (&caches[i].dev == dev || caches[i].backing == dev || caches[i].cache == dev) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+BlockDevice *bcache_create(BlockDevice *backing, BlockDevice *cache, uint32_t mode, int force) {
+    if (cache_count >= BCACHE_MAX_DEVICES) {
+        return bc_reject("no free cache device");
+    }
+    if (!backing || !cache || backing == cache || is_stacked(backing) || is_stacked(cache)) {
+        return bc_reject("devices missing, the same or already stacked");
+    }
+    if (mode != BCACHE_WRITETHROUGH && mode != BCACHE_WRITEBACK) {
+        return bc_reject("bad mode");
+    }
+    uint32_t bss = backing->sector_size ? backing->sector_size : BLOCK_SECTOR_SIZE;
+    uint32_t css = cache->sector_size ? cache->sector_size : BLOCK_SECTOR_SIZE;
+    if (BCACHE_BLOCK_SIZE % bss || css > bss || !backing->total_sectors || !cache->total_sectors) {
+        return bc_reject("unsupported sector sizes or unknown size");
+    }
+
+    /* Superblock, then 16 bytes of table and 4 KiB of data per slot */
+    uint64_t cache_bytes = cache->total_sectors * css;
+    uint64_t blocks = (cache_bytes - BCACHE_BLOCK_SIZE) / (BCACHE_BLOCK_SIZE + sizeof(BcEntry));
+    if (blocks > BCACHE_MAX_BLOCKS) {
+        blocks = BCACHE_MAX_BLOCKS;
+    }
+    blocks -= blocks % ENTRIES_PER_META;
+    if (blocks == 0) {
+        return bc_reject("cache device too small");
+    }
+    uint32_t meta_blocks = (uint32_t)(blocks / ENTRIES_PER_META);
+
+    Bcache *bc = &caches[cache_count];
+    if (!bc->batch) {
+        bc->batch = (BlockRequest *)pmm_alloc_pages((BCACHE_BATCH * sizeof(BlockRequest) + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE);
+        bc->bounce = (uint8_t *)pmm_alloc_pages((uint64_t)BCACHE_WB_BATCH * BCACHE_BLOCK_SIZE / PMM_PAGE_SIZE);
+    }
+    BcEntry *entries = (BcEntry *)pmm_alloc_pages((uint64_t)meta_blocks * BCACHE_BLOCK_SIZE / PMM_PAGE_SIZE);
+    if (!bc->batch || !bc->bounce || !entries) {
+        return bc_reject("out of memory");
+    }
+
+    uint8_t *zero = (uint8_t *)&bc->stats;
+    for (uint32_t i = 0; i < sizeof(BcacheStats); i++) {
+        zero[i] = 0;
+    }
+    for (uint32_t i = 0; i < META_MAX / 32; i++) {
+        bc->meta_dirty[i] = 0;
+    }
+    bc->unsynced = 0;
+    bc->backing = backing;
+    bc->cache = cache;
+    bc->mode = mode;
+    bc->spb = BCACHE_BLOCK_SIZE / bss;
+    bc->cspb = BCACHE_BLOCK_SIZE / css;
+    bc->blocks = blocks;
+    bc->sets = blocks / BCACHE_WAYS;
+    bc->data_lba = (uint64_t)(1 + meta_blocks) * bc->cspb;
+    bc->entries = entries;
+    bc->meta_blocks = meta_blocks;
+    bc->dev.sector_size = bss;
+
+    if (!block_read(cache, 0, bc->cspb, bc->bounce)) {
+        return bc_reject("cannot read the cache device");
+    }
+    BcSuper *sb = (BcSuper *)bc->bounce;
+    int ours = super_valid(sb);
+    int same = ours && sb->block_size == BCACHE_BLOCK_SIZE && sb->ways == BCACHE_WAYS &&
+               sb->blocks == blocks && sb->backing_sectors == backing->total_sectors &&
+               sb->backing_sector_size == bss && names_equal(sb->backing_name, backing->name ? backing->name : "");
+    if (ours && !same && !force) {
+        return bc_reject("cache belongs to another disk (force to reformat)");
+    }
+
+    bc->tick = 0;
+    bc->stats.warm = same && load_entries(bc);
+    if (!bc->stats.warm) {
+        bc->stats.valid = 0;
+        bc->stats.dirty = 0;
+        if (!format_entries(bc)) {
+            return bc_reject("cannot write the cache device");
+        }
+    }
+    /* A clean cache can change mode freely; dirty blocks go back first */
+    if (mode == BCACHE_WRITETHROUGH) {
+        while (bc->stats.dirty && writeback_pass(bc, BCACHE_WB_BATCH)) {
+        }
+        if (bc->stats.dirty) {
+            return bc_reject("cannot write back dirty blocks");
+        }
+    }
+    if (!write_super(bc)) {
+        return bc_reject("cannot write the superblock");
+    }
+
+    BlockDevice *dev = &bc->dev;
+    dev->name = cache_names[cache_count];
+    dev->total_sectors = backing->total_sectors;
+    dev->driver_data = bc;
+    dev->max_segments = BLOCK_MAX_SEGMENTS;
+    dev->max_sectors = (BCACHE_MAX_REQ_BLOCKS - 1) * bc->spb;
+    if (backing->max_sectors && backing->max_sectors < dev->max_sectors) {
+        dev->max_sectors = backing->max_sectors;
+    }
+    dev->queue_depth = BCACHE_QUEUE_DEPTH;
+    dev->submit = bc_submit;
+    dev->poll = bc_poll;
+    bc->stats.blocks = (uint32_t)blocks;
+    bc->stats.mode = mode;
+
+    if (!block_register(dev)) {
+        return bc_reject("no free block device slot");
+    }
+    cache_count++;
+
+    serial_write("BCACHE: ");
+    serial_write(dev->name);
+    serial_write(": ");
+    serial_write(cache->name ? cache->name : "?");
+    serial_write(mode == BCACHE_WRITEBACK ? " caching (write-back) " : " caching (write-through) ");
+    serial_write(backing->name ? backing->name : "?");
+    serial_write(bc->stats.warm ? ", warm\n" : ", empty\n");
+    KLOG("BCACHE: cache attached");
+    return dev;
+}
+
+int bcache_probe(void) {
+    static uint8_t probe_buf[BCACHE_BLOCK_SIZE] __attribute__((aligned(4096)));
+    int attached = 0;
+    int count = block_count();
+
+    for (int i = 0; i < count; i++) {
+        BlockDevice *cache = block_get(i);
+        if (!cache || is_stacked(cache) || !cache->total_sectors ||
+            (cache->sector_size && BCACHE_BLOCK_SIZE % cache->sector_size)) {
+            continue;
+        }
+        uint32_t css = cache->sector_size ? cache->sector_size : BLOCK_SECTOR_SIZE;
+        if (!block_read(cache, 0, BCACHE_BLOCK_SIZE / css, probe_buf)) {
+            continue;
+        }
+        BcSuper *sb = (BcSuper *)probe_buf;
+        if (!super_valid(sb)) {
+            continue;
+        }
+        uint32_t mode = sb->mode;
+        for (int j = 0; j < count; j++) {
+            BlockDevice *backing = block_get(j);
+            if (backing && backing != cache && backing->total_sectors == sb->backing_sectors &&
+                names_equal(sb->backing_name, backing->name ? backing->name : "")) {
+                attached += bcache_create(backing, cache, mode, 0) != 0;
+                break;
+            }
+        }
+    }
+    return attached;
+}
+
+BlockDevice *bcache_for_backing(BlockDevice *backing) {
+    for (int i = 0; i < cache_count; i++) {
+        if (caches[i].backing == backing) {
+            return &caches[i].dev;
+        }
+    }
+    return 0;
+}
+
+int bcache_count(void) {
+    return cache_count;
+}
+
+BlockDevice *bcache_get(int index) {
+    if (index < 0 || index >= cache_count) {
+        return 0;
+    }
+    return &caches[index].dev;
+}
+
+static Bcache *bc_of(BlockDevice *dev) {
+    return (dev && dev->submit == bc_submit) ? (Bcache *)dev->driver_data : 0;
+}
+
+int bcache_flush_dirty(BlockDevice *dev) {
+    Bcache *bc = bc_of(dev);
+    if (!bc) {
+        return 0;
+    }
+    while (!bc_acquire(bc)) {
+        bc_poll(dev);
+    }
+    while (bc->stats.dirty && writeback_pass(bc, BCACHE_WB_BATCH)) {
+    }
+    int clean = bc->stats.dirty == 0;
+    bc_release(bc);
+    bc_poll(dev);
+    return clean;
+}
+
+int bcache_set_mode(BlockDevice *dev, uint32_t mode) {
+    Bcache *bc = bc_of(dev);
+    if (!bc || (mode != BCACHE_WRITETHROUGH && mode != BCACHE_WRITEBACK)) {
+        return 0;
+    }
+    if (mode == BCACHE_WRITETHROUGH && !bcache_flush_dirty(dev)) {
+        return 0;
+    }
+    while (!bc_acquire(bc)) {
+        bc_poll(dev);
+    }
+    /* Writes that dirtied blocks after the flush above go back too */
+    while (mode == BCACHE_WRITETHROUGH && bc->stats.dirty && writeback_pass(bc, BCACHE_WB_BATCH)) {
+    }
+    int ok = mode == BCACHE_WRITEBACK || bc->stats.dirty == 0;
+    if (ok) {
+        bc->mode = mode;
+        bc->stats.mode = mode;
+        ok = write_super(bc);
+    }
+    bc_release(bc);
+    bc_poll(dev);
+    return ok;
+}
+
+int bcache_get_stats(BlockDevice *dev, BcacheStats *out) {
+    Bcache *bc = bc_of(dev);
+    if (!bc || !out) {
+        return 0;
+    }
+    const uint8_t *src = (const uint8_t *)&bc->stats;
+    uint8_t *dst = (uint8_t *)out;
+    for (uint32_t i = 0; i < sizeof(BcacheStats); i++) {
+        dst[i] = src[i];
+    }
+    return 1;
+}
+
+void bcache_background(void) {
+    for (int i = 0; i < cache_count; i++) {
+        Bcache *bc = &caches[i];
+        if (bc->pending) {
+            /* Requests nobody waits on yet */
+            bc_poll(&bc->dev);
+            continue;
+        }
+        int dirty = bc->mode == BCACHE_WRITEBACK && bc->stats.dirty;
+        if (!dirty && !bc->unsynced) {
+            continue;
+        }
+        uint64_t now = rdtsc();
+        if (now - bc->last_writeback < tsc_from_us((uint64_t)BCACHE_WB_INTERVAL_MS * 1000)) {
+            continue;
+        }
+        if (bc_acquire(bc)) {
+            /* A pass syncs the table too; slots filled since the last
+             * flush keep the cache warm across a reboot */
+            if (!dirty || !writeback_pass(bc, BCACHE_WB_BATCH)) {
+                sync_meta(bc);
+            }
+            bc->last_writeback = rdtsc();
+            bc_release(bc);
+            bc_poll(&bc->dev);
+        }
+    }
+}
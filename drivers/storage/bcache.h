@@ -0,0 +1,90 @@
+#ifndef KAGAMI_BCACHE_H
+#define KAGAMI_BCACHE_H
+
+#include "types.h"
+#include "block.h"
+
+/* Block-level cache tier: a fast device (typically NVMe) caching a slower
+ * backing disk, registered as bcache0, bcache1, ... with the backing
+ * disk's size and sector size, so partitions and ext4 work unchanged.
+ *
+ * The cache is split into 4 KiB slots, BCACHE_WAYS-way set associative
+ * on the backing block number and replaced LRU within a set. Read misses
+ * fill the cache before completing; sequential streams longer than
+ * BCACHE_SEQ_CUTOFF bypass it, so a large copy does not flush out hot
+ * metadata. In write-through mode writes go to both devices; in
+ * write-back mode they complete once on the cache and dirty slots are
+ * written back in the background.
+ *
+ * The cache device holds a superblock and a table of slot entries. A slot
+ * is marked invalid on the cache before its data changes; its new state
+ * reaches the table at the next flush or writeback pass, behind a barrier
+ * on the data, so the table never describes data that is not there. After
+ * a reboot bcache_probe() picks the cache up warm, dirty blocks included.
+ * Requests are handled one at a time in task context, from poll and the
+ * idle loop, with the member I/O of each issued in parallel.
+ */
+
+#define BCACHE_MAX_DEVICES    2
+#define BCACHE_BLOCK_SIZE     4096
+#define BCACHE_WAYS           8
+#define BCACHE_MAX_BLOCKS     (256 * 1024)         /* 1 GiB of cache, 4 MiB of entries in RAM */
+#define BCACHE_QUEUE_DEPTH    16
+#define BCACHE_MAX_REQ_BLOCKS 64                   /* Largest request, in cache blocks */
+#define BCACHE_SEQ_CUTOFF     (4 * 1024 * 1024)
+#define BCACHE_STREAMS        8                    /* Sequential streams tracked */
+#define BCACHE_WB_BATCH       64                   /* Blocks written back per pass */
+#define BCACHE_WB_INTERVAL_MS 100                  /* Between background passes */
+#define BCACHE_DIRTY_HIGH     50                   /* % dirty that writes back from poll */
+
+#define BCACHE_WRITETHROUGH   0
+#define BCACHE_WRITEBACK      1
+
+typedef struct {
+    uint64_t read_hits;                   /* Cache blocks */
+    uint64_t read_misses;
+    uint64_t write_hits;
+    uint64_t write_misses;
+    uint64_t bypassed;                    /* Requests sent straight to the backing disk */
+    uint64_t fills;                       /* Blocks copied into the cache */
+    uint64_t evictions;
+    uint64_t writebacks;                  /* Dirty blocks written to the backing disk */
+    uint64_t errors;                      /* Failed cache I/O */
+    uint32_t blocks;                      /* Cache slots */
+    uint32_t valid;
+    uint32_t dirty;
+    uint32_t mode;
+    int warm;                             /* Entries reloaded from the cache device */
+} BcacheStats;
+
+/* Attach cache in front of backing. An existing cache for the same disk
+ * is reused; one belonging to another disk is only reformatted with
+ * force. Returns the new device or 0 (and logs why). */
+BlockDevice *bcache_create(BlockDevice *backing, BlockDevice *cache, uint32_t mode, int force);
+
+/* Attach every registered cache device whose backing disk is present;
+ * called once the disk drivers are up. Returns the number attached. */
+int bcache_probe(void);
+
+/* The cached device stacked on backing, or 0 */
+BlockDevice *bcache_for_backing(BlockDevice *backing);
+
+int bcache_count(void);
+BlockDevice *bcache_get(int index);
+
+/* Switch mode; leaving write-back first writes every dirty block back.
+ * Returns 1 on success. */
+int bcache_set_mode(BlockDevice *dev, uint32_t mode);
+
+/* Write back every dirty block. Returns 1 when none are left. */
+int bcache_flush_dirty(BlockDevice *dev);
+
+/* Returns 0 if dev is not a cached device */
+int bcache_get_stats(BlockDevice *dev, BcacheStats *out);
+
+/* Background write-back and table sync, and requests nobody is waiting
+ * on yet; cheap when there is nothing to do. Idle loops call it next to
+ * bufcache_writeback(). */
+void bcache_background(void);
+
+#endif
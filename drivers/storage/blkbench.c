@@ -0,0 +1,271 @@
+#include "blkbench.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "irqflags.h"
+
+/* Log-linear latency histogram in nanoseconds: values below 8 get their
+ * own bucket, above that every power of two is split in 8 */
+#define LAT_SUB_BITS  3
+#define LAT_SUB       (1U << LAT_SUB_BITS)
+#define LAT_BUCKETS   (64 * LAT_SUB)
+
+typedef struct {
+    BlockRequest req;
+    uint64_t issued;            /* TSC at submit */
+    int busy;
+} BenchSlot;
+
+static BenchSlot slots[BLKBENCH_MAX_QD];
+static uint8_t *buffers;        /* BLKBENCH_MAX_QD * BLKBENCH_MAX_BS, kept across runs */
+static uint64_t latency[LAT_BUCKETS];
+static uint64_t lat_sum_ns;
+static uint64_t lat_max_ns;
+static uint64_t done_ios;
+static uint64_t done_errors;
+static volatile uint32_t in_flight;
+
+static uint32_t lat_bucket(uint64_t ns) {
+    if (ns < LAT_SUB) {
+        return (uint32_t)ns;
+    }
+    uint32_t msb = 0;
+    for (uint64_t v = ns; v > 1; v >>= 1) {
+        msb++;
+    }
+    uint32_t sub = (uint32_t)(ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1);
+    return (msb - LAT_SUB_BITS + 1) * LAT_SUB + sub;
+}
+
+/* Largest value that falls in bucket b */
+static uint64_t lat_bucket_max(uint32_t b) {
+    if (b < LAT_SUB) {
+        return b;
+    }
+    uint32_t shift = b / LAT_SUB - 1;
+    uint64_t low = (uint64_t)(LAT_SUB + b % LAT_SUB) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+static uint64_t lat_percentile(uint64_t total, uint32_t per_mille) {
+    uint64_t want = (total * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < LAT_BUCKETS; b++) {
+        seen += latency[b];
+        if (seen >= want && seen) {
+            uint64_t bound = lat_bucket_max(b);
+            return bound < lat_max_ns ? bound : lat_max_ns;
+        }
+    }
+    return lat_max_ns;
+}
+
+static uint64_t cycles_to_ns(uint64_t cycles) {
+    return cycles * 1000000 / tsc_khz();
+}
+
+/* May run from the block softirq as well as from our own poll */
+static void bench_done(BlockRequest *req) {
+    BenchSlot *slot = (BenchSlot *)req->private;
+    uint64_t ns = cycles_to_ns(rdtsc() - slot->issued);
+
+    latency[lat_bucket(ns)]++;
+    lat_sum_ns += ns;
+    if (ns > lat_max_ns) {
+        lat_max_ns = ns;
+    }
+    done_ios++;
+    if (req->status != BLOCK_OK) {
+        done_errors++;
+    }
+    slot->busy = 0;
+    in_flight--;
+}
+
+/* xorshift64*, seeded from the TSC */
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int bench_check(BlkBenchConfig *cfg) {
+    BlockDevice *dev = cfg->dev;
+    if (!dev || (cfg->op != BLOCK_OP_READ && cfg->op != BLOCK_OP_WRITE)) {
+        return 0;
+    }
+    uint32_t sector_size = dev->sector_size ? dev->sector_size : BLOCK_SECTOR_SIZE;
+    if (cfg->block_size == 0 || cfg->block_size > BLKBENCH_MAX_BS || cfg->block_size % sector_size) {
+        return 0;
+    }
+    if (cfg->queue_depth == 0 || cfg->queue_depth > BLKBENCH_MAX_QD) {
+        return 0;
+    }
+    if (cfg->seconds == 0 || cfg->seconds > BLKBENCH_MAX_SECONDS) {
+        return 0;
+    }
+
+    if (cfg->sectors == 0) {
+        if (dev->total_sectors) {
+            if (cfg->start_lba >= dev->total_sectors) {
+                return 0;
+            }
+            cfg->sectors = dev->total_sectors - cfg->start_lba;
+        } else {
+            cfg->sectors = BLKBENCH_DEFAULT_SPAN / sector_size;
+        }
+    }
+    if (dev->total_sectors &&
+        (cfg->start_lba >= dev->total_sectors || cfg->sectors > dev->total_sectors - cfg->start_lba)) {
+        return 0;
+    }
+    return cfg->sectors >= cfg->block_size / sector_size;
+}
+
+int blkbench_run(BlkBenchConfig *cfg, BlkBenchResult *out) {
+    if (!out || !cfg || !bench_check(cfg)) {
+        return 0;
+    }
+    if (!buffers) {
+        buffers = (uint8_t *)pmm_alloc_pages((uint64_t)BLKBENCH_MAX_QD * BLKBENCH_MAX_BS / PMM_PAGE_SIZE);
+        if (!buffers) {
+            return 0;
+        }
+    }
+
+    BlockDevice *dev = cfg->dev;
+    uint32_t sector_size = dev->sector_size ? dev->sector_size : BLOCK_SECTOR_SIZE;
+    uint32_t bs_sectors = cfg->block_size / sector_size;
+    uint64_t blocks = cfg->sectors / bs_sectors;
+    uint64_t next_block = 0;
+    uint64_t seed = rdtsc() | 1;
+
+    if (cfg->op == BLOCK_OP_WRITE) {
+        for (uint64_t i = 0; i < (uint64_t)cfg->queue_depth * BLKBENCH_MAX_BS; i++) {
+            buffers[i] = (uint8_t)(i * 31 + (i >> 9));
+        }
+    }
+    for (uint32_t b = 0; b < LAT_BUCKETS; b++) {
+        latency[b] = 0;
+    }
+    lat_sum_ns = 0;
+    lat_max_ns = 0;
+    done_ios = 0;
+    done_errors = 0;
+    in_flight = 0;
+    for (uint32_t i = 0; i < cfg->queue_depth; i++) {
+        slots[i].busy = 0;
+    }
+
+    uint64_t start = rdtsc();
+    uint64_t end = start + tsc_from_us((uint64_t)cfg->seconds * 1000000);
+    int stopping = 0;
+
+    for (;;) {
+        if (!stopping && rdtsc() >= end) {
+            stopping = 1;
+        }
+        if (stopping && in_flight == 0) {
+            break;
+        }
+
+        for (uint32_t i = 0; !stopping && i < cfg->queue_depth; i++) {
+            BenchSlot *slot = &slots[i];
+            if (slot->busy) {
+                continue;
+            }
+            uint64_t block;
+            if (cfg->random) {
+                block = bench_random(&seed) % blocks;
+            } else {
+                block = next_block;
+                next_block = next_block + 1 < blocks ? next_block + 1 : 0;
+            }
+
+            block_request_init(&slot->req, dev, cfg->op, cfg->start_lba + block * bs_sectors);
+            slot->req.flags |= BLOCK_REQ_NOMERGE;
+            slot->req.done = bench_done;
+            slot->req.private = slot;
+            block_request_add(&slot->req, buffers + (uint64_t)i * BLKBENCH_MAX_BS, cfg->block_size);
+
+            uint64_t flags = local_irq_save();
+            slot->busy = 1;
+            in_flight++;
+            local_irq_restore(flags);
+
+            slot->issued = rdtsc();
+            block_submit(&slot->req);
+        }
+
+        if (!block_poll(dev)) {
+            __asm__ __volatile__("pause");
+        }
+    }
+
+    uint64_t elapsed_us = tsc_to_us(rdtsc() - start);
+    if (elapsed_us == 0) {
+        elapsed_us = 1;
+    }
+    out->ios = done_ios;
+    out->errors = done_errors;
+    out->bytes = (done_ios - done_errors) * cfg->block_size;
+    out->elapsed_us = elapsed_us;
+    out->iops = done_ios * 1000000 / elapsed_us;
+    out->kb_per_sec = out->bytes * 1000000 / 1024 / elapsed_us;
+    out->lat_avg_ns = done_ios ? lat_sum_ns / done_ios : 0;
+    out->lat_p50_ns = lat_percentile(done_ios, 500);
+    out->lat_p99_ns = lat_percentile(done_ios, 990);
+    out->lat_p999_ns = lat_percentile(done_ios, 999);
+    out->lat_max_ns = lat_max_ns;
+    return 1;
+}
+
+static void csv_str(char *line, int *pos, const char *s) {
+    while (*s) {
+        line[(*pos)++] = *s++;
+    }
+}
+
+static void csv_dec(char *line, int *pos, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n) {
+        line[(*pos)++] = digits[--n];
+    }
+}
+
+void blkbench_report_serial(const BlkBenchConfig *cfg, const BlkBenchResult *res) {
+    char line[256];
+    int pos = 0;
+
+    serial_write("BLKBENCH BEGIN\n");
+    serial_write("device,mode,bs,qd,start_lba,sectors,seconds,ios,errors,iops,kb_s,"
+                 "lat_avg_ns,lat_p50_ns,lat_p99_ns,lat_p999_ns,lat_max_ns\n");
+
+    csv_str(line, &pos, cfg->dev->name ? cfg->dev->name : "?");
+    line[pos++] = ',';
+    if (cfg->random) {
+        csv_str(line, &pos, "rand");
+    }
+    csv_str(line, &pos, cfg->op == BLOCK_OP_WRITE ? "write" : "read");
+    uint64_t values[] = {
+        cfg->block_size, cfg->queue_depth, cfg->start_lba, cfg->sectors, cfg->seconds,
+        res->ios, res->errors, res->iops, res->kb_per_sec,
+        res->lat_avg_ns, res->lat_p50_ns, res->lat_p99_ns, res->lat_p999_ns, res->lat_max_ns,
+    };
+    for (uint32_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        line[pos++] = ',';
+        csv_dec(line, &pos, values[i]);
+    }
+    line[pos++] = '\n';
+    line[pos] = 0;
+    serial_write(line);
+    serial_write("BLKBENCH END\n");
+}
@@ -0,0 +1,48 @@
+#ifndef KAGAMI_BLKBENCH_H
+#define KAGAMI_BLKBENCH_H
+
+#include "types.h"
+#include "block.h"
+
+/* fio-style load generator for a block device. Requests bypass the buffer
+ * cache and are never merged, so the numbers are the driver's and the
+ * device's. Task context; interrupts may be on or off. */
+
+#define BLKBENCH_MAX_QD       32
+#define BLKBENCH_MAX_BS       (128 * 1024)
+#define BLKBENCH_DEFAULT_SPAN (1024ULL * 1024 * 1024)  /* When the device size is unknown */
+#define BLKBENCH_MAX_SECONDS  600
+
+typedef struct {
+    BlockDevice *dev;
+    uint32_t op;                /* BLOCK_OP_READ or BLOCK_OP_WRITE */
+    int random;                 /* Uniform block-aligned offsets, else sequential */
+    uint32_t block_size;        /* Bytes, a multiple of the sector size */
+    uint32_t queue_depth;
+    uint64_t start_lba;
+    uint64_t sectors;           /* Range tested; 0 = to the end of the device */
+    uint32_t seconds;
+} BlkBenchConfig;
+
+typedef struct {
+    uint64_t ios;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t elapsed_us;
+    uint64_t iops;
+    uint64_t kb_per_sec;
+    uint64_t lat_avg_ns;
+    uint64_t lat_p50_ns;        /* Percentiles are bucket upper bounds, within 1/8 */
+    uint64_t lat_p99_ns;
+    uint64_t lat_p999_ns;
+    uint64_t lat_max_ns;
+} BlkBenchResult;
+
+/* Run the load for cfg->seconds. Returns 0 without issuing anything when
+ * the configuration is invalid. Write runs destroy the range's contents. */
+int blkbench_run(BlkBenchConfig *cfg, BlkBenchResult *out);
+
+/* One CSV header and row between BLKBENCH BEGIN / BLKBENCH END on serial */
+void blkbench_report_serial(const BlkBenchConfig *cfg, const BlkBenchResult *res);
+
+#endif
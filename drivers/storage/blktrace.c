@@ -0,0 +1,400 @@
+#include "blktrace.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "irqflags.h"
+
+#define RING_MASK (BLKTRACE_RING_SIZE - 1)
+
+static BlkTraceEvent *ring;     /* From pmm on the first enable, kept across resets */
+static volatile uint64_t ring_head;
+static volatile int recording;
+
+typedef struct {
+    BlockRequest req;
+    uint64_t issued;            /* TSC at submit */
+    int busy;
+} ReplaySlot;
+
+static ReplaySlot slots[BLKREPLAY_SLOTS];
+static uint8_t *replay_buffers; /* BLKREPLAY_SLOTS * BLKREPLAY_MAX_BS */
+static volatile uint32_t replay_in_flight;
+static uint64_t replay_ios;
+static uint64_t replay_errors;
+static uint64_t replay_lat_sum;
+static uint64_t replay_lat_max;
+
+int blktrace_enable(int enabled) {
+    if (enabled && !ring) {
+        ring = (BlkTraceEvent *)pmm_alloc_pages(
+            (BLKTRACE_RING_SIZE * sizeof(BlkTraceEvent) + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE);
+        if (!ring) {
+            return 0;
+        }
+    }
+    recording = enabled ? 1 : 0;
+    return 1;
+}
+
+int blktrace_enabled(void) {
+    return recording;
+}
+
+void blktrace_reset(void) {
+    uint64_t flags = local_irq_save();
+    ring_head = 0;
+    local_irq_restore(flags);
+}
+
+uint64_t blktrace_event_count(void) {
+    return ring_head;
+}
+
+uint64_t blktrace_dropped(void) {
+    return ring_head > BLKTRACE_RING_SIZE ? ring_head - BLKTRACE_RING_SIZE : 0;
+}
+
+static uint64_t ring_events(void) {
+    return ring_head > BLKTRACE_RING_SIZE ? BLKTRACE_RING_SIZE : ring_head;
+}
+
+/* i-th oldest event still in the ring */
+static BlkTraceEvent *ring_at(uint64_t i) {
+    return &ring[(ring_head - ring_events() + i) & RING_MASK];
+}
+
+/* block_get() index of dev as stored in events; 0xFF if unregistered */
+static uint8_t device_index(BlockDevice *dev) {
+    int devices = block_count();
+    for (int i = 0; i < devices; i++) {
+        if (block_get(i) == dev) {
+            return (uint8_t)i;
+        }
+    }
+    return 0xFF;
+}
+
+int blktrace_has_writes(BlockDevice *from) {
+    if (!ring) {
+        return 0;
+    }
+    uint8_t index = device_index(from);
+    uint64_t count = ring_events();
+    for (uint64_t i = 0; i < count; i++) {
+        BlkTraceEvent *ev = ring_at(i);
+        if (ev->dev == index && (ev->op == BLOCK_OP_WRITE || ev->op == BLOCK_OP_DISCARD)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void blktrace_record(BlockRequest *req, int status) {
+    if (!recording) {
+        return;
+    }
+    BlockDevice *dev = req->dev;
+    uint8_t index = device_index(dev);
+    uint32_t sector_size = (dev && dev->sector_size) ? dev->sector_size : BLOCK_SECTOR_SIZE;
+    uint8_t shift = 0;
+    while ((1U << shift) < sector_size) {
+        shift++;
+    }
+    uint64_t now = rdtsc();
+
+    uint64_t flags = local_irq_save();
+    BlkTraceEvent *ev = &ring[ring_head++ & RING_MASK];
+    ev->submit_tsc = req->submitted_at;
+    ev->complete_tsc = now;
+    ev->lba = req->lba;
+    ev->count = req->count;
+    ev->dev = index;
+    ev->op = (uint8_t)req->op;
+    ev->error = (uint8_t)(status < 0 ? -status : 0);
+    ev->sector_shift = shift;
+    local_irq_restore(flags);
+}
+
+static void dump_str(char *line, int *pos, const char *s) {
+    while (*s) {
+        line[(*pos)++] = *s++;
+    }
+}
+
+static void dump_dec(char *line, int *pos, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n) {
+        line[(*pos)++] = digits[--n];
+    }
+}
+
+void blktrace_dump_serial(void) {
+    int was_recording = recording;
+    recording = 0;
+
+    uint64_t count = ring ? ring_events() : 0;
+    char line[160];
+    int pos = 0;
+    dump_str(line, &pos, "BLKTRACE BEGIN ");
+    dump_dec(line, &pos, count);
+    dump_str(line, &pos, " tsc_khz=");
+    dump_dec(line, &pos, tsc_khz());
+    line[pos++] = '\n';
+    line[pos] = 0;
+    serial_write(line);
+
+    for (uint64_t i = 0; i < count; i++) {
+        BlkTraceEvent *ev = ring_at(i);
+        BlockDevice *dev = ev->dev < block_count() ? block_get(ev->dev) : 0;
+        pos = 0;
+        if (dev && dev->name) {
+            dump_str(line, &pos, dev->name);
+        } else {
+            dump_dec(line, &pos, ev->dev);
+        }
+        line[pos++] = ',';
+        line[pos++] = ev->op == BLOCK_OP_WRITE ? 'W' : ev->op == BLOCK_OP_FLUSH ? 'F' :
+                      ev->op == BLOCK_OP_DISCARD ? 'D' : 'R';
+        uint64_t values[] = {
+            ev->lba, ev->count, 1ULL << ev->sector_shift, ev->submit_tsc, ev->complete_tsc,
+        };
+        for (uint32_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+            line[pos++] = ',';
+            dump_dec(line, &pos, values[v]);
+        }
+        line[pos++] = ',';
+        if (ev->error) {
+            line[pos++] = '-';
+        }
+        dump_dec(line, &pos, ev->error);
+        line[pos++] = '\n';
+        line[pos] = 0;
+        serial_write(line);
+    }
+
+    serial_write("BLKTRACE END\n");
+    recording = was_recording;
+}
+
+/* ---- Replay -------------------------------------------------------------- */
+
+static void event_copy(BlkTraceEvent *dst, const BlkTraceEvent *src) {
+    dst->submit_tsc = src->submit_tsc;
+    dst->complete_tsc = src->complete_tsc;
+    dst->lba = src->lba;
+    dst->count = src->count;
+    dst->dev = src->dev;
+    dst->op = src->op;
+    dst->error = src->error;
+    dst->sector_shift = src->sector_shift;
+}
+
+/* Events are logged in completion order, which is nearly submit order, so
+ * an insertion sort does little work */
+static void sort_by_submit(uint64_t count) {
+    BlkTraceEvent tmp;
+    for (uint64_t i = 1; i < count; i++) {
+        if (ring_at(i - 1)->submit_tsc <= ring_at(i)->submit_tsc) {
+            continue;
+        }
+        event_copy(&tmp, ring_at(i));
+        uint64_t j = i;
+        while (j > 0 && ring_at(j - 1)->submit_tsc > tmp.submit_tsc) {
+            event_copy(ring_at(j), ring_at(j - 1));
+            j--;
+        }
+        event_copy(ring_at(j), &tmp);
+    }
+}
+
+/* May run from the block softirq as well as from our own poll */
+static void replay_done(BlockRequest *req) {
+    ReplaySlot *slot = (ReplaySlot *)req->private;
+    uint64_t us = tsc_to_us(rdtsc() - slot->issued);
+
+    replay_lat_sum += us;
+    if (us > replay_lat_max) {
+        replay_lat_max = us;
+    }
+    replay_ios++;
+    if (req->status != BLOCK_OK && !(req->op == BLOCK_OP_FLUSH && req->status == BLOCK_ENOTSUP)) {
+        replay_errors++;
+    }
+    slot->busy = 0;
+    replay_in_flight--;
+}
+
+static void replay_pause(BlockDevice *dev) {
+    if (!block_poll(dev)) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+static uint32_t replay_slot(BlockDevice *dev) {
+    for (;;) {
+        for (uint32_t i = 0; i < BLKREPLAY_SLOTS; i++) {
+            if (!slots[i].busy) {
+                return i;
+            }
+        }
+        replay_pause(dev);
+    }
+}
+
+static void replay_issue(BlockDevice *dev, uint32_t op, uint64_t lba, uint32_t sectors) {
+    uint32_t i = replay_slot(dev);
+    ReplaySlot *slot = &slots[i];
+
+    block_request_init(&slot->req, dev, op, lba);
+    slot->req.done = replay_done;
+    slot->req.private = slot;
+    if (op == BLOCK_OP_DISCARD) {
+        slot->req.count = sectors;
+    } else if (sectors) {
+        block_request_add(&slot->req, replay_buffers + (uint64_t)i * BLKREPLAY_MAX_BS,
+                          sectors * block_sector_size(dev));
+    }
+
+    uint64_t flags = local_irq_save();
+    slot->busy = 1;
+    replay_in_flight++;
+    local_irq_restore(flags);
+
+    slot->issued = rdtsc();
+    block_submit(&slot->req);
+}
+
+int blktrace_replay(BlockDevice *dev, BlockDevice *from, int fast, BlkReplayResult *out) {
+    if (!dev || !from || !out || !ring) {
+        return 0;
+    }
+    recording = 0;
+    uint8_t source = device_index(from);
+    uint64_t count = ring_events();
+    uint64_t events = 0;
+    for (uint64_t e = 0; e < count; e++) {
+        events += ring_at(e)->dev == source;
+    }
+    if (source == 0xFF || events == 0) {
+        return 0;
+    }
+    if (!replay_buffers) {
+        replay_buffers = (uint8_t *)pmm_alloc_pages((uint64_t)BLKREPLAY_SLOTS * BLKREPLAY_MAX_BS / PMM_PAGE_SIZE);
+        if (!replay_buffers) {
+            return 0;
+        }
+        for (uint64_t i = 0; i < (uint64_t)BLKREPLAY_SLOTS * BLKREPLAY_MAX_BS; i++) {
+            replay_buffers[i] = (uint8_t)(i * 31 + (i >> 9));
+        }
+    }
+    sort_by_submit(count);
+
+    uint32_t sector_size = dev->sector_size ? dev->sector_size : BLOCK_SECTOR_SIZE;
+    uint32_t chunk = BLKREPLAY_MAX_BS / sector_size;
+    if (dev->max_sectors && dev->max_sectors < chunk) {
+        chunk = dev->max_sectors;
+    }
+    if (chunk == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < BLKREPLAY_SLOTS; i++) {
+        slots[i].busy = 0;
+    }
+    replay_in_flight = 0;
+    replay_ios = 0;
+    replay_errors = 0;
+    replay_lat_sum = 0;
+    replay_lat_max = 0;
+    out->events = events;
+    out->bytes = 0;
+    out->late = 0;
+
+    /* Requests other devices saw were issued on from's behalf or are
+     * another workload; either way they are not from's */
+    uint64_t first = 0;
+    uint64_t last = 0;
+    int seen = 0;
+    for (uint64_t e = 0; e < count; e++) {
+        if (ring_at(e)->dev != source) {
+            continue;
+        }
+        if (!seen) {
+            first = ring_at(e)->submit_tsc;
+            seen = 1;
+        }
+        last = ring_at(e)->submit_tsc;
+    }
+    uint64_t late_cycles = tsc_from_us(BLKREPLAY_LATE_US);
+    uint64_t start = rdtsc();
+
+    for (uint64_t e = 0; e < count; e++) {
+        BlkTraceEvent *ev = ring_at(e);
+        if (ev->dev != source) {
+            continue;
+        }
+        if (!fast) {
+            uint64_t due = start + (ev->submit_tsc - first);
+            while (rdtsc() < due) {
+                replay_pause(dev);
+            }
+            if (rdtsc() - due > late_cycles) {
+                out->late++;
+            }
+        }
+
+        if (ev->op == BLOCK_OP_FLUSH) {
+            replay_issue(dev, BLOCK_OP_FLUSH, 0, 0);
+            continue;
+        }
+        /* A device that cannot discard would only fail every one */
+        uint32_t limit = chunk;
+        if (ev->op == BLOCK_OP_DISCARD) {
+            if (!dev->max_discard_sectors) {
+                continue;
+            }
+            limit = dev->max_discard_sectors;
+        }
+
+        /* Same byte range on dev, rounded out to its sectors and moved
+         * down if it would run off the end */
+        uint64_t offset = ev->lba << ev->sector_shift;
+        uint64_t bytes = (uint64_t)ev->count << ev->sector_shift;
+        uint64_t lba = offset / sector_size;
+        uint64_t sectors = (offset + bytes + sector_size - 1) / sector_size - lba;
+        if (dev->total_sectors) {
+            if (sectors > dev->total_sectors) {
+                sectors = dev->total_sectors;
+            }
+            if (lba + sectors > dev->total_sectors) {
+                lba %= dev->total_sectors - sectors + 1;
+            }
+        }
+        while (sectors) {
+            uint32_t n = sectors < limit ? (uint32_t)sectors : limit;
+            replay_issue(dev, ev->op, lba, n);
+            if (ev->op != BLOCK_OP_DISCARD) {
+                out->bytes += (uint64_t)n * sector_size;
+            }
+            lba += n;
+            sectors -= n;
+        }
+    }
+    while (replay_in_flight) {
+        replay_pause(dev);
+    }
+
+    uint64_t elapsed_us = tsc_to_us(rdtsc() - start);
+    out->ios = replay_ios;
+    out->errors = replay_errors;
+    out->elapsed_us = elapsed_us ? elapsed_us : 1;
+    out->trace_us = tsc_to_us(last - first);
+    out->lat_avg_us = replay_ios ? replay_lat_sum / replay_ios : 0;
+    out->lat_max_us = replay_lat_max;
+    return 1;
+}
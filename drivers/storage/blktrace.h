@@ -0,0 +1,74 @@
+#ifndef KAGAMI_BLKTRACE_H
+#define KAGAMI_BLKTRACE_H
+
+#include "types.h"
+#include "block.h"
+
+/* blktrace-style request recorder. When enabled, every request a submitter
+ * handed to block_submit() is logged as it completes, with its device,
+ * operation, range, status and the TSC at submit and completion. Requests
+ * the queue merged are logged individually, as submitted. The ring keeps
+ * the newest BLKTRACE_RING_SIZE events; older ones are counted as dropped.
+ *
+ * blktrace_replay() re-issues one device's part of a captured trace
+ * against any device, either at the original submit times or as fast as
+ * the device takes it. A stacked device (md, crypt, bcache) and the member
+ * requests it issues are all recorded, so replaying every device's events
+ * would send each I/O more than once.
+ */
+
+#define BLKTRACE_RING_SIZE      16384     /* Events, a power of two */
+#define BLKREPLAY_SLOTS         16        /* Replay requests in flight */
+#define BLKREPLAY_MAX_BS        (128 * 1024)
+#define BLKREPLAY_LATE_US       1000      /* Issued this far behind schedule counts as late */
+
+typedef struct {
+    uint64_t submit_tsc;
+    uint64_t complete_tsc;
+    uint64_t lba;
+    uint32_t count;                       /* Sectors */
+    uint8_t dev;                          /* block_get() index */
+    uint8_t op;                           /* BLOCK_OP_* */
+    uint8_t error;                        /* -status: 0 for BLOCK_OK */
+    uint8_t sector_shift;                 /* log2 of the device sector size */
+} BlkTraceEvent;
+
+typedef struct {
+    uint64_t events;                      /* Trace events replayed */
+    uint64_t ios;                         /* Requests issued, after splitting */
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t late;                        /* Issued over BLKREPLAY_LATE_US behind schedule */
+    uint64_t elapsed_us;
+    uint64_t trace_us;                    /* First to last submit in the trace */
+    uint64_t lat_avg_us;
+    uint64_t lat_max_us;
+} BlkReplayResult;
+
+/* The ring is allocated on the first enable; returns 0 if that fails */
+int blktrace_enable(int enabled);
+int blktrace_enabled(void);
+void blktrace_reset(void);
+uint64_t blktrace_event_count(void);      /* Recorded since reset, including dropped */
+uint64_t blktrace_dropped(void);
+int blktrace_has_writes(BlockDevice *from);   /* Among from's events */
+
+/* Called by the block layer as req finishes */
+void blktrace_record(BlockRequest *req, int status);
+
+/* Format:  BLKTRACE BEGIN <events> tsc_khz=<khz>
+ *          dev,op,lba,sectors,sector_size,submit_tsc,complete_tsc,status
+ *          ...                 (decimal, op is R, W, F or D)
+ *          BLKTRACE END
+ */
+void blktrace_dump_serial(void);
+
+/* Replay the events recorded on from against dev and wait for them to
+ * finish. Tracing is stopped first and the ring is left ordered by submit
+ * time. Offsets are kept in bytes and wrapped to fit dev. Returns 0 if
+ * from has no events or there are no buffers. Traces with writes or
+ * discards overwrite dev's contents; discards are skipped on a device
+ * that takes none. */
+int blktrace_replay(BlockDevice *dev, BlockDevice *from, int fast, BlkReplayResult *out);
+
+#endif
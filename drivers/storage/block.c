@@ -1,23 +1,972 @@
 #include "block.h"
+#include "rcu.h"
+#include "irqflags.h"
+#include "tsc.h"
+#include "serial.h"
+#include "blktrace.h"
 
-static BlockDevice *devices[BLOCK_MAX_DEVICES];
-static int device_count = 0;
+/* The device table is read on every lookup and changed only when a driver
+ * (un)registers, so readers go lock-free through an RCU-published snapshot
+ * and updaters copy, publish and wait out a grace period. */
+typedef struct {
+    int count;
+    BlockDevice *devices[BLOCK_MAX_DEVICES];
+} BlockTable;
+
+static BlockTable tables[2];
+static BlockTable *current_table = &tables[0];
+
+/* Updaters run from boot or shell context, never concurrently */
+static BlockTable *block_table_spare(void) {
+    return (current_table == &tables[0]) ? &tables[1] : &tables[0];
+}
+
+static void block_table_publish(BlockTable *next) {
+    rcu_assign_pointer(current_table, next);
+    /* The old table becomes the next spare once no reader can hold it */
+    synchronize_rcu();
+}
+
+uint32_t block_sector_size(BlockDevice *dev) {
+    return dev->sector_size ? dev->sector_size : BLOCK_SECTOR_SIZE;
+}
 
 int block_register(BlockDevice *dev) {
-    if (!dev || device_count >= BLOCK_MAX_DEVICES) {
+    BlockTable *cur = current_table;
+    if (!dev || cur->count >= BLOCK_MAX_DEVICES) {
+        return 0;
+    }
+    uint32_t sector_size = block_sector_size(dev);
+    if (sector_size < BLOCK_SECTOR_SIZE || sector_size > BLOCK_MAX_SECTOR_SIZE ||
+        (sector_size & (sector_size - 1))) {
+        serial_write("Block: unsupported sector size, device not registered\n");
         return 0;
     }
-    devices[device_count++] = dev;
+
+    BlockTable *next = block_table_spare();
+    for (int i = 0; i < cur->count; i++) {
+        next->devices[i] = cur->devices[i];
+    }
+    next->devices[cur->count] = dev;
+    next->count = cur->count + 1;
+
+    block_table_publish(next);
     return 1;
 }
 
-BlockDevice *block_get(int index) {
-    if (index < 0 || index >= device_count) {
+int block_unregister(BlockDevice *dev) {
+    BlockTable *cur = current_table;
+    BlockTable *next = block_table_spare();
+    int found = 0;
+
+    next->count = 0;
+    for (int i = 0; i < cur->count; i++) {
+        if (cur->devices[i] == dev) {
+            found = 1;
+            continue;
+        }
+        next->devices[next->count++] = cur->devices[i];
+    }
+    if (!found) {
         return 0;
     }
-    return devices[index];
+
+    block_table_publish(next);
+    return 1;
+}
+
+BlockDevice *block_get(int index) {
+    BlockDevice *dev = 0;
+
+    rcu_read_lock();
+    BlockTable *table = rcu_dereference(current_table);
+    if (index >= 0 && index < table->count) {
+        dev = table->devices[index];
+    }
+    rcu_read_unlock();
+    return dev;
 }
 
 int block_count(void) {
-    return device_count;
+    rcu_read_lock();
+    int count = rcu_dereference(current_table)->count;
+    rcu_read_unlock();
+    return count;
+}
+
+void block_request_init(BlockRequest *req, BlockDevice *dev, uint32_t op, uint64_t lba) {
+    req->dev = dev;
+    req->op = op;
+    req->flags = 0;
+    req->lba = lba;
+    req->count = 0;
+    req->segment_count = 0;
+    req->done = 0;
+    req->private = 0;
+    req->status = BLOCK_OK;
+    req->next = 0;
+    req->merged = 0;
+    req->deadline = 0;
+    req->submitted_at = 0;
+    req->dispatched_at = 0;
+}
+
+static uint32_t block_max_segments(BlockDevice *dev) {
+    uint32_t max = dev->max_segments ? dev->max_segments : 1;
+    return max > BLOCK_MAX_SEGMENTS ? BLOCK_MAX_SEGMENTS : max;
+}
+
+/* Whether a segment ending at end may be followed by one starting at next */
+static int block_boundary_ok(BlockDevice *dev, void *end, void *next) {
+    if (end == next || !dev->virt_boundary) {
+        return 1;
+    }
+    uintptr_t mask = dev->virt_boundary - 1;
+    return ((uintptr_t)end & mask) == 0 && ((uintptr_t)next & mask) == 0;
+}
+
+int block_request_add(BlockRequest *req, void *buf, uint32_t len) {
+    if (!req || !req->dev || !buf) {
+        return 0;
+    }
+    BlockDevice *dev = req->dev;
+    uint32_t sector_size = block_sector_size(dev);
+    if (len == 0 || (len % sector_size) != 0) {
+        return 0;
+    }
+    if (dev->max_sectors && req->count + len / sector_size > dev->max_sectors) {
+        return 0;
+    }
+
+    if (req->segment_count) {
+        BlockSegment *tail = &req->segments[req->segment_count - 1];
+        uint8_t *end = (uint8_t *)tail->buf + tail->len;
+        if (end == (uint8_t *)buf) {
+            tail->len += len;
+            req->count += len / sector_size;
+            return 1;
+        }
+        if (!block_boundary_ok(dev, end, buf)) {
+            return 0;
+        }
+    }
+    if (req->segment_count >= block_max_segments(dev)) {
+        return 0;
+    }
+
+    BlockSegment *seg = &req->segments[req->segment_count++];
+    seg->buf = buf;
+    seg->len = len;
+    req->count += len / sector_size;
+    return 1;
+}
+
+/* Reject anything the driver would have to second-guess */
+static int block_check(BlockRequest *req) {
+    BlockDevice *dev = req->dev;
+    if (!dev || !dev->submit) {
+        return BLOCK_EINVAL;
+    }
+    if (req->op == BLOCK_OP_FLUSH) {
+        return (req->segment_count == 0 && req->count == 0) ? BLOCK_OK : BLOCK_EINVAL;
+    }
+    if (req->op == BLOCK_OP_DISCARD) {
+        if (!dev->max_discard_sectors) {
+            return BLOCK_ENOTSUP;
+        }
+        if (req->segment_count != 0 || req->count == 0 || req->count > dev->max_discard_sectors) {
+            return BLOCK_EINVAL;
+        }
+        if (dev->total_sectors &&
+            (req->lba >= dev->total_sectors || req->count > dev->total_sectors - req->lba)) {
+            return BLOCK_EINVAL;
+        }
+        return BLOCK_OK;
+    }
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE) {
+        return BLOCK_ENOTSUP;
+    }
+
+    if (req->segment_count == 0 || req->segment_count > block_max_segments(dev) || req->count == 0) {
+        return BLOCK_EINVAL;
+    }
+    /* Requests built by hand rather than through block_request_add() must
+     * still cover whole logical blocks, or the driver would move a partial
+     * sector or miscount the transfer */
+    uint32_t sector_size = block_sector_size(dev);
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        BlockSegment *seg = &req->segments[i];
+        if (seg->len == 0 || (seg->len % sector_size) != 0) {
+            return BLOCK_EINVAL;
+        }
+        if (i && !block_boundary_ok(dev, (uint8_t *)req->segments[i - 1].buf + req->segments[i - 1].len,
+                                    seg->buf)) {
+            return BLOCK_EINVAL;
+        }
+        bytes += seg->len;
+    }
+    if (bytes != (uint64_t)req->count * sector_size) {
+        return BLOCK_EINVAL;
+    }
+    if (dev->max_sectors && req->count > dev->max_sectors) {
+        return BLOCK_EINVAL;
+    }
+    if (dev->total_sectors &&
+        (req->lba >= dev->total_sectors || req->count > dev->total_sectors - req->lba)) {
+        return BLOCK_EINVAL;
+    }
+    return BLOCK_OK;
+}
+
+/* ---- Merge pool ---------------------------------------------------------- */
+
+static BlockRequest merge_pool[BLOCK_MERGE_POOL];
+static uint32_t merge_pool_used;
+
+/* Interrupts must be off */
+static BlockRequest *merge_alloc(void) {
+    for (int i = 0; i < BLOCK_MERGE_POOL; i++) {
+        if (!(merge_pool_used & (1U << i))) {
+            merge_pool_used |= 1U << i;
+            return &merge_pool[i];
+        }
+    }
+    return 0;
+}
+
+static void merge_free(BlockRequest *req) {
+    uint64_t flags = local_irq_save();
+    merge_pool_used &= ~(1U << (req - merge_pool));
+    local_irq_restore(flags);
+}
+
+/* ---- Completion ---------------------------------------------------------- */
+
+/* Copy what a piggybacked read asked for out of the read that served it */
+static void block_copy_from(BlockRequest *src, uint32_t offset, BlockRequest *dst) {
+    uint32_t s = 0;
+    while (s < src->segment_count && offset >= src->segments[s].len) {
+        offset -= src->segments[s].len;
+        s++;
+    }
+
+    for (uint32_t d = 0; d < dst->segment_count; d++) {
+        uint8_t *out = (uint8_t *)dst->segments[d].buf;
+        uint32_t len = dst->segments[d].len;
+        while (len > 0 && s < src->segment_count) {
+            uint8_t *in = (uint8_t *)src->segments[s].buf + offset;
+            uint32_t n = src->segments[s].len - offset;
+            if (n > len) {
+                n = len;
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                out[i] = in[i];
+            }
+            out += n;
+            len -= n;
+            offset += n;
+            if (offset == src->segments[s].len) {
+                offset = 0;
+                s++;
+            }
+        }
+    }
+}
+
+static void block_finish(BlockRequest *req, int status) {
+    uint64_t flags = local_irq_save();
+    BlockRequest *chain = req->merged;
+    req->merged = 0;
+    local_irq_restore(flags);
+
+    /* Copies first: a finished member may release the buffer we copy from */
+    if (status == BLOCK_OK) {
+        uint32_t sector_size = block_sector_size(req->dev);
+        for (BlockRequest *m = chain; m; m = m->next) {
+            if (m->flags & BLOCK_REQ_PIGGYBACK) {
+                block_copy_from(req, (uint32_t)(m->lba - req->lba) * sector_size, m);
+            }
+        }
+    }
+
+    while (chain) {
+        BlockRequest *m = chain;
+        chain = chain->next;
+        m->next = 0;
+        m->flags &= ~BLOCK_REQ_QUEUE_MASK;
+        block_finish(m, status);
+    }
+
+    if (req->flags & BLOCK_REQ_MERGED) {
+        merge_free(req);
+        return;
+    }
+    blktrace_record(req, status);
+    req->status = status;
+    if (req->done) {
+        req->done(req);
+    }
+}
+
+/* ---- Queue --------------------------------------------------------------- */
+
+static int ranges_overlap(BlockRequest *a, BlockRequest *b) {
+    return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+static int range_contains(BlockRequest *outer, BlockRequest *inner) {
+    return outer->lba <= inner->lba && inner->lba + inner->count <= outer->lba + outer->count;
+}
+
+/* Overlapping requests other than read/read must reach the disk in
+ * submission order, which neither the elevator nor the HBA guarantees.
+ * A flush must not overtake anything submitted before it. */
+static int queue_conflicts(BlockQueue *q, BlockRequest *req) {
+    if (req->op == BLOCK_OP_FLUSH) {
+        return q->pending || q->in_flight;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        BlockRequest *r = pass ? q->in_flight : q->pending;
+        for (; r; r = r->next) {
+            if ((r->op != BLOCK_OP_READ || req->op != BLOCK_OP_READ) && ranges_overlap(r, req)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void queue_insert(BlockQueue *q, BlockRequest *req) {
+    BlockRequest **link = &q->pending;
+    while (*link && (*link)->lba <= req->lba) {
+        link = &(*link)->next;
+    }
+    req->next = *link;
+    *link = req;
+}
+
+static void queue_unlink(BlockRequest **head, BlockRequest *req) {
+    for (BlockRequest **link = head; *link; link = &(*link)->next) {
+        if (*link == req) {
+            *link = req->next;
+            req->next = 0;
+            return;
+        }
+    }
+}
+
+/* Segments of two requests joined end to end, fusing contiguous memory */
+static uint32_t merged_segments(BlockRequest *first, BlockRequest *second) {
+    BlockSegment *tail = &first->segments[first->segment_count - 1];
+    uint32_t count = first->segment_count + second->segment_count;
+    if ((uint8_t *)tail->buf + tail->len == (uint8_t *)second->segments[0].buf) {
+        count--;
+    }
+    return count;
+}
+
+static void append_segments(BlockRequest *dst, BlockRequest *src) {
+    uint32_t i = 0;
+    BlockSegment *tail = &dst->segments[dst->segment_count - 1];
+    if ((uint8_t *)tail->buf + tail->len == (uint8_t *)src->segments[0].buf) {
+        tail->len += src->segments[0].len;
+        i = 1;
+    }
+    for (; i < src->segment_count; i++) {
+        dst->segments[dst->segment_count++] = src->segments[i];
+    }
+    dst->count += src->count;
+}
+
+/* Turn a queued request into a pool request that can absorb others */
+static BlockRequest *queue_make_merged(BlockQueue *q, BlockRequest *req) {
+    if (req->flags & BLOCK_REQ_MERGED) {
+        return req;
+    }
+    BlockRequest *m = merge_alloc();
+    if (!m) {
+        return 0;
+    }
+
+    block_request_init(m, req->dev, req->op, req->lba);
+    m->flags = BLOCK_REQ_MERGED;
+    m->deadline = req->deadline;
+    m->status = BLOCK_PENDING;
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        m->segments[i] = req->segments[i];
+    }
+    m->segment_count = req->segment_count;
+    m->count = req->count;
+
+    queue_unlink(&q->pending, req);
+    m->merged = req;
+    queue_insert(q, m);
+    return m;
+}
+
+/* Fold queued request b into queued request a, which ends where b starts */
+static BlockRequest *queue_join(BlockQueue *q, BlockDevice *dev, BlockRequest *a, BlockRequest *b) {
+    BlockSegment *tail = &a->segments[a->segment_count - 1];
+    if (dev->max_sectors && a->count + b->count > dev->max_sectors) {
+        return 0;
+    }
+    if (merged_segments(a, b) > block_max_segments(dev)) {
+        return 0;
+    }
+    if (!block_boundary_ok(dev, (uint8_t *)tail->buf + tail->len, b->segments[0].buf)) {
+        return 0;
+    }
+
+    BlockRequest *m = queue_make_merged(q, a);
+    if (!m) {
+        return 0;
+    }
+    append_segments(m, b);
+    if (b->deadline < m->deadline) {
+        m->deadline = b->deadline;
+    }
+
+    queue_unlink(&q->pending, b);
+    q->stats.depth--;
+    if (b->flags & BLOCK_REQ_MERGED) {
+        BlockRequest *tail = b->merged;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = m->merged;
+        m->merged = b->merged;
+        b->merged = 0;
+        merge_free(b);
+    } else {
+        b->next = m->merged;
+        m->merged = b;
+    }
+    q->stats.merges++;
+    return m;
+}
+
+static BlockRequest *queue_find_adjacent(BlockQueue *q, BlockRequest *req, int before) {
+    /* Joining concatenates segments, and these have none */
+    if (req->op == BLOCK_OP_FLUSH || req->op == BLOCK_OP_DISCARD) {
+        return 0;
+    }
+    for (BlockRequest *r = q->pending; r; r = r->next) {
+        if (r == req || r->op != req->op || (r->flags & BLOCK_REQ_NOMERGE)) {
+            continue;
+        }
+        if (before ? (r->lba + r->count == req->lba) : (req->lba + req->count == r->lba)) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+/* Queue req, merging it with whatever it touches. A read that lies inside
+ * a queued read is not queued at all; it rides along and copies its data. */
+static void queue_add(BlockQueue *q, BlockDevice *dev, BlockRequest *req) {
+    int merge = !(req->flags & BLOCK_REQ_NOMERGE);
+    if (merge && req->op == BLOCK_OP_READ) {
+        for (BlockRequest *r = q->pending; r; r = r->next) {
+            if (r->op == BLOCK_OP_READ && !(r->flags & BLOCK_REQ_NOMERGE) && range_contains(r, req)) {
+                req->flags |= BLOCK_REQ_PIGGYBACK;
+                req->next = r->merged;
+                r->merged = req;
+                q->stats.piggybacks++;
+                return;
+            }
+        }
+    }
+
+    queue_insert(q, req);
+    q->stats.depth++;
+    if (q->stats.depth > q->stats.max_depth) {
+        q->stats.max_depth = q->stats.depth;
+    }
+    if (!merge) {
+        return;
+    }
+
+    BlockRequest *cur = req;
+    BlockRequest *prev = queue_find_adjacent(q, cur, 1);
+    if (prev) {
+        BlockRequest *m = queue_join(q, dev, prev, cur);
+        if (m) {
+            cur = m;
+        }
+    }
+    BlockRequest *next = queue_find_adjacent(q, cur, 0);
+    if (next) {
+        queue_join(q, dev, cur, next);
+    }
+}
+
+/* Next request to dispatch: an expired deadline wins, otherwise continue the
+ * sweep upward from head_lba and wrap to the lowest LBA. */
+static BlockRequest *queue_pick(BlockQueue *q) {
+    uint64_t now = rdtsc();
+    BlockRequest *oldest = 0;
+    BlockRequest *ahead = 0;
+
+    for (BlockRequest *r = q->pending; r; r = r->next) {
+        if (!oldest || r->deadline < oldest->deadline) {
+            oldest = r;
+        }
+        if (!ahead && r->lba >= q->head_lba) {
+            ahead = r;
+        }
+    }
+
+    if (oldest && oldest->deadline <= now) {
+        if (oldest != (ahead ? ahead : q->pending)) {
+            q->stats.expired++;
+        }
+        return oldest;
+    }
+    return ahead ? ahead : q->pending;
+}
+
+/* Hand pending requests to the driver until it runs out of slots.
+ * Interrupts must be off. */
+static void queue_run(BlockDevice *dev) {
+    BlockQueue *q = &dev->queue;
+    int dispatched = 0;
+
+    while (q->pending) {
+        BlockRequest *req = queue_pick(q);
+        queue_unlink(&q->pending, req);
+        q->stats.depth--;
+
+        req->flags |= BLOCK_REQ_DISPATCHED;
+        req->next = q->in_flight;
+        q->in_flight = req;
+        q->stats.in_flight++;
+        req->dispatched_at = rdtsc();
+        if (q->stats.in_flight == 1) {
+            dev->io.busy_since = req->dispatched_at;
+        }
+
+        int rc = dev->submit(dev, req);
+        if (rc == BLOCK_OK) {
+            q->head_lba = req->lba + req->count;
+            q->stats.dispatched++;
+            if (q->stats.in_flight > q->stats.max_in_flight) {
+                q->stats.max_in_flight = q->stats.in_flight;
+            }
+            dispatched++;
+            continue;
+        }
+
+        queue_unlink(&q->in_flight, req);
+        q->stats.in_flight--;
+        req->flags &= ~BLOCK_REQ_DISPATCHED;
+
+        if (rc == BLOCK_EBUSY) {
+            /* A completion will rerun the queue */
+            queue_insert(q, req);
+            q->stats.depth++;
+            break;
+        }
+        block_finish(req, rc);
+    }
+
+    if (dispatched) {
+        q->stats.batches++;
+    }
+}
+
+/* Dispatch everything and wait for the hardware to go idle */
+static void queue_drain(BlockDevice *dev) {
+    uint64_t flags = local_irq_save();
+    queue_run(dev);
+    local_irq_restore(flags);
+
+    while (dev->queue.in_flight || dev->queue.pending) {
+        if (!block_poll(dev)) {
+            __asm__ __volatile__("pause");
+        }
+        flags = local_irq_save();
+        queue_run(dev);
+        local_irq_restore(flags);
+    }
+}
+
+static uint32_t latency_bucket(uint64_t cycles) {
+    uint64_t us = tsc_to_us(cycles);
+    uint32_t bucket = 0;
+    while (us > 1 && bucket < BLOCK_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Interrupts must be off */
+static void block_account(BlockDevice *dev, BlockRequest *req, int status) {
+    BlockIoStats *io = &dev->io;
+    uint64_t now = rdtsc();
+    uint64_t cycles = now - req->dispatched_at;
+    uint32_t op = req->op < BLOCK_OP_COUNT ? req->op : BLOCK_OP_READ;
+
+    io->ops[op]++;
+    io->sectors[op] += req->count;
+    io->service_cycles[op] += cycles;
+    io->latency[op][latency_bucket(cycles)]++;
+    if (status != BLOCK_OK) {
+        io->errors++;
+    }
+    if (dev->queue.stats.in_flight == 0) {
+        io->busy_cycles += now - io->busy_since;
+    }
+}
+
+void block_complete(BlockRequest *req, int status) {
+    BlockDevice *dev = req->dev;
+    int dispatched = (req->flags & BLOCK_REQ_DISPATCHED) != 0;
+
+    if (dispatched) {
+        uint64_t flags = local_irq_save();
+        queue_unlink(&dev->queue.in_flight, req);
+        dev->queue.stats.in_flight--;
+        req->flags &= ~BLOCK_REQ_DISPATCHED;
+        block_account(dev, req, status);
+        local_irq_restore(flags);
+    }
+
+    block_finish(req, status);
+
+    if (dispatched && dev->queue.pending && !dev->queue.plugged) {
+        uint64_t flags = local_irq_save();
+        queue_run(dev);
+        local_irq_restore(flags);
+    }
+}
+
+int block_submit(BlockRequest *req) {
+    if (!req) {
+        return 0;
+    }
+
+    req->submitted_at = rdtsc();
+    int err = block_check(req);
+    req->status = BLOCK_PENDING;
+    req->flags &= ~BLOCK_REQ_QUEUE_MASK;
+    req->next = 0;
+    req->merged = 0;
+    if (err != BLOCK_OK) {
+        block_finish(req, err);
+        return 0;
+    }
+
+    BlockDevice *dev = req->dev;
+    BlockQueue *q = &dev->queue;
+    uint64_t deadline_us = (req->op == BLOCK_OP_WRITE || req->op == BLOCK_OP_DISCARD) ?
+                           BLOCK_WRITE_DEADLINE_US : BLOCK_READ_DEADLINE_US;
+    req->deadline = req->submitted_at + tsc_from_us(deadline_us);
+
+    uint64_t flags = local_irq_save();
+    q->stats.submitted++;
+    while (queue_conflicts(q, req)) {
+        q->stats.drains++;
+        local_irq_restore(flags);
+        queue_drain(dev);
+        flags = local_irq_save();
+    }
+
+    queue_add(q, dev, req);
+
+    if (!q->plugged || q->stats.depth >= BLOCK_QUEUE_UNPLUG_DEPTH) {
+        queue_run(dev);
+    }
+    local_irq_restore(flags);
+    return 1;
+}
+
+void block_plug(BlockDevice *dev) {
+    uint64_t flags = local_irq_save();
+    dev->queue.plugged++;
+    local_irq_restore(flags);
+}
+
+void block_unplug(BlockDevice *dev) {
+    uint64_t flags = local_irq_save();
+    if (dev->queue.plugged && --dev->queue.plugged == 0) {
+        queue_run(dev);
+    }
+    local_irq_restore(flags);
+}
+
+void block_queue_stats(BlockDevice *dev, BlockQueueStats *out) {
+    uint64_t flags = local_irq_save();
+    *out = dev->queue.stats;
+    local_irq_restore(flags);
+}
+
+void block_io_stats(BlockDevice *dev, BlockIoStats *out) {
+    const uint8_t *src = (const uint8_t *)&dev->io;
+    uint8_t *dst = (uint8_t *)out;
+    uint64_t flags = local_irq_save();
+    for (uint32_t i = 0; i < sizeof(BlockIoStats); i++) {
+        dst[i] = src[i];
+    }
+    if (dev->queue.stats.in_flight) {
+        out->busy_cycles += rdtsc() - dev->io.busy_since;
+    }
+    local_irq_restore(flags);
+}
+
+uint64_t block_latency_percentile(const BlockIoStats *st, uint32_t op, uint32_t pct) {
+    uint64_t total = 0;
+    for (uint32_t b = 0; b < BLOCK_LAT_BUCKETS; b++) {
+        total += st->latency[op][b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    /* Smallest bucket that covers pct percent of the commands */
+    uint64_t want = (total * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < BLOCK_LAT_BUCKETS; b++) {
+        seen += st->latency[op][b];
+        if (seen >= want) {
+            return 2ULL << b;
+        }
+    }
+    return 2ULL << (BLOCK_LAT_BUCKETS - 1);
+}
+
+static void dump_str(char *line, int *pos, const char *s) {
+    while (*s) {
+        line[(*pos)++] = *s++;
+    }
+}
+
+static void dump_dec(char *line, int *pos, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n) {
+        line[(*pos)++] = digits[--n];
+    }
+}
+
+void block_iostat_dump(void) {
+    static const char *op_names[BLOCK_OP_COUNT] = { "read", "write", "flush", "discard" };
+    char line[96];
+
+    serial_write("IOSTAT BEGIN\n");
+    for (int i = 0; i < block_count(); i++) {
+        BlockDevice *dev = block_get(i);
+        if (!dev) {
+            continue;
+        }
+        BlockIoStats st;
+        BlockQueueStats qs;
+        block_io_stats(dev, &st);
+        block_queue_stats(dev, &qs);
+
+        int pos = 0;
+        dump_str(line, &pos, dev->name ? dev->name : "?");
+        dump_str(line, &pos, " busy_us=");
+        dump_dec(line, &pos, tsc_to_us(st.busy_cycles));
+        dump_str(line, &pos, " errors=");
+        dump_dec(line, &pos, st.errors);
+        dump_str(line, &pos, " inflight=");
+        dump_dec(line, &pos, qs.in_flight);
+        dump_str(line, &pos, " max_inflight=");
+        dump_dec(line, &pos, qs.max_in_flight);
+        line[pos++] = '\n';
+        line[pos] = 0;
+        serial_write(line);
+
+        for (uint32_t op = 0; op < BLOCK_OP_COUNT; op++) {
+            if (st.ops[op] == 0) {
+                continue;
+            }
+            pos = 0;
+            dump_str(line, &pos, "  ");
+            dump_str(line, &pos, op_names[op]);
+            dump_str(line, &pos, " ops=");
+            dump_dec(line, &pos, st.ops[op]);
+            dump_str(line, &pos, " sectors=");
+            dump_dec(line, &pos, st.sectors[op]);
+            dump_str(line, &pos, " avg_us=");
+            dump_dec(line, &pos, tsc_to_us(st.service_cycles[op] / st.ops[op]));
+            line[pos++] = '\n';
+            line[pos] = 0;
+            serial_write(line);
+
+            /* One "<upper bound us>:<count>" pair per non-empty bucket */
+            pos = 0;
+            dump_str(line, &pos, "   ");
+            for (uint32_t b = 0; b < BLOCK_LAT_BUCKETS; b++) {
+                if (st.latency[op][b] == 0) {
+                    continue;
+                }
+                if (pos > 70) {
+                    line[pos++] = '\n';
+                    line[pos] = 0;
+                    serial_write(line);
+                    pos = 0;
+                    dump_str(line, &pos, "   ");
+                }
+                dump_str(line, &pos, " <");
+                dump_dec(line, &pos, 2ULL << b);
+                dump_str(line, &pos, "us:");
+                dump_dec(line, &pos, st.latency[op][b]);
+            }
+            line[pos++] = '\n';
+            line[pos] = 0;
+            serial_write(line);
+        }
+    }
+    serial_write("IOSTAT END\n");
+}
+
+int block_poll(BlockDevice *dev) {
+    if (dev) {
+        return dev->poll ? dev->poll(dev) : 0;
+    }
+
+    int completed = 0;
+    rcu_read_lock();
+    BlockTable *table = rcu_dereference(current_table);
+    for (int i = 0; i < table->count; i++) {
+        BlockDevice *d = table->devices[i];
+        if (d->poll) {
+            completed += d->poll(d);
+        }
+    }
+    rcu_read_unlock();
+    return completed;
+}
+
+int block_wait(BlockRequest *req) {
+    BlockDevice *dev = req->dev;
+    while (req->status == BLOCK_PENDING) {
+        if (dev->queue.pending) {
+            /* Whatever holds our request back, we are not waiting on it */
+            uint64_t flags = local_irq_save();
+            queue_run(dev);
+            local_irq_restore(flags);
+        }
+        if (!block_poll(dev)) {
+            __asm__ __volatile__("pause");
+        }
+    }
+    return req->status;
+}
+
+static int block_rwv(BlockDevice *dev, uint32_t op, uint64_t lba, const BlockSegment *iov, uint32_t iovcnt) {
+    if (!dev || !iov) {
+        return 0;
+    }
+
+    uint32_t sector_size = block_sector_size(dev);
+    uint32_t i = 0;
+    uint32_t done = 0;              /* Bytes of iov[i] already sent */
+
+    while (i < iovcnt) {
+        BlockRequest req;
+        block_request_init(&req, dev, op, lba);
+        req.flags = BLOCK_REQ_SYNC;
+
+        /* Take whole segments while they fit, then as much of the next
+         * one as max_sectors leaves room for */
+        while (i < iovcnt) {
+            if (iov[i].len == 0) {
+                i++;
+                continue;
+            }
+            uint8_t *buf = (uint8_t *)iov[i].buf + done;
+            uint32_t len = iov[i].len - done;
+            if (dev->max_sectors) {
+                uint32_t room = (dev->max_sectors - req.count) * sector_size;
+                if (len > room) {
+                    len = room;
+                }
+            }
+            if (len == 0 || !block_request_add(&req, buf, len)) {
+                break;
+            }
+            done += len;
+            if (done == iov[i].len) {
+                i++;
+                done = 0;
+            }
+        }
+        if (req.count == 0) {
+            /* Either nothing was left or a segment is not whole sectors */
+            return i == iovcnt;
+        }
+        if (!block_submit(&req) || block_wait(&req) != BLOCK_OK) {
+            return 0;
+        }
+        lba += req.count;
+    }
+    return 1;
+}
+
+int block_read(BlockDevice *dev, uint64_t lba, uint32_t count, void *buffer) {
+    if (!dev || !buffer) {
+        return 0;
+    }
+    BlockSegment seg = { buffer, count * block_sector_size(dev) };
+    return block_rwv(dev, BLOCK_OP_READ, lba, &seg, 1);
+}
+
+int block_write(BlockDevice *dev, uint64_t lba, uint32_t count, const void *buffer) {
+    if (!dev || !buffer) {
+        return 0;
+    }
+    /* Writes only ever read from the segment buffer */
+    BlockSegment seg = { (void *)(uintptr_t)buffer, count * block_sector_size(dev) };
+    return block_rwv(dev, BLOCK_OP_WRITE, lba, &seg, 1);
+}
+
+int block_readv(BlockDevice *dev, uint64_t lba, const BlockSegment *iov, uint32_t iovcnt) {
+    return block_rwv(dev, BLOCK_OP_READ, lba, iov, iovcnt);
+}
+
+int block_writev(BlockDevice *dev, uint64_t lba, const BlockSegment *iov, uint32_t iovcnt) {
+    return block_rwv(dev, BLOCK_OP_WRITE, lba, iov, iovcnt);
+}
+
+int block_flush(BlockDevice *dev) {
+    if (!dev) {
+        return 0;
+    }
+
+    BlockRequest req;
+    block_request_init(&req, dev, BLOCK_OP_FLUSH, 0);
+    req.flags = BLOCK_REQ_SYNC;
+    if (!block_submit(&req)) {
+        return req.status == BLOCK_ENOTSUP;
+    }
+    int status = block_wait(&req);
+    return status == BLOCK_OK || status == BLOCK_ENOTSUP;
+}
+
+int block_discard(BlockDevice *dev, uint64_t lba, uint64_t count) {
+    if (!dev || !dev->max_discard_sectors) {
+        return 0;
+    }
+
+    while (count) {
+        uint32_t piece = count > dev->max_discard_sectors ? dev->max_discard_sectors : (uint32_t)count;
+        BlockRequest req;
+        block_request_init(&req, dev, BLOCK_OP_DISCARD, lba);
+        req.flags = BLOCK_REQ_SYNC;
+        req.count = piece;
+        if (!block_submit(&req) || block_wait(&req) != BLOCK_OK) {
+            return 0;
+        }
+        lba += piece;
+        count -= piece;
+    }
+    return 1;
 }
@@ -4,22 +4,198 @@
 #include "types.h"
 
 #define BLOCK_MAX_DEVICES 8
-#define BLOCK_SECTOR_SIZE 512
+#define BLOCK_SECTOR_SIZE 512        /* Logical block size of a driver that leaves it 0 */
+#define BLOCK_MAX_SECTOR_SIZE 4096
+#define BLOCK_MAX_SEGMENTS 16
+
+/* Request operations */
+#define BLOCK_OP_READ  0
+#define BLOCK_OP_WRITE 1
+#define BLOCK_OP_FLUSH 2            /* Drain the device's volatile write cache; no data */
+#define BLOCK_OP_DISCARD 3          /* lba..lba+count holds nothing worth keeping; no data */
+#define BLOCK_OP_COUNT 4
+
+/* Request flags */
+#define BLOCK_REQ_SYNC (1U << 0)   /* Submitter waits on the result */
+#define BLOCK_REQ_NOMERGE (1U << 1) /* Dispatch exactly as submitted */
+
+/* Flags owned by the request queue */
+#define BLOCK_REQ_MERGED     (1U << 16)   /* Pool request standing in for merged ones */
+#define BLOCK_REQ_PIGGYBACK  (1U << 17)   /* Read served by copying from an overlapping read */
+#define BLOCK_REQ_DISPATCHED (1U << 18)   /* Owned by the driver */
+#define BLOCK_REQ_QUEUE_MASK (0xFFFFU << 16)
+
+/* Request queue tuning */
+#define BLOCK_QUEUE_UNPLUG_DEPTH 16       /* Pending requests that force a dispatch */
+#define BLOCK_MERGE_POOL         32       /* Stand-in requests shared by all queues */
+#define BLOCK_READ_DEADLINE_US   50000
+#define BLOCK_WRITE_DEADLINE_US  500000
+
+/* Request status. Positive while in flight, zero or negative once done. */
+#define BLOCK_PENDING   1
+#define BLOCK_OK        0
+#define BLOCK_EIO      -1
+#define BLOCK_EINVAL   -2
+#define BLOCK_ENOTSUP  -3
+#define BLOCK_EBUSY    -4           /* Driver has no free slot; retry later */
 
 typedef struct BlockDevice BlockDevice;
+typedef struct BlockRequest BlockRequest;
+
+typedef void (*block_done_t)(BlockRequest *req);
+
+/* One contiguous piece of a request's memory; len is a multiple of the
+ * device sector size. */
+typedef struct {
+    void *buf;
+    uint32_t len;
+} BlockSegment;
+
+/* An I/O request. The submitter owns the memory and must keep it alive
+ * until the completion callback has run (or block_wait() returned). */
+struct BlockRequest {
+    BlockDevice *dev;
+    uint32_t op;
+    uint32_t flags;
+    uint64_t lba;
+    uint32_t count;                 /* Sectors, sum of segment lengths */
+    uint32_t segment_count;
+    BlockSegment segments[BLOCK_MAX_SEGMENTS];
+
+    block_done_t done;              /* Optional, runs once on completion */
+    void *private;                  /* Submitter cookie */
+    volatile int status;
+
+    /* Owned by the block layer between submit and completion */
+    BlockRequest *next;             /* Queue link */
+    BlockRequest *merged;           /* Requests completed along with this one */
+    uint64_t deadline;              /* TSC by which it should be dispatched */
+    uint64_t submitted_at;          /* TSC at block_submit() */
+    uint64_t dispatched_at;         /* TSC when handed to the driver */
+};
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t merges;                /* Joined to an adjacent queued request */
+    uint64_t piggybacks;            /* Served from an overlapping read */
+    uint64_t dispatched;            /* Requests handed to the driver */
+    uint64_t batches;               /* Queue runs that dispatched anything */
+    uint64_t expired;               /* Dispatched out of LBA order by deadline */
+    uint64_t drains;                /* Ordering conflicts that emptied the queue */
+    uint32_t depth;                 /* Queued, not yet dispatched */
+    uint32_t max_depth;
+    uint32_t in_flight;
+    uint32_t max_in_flight;
+} BlockQueueStats;
+
+/* Service time histogram: bucket i counts commands that took [2^i, 2^(i+1))
+ * microseconds from dispatch to completion; bucket 0 also takes 0-1 us. */
+#define BLOCK_LAT_BUCKETS 24
+
+/* Per-device accounting of commands the driver completed, indexed by
+ * BLOCK_OP_*. A merged command counts once. */
+typedef struct {
+    uint64_t ops[BLOCK_OP_COUNT];
+    uint64_t sectors[BLOCK_OP_COUNT];
+    uint64_t service_cycles[BLOCK_OP_COUNT];  /* Sum of dispatch-to-completion TSC */
+    uint64_t errors;
+    uint64_t busy_cycles;           /* TSC with at least one command in flight */
+    uint64_t busy_since;            /* Start of the current busy period */
+    uint32_t latency[BLOCK_OP_COUNT][BLOCK_LAT_BUCKETS];
+} BlockIoStats;
+
+/* Per-device request queue. Pending requests are kept sorted by LBA and
+ * dispatched as a one-way elevator sweep, except that a request past its
+ * deadline goes first. */
+typedef struct {
+    BlockRequest *pending;
+    BlockRequest *in_flight;
+    uint32_t plugged;               /* block_plug() nesting */
+    uint64_t head_lba;              /* Where the last dispatch ended */
+    BlockQueueStats stats;
+} BlockQueue;
 
 struct BlockDevice {
     const char *name;
-    uint32_t sector_size;
-    uint64_t total_sectors;
+    uint32_t sector_size;           /* Logical block size: a power of two from
+                                     * 512 to BLOCK_MAX_SECTOR_SIZE, 0 for 512.
+                                     * Every LBA and count is in these units. */
+    uint64_t total_sectors;         /* 0 when the driver cannot tell */
     void *driver_data;
 
-    int (*read)(BlockDevice *dev, uint64_t lba, uint32_t count, void *buffer);
-    int (*write)(BlockDevice *dev, uint64_t lba, uint32_t count, const void *buffer);
+    /* Limits the block layer enforces before calling submit */
+    uint32_t max_segments;
+    uint32_t max_sectors;
+    uint32_t queue_depth;
+    uint32_t virt_boundary;         /* If set, segments after the first start and
+                                     * all but the last end on a multiple of it */
+    uint32_t max_discard_sectors;   /* Largest discard, 0 if the device takes none.
+                                     * Reads of discarded sectors return
+                                     * unspecified data. */
+
+    /* Start req without waiting. Returns BLOCK_OK once the hardware owns it,
+     * BLOCK_EBUSY when every slot is taken, or another error to fail it. */
+    int (*submit)(BlockDevice *dev, BlockRequest *req);
+    /* Reap finished requests and run their completions. Safe to call from
+     * any context, including concurrently with a softirq doing the same.
+     * Returns the number of requests completed. */
+    int (*poll)(BlockDevice *dev);
+
+    BlockQueue queue;               /* Managed by the block layer */
+    BlockIoStats io;
 };
 
+/* Refuses a device whose sector_size is not one the block layer handles */
 int block_register(BlockDevice *dev);
+int block_unregister(BlockDevice *dev);
 BlockDevice *block_get(int index);
 int block_count(void);
+uint32_t block_sector_size(BlockDevice *dev);
+
+/* Asynchronous interface. block_request_add() returns 0 when the segment
+ * would take req past one of the device limits, so callers can build
+ * requests greedily and submit when it refuses. */
+void block_request_init(BlockRequest *req, BlockDevice *dev, uint32_t op, uint64_t lba);
+int block_request_add(BlockRequest *req, void *buf, uint32_t len);
+int block_submit(BlockRequest *req);
+int block_poll(BlockDevice *dev);
+int block_wait(BlockRequest *req);
+
+/* Hold back dispatch so a burst of submissions can be merged; the last
+ * block_unplug() sends everything. block_wait() on a held request, or a
+ * queue reaching BLOCK_QUEUE_UNPLUG_DEPTH, dispatches early. */
+void block_plug(BlockDevice *dev);
+void block_unplug(BlockDevice *dev);
+void block_queue_stats(BlockDevice *dev, BlockQueueStats *out);
+
+/* Snapshot of dev's accounting; busy_cycles includes a busy period still
+ * running */
+void block_io_stats(BlockDevice *dev, BlockIoStats *out);
+/* Upper bound in microseconds of the pct-th percentile service time of op,
+ * or 0 when no command of that kind completed */
+uint64_t block_latency_percentile(const BlockIoStats *st, uint32_t op, uint32_t pct);
+/* Write every device's accounting and histograms to the serial port */
+void block_iostat_dump(void);
+
+/* Driver side: finish req with status and run its callback */
+void block_complete(BlockRequest *req, int status);
+
+/* Synchronous wrappers, return 1 on success */
+int block_read(BlockDevice *dev, uint64_t lba, uint32_t count, void *buffer);
+int block_write(BlockDevice *dev, uint64_t lba, uint32_t count, const void *buffer);
+
+/* Vectored wrappers: the segments are consecutive on disk starting at lba
+ * and are sent in as few commands as the device limits allow */
+int block_readv(BlockDevice *dev, uint64_t lba, const BlockSegment *iov, uint32_t iovcnt);
+int block_writev(BlockDevice *dev, uint64_t lba, const BlockSegment *iov, uint32_t iovcnt);
+
+/* Make every write completed so far durable. Devices without a write cache
+ * answer BLOCK_ENOTSUP, which counts as success. */
+int block_flush(BlockDevice *dev);
+
+/* Tell the device it may forget count sectors from lba, in as many
+ * commands as max_discard_sectors needs. Returns 0 on error or when the
+ * device cannot discard. */
+int block_discard(BlockDevice *dev, uint64_t lba, uint64_t count);
 
 #endif
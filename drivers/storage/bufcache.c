@@ -0,0 +1,797 @@
+#include "bufcache.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "klog.h"
+
+#define LIST_T1 0       /* Resident, seen once recently */
+#define LIST_T2 1       /* Resident, seen at least twice */
+#define LIST_B1 2       /* Ghost of an entry evicted from T1 */
+#define LIST_B2 3       /* Ghost of an entry evicted from T2 */
+#define LIST_FREE 4
+#define LIST_COUNT 4
+
+typedef struct {
+    Buffer *head;       /* MRU */
+    Buffer *tail;       /* LRU */
+    uint32_t size;
+} BufList;
+
+static BufList lists[LIST_COUNT];
+static Buffer *free_entries;
+static uint8_t *free_data;          /* Free data slots, linked through their first word */
+
+static Buffer **buckets;
+static uint32_t bucket_mask;
+
+static Buffer *dirty_head;          /* Oldest dirty buffer */
+static Buffer *dirty_tail;
+static uint32_t dirty_count;
+
+#define RA_FREE      0
+#define RA_FILLING   1  /* Collecting buffers, not submitted yet */
+#define RA_IN_FLIGHT 2
+
+/* A readahead request and the buffers it fills; each holds a reference
+ * until the request is reaped in task context */
+typedef struct {
+    BlockRequest req;
+    Buffer *bufs[BUFCACHE_RA_SLOT_BUFS];
+    uint32_t count;
+    uint32_t state;
+} RaSlot;
+
+static RaSlot ra_slots[BUFCACHE_RA_SLOTS];
+static uint32_t ra_buffers;         /* Referenced by readahead in flight */
+
+static uint32_t capacity;           /* c: resident buffers */
+static uint32_t target;             /* p: desired |T1| */
+static BufCacheStats stats;
+
+/* Used when no memory map was passed */
+static Buffer fallback_entries[BUFCACHE_MIN_BUFFERS * 2];
+static uint8_t fallback_data[BUFCACHE_MIN_BUFFERS][BUFCACHE_BLOCK_MAX] __attribute__((aligned(4096)));
+static Buffer *fallback_buckets[BUFCACHE_MIN_BUFFERS * 2];
+
+/* ---- Lists --------------------------------------------------------------- */
+
+static void list_remove(Buffer *b) {
+    BufList *l = &lists[b->list];
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        l->head = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    } else {
+        l->tail = b->prev;
+    }
+    b->prev = b->next = 0;
+    l->size--;
+}
+
+static void list_push_mru(uint32_t list, Buffer *b) {
+    BufList *l = &lists[list];
+    b->list = list;
+    b->prev = 0;
+    b->next = l->head;
+    if (l->head) {
+        l->head->prev = b;
+    } else {
+        l->tail = b;
+    }
+    l->head = b;
+    l->size++;
+}
+
+/* ---- Dirty list ---------------------------------------------------------- */
+
+/* Kept in the order buffers became dirty, so the head is the oldest */
+static void dirty_link(Buffer *b) {
+    b->flags |= BUF_DIRTY;
+    b->dirty_since = rdtsc();
+    b->dirty_next = 0;
+    b->dirty_prev = dirty_tail;
+    if (dirty_tail) {
+        dirty_tail->dirty_next = b;
+    } else {
+        dirty_head = b;
+    }
+    dirty_tail = b;
+    dirty_count++;
+}
+
+static void dirty_unlink(Buffer *b) {
+    if (b->dirty_prev) {
+        b->dirty_prev->dirty_next = b->dirty_next;
+    } else {
+        dirty_head = b->dirty_next;
+    }
+    if (b->dirty_next) {
+        b->dirty_next->dirty_prev = b->dirty_prev;
+    } else {
+        dirty_tail = b->dirty_prev;
+    }
+    b->dirty_prev = b->dirty_next = 0;
+    b->flags &= ~BUF_DIRTY;
+    dirty_count--;
+}
+
+/* Account for a writeback; a failed buffer stays dirty but goes to the back
+ * so it is retried after a full expiry instead of on every pass */
+static void dirty_written(Buffer *b, int status) {
+    dirty_unlink(b);
+    if (status == BLOCK_OK) {
+        stats.writebacks++;
+    } else {
+        stats.write_errors++;
+        dirty_link(b);
+    }
+}
+
+/* ---- Hash ---------------------------------------------------------------- */
+
+static uint32_t hash_key(BlockDevice *dev, uint64_t lba) {
+    uint64_t h = (lba * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)(uintptr_t)dev >> 4);
+    return (uint32_t)(h >> 32) & bucket_mask;
+}
+
+static Buffer *hash_find(BlockDevice *dev, uint64_t lba) {
+    for (Buffer *b = buckets[hash_key(dev, lba)]; b; b = b->hash_next) {
+        if (b->dev == dev && b->lba == lba) {
+            return b;
+        }
+    }
+    return 0;
+}
+
+static void hash_insert(Buffer *b) {
+    uint32_t h = hash_key(b->dev, b->lba);
+    b->hash_next = buckets[h];
+    buckets[h] = b;
+}
+
+static void hash_remove(Buffer *b) {
+    Buffer **link = &buckets[hash_key(b->dev, b->lba)];
+    while (*link && *link != b) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = b->hash_next;
+    }
+    b->hash_next = 0;
+}
+
+/* ---- Data slots and entries ---------------------------------------------- */
+
+static uint8_t *data_alloc(void) {
+    uint8_t *slot = free_data;
+    if (slot) {
+        free_data = *(uint8_t **)slot;
+    }
+    return slot;
+}
+
+static void data_free(uint8_t *slot) {
+    *(uint8_t **)slot = free_data;
+    free_data = slot;
+}
+
+/* Drop an entry (resident or ghost) from the cache altogether */
+static void entry_drop(Buffer *b) {
+    if (b->flags & BUF_DIRTY) {
+        dirty_unlink(b);
+    }
+    if (b->flags & BUF_READAHEAD) {
+        stats.ra_waste++;
+    }
+    list_remove(b);
+    hash_remove(b);
+    if (b->data) {
+        data_free(b->data);
+        b->data = 0;
+    }
+    b->dev = 0;
+    b->flags = 0;
+    b->list = LIST_FREE;
+    b->next = free_entries;
+    free_entries = b;
+}
+
+static Buffer *entry_alloc(void) {
+    Buffer *b = free_entries;
+    if (!b) {
+        /* Every entry in use: the oldest ghost goes */
+        Buffer *ghost = lists[LIST_B2].tail ? lists[LIST_B2].tail : lists[LIST_B1].tail;
+        if (!ghost) {
+            return 0;
+        }
+        entry_drop(ghost);
+        b = free_entries;
+    }
+    free_entries = b->next;
+    b->next = 0;
+    return b;
+}
+
+static uint32_t sectors_for(BlockDevice *dev, uint32_t size) {
+    return size / block_sector_size(dev);
+}
+
+static int writeback_one(Buffer *b) {
+    int ok = block_write(b->dev, b->lba, sectors_for(b->dev, b->size), b->data);
+    dirty_written(b, ok ? BLOCK_OK : BLOCK_EIO);
+    return ok;
+}
+
+/* Oldest buffer on the list that can be evicted. Clean buffers are
+ * preferred; a dirty one is only written back when nothing else is free. */
+static Buffer *lru_unreferenced(uint32_t list) {
+    Buffer *dirty = 0;
+    for (Buffer *b = lists[list].tail; b; b = b->prev) {
+        if (b->refcount) {
+            continue;
+        }
+        if (!(b->flags & BUF_DIRTY)) {
+            return b;
+        }
+        if (!dirty) {
+            dirty = b;
+        }
+    }
+    if (dirty && writeback_one(dirty)) {
+        return dirty;
+    }
+    return 0;
+}
+
+/* Write back up to a batch of dirty buffers for one device, oldest first,
+ * under a plug so neighbouring blocks go out as merged requests. dev 0
+ * means the device of the oldest dirty buffer; buffers dirtied after
+ * 'before' are left alone. Returns the number written successfully. */
+static uint32_t writeback_batch(BlockDevice *dev, uint64_t before) {
+    static BlockRequest reqs[BUFCACHE_WRITEBACK_BATCH];
+    static Buffer *bufs[BUFCACHE_WRITEBACK_BATCH];
+    uint32_t n = 0;
+
+    for (Buffer *b = dirty_head; b && n < BUFCACHE_WRITEBACK_BATCH; b = b->dirty_next) {
+        if (b->dirty_since > before) {
+            break;
+        }
+        if (!dev) {
+            dev = b->dev;
+        }
+        if (b->dev == dev) {
+            bufs[n++] = b;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    block_plug(dev);
+    for (uint32_t i = 0; i < n; i++) {
+        bufs[i]->refcount++;
+        block_request_init(&reqs[i], dev, BLOCK_OP_WRITE, bufs[i]->lba);
+        block_request_add(&reqs[i], bufs[i]->data, bufs[i]->size);
+        block_submit(&reqs[i]);
+    }
+    block_unplug(dev);
+
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        int status = block_wait(&reqs[i]);
+        dirty_written(bufs[i], status);
+        bufs[i]->refcount--;
+        if (status == BLOCK_OK) {
+            written++;
+        }
+    }
+    return written;
+}
+
+/* Write back the oldest buffers until at most 'limit' are dirty */
+static void writeback_excess(uint32_t limit) {
+    uint64_t now = rdtsc();
+    while (dirty_count > limit && writeback_batch(0, now)) {
+    }
+}
+
+/* ARC REPLACE: demote the LRU of T1 or T2 to its ghost list, freeing a
+ * data slot. x_in_b2 says the request that needs the slot hit in B2. */
+static int arc_replace(int x_in_b2) {
+    uint32_t t1 = lists[LIST_T1].size;
+    int from_t1 = t1 > 0 && ((x_in_b2 && t1 == target) || t1 > target);
+
+    Buffer *victim = lru_unreferenced(from_t1 ? LIST_T1 : LIST_T2);
+    if (!victim) {
+        from_t1 = !from_t1;
+        victim = lru_unreferenced(from_t1 ? LIST_T1 : LIST_T2);
+    }
+    if (!victim) {
+        return 0;
+    }
+
+    if (victim->flags & BUF_READAHEAD) {
+        stats.ra_waste++;
+    }
+    list_remove(victim);
+    data_free(victim->data);
+    victim->data = 0;
+    victim->flags = 0;
+    list_push_mru(from_t1 ? LIST_B1 : LIST_B2, victim);
+    stats.evictions++;
+    return 1;
+}
+
+static uint32_t ratio(uint32_t a, uint32_t b) {
+    uint32_t r = b ? a / b : a;
+    return r ? r : 1;
+}
+
+/* ---- Readahead ----------------------------------------------------------- */
+
+/* Settle a finished readahead request: publish the data, drop the refs */
+static void ra_reap(RaSlot *slot) {
+    int ok = slot->req.status == BLOCK_OK;
+    for (uint32_t i = 0; i < slot->count; i++) {
+        Buffer *b = slot->bufs[i];
+        b->flags &= ~BUF_IO;
+        if (ok) {
+            b->flags |= BUF_VALID;
+        } else {
+            b->flags &= ~BUF_READAHEAD;
+            stats.read_errors++;
+        }
+        b->refcount--;
+    }
+    ra_buffers -= slot->count;
+    slot->count = 0;
+    slot->state = RA_FREE;
+}
+
+static void ra_reap_done(void) {
+    for (uint32_t i = 0; i < BUFCACHE_RA_SLOTS; i++) {
+        if (ra_slots[i].state == RA_IN_FLIGHT && ra_slots[i].req.status != BLOCK_PENDING) {
+            ra_reap(&ra_slots[i]);
+        }
+    }
+}
+
+/* Wait for the readahead filling b, or for all of them when b is 0 */
+static void ra_wait(Buffer *b) {
+    for (uint32_t i = 0; i < BUFCACHE_RA_SLOTS; i++) {
+        RaSlot *slot = &ra_slots[i];
+        if (slot->state != RA_IN_FLIGHT) {
+            continue;
+        }
+        int wanted = !b;
+        for (uint32_t j = 0; !wanted && j < slot->count; j++) {
+            wanted = slot->bufs[j] == b;
+        }
+        if (wanted) {
+            block_wait(&slot->req);
+            ra_reap(slot);
+        }
+    }
+}
+
+static void ra_submit(RaSlot **slot) {
+    if (*slot) {
+        (*slot)->state = RA_IN_FLIGHT;
+        block_submit(&(*slot)->req);
+        *slot = 0;
+    }
+}
+
+static RaSlot *ra_slot_alloc(void) {
+    ra_reap_done();
+    for (uint32_t i = 0; i < BUFCACHE_RA_SLOTS; i++) {
+        if (ra_slots[i].state == RA_FREE) {
+            ra_slots[i].state = RA_FILLING;
+            ra_slots[i].count = 0;
+            return &ra_slots[i];
+        }
+    }
+    return 0;
+}
+
+/* Free a data slot. Readahead in flight holds references, so when nothing
+ * else can be evicted finish it rather than fail the caller. */
+static int make_room(int x_in_b2) {
+    if (free_data || arc_replace(x_in_b2)) {
+        return 1;
+    }
+    if (!ra_buffers) {
+        return 0;
+    }
+    ra_wait(0);
+    return arc_replace(x_in_b2);
+}
+
+/* Complete miss: a new referenced T1 entry for a key the cache has never
+ * seen or has forgotten. Keeps |T1|+|B1| <= c and the directory <= 2c. */
+static Buffer *arc_insert(BlockDevice *dev, uint64_t lba, uint32_t size) {
+    uint32_t l1 = lists[LIST_T1].size + lists[LIST_B1].size;
+    uint32_t total = l1 + lists[LIST_T2].size + lists[LIST_B2].size;
+    if (l1 >= capacity) {
+        if (lists[LIST_B1].size) {
+            entry_drop(lists[LIST_B1].tail);
+        } else {
+            Buffer *victim = lru_unreferenced(LIST_T1);
+            if (victim) {
+                entry_drop(victim);
+                stats.evictions++;
+            }
+        }
+    } else if (total >= capacity * 2 && lists[LIST_B2].size) {
+        entry_drop(lists[LIST_B2].tail);
+    }
+    if (!make_room(0)) {
+        return 0;
+    }
+
+    Buffer *b = entry_alloc();
+    if (!b) {
+        return 0;
+    }
+    b->dev = dev;
+    b->lba = lba;
+    b->size = size;
+    b->flags = 0;
+    b->refcount = 1;
+    b->data = data_alloc();
+    hash_insert(b);
+    list_push_mru(LIST_T1, b);
+    return b;
+}
+
+/* ---- Public -------------------------------------------------------------- */
+
+void bufcache_init(void) {
+    uint64_t want = pmm_free_pages() / BUFCACHE_RAM_SHARE;
+    if (want > BUFCACHE_MAX_BUFFERS) {
+        want = BUFCACHE_MAX_BUFFERS;
+    }
+
+    Buffer *entries = 0;
+    uint8_t *data = 0;
+    uint32_t nbuckets = 1;
+
+    if (want > BUFCACHE_MIN_BUFFERS) {
+        capacity = (uint32_t)want;
+        while (nbuckets < capacity * 2) {
+            nbuckets <<= 1;
+        }
+        uint64_t entry_bytes = (uint64_t)capacity * 2 * sizeof(Buffer);
+        uint64_t bucket_bytes = (uint64_t)nbuckets * sizeof(Buffer *);
+        data = (uint8_t *)pmm_alloc_pages(capacity);
+        entries = (Buffer *)pmm_alloc_pages((entry_bytes + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE);
+        buckets = (Buffer **)pmm_alloc_pages((bucket_bytes + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE);
+    }
+    if (!data || !entries || !buckets) {
+        capacity = BUFCACHE_MIN_BUFFERS;
+        nbuckets = BUFCACHE_MIN_BUFFERS * 2;
+        data = &fallback_data[0][0];
+        entries = fallback_entries;
+        buckets = fallback_buckets;
+    }
+    bucket_mask = nbuckets - 1;
+
+    for (uint32_t i = 0; i < LIST_COUNT; i++) {
+        lists[i].head = lists[i].tail = 0;
+        lists[i].size = 0;
+    }
+    free_entries = 0;
+    for (uint32_t i = 0; i < capacity * 2; i++) {
+        entries[i].list = LIST_FREE;
+        entries[i].data = 0;
+        entries[i].next = free_entries;
+        free_entries = &entries[i];
+    }
+    free_data = 0;
+    for (uint32_t i = 0; i < capacity; i++) {
+        data_free(data + (uint64_t)i * BUFCACHE_BLOCK_MAX);
+    }
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        buckets[i] = 0;
+    }
+    target = 0;
+
+    char msg[] = "BufCache: 00000 buffers\n";
+    uint32_t n = capacity;
+    for (int i = 14; i >= 10; i--) {
+        msg[i] = (char)('0' + (n % 10));
+        n /= 10;
+    }
+    serial_write(msg);
+    KLOG("BufCache: initialized");
+}
+
+Buffer *bufcache_get(BlockDevice *dev, uint64_t lba, uint32_t size) {
+    if (!dev || !capacity || size == 0 || size > BUFCACHE_BLOCK_MAX) {
+        return 0;
+    }
+    if (size % block_sector_size(dev)) {
+        /* A block smaller than, or straddling, the device's logical block
+         * cannot be read or written on its own */
+        return 0;
+    }
+
+    ra_reap_done();
+    Buffer *b = hash_find(dev, lba);
+    if (b && (b->flags & BUF_IO)) {
+        ra_wait(b);
+    }
+    if (b && b->size != size) {
+        /* Same start, different block size: the old view is stale */
+        if (b->refcount || ((b->flags & BUF_DIRTY) && !writeback_one(b))) {
+            return 0;
+        }
+        entry_drop(b);
+        b = 0;
+    }
+
+    if (b && (b->list == LIST_T1 || b->list == LIST_T2)) {
+        stats.hits++;
+        list_remove(b);
+        if (b->flags & BUF_READAHEAD) {
+            /* The prefetch was not a use; this is the first */
+            b->flags &= ~BUF_READAHEAD;
+            stats.ra_hits++;
+            list_push_mru(LIST_T1, b);
+        } else {
+            list_push_mru(LIST_T2, b);
+        }
+        b->refcount++;
+        return b;
+    }
+
+    stats.misses++;
+    if (b) {
+        /* Ghost hit: the list it sat on deserved more room */
+        int in_b2 = (b->list == LIST_B2);
+        uint32_t b1 = lists[LIST_B1].size;
+        uint32_t b2 = lists[LIST_B2].size;
+        if (in_b2) {
+            uint32_t dec = ratio(b1, b2);
+            target = (target > dec) ? target - dec : 0;
+        } else {
+            uint32_t inc = ratio(b2, b1);
+            target = (target + inc < capacity) ? target + inc : capacity;
+        }
+        stats.ghost_hits++;
+
+        if (!make_room(in_b2)) {
+            return 0;
+        }
+        list_remove(b);
+        b->data = data_alloc();
+        b->flags = 0;
+        b->refcount = 1;
+        list_push_mru(LIST_T2, b);
+        return b;
+    }
+
+    return arc_insert(dev, lba, size);
+}
+
+Buffer *bufcache_read(BlockDevice *dev, uint64_t lba, uint32_t size) {
+    Buffer *b = bufcache_get(dev, lba, size);
+    if (!b) {
+        /* Cache exhausted by references: the caller cannot be served */
+        return 0;
+    }
+    if (!(b->flags & BUF_VALID)) {
+        if (!block_read(dev, lba, sectors_for(dev, size), b->data)) {
+            stats.read_errors++;
+            bufcache_release(b);
+            return 0;
+        }
+        b->flags |= BUF_VALID;
+    }
+    return b;
+}
+
+int bufcache_write(BlockDevice *dev, uint64_t lba, uint32_t size, const void *data) {
+    Buffer *b = bufcache_get(dev, lba, size);
+    if (!b) {
+        if (!dev || size == 0 || size % block_sector_size(dev)) {
+            return 0;
+        }
+        return block_write(dev, lba, sectors_for(dev, size), data);
+    }
+
+    const uint8_t *src = (const uint8_t *)data;
+    for (uint32_t i = 0; i < size; i++) {
+        b->data[i] = src[i];
+    }
+    b->flags |= BUF_VALID;
+    if (b->flags & BUF_DIRTY) {
+        stats.coalesced++;
+    } else {
+        dirty_link(b);
+    }
+    bufcache_release(b);
+
+    /* Throttle: the writer pays for letting too much pile up */
+    if (dirty_count > capacity * BUFCACHE_DIRTY_LIMIT / 100) {
+        writeback_excess(capacity * BUFCACHE_DIRTY_BACKGROUND / 100);
+    }
+    return 1;
+}
+
+void bufcache_release(Buffer *buf) {
+    if (buf && buf->refcount) {
+        buf->refcount--;
+    }
+}
+
+uint32_t bufcache_readahead(BlockDevice *dev, uint64_t lba, uint32_t size, uint32_t count) {
+    if (!dev || !capacity || size == 0 || size > BUFCACHE_BLOCK_MAX || size % block_sector_size(dev)) {
+        return 0;
+    }
+
+    uint32_t sectors = sectors_for(dev, size);
+    uint32_t issued = 0;
+    RaSlot *slot = 0;
+
+    block_plug(dev);
+    for (uint32_t i = 0; i < count && ra_buffers < capacity / 4; i++, lba += sectors) {
+        if (hash_find(dev, lba)) {
+            /* Cached, in flight, or a ghost the next demand read should
+             * see; either way the open run ends here */
+            ra_submit(&slot);
+            continue;
+        }
+
+        Buffer *b = arc_insert(dev, lba, size);
+        if (!b) {
+            break;
+        }
+        if (slot && (slot->count == BUFCACHE_RA_SLOT_BUFS ||
+                     !block_request_add(&slot->req, b->data, size))) {
+            ra_submit(&slot);
+        }
+        if (!slot) {
+            slot = ra_slot_alloc();
+            if (slot) {
+                block_request_init(&slot->req, dev, BLOCK_OP_READ, lba);
+            }
+            if (!slot || !block_request_add(&slot->req, b->data, size)) {
+                if (slot) {
+                    slot->state = RA_FREE;
+                }
+                entry_drop(b);
+                break;
+            }
+        }
+
+        b->flags = BUF_READAHEAD | BUF_IO;
+        slot->bufs[slot->count++] = b;
+        ra_buffers++;
+        issued++;
+    }
+    ra_submit(&slot);
+    block_unplug(dev);
+
+    stats.ra_issued += issued;
+    return issued;
+}
+
+int bufcache_sync(BlockDevice *dev) {
+    uint64_t now = rdtsc();
+    int ok = 1;
+
+    stats.syncs++;
+    while (writeback_batch(dev, now)) {
+    }
+    /* Whatever is still dirty from before the sync failed to write */
+    for (Buffer *b = dirty_head; b; b = b->dirty_next) {
+        if (b->dirty_since <= now && (!dev || b->dev == dev)) {
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        KERR("BufCache: sync could not write every dirty buffer");
+    }
+
+    if (dev) {
+        return block_flush(dev) && ok;
+    }
+    for (int i = 0; i < block_count(); i++) {
+        BlockDevice *d = block_get(i);
+        if (d && !block_flush(d)) {
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+void bufcache_writeback(void) {
+    ra_reap_done();
+    if (!dirty_head) {
+        return;
+    }
+
+    uint32_t background = capacity * BUFCACHE_DIRTY_BACKGROUND / 100;
+    if (dirty_count > background) {
+        writeback_excess(background);
+    }
+
+    uint64_t now = rdtsc();
+    uint64_t expire = tsc_from_us((uint64_t)BUFCACHE_DIRTY_EXPIRE_MS * 1000);
+    if (now < expire) {
+        return;
+    }
+    uint64_t expired = now - expire;
+    while (dirty_head && dirty_head->dirty_since <= expired && writeback_batch(0, expired)) {
+    }
+}
+
+void bufcache_invalidate(BlockDevice *dev) {
+    ra_wait(0);
+    uint64_t now = rdtsc();
+    while (writeback_batch(dev, now)) {
+    }
+
+    /* Dirty data that still could not be written is lost here */
+    for (uint32_t l = 0; l < LIST_COUNT; l++) {
+        Buffer *b = lists[l].head;
+        while (b) {
+            Buffer *next = b->next;
+            if (b->dev == dev) {
+                if (b->refcount) {
+                    if (b->flags & BUF_DIRTY) {
+                        dirty_unlink(b);
+                    }
+                    b->flags &= ~BUF_VALID;
+                } else {
+                    entry_drop(b);
+                }
+            }
+            b = next;
+        }
+    }
+}
+
+int bufcache_discard(BlockDevice *dev, uint64_t lba, uint64_t count) {
+    if (!dev || !dev->max_discard_sectors || count == 0) {
+        return 0;
+    }
+
+    /* Buffers wholly inside the range would only write back data nobody
+     * wants, or serve it after the disk has forgotten it */
+    ra_wait(0);
+    for (uint32_t l = 0; l < LIST_COUNT; l++) {
+        Buffer *b = lists[l].head;
+        while (b) {
+            Buffer *next = b->next;
+            if (b->dev == dev && b->lba >= lba &&
+                b->lba + sectors_for(dev, b->size) <= lba + count) {
+                if (b->refcount) {
+                    if (b->flags & BUF_DIRTY) {
+                        dirty_unlink(b);
+                    }
+                    b->flags &= ~BUF_VALID;
+                } else {
+                    entry_drop(b);
+                }
+            }
+            b = next;
+        }
+    }
+    return block_discard(dev, lba, count);
+}
+
+void bufcache_get_stats(BufCacheStats *out) {
+    *out = stats;
+    out->dirty = dirty_count;
+    out->capacity = capacity;
+    out->target = target;
+    out->recent = lists[LIST_T1].size;
+    out->frequent = lists[LIST_T2].size;
+    out->ghost_recent = lists[LIST_B1].size;
+    out->ghost_frequent = lists[LIST_B2].size;
+}
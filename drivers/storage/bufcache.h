@@ -0,0 +1,121 @@
+#ifndef KAGAMI_BUFCACHE_H
+#define KAGAMI_BUFCACHE_H
+
+#include "types.h"
+#include "block.h"
+
+/* Block buffer cache.
+ * Buffers are keyed by (device, starting LBA) and hold one filesystem
+ * block of up to BUFCACHE_BLOCK_MAX bytes. Replacement is ARC: recently
+ * used (T1) and frequently used (T2) buffers compete for the cache, and
+ * ghost lists of recently evicted keys (B1/B2) steer the split between
+ * them. Callers hold a reference from get/read until release; referenced
+ * buffers are never evicted. Task context only.
+ *
+ * Writes are write-back: they dirty the buffer and return, so repeated
+ * writes of the same block cost one disk write. Dirty buffers go out once
+ * they are BUFCACHE_DIRTY_EXPIRE_MS old or when too many are dirty, and
+ * bufcache_sync() writes them all and flushes the device caches.
+ *
+ * bufcache_readahead() fills buffers asynchronously. They count as a
+ * readahead hit when first used and as waste if evicted unused.
+ */
+
+#define BUFCACHE_BLOCK_MAX    4096
+#define BUFCACHE_MIN_BUFFERS  32
+#define BUFCACHE_MAX_BUFFERS  8192        /* 32 MiB of block data */
+#define BUFCACHE_RAM_SHARE    8           /* Use up to 1/8 of free RAM */
+
+#define BUFCACHE_DIRTY_EXPIRE_MS     5000 /* Age at which a dirty buffer is written */
+#define BUFCACHE_DIRTY_BACKGROUND    10   /* % of capacity dirty that starts writeback */
+#define BUFCACHE_DIRTY_LIMIT         40   /* % of capacity dirty that stalls writers */
+#define BUFCACHE_WRITEBACK_BATCH     32   /* Buffers written under one plug */
+#define BUFCACHE_RA_SLOTS            8    /* Readahead requests in flight */
+#define BUFCACHE_RA_SLOT_BUFS        16   /* Buffers filled by one request */
+
+#define BUF_VALID  (1U << 0)              /* data is the block's current contents */
+#define BUF_DIRTY  (1U << 1)              /* data is newer than the disk */
+#define BUF_READAHEAD (1U << 2)           /* Prefetched, not used yet */
+#define BUF_IO     (1U << 3)              /* Readahead read in flight */
+
+typedef struct Buffer Buffer;
+
+struct Buffer {
+    BlockDevice *dev;
+    uint64_t lba;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t refcount;
+    uint32_t list;                        /* ARC list the entry is on */
+    uint8_t *data;                        /* 0 while only a ghost */
+    Buffer *hash_next;
+    Buffer *prev;
+    Buffer *next;
+    uint64_t dirty_since;                 /* TSC of the first write since clean */
+    Buffer *dirty_prev;                   /* Dirty list, oldest first */
+    Buffer *dirty_next;
+};
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t ghost_hits;                  /* Misses the ghost lists predicted */
+    uint64_t evictions;
+    uint64_t read_errors;
+    uint64_t coalesced;                   /* Writes absorbed by an already dirty buffer */
+    uint64_t writebacks;                  /* Dirty buffers written to disk */
+    uint64_t write_errors;
+    uint64_t syncs;
+    uint64_t ra_issued;                   /* Buffers prefetched */
+    uint64_t ra_hits;                     /* Prefetched buffers later used */
+    uint64_t ra_waste;                    /* Prefetched buffers evicted unused */
+    uint32_t dirty;
+    uint32_t capacity;                    /* Buffers */
+    uint32_t target;                      /* ARC p: T1 share of capacity */
+    uint32_t recent;                      /* |T1| */
+    uint32_t frequent;                    /* |T2| */
+    uint32_t ghost_recent;                /* |B1| */
+    uint32_t ghost_frequent;              /* |B2| */
+} BufCacheStats;
+
+/* Size the cache from free RAM (after pmm_init) */
+void bufcache_init(void);
+
+/* Referenced buffer for the block, not read from disk; check BUF_VALID.
+ * Returns 0 if every buffer is referenced or size is unsupported. */
+Buffer *bufcache_get(BlockDevice *dev, uint64_t lba, uint32_t size);
+
+/* Referenced buffer holding the block's contents, or 0 on I/O error */
+Buffer *bufcache_read(BlockDevice *dev, uint64_t lba, uint32_t size);
+
+/* Replace the block's contents in the cache; the disk is updated later.
+ * Returns 1 on success. */
+int bufcache_write(BlockDevice *dev, uint64_t lba, uint32_t size, const void *data);
+
+void bufcache_release(Buffer *buf);
+
+/* Start reading count consecutive blocks from lba into the cache without
+ * waiting. Blocks already cached, or recently evicted, are skipped.
+ * Returns the number of buffers being filled. */
+uint32_t bufcache_readahead(BlockDevice *dev, uint64_t lba, uint32_t size, uint32_t count);
+
+/* Write back every dirty buffer of dev (0 = all devices) and flush the
+ * device write caches. Returns 1 if everything reached stable storage. */
+int bufcache_sync(BlockDevice *dev);
+
+/* Finish completed readahead and write back old buffers and dirty excess;
+ * cheap when there is nothing to do, so idle loops can call it freely. */
+void bufcache_writeback(void);
+
+/* Write back and forget every buffer of dev, e.g. when a filesystem is
+ * (re)mounted */
+void bufcache_invalidate(BlockDevice *dev);
+
+/* Forget the cached blocks inside count sectors from lba, dirty or not,
+ * and discard the range on dev. Returns 0 if dev cannot discard or the
+ * discard failed. */
+int bufcache_discard(BlockDevice *dev, uint64_t lba, uint64_t count);
+
+void bufcache_get_stats(BufCacheStats *out);
+
+#endif
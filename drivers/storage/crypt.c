@@ -0,0 +1,360 @@
+#include "crypt.h"
+#include "aes.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "klog.h"
+#include "irqflags.h"
+#include "softirq.h"
+
+/* Each request of ours maps to exactly one request on the lower device,
+ * held in a slot. Like md, the lower completion only marks the slot done
+ * and the parent completes from poll, which is also where reads are
+ * decrypted - never in the lower driver's interrupt path. */
+
+typedef struct CryptDev CryptDev;
+
+typedef struct {
+    CryptDev *cd;
+    BlockRequest *parent;
+    BlockRequest child;
+    uint8_t *bounce;                  /* CRYPT_MAX_BYTES */
+} CryptSlot;
+
+struct CryptDev {
+    BlockDevice dev;
+    BlockDevice *lower;
+    XtsKey key;
+    uint32_t key_bits;
+    CryptSlot slots[CRYPT_QUEUE_DEPTH];
+    uint32_t busy;                    /* Slot bitmap */
+    uint32_t done;                    /* Slots whose lower request completed */
+    int kicked;                       /* Softirq queued, not yet run */
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t errors;
+    uint64_t bytes_encrypted;
+    uint64_t bytes_decrypted;
+    uint64_t cipher_cycles;
+};
+
+static CryptDev devices[CRYPT_MAX_DEVICES];
+static int device_count = 0;
+static const char *device_names[CRYPT_MAX_DEVICES] = { "crypt0", "crypt1" };
+
+static int crypt_poll(BlockDevice *dev);
+
+static void crypt_softirq(uint64_t arg) {
+    CryptDev *cd = (CryptDev *)(uintptr_t)arg;
+    cd->kicked = 0;
+    crypt_poll(&cd->dev);
+}
+
+/* May run from the lower driver's interrupt path or softirq, or from
+ * block_submit() when the lower device rejects the request */
+static void crypt_child_done(BlockRequest *child) {
+    CryptSlot *slot = (CryptSlot *)child->private;
+    CryptDev *cd = slot->cd;
+
+    uint64_t flags = local_irq_save();
+    cd->done |= 1U << (uint32_t)(slot - cd->slots);
+    int kick = !cd->kicked;
+    cd->kicked = 1;
+    local_irq_restore(flags);
+
+    if (kick && !softirq_queue(crypt_softirq, (uint64_t)(uintptr_t)cd)) {
+        cd->kicked = 0;             /* Waiters still poll */
+    }
+}
+
+/* Encrypt the parent's data into the slot's bounce buffer, or decrypt it
+ * in place. Segments always hold whole sectors (block_request_add). */
+static void crypt_data(CryptDev *cd, CryptSlot *slot, int encrypt) {
+    BlockRequest *req = slot->parent;
+    uint32_t sector_size = cd->dev.sector_size;
+    uint64_t sector = req->lba;
+    uint32_t out = 0;
+    uint64_t start = rdtsc();
+
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        uint8_t *p = (uint8_t *)req->segments[i].buf;
+        uint32_t len = req->segments[i].len;
+        if (encrypt) {
+            xts_encrypt(&cd->key, slot->bounce + out, p, len, sector, sector_size);
+            out += len;
+        } else {
+            xts_decrypt(&cd->key, p, p, len, sector, sector_size);
+        }
+        sector += len / sector_size;
+    }
+
+    uint64_t bytes = (uint64_t)req->count * sector_size;
+    if (encrypt) {
+        cd->bytes_encrypted += bytes;
+    } else {
+        cd->bytes_decrypted += bytes;
+    }
+    cd->cipher_cycles += rdtsc() - start;
+}
+
+static int crypt_submit(BlockDevice *dev, BlockRequest *req) {
+    CryptDev *cd = (CryptDev *)dev->driver_data;
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE && req->op != BLOCK_OP_FLUSH) {
+        return BLOCK_EINVAL;
+    }
+    if ((uint64_t)req->count * dev->sector_size > CRYPT_MAX_BYTES) {
+        return BLOCK_EINVAL;
+    }
+
+    uint64_t flags = local_irq_save();
+    int index = -1;
+    for (int i = 0; i < CRYPT_QUEUE_DEPTH; i++) {
+        if (!(cd->busy & (1U << i))) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+    cd->busy |= 1U << index;
+    local_irq_restore(flags);
+
+    CryptSlot *slot = &cd->slots[index];
+    BlockRequest *child = &slot->child;
+    slot->parent = req;
+    block_request_init(child, cd->lower, req->op, req->lba);
+    child->done = crypt_child_done;
+    child->private = slot;
+
+    int ok = 1;
+    if (req->op == BLOCK_OP_WRITE) {
+        crypt_data(cd, slot, 1);
+        ok = block_request_add(child, slot->bounce, req->count * dev->sector_size);
+        cd->writes++;
+    } else if (req->op == BLOCK_OP_READ) {
+        /* The lower device reads straight into the caller's buffers */
+        for (uint32_t i = 0; i < req->segment_count && ok; i++) {
+            ok = block_request_add(child, req->segments[i].buf, req->segments[i].len);
+        }
+        cd->reads++;
+    }
+    if (!ok) {
+        flags = local_irq_save();
+        cd->busy &= ~(1U << index);
+        local_irq_restore(flags);
+        serial_write("CRYPT: request does not fit the lower device\n");
+        return BLOCK_EINVAL;
+    }
+
+    block_submit(child);
+    return BLOCK_OK;
+}
+
+static int crypt_poll(BlockDevice *dev) {
+    CryptDev *cd = (CryptDev *)dev->driver_data;
+    int completed = 0;
+
+    /* block_wait() on us only polls us */
+    block_poll(cd->lower);
+
+    uint64_t flags = local_irq_save();
+    uint32_t done = cd->done;
+    cd->done = 0;
+    local_irq_restore(flags);
+
+    for (uint32_t index = 0; index < CRYPT_QUEUE_DEPTH; index++) {
+        if (!(done & (1U << index))) {
+            continue;
+        }
+        CryptSlot *slot = &cd->slots[index];
+        BlockRequest *parent = slot->parent;
+        int status = slot->child.status;
+
+        if (status == BLOCK_OK && parent->op == BLOCK_OP_READ) {
+            crypt_data(cd, slot, 0);
+        }
+        if (status != BLOCK_OK && !(parent->op == BLOCK_OP_FLUSH && status == BLOCK_ENOTSUP)) {
+            cd->errors++;
+        }
+
+        flags = local_irq_save();
+        cd->busy &= ~(1U << index);
+        local_irq_restore(flags);
+        block_complete(parent, status);
+        completed++;
+    }
+    return completed;
+}
+
+static BlockDevice *crypt_reject(const char *why) {
+    serial_write("CRYPT: ");
+    serial_write(why);
+    serial_write("\n");
+    KERR("CRYPT: device not created");
+    return 0;
+}
+
+BlockDevice *crypt_create(BlockDevice *lower, const uint8_t *key, uint32_t key_len) {
+    if (device_count >= CRYPT_MAX_DEVICES) {
+        return crypt_reject("no free device");
+    }
+    if (!lower || !lower->total_sectors) {
+        return crypt_reject("lower device missing or of unknown size");
+    }
+    if (key_len != 32 && key_len != 64) {
+        return crypt_reject("key must be 32 or 64 bytes");
+    }
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].lower == lower || &devices[i].dev == lower) {
+            return crypt_reject("device already encrypted or is itself encrypted");
+        }
+    }
+    uint32_t sector_size = lower->sector_size ? lower->sector_size : BLOCK_SECTOR_SIZE;
+    if (sector_size % AES_BLOCK_SIZE || sector_size > CRYPT_MAX_BYTES) {
+        return crypt_reject("sector size is not a multiple of the AES block");
+    }
+
+    uint8_t *buffers = (uint8_t *)pmm_alloc_pages((uint64_t)CRYPT_QUEUE_DEPTH * CRYPT_MAX_BYTES / PMM_PAGE_SIZE);
+    if (!buffers) {
+        return crypt_reject("out of memory");
+    }
+
+    CryptDev *cd = &devices[device_count];
+    if (!xts_setkey(&cd->key, key, key_len)) {
+        return crypt_reject("bad key");
+    }
+    cd->lower = lower;
+    cd->key_bits = key_len * 8;
+    for (int i = 0; i < CRYPT_QUEUE_DEPTH; i++) {
+        cd->slots[i].cd = cd;
+        cd->slots[i].parent = 0;
+        cd->slots[i].bounce = buffers + (uint64_t)i * CRYPT_MAX_BYTES;
+    }
+    cd->busy = 0;
+    cd->done = 0;
+    cd->kicked = 0;
+    cd->reads = 0;
+    cd->writes = 0;
+    cd->errors = 0;
+    cd->bytes_encrypted = 0;
+    cd->bytes_decrypted = 0;
+    cd->cipher_cycles = 0;
+
+    uint32_t max_sectors = CRYPT_MAX_BYTES / sector_size;
+    if (lower->max_sectors && lower->max_sectors < max_sectors) {
+        max_sectors = lower->max_sectors;
+    }
+
+    BlockDevice *dev = &cd->dev;
+    dev->name = device_names[device_count];
+    dev->sector_size = sector_size;
+    dev->total_sectors = lower->total_sectors;
+    dev->driver_data = cd;
+    dev->max_segments = lower->max_segments ? lower->max_segments : BLOCK_MAX_SEGMENTS;
+    dev->max_sectors = max_sectors;
+    dev->virt_boundary = lower->virt_boundary;
+    dev->queue_depth = CRYPT_QUEUE_DEPTH;
+    dev->submit = crypt_submit;
+    dev->poll = crypt_poll;
+
+    if (!block_register(dev)) {
+        xts_wipe(&cd->key);
+        return crypt_reject("no free block device slot");
+    }
+    device_count++;
+
+    serial_write("CRYPT: ");
+    serial_write(dev->name);
+    serial_write(key_len == 64 ? " aes-256-xts over " : " aes-128-xts over ");
+    serial_write(lower->name ? lower->name : "?");
+    serial_write(cd->key.aesni ? " (AES-NI)\n" : " (software)\n");
+    KLOG("CRYPT: device registered");
+    return dev;
+}
+
+int crypt_count(void) {
+    return device_count;
+}
+
+BlockDevice *crypt_get(int index) {
+    if (index < 0 || index >= device_count) {
+        return 0;
+    }
+    return &devices[index].dev;
+}
+
+int crypt_get_info(BlockDevice *dev, CryptInfo *out) {
+    if (!dev || !out || dev->submit != crypt_submit) {
+        return 0;
+    }
+    CryptDev *cd = (CryptDev *)dev->driver_data;
+    out->lower = cd->lower;
+    out->key_bits = cd->key_bits;
+    out->aesni = cd->key.aesni;
+    out->reads = cd->reads;
+    out->writes = cd->writes;
+    out->errors = cd->errors;
+    out->bytes_encrypted = cd->bytes_encrypted;
+    out->bytes_decrypted = cd->bytes_decrypted;
+    out->cipher_cycles = cd->cipher_cycles;
+    return 1;
+}
+
+/* ---- Benchmark ------------------------------------------------------------ */
+
+#define BENCH_US 125000             /* Per direction */
+
+static uint64_t bench_one(XtsKey *key, uint8_t *buf, int encrypt) {
+    uint64_t bytes = 0;
+    uint64_t start = rdtsc();
+    uint64_t end = start + tsc_from_us(BENCH_US);
+    uint64_t now = start;
+    while (now < end) {
+        if (encrypt) {
+            xts_encrypt(key, buf, buf, CRYPT_BENCH_BYTES, bytes >> 9, 4096);
+        } else {
+            xts_decrypt(key, buf, buf, CRYPT_BENCH_BYTES, bytes >> 9, 4096);
+        }
+        bytes += CRYPT_BENCH_BYTES;
+        now = rdtsc();
+    }
+    uint64_t us = tsc_to_us(now - start);
+    return us ? bytes * 1000 / 1024 * 1000 / us : 0;
+}
+
+int crypt_bench(CryptBenchResult *out, int max) {
+    static uint8_t *buf;
+    static XtsKey key;
+    uint8_t key_bytes[64];
+
+    if (!buf) {
+        buf = (uint8_t *)pmm_alloc_pages(CRYPT_BENCH_BYTES / PMM_PAGE_SIZE);
+        if (!buf) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < CRYPT_BENCH_BYTES; i++) {
+        buf[i] = (uint8_t)(i * 31 + (i >> 8));
+    }
+    for (uint32_t i = 0; i < sizeof(key_bytes); i++) {
+        key_bytes[i] = (uint8_t)(i * 73 + 11);
+    }
+
+    int count = 0;
+    int passes = aes_has_aesni() ? 2 : 1;
+    for (int pass = 0; pass < passes; pass++) {
+        for (uint32_t key_len = 32; key_len <= 64 && count < max; key_len += 32) {
+            xts_setkey(&key, key_bytes, key_len);
+            key.aesni = passes == 2 && pass == 0;
+            CryptBenchResult *r = &out[count++];
+            r->key_bits = key_len * 8;
+            r->aesni = key.aesni;
+            r->encrypt_kb_per_sec = bench_one(&key, buf, 1);
+            r->decrypt_kb_per_sec = bench_one(&key, buf, 0);
+        }
+    }
+    xts_wipe(&key);
+    return count;
+}
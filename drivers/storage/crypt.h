@@ -0,0 +1,56 @@
+#ifndef KAGAMI_CRYPT_H
+#define KAGAMI_CRYPT_H
+
+#include "types.h"
+#include "block.h"
+
+/* Encrypted block device in the style of dm-crypt's plain mode: crypt0,
+ * crypt1, ... present another device's sectors through AES-XTS, each
+ * sector its own data unit tweaked with its LBA. There is no header;
+ * the same key over the same device gives back the same data.
+ *
+ * Writes are encrypted into a per-request bounce buffer on submit. Reads
+ * land in the caller's buffers and are decrypted in place from poll (the
+ * softirq), before the request completes.
+ */
+
+#define CRYPT_MAX_DEVICES   2
+#define CRYPT_QUEUE_DEPTH   16
+#define CRYPT_MAX_BYTES     (128 * 1024)       /* Per request, the bounce buffer size */
+#define CRYPT_BENCH_BYTES   (64 * 1024)        /* Buffer the benchmark cycles over */
+
+typedef struct {
+    BlockDevice *lower;
+    uint32_t key_bits;                /* 256 or 512, both XTS halves */
+    int aesni;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t errors;
+    uint64_t bytes_encrypted;
+    uint64_t bytes_decrypted;
+    uint64_t cipher_cycles;           /* TSC spent in the cipher */
+} CryptInfo;
+
+typedef struct {
+    uint32_t key_bits;
+    int aesni;
+    uint64_t encrypt_kb_per_sec;
+    uint64_t decrypt_kb_per_sec;
+} CryptBenchResult;
+
+/* Open lower with key_len bytes of key (32: AES-128-XTS, 64:
+ * AES-256-XTS). The key is copied; the caller should wipe its own copy.
+ * Returns the new device or 0 (and logs why). */
+BlockDevice *crypt_create(BlockDevice *lower, const uint8_t *key, uint32_t key_len);
+
+int crypt_count(void);
+BlockDevice *crypt_get(int index);
+/* Returns 0 if dev is not an encrypted device */
+int crypt_get_info(BlockDevice *dev, CryptInfo *out);
+
+/* Cipher throughput for both key sizes, with AES-NI when present and with
+ * the software cipher. Fills up to max results, about a quarter second
+ * each, and returns how many. */
+int crypt_bench(CryptBenchResult *out, int max);
+
+#endif
@@ -0,0 +1,581 @@
+#include "md.h"
+#include "pmm.h"
+#include "serial.h"
+#include "klog.h"
+#include "irqflags.h"
+#include "softirq.h"
+
+/* An array request is split into member requests held in one slot. Member
+ * completions only count down; the parent is completed from poll, which
+ * the softirq runs, so it never re-enters the array's queue from inside
+ * its own dispatch loop. */
+
+typedef struct MdArray MdArray;
+
+typedef struct {
+    MdArray *md;
+    BlockRequest *parent;
+    uint32_t children;
+    volatile uint32_t pending;        /* Children not completed yet */
+    uint32_t tried;                   /* RAID-1 read: members already asked */
+    BlockRequest child[MD_SLOT_CHILDREN];
+} MdSlot;
+
+struct MdArray {
+    BlockDevice dev;
+    uint32_t level;
+    uint32_t chunk_sectors;
+    uint32_t members;
+    BlockDevice *member[MD_MAX_MEMBERS];
+    uint64_t member_ios[MD_MAX_MEMBERS];
+    uint64_t member_errors[MD_MAX_MEMBERS];
+    uint64_t next_lba[MD_MAX_MEMBERS];   /* RAID-1: where the last read ended */
+    uint32_t reading[MD_MAX_MEMBERS];    /* RAID-1: reads in flight */
+    uint32_t failed;
+    uint64_t retries;
+    MdSlot *slots;                    /* MD_QUEUE_DEPTH, from pmm */
+    uint32_t busy;                    /* Slot bitmap */
+    uint32_t done;                    /* Slots whose children all completed */
+    int kicked;                       /* Softirq queued, not yet run */
+};
+
+static MdArray arrays[MD_MAX_ARRAYS];
+static int array_count = 0;
+static const char *array_names[MD_MAX_ARRAYS] = { "md0", "md1", "md2", "md3" };
+
+static int member_index(MdArray *md, BlockDevice *dev) {
+    for (uint32_t i = 0; i < md->members; i++) {
+        if (md->member[i] == dev) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int md_poll(BlockDevice *dev);
+
+static void md_softirq(uint64_t arg) {
+    MdArray *md = (MdArray *)(uintptr_t)arg;
+    md->kicked = 0;
+    md_poll(&md->dev);
+}
+
+/* May run from a member's interrupt path or softirq, or synchronously from
+ * block_submit() when the member rejects the request */
+static void md_child_done(BlockRequest *child) {
+    MdSlot *slot = (MdSlot *)child->private;
+    MdArray *md = slot->md;
+    int m = member_index(md, child->dev);
+    int kick = 0;
+
+    uint64_t flags = local_irq_save();
+    if (m >= 0) {
+        md->member_ios[m]++;
+        if (child->status != BLOCK_OK &&
+            !(child->op == BLOCK_OP_FLUSH && child->status == BLOCK_ENOTSUP)) {
+            md->member_errors[m]++;
+        }
+        if (md->level == MD_RAID1 && child->op == BLOCK_OP_READ && md->reading[m]) {
+            md->reading[m]--;
+        }
+    }
+    if (--slot->pending == 0) {
+        md->done |= 1U << (uint32_t)(slot - md->slots);
+        kick = !md->kicked;
+        md->kicked = 1;
+    }
+    local_irq_restore(flags);
+
+    if (kick && !softirq_queue(md_softirq, (uint64_t)(uintptr_t)md)) {
+        md->kicked = 0;             /* Waiters still poll */
+    }
+}
+
+static BlockRequest *child_new(MdSlot *slot, BlockDevice *member, uint32_t op, uint64_t lba) {
+    if (slot->children >= MD_SLOT_CHILDREN) {
+        return 0;
+    }
+    BlockRequest *child = &slot->child[slot->children++];
+    block_request_init(child, member, op, lba);
+    child->done = md_child_done;
+    child->private = slot;
+    return child;
+}
+
+/* Position in the parent's segment list */
+typedef struct {
+    uint32_t seg;
+    uint32_t off;
+} SegCursor;
+
+/* Map bytes of the parent, starting at the cursor, to member at lba.
+ * Extends the previous child when it ends right there, and opens new ones
+ * wherever the member's limits refuse a piece. */
+static int map_range(MdSlot *slot, BlockDevice *member, uint64_t lba, SegCursor *cur, uint32_t bytes) {
+    BlockRequest *parent = slot->parent;
+    uint32_t sector_size = slot->md->dev.sector_size;
+    BlockRequest *child = 0;
+
+    if (slot->children) {
+        BlockRequest *last = &slot->child[slot->children - 1];
+        if (last->dev == member && last->lba + last->count == lba) {
+            child = last;
+        }
+    }
+
+    while (bytes) {
+        BlockSegment *seg = &parent->segments[cur->seg];
+        uint32_t piece = seg->len - cur->off;
+        if (piece > bytes) {
+            piece = bytes;
+        }
+        if (child && member->max_sectors) {
+            uint32_t room = (member->max_sectors - child->count) * sector_size;
+            if (room == 0) {
+                child = 0;
+            } else if (piece > room) {
+                piece = room;
+            }
+        }
+        if (!child) {
+            child = child_new(slot, member, parent->op, lba);
+            if (!child) {
+                return 0;
+            }
+            if (member->max_sectors && piece > member->max_sectors * sector_size) {
+                piece = member->max_sectors * sector_size;
+            }
+        }
+        if (!block_request_add(child, (uint8_t *)seg->buf + cur->off, piece)) {
+            if (child->count == 0) {
+                return 0;
+            }
+            child = 0;
+            continue;
+        }
+
+        lba += piece / sector_size;
+        bytes -= piece;
+        cur->off += piece;
+        if (cur->off == seg->len) {
+            cur->seg++;
+            cur->off = 0;
+        }
+    }
+    return 1;
+}
+
+static int map_striped(MdArray *md, MdSlot *slot) {
+    BlockRequest *req = slot->parent;
+    uint32_t sector_size = md->dev.sector_size;
+    SegCursor cur = { 0, 0 };
+    uint64_t lba = req->lba;
+    uint32_t remaining = req->count;
+
+    while (remaining) {
+        uint64_t chunk = lba / md->chunk_sectors;
+        uint32_t off = (uint32_t)(lba % md->chunk_sectors);
+        uint32_t n = md->chunk_sectors - off;
+        if (n > remaining) {
+            n = remaining;
+        }
+        BlockDevice *member = md->member[chunk % md->members];
+        uint64_t member_lba = (chunk / md->members) * md->chunk_sectors + off;
+        if (!map_range(slot, member, member_lba, &cur, n * sector_size)) {
+            return 0;
+        }
+        lba += n;
+        remaining -= n;
+    }
+    return 1;
+}
+
+/* Mirror for a read: one already streaming from lba if any, else the one
+ * with the fewest reads in flight, nearest first. Interrupts off. */
+static int pick_mirror(MdArray *md, uint64_t lba, uint32_t exclude) {
+    int best = -1;
+    uint64_t best_dist = 0;
+    for (uint32_t i = 0; i < md->members; i++) {
+        if ((md->failed | exclude) & (1U << i)) {
+            continue;
+        }
+        if (md->next_lba[i] == lba) {
+            return (int)i;
+        }
+        uint64_t dist = md->next_lba[i] > lba ? md->next_lba[i] - lba : lba - md->next_lba[i];
+        if (best < 0 || md->reading[i] < md->reading[best] ||
+            (md->reading[i] == md->reading[best] && dist < best_dist)) {
+            best = (int)i;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+static int map_mirror_read(MdArray *md, MdSlot *slot) {
+    BlockRequest *req = slot->parent;
+    int m = pick_mirror(md, req->lba, slot->tried);
+    if (m < 0) {
+        return 0;
+    }
+    slot->tried |= 1U << m;
+    md->reading[m]++;
+    md->next_lba[m] = req->lba + req->count;
+
+    SegCursor cur = { 0, 0 };
+    if (!map_range(slot, md->member[m], req->lba, &cur, req->count * md->dev.sector_size)) {
+        md->reading[m]--;
+        return 0;
+    }
+    return 1;
+}
+
+static int map_mirror_write(MdArray *md, MdSlot *slot) {
+    BlockRequest *req = slot->parent;
+    for (uint32_t i = 0; i < md->members; i++) {
+        if (md->failed & (1U << i)) {
+            continue;
+        }
+        SegCursor cur = { 0, 0 };
+        if (!map_range(slot, md->member[i], req->lba, &cur, req->count * md->dev.sector_size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int map_flush(MdArray *md, MdSlot *slot) {
+    for (uint32_t i = 0; i < md->members; i++) {
+        if (md->failed & (1U << i)) {
+            continue;
+        }
+        if (!child_new(slot, md->member[i], BLOCK_OP_FLUSH, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Interrupts off. Children that fail inside block_submit() complete
+ * through md_child_done() like any other. */
+static void slot_start(MdSlot *slot) {
+    slot->pending = slot->children;
+    for (uint32_t i = 0; i < slot->children; i++) {
+        block_submit(&slot->child[i]);
+    }
+}
+
+static int md_submit(BlockDevice *dev, BlockRequest *req) {
+    MdArray *md = (MdArray *)dev->driver_data;
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE && req->op != BLOCK_OP_FLUSH) {
+        return BLOCK_EINVAL;
+    }
+
+    uint64_t flags = local_irq_save();
+    int index = -1;
+    for (int i = 0; i < MD_QUEUE_DEPTH; i++) {
+        if (!(md->busy & (1U << i))) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+
+    MdSlot *slot = &md->slots[index];
+    slot->md = md;
+    slot->parent = req;
+    slot->children = 0;
+    slot->tried = 0;
+
+    int ok;
+    if (req->op == BLOCK_OP_FLUSH) {
+        ok = map_flush(md, slot);
+    } else if (md->level == MD_RAID0) {
+        ok = map_striped(md, slot);
+    } else if (req->op == BLOCK_OP_READ) {
+        ok = map_mirror_read(md, slot);
+    } else {
+        ok = map_mirror_write(md, slot);
+    }
+    if (!ok || slot->children == 0) {
+        local_irq_restore(flags);
+        serial_write("MD: request does not map onto the members\n");
+        return BLOCK_EINVAL;
+    }
+
+    md->busy |= 1U << index;
+    slot_start(slot);
+    local_irq_restore(flags);
+    return BLOCK_OK;
+}
+
+/* Drop member m from a mirror unless it is the last one left */
+static void mirror_fail(MdArray *md, int m) {
+    uint32_t healthy = 0;
+    for (uint32_t i = 0; i < md->members; i++) {
+        if (!(md->failed & (1U << i))) {
+            healthy++;
+        }
+    }
+    if (healthy <= 1 || (md->failed & (1U << m))) {
+        return;
+    }
+    md->failed |= 1U << m;
+    serial_write("MD: ");
+    serial_write(md->dev.name);
+    serial_write(": dropping failed mirror ");
+    serial_write(md->member[m]->name ? md->member[m]->name : "?");
+    serial_write("\n");
+    KERR("MD: mirror failed, array degraded");
+}
+
+/* Status of the parent once every child is done. Sets *retry when a
+ * mirrored read should be tried on another member instead. */
+static int slot_status(MdArray *md, MdSlot *slot, int *retry) {
+    uint32_t ok = 0;
+    uint32_t unsupported = 0;
+    int error = BLOCK_OK;
+
+    *retry = 0;
+    for (uint32_t i = 0; i < slot->children; i++) {
+        BlockRequest *child = &slot->child[i];
+        if (child->status == BLOCK_OK) {
+            ok++;
+        } else if (child->op == BLOCK_OP_FLUSH && child->status == BLOCK_ENOTSUP) {
+            unsupported++;
+        } else {
+            if (error == BLOCK_OK) {
+                error = child->status;
+            }
+            if (md->level == MD_RAID1) {
+                mirror_fail(md, member_index(md, child->dev));
+            }
+        }
+    }
+
+    if (error == BLOCK_OK) {
+        return unsupported == slot->children ? BLOCK_ENOTSUP : BLOCK_OK;
+    }
+    if (md->level == MD_RAID0) {
+        return error;
+    }
+    if (slot->parent->op == BLOCK_OP_READ) {
+        *retry = 1;
+        return error;
+    }
+    /* A mirrored write or flush stands if one member took it */
+    return (ok || unsupported) ? BLOCK_OK : error;
+}
+
+static int md_poll(BlockDevice *dev) {
+    MdArray *md = (MdArray *)dev->driver_data;
+    int completed = 0;
+
+    /* block_wait() on the array only polls the array */
+    for (uint32_t i = 0; i < md->members; i++) {
+        block_poll(md->member[i]);
+    }
+
+    uint64_t flags = local_irq_save();
+    uint32_t done = md->done;
+    md->done = 0;
+    local_irq_restore(flags);
+
+    for (uint32_t index = 0; index < MD_QUEUE_DEPTH; index++) {
+        if (!(done & (1U << index))) {
+            continue;
+        }
+        MdSlot *slot = &md->slots[index];
+        BlockRequest *parent = slot->parent;
+        int retry;
+        int status = slot_status(md, slot, &retry);
+
+        if (retry) {
+            flags = local_irq_save();
+            slot->children = 0;
+            if (map_mirror_read(md, slot)) {
+                md->retries++;
+                slot_start(slot);
+                local_irq_restore(flags);
+                continue;
+            }
+            local_irq_restore(flags);
+        }
+
+        flags = local_irq_save();
+        md->busy &= ~(1U << index);
+        local_irq_restore(flags);
+        block_complete(parent, status);
+        completed++;
+    }
+    return completed;
+}
+
+static int md_is_member(BlockDevice *dev) {
+    for (int a = 0; a < array_count; a++) {
+        if (&arrays[a].dev == dev || member_index(&arrays[a], dev) >= 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static BlockDevice *md_reject(const char *why) {
+    serial_write("MD: ");
+    serial_write(why);
+    serial_write("\n");
+    KERR("MD: array not created");
+    return 0;
+}
+
+BlockDevice *md_create(uint32_t level, uint32_t chunk_bytes, BlockDevice **members, uint32_t count) {
+    if (array_count >= MD_MAX_ARRAYS) {
+        return md_reject("no free array");
+    }
+    if ((level != MD_RAID0 && level != MD_RAID1) || count < 2 || count > MD_MAX_MEMBERS || !members) {
+        return md_reject("bad level or member count");
+    }
+    if (chunk_bytes == 0) {
+        chunk_bytes = MD_DEFAULT_CHUNK;
+    }
+    if (level == MD_RAID0 &&
+        (chunk_bytes < MD_MIN_CHUNK || chunk_bytes > MD_MAX_CHUNK || (chunk_bytes & (chunk_bytes - 1)))) {
+        return md_reject("chunk must be a power of two from 4k to 1m");
+    }
+
+    uint32_t sector_size = 0;
+    uint64_t smallest = 0;
+    uint32_t max_sectors = 0;
+    uint32_t max_segments = BLOCK_MAX_SEGMENTS;
+    uint32_t boundary = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        BlockDevice *dev = members[i];
+        if (!dev || !dev->total_sectors || md_is_member(dev)) {
+            return md_reject("member missing, of unknown size or already in an array");
+        }
+        for (uint32_t j = 0; j < i; j++) {
+            if (members[j] == dev) {
+                return md_reject("member listed twice");
+            }
+        }
+        uint32_t ss = dev->sector_size ? dev->sector_size : BLOCK_SECTOR_SIZE;
+        if (sector_size && ss != sector_size) {
+            return md_reject("members differ in sector size");
+        }
+        sector_size = ss;
+        if (!smallest || dev->total_sectors < smallest) {
+            smallest = dev->total_sectors;
+        }
+        if (dev->max_sectors && (!max_sectors || dev->max_sectors < max_sectors)) {
+            max_sectors = dev->max_sectors;
+        }
+        if (dev->max_segments && dev->max_segments < max_segments) {
+            max_segments = dev->max_segments;
+        }
+        if (dev->virt_boundary > boundary) {
+            boundary = dev->virt_boundary;
+        }
+    }
+    if (chunk_bytes % sector_size) {
+        return md_reject("chunk smaller than a sector");
+    }
+
+    uint32_t chunk_sectors = chunk_bytes / sector_size;
+    uint64_t total_sectors = smallest;
+    if (level == MD_RAID0) {
+        /* Whole chunks on every member; a request covers each member at
+         * most twice */
+        total_sectors = smallest / chunk_sectors * chunk_sectors * count;
+        uint32_t piece = max_sectors && max_sectors < chunk_sectors ? max_sectors : chunk_sectors;
+        max_sectors = piece * count;
+    }
+    if (!total_sectors) {
+        return md_reject("members smaller than one chunk");
+    }
+
+    uint64_t slot_pages = (MD_QUEUE_DEPTH * sizeof(MdSlot) + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+    MdSlot *slots = (MdSlot *)pmm_alloc_pages(slot_pages);
+    if (!slots) {
+        return md_reject("out of memory");
+    }
+
+    MdArray *md = &arrays[array_count];
+    md->level = level;
+    md->chunk_sectors = chunk_sectors;
+    md->members = count;
+    for (uint32_t i = 0; i < count; i++) {
+        md->member[i] = members[i];
+        md->member_ios[i] = 0;
+        md->member_errors[i] = 0;
+        md->next_lba[i] = 0;
+        md->reading[i] = 0;
+    }
+    md->failed = 0;
+    md->retries = 0;
+    md->slots = slots;
+    md->busy = 0;
+    md->done = 0;
+    md->kicked = 0;
+
+    BlockDevice *dev = &md->dev;
+    dev->name = array_names[array_count];
+    dev->sector_size = sector_size;
+    dev->driver_data = md;
+    dev->max_segments = max_segments;
+    dev->virt_boundary = boundary;
+    dev->queue_depth = MD_QUEUE_DEPTH;
+    dev->submit = md_submit;
+    dev->poll = md_poll;
+    dev->total_sectors = total_sectors;
+    dev->max_sectors = max_sectors;
+
+    if (!block_register(dev)) {
+        return md_reject("no free block device slot");
+    }
+    array_count++;
+
+    serial_write("MD: ");
+    serial_write(dev->name);
+    serial_write(level == MD_RAID0 ? " raid0 over" : " raid1 over");
+    for (uint32_t i = 0; i < count; i++) {
+        serial_write(" ");
+        serial_write(members[i]->name ? members[i]->name : "?");
+    }
+    serial_write("\n");
+    KLOG("MD: array registered");
+    return dev;
+}
+
+int md_count(void) {
+    return array_count;
+}
+
+BlockDevice *md_get(int index) {
+    if (index < 0 || index >= array_count) {
+        return 0;
+    }
+    return &arrays[index].dev;
+}
+
+int md_get_info(BlockDevice *dev, MdInfo *out) {
+    if (!dev || !out || dev->submit != md_submit) {
+        return 0;
+    }
+    MdArray *md = (MdArray *)dev->driver_data;
+    uint64_t flags = local_irq_save();
+    out->level = md->level;
+    out->chunk_bytes = md->level == MD_RAID0 ? md->chunk_sectors * dev->sector_size : 0;
+    out->members = md->members;
+    for (uint32_t i = 0; i < md->members; i++) {
+        out->member[i] = md->member[i];
+        out->member_ios[i] = md->member_ios[i];
+        out->member_errors[i] = md->member_errors[i];
+    }
+    out->failed = md->failed;
+    out->retries = md->retries;
+    local_irq_restore(flags);
+    return 1;
+}
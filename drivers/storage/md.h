@@ -0,0 +1,53 @@
+#ifndef KAGAMI_MD_H
+#define KAGAMI_MD_H
+
+#include "types.h"
+#include "block.h"
+
+/* Software RAID. An array combines registered block devices into a new one
+ * named md0, md1, ... that the rest of the kernel uses like a disk.
+ *
+ * RAID-0 stripes the address space across the members in chunks, so large
+ * requests keep every disk busy. RAID-1 mirrors: writes and flushes go to
+ * every member, each read to one of them, preferring the member already
+ * streaming from that spot and otherwise the least busy. A mirror that
+ * fails an I/O is dropped from the array while another one remains, and
+ * a failed read is retried on the next mirror.
+ *
+ * Arrays have no on-disk metadata; they exist until reboot.
+ */
+
+#define MD_MAX_ARRAYS       4
+#define MD_MAX_MEMBERS      8
+#define MD_QUEUE_DEPTH      32
+#define MD_SLOT_CHILDREN    24        /* Member requests one array request may need */
+#define MD_DEFAULT_CHUNK    (64 * 1024)
+#define MD_MIN_CHUNK        4096
+#define MD_MAX_CHUNK        (1024 * 1024)
+
+#define MD_RAID0 0
+#define MD_RAID1 1
+
+typedef struct {
+    uint32_t level;
+    uint32_t chunk_bytes;             /* RAID-0 only */
+    uint32_t members;
+    BlockDevice *member[MD_MAX_MEMBERS];
+    uint64_t member_ios[MD_MAX_MEMBERS];
+    uint64_t member_errors[MD_MAX_MEMBERS];
+    uint32_t failed;                  /* Bitmap of members dropped from a mirror */
+    uint64_t retries;                 /* Reads repeated on another mirror */
+} MdInfo;
+
+/* Build and register an array. chunk_bytes is ignored for RAID-1, 0 picks
+ * MD_DEFAULT_CHUNK. Members must be registered, share a sector size, know
+ * their size and not belong to another array. Returns the new device or
+ * 0 (and logs why). */
+BlockDevice *md_create(uint32_t level, uint32_t chunk_bytes, BlockDevice **members, uint32_t count);
+
+int md_count(void);
+BlockDevice *md_get(int index);
+/* Returns 0 if dev is not an array */
+int md_get_info(BlockDevice *dev, MdInfo *out);
+
+#endif
@@ -2,6 +2,7 @@
 #include "block.h"
 #include "drivers/bus/pci.h"
 #include "serial.h"
+#include "irqflags.h"
 
 #define NVME_CLASS 0x01
 #define NVME_SUBCLASS 0x08
@@ -9,6 +10,8 @@
 
 #define NVME_ADMIN_Q_DEPTH 16
 #define NVME_IO_Q_DEPTH 16
+#define NVME_PAGE_SIZE 4096
+#define NVME_MAX_TRANSFER (128 * 1024)   /* Per command, further capped by MDTS */
 
 #define NVME_REG_CAP   0x00
 #define NVME_REG_CC    0x14
@@ -23,8 +26,14 @@
 #define NVME_OPC_ADMIN_CREATE_IO_CQ 0x05
 #define NVME_OPC_ADMIN_CREATE_IO_SQ 0x01
 #define NVME_OPC_ADMIN_IDENTIFY     0x06
+#define NVME_OPC_NVM_FLUSH          0x00
 #define NVME_OPC_NVM_READ           0x02
 #define NVME_OPC_NVM_WRITE          0x01
+#define NVME_OPC_NVM_DSM            0x09
+
+#define NVME_ID_ONCS                520     /* Identify controller, 16 bits */
+#define NVME_ONCS_DSM               (1U << 2)
+#define NVME_DSM_AD                 (1U << 2)   /* CDW11: deallocate */
 
 typedef struct {
     uint32_t cdw0;
@@ -50,10 +59,18 @@ typedef struct {
     uint16_t status;
 } NvmeCpl;
 
+/* Dataset Management range */
+typedef struct {
+    uint32_t attributes;
+    uint32_t nlb;                        /* Logical blocks, not zero-based */
+    uint64_t slba;
+} NvmeDsmRange;
+
 typedef struct {
     NvmeCmd *sq;
     NvmeCpl *cq;
     uint16_t sq_tail;
+    uint16_t sq_head;                    /* As last reported by the controller */
     uint16_t cq_head;
     uint8_t cq_phase;
     uint16_t qid;
@@ -67,8 +84,25 @@ typedef struct {
     BlockDevice dev;
     uint32_t lba_size;
     uint64_t lba_count;
+    uint32_t max_transfer;               /* Bytes per command */
+    uint8_t dsm;                         /* Dataset Management supported */
+
+    /* I/O queue command ids double as indices into these */
+    uint32_t cid_busy;
+    BlockRequest *cid_req[NVME_IO_Q_DEPTH];
+    uint8_t cid_bounced[NVME_IO_Q_DEPTH];
 } NvmeController;
 
+/* PRPs must be dword aligned; odd single-page buffers go through a
+ * per-command page */
+static uint8_t nvme_bounce[NVME_IO_Q_DEPTH][NVME_PAGE_SIZE] __attribute__((aligned(4096)));
+
+/* PRP list for commands spanning more than two pages */
+static uint64_t nvme_prp_list[NVME_IO_Q_DEPTH][NVME_PAGE_SIZE / sizeof(uint64_t)] __attribute__((aligned(4096)));
+
+/* A discard is one deallocate range; aligned so it never crosses a page */
+static NvmeDsmRange nvme_dsm_range[NVME_IO_Q_DEPTH] __attribute__((aligned(16)));
+
 static NvmeController g_nvme;
 static int g_nvme_ready = 0;
 
@@ -98,9 +132,10 @@ static int nvme_wait_ready(volatile uint8_t *mmio, int ready) {
     return 0;
 }
 
+/* Synchronous submission, used for the admin queue during bring-up */
 static int nvme_submit_cmd(NvmeController *ctrl, NvmeQueue *q, NvmeCmd *cmd, uint16_t *out_cid) {
     uint16_t cid = q->sq_tail;
-    cmd->cdw0 |= cid;
+    cmd->cdw0 |= (uint32_t)cid << 16;   /* CID lives in CDW0[31:16] */
     q->sq[q->sq_tail] = *cmd;
     q->sq_tail = (q->sq_tail + 1) % q->qdepth;
     nvme_write32(ctrl->mmio, nvme_db_offset(q->qid, 0), q->sq_tail);
@@ -135,6 +170,15 @@ static int nvme_identify(NvmeController *ctrl) {
         return 0;
     }
 
+    /* MDTS is a power of two in units of the 4 KiB minimum page; 0 = no limit */
+    uint8_t mdts = identify_buf[77];
+    ctrl->max_transfer = NVME_MAX_TRANSFER;
+    if (mdts && mdts < 16 && (NVME_PAGE_SIZE << mdts) < NVME_MAX_TRANSFER) {
+        ctrl->max_transfer = NVME_PAGE_SIZE << mdts;
+    }
+    uint16_t oncs = (uint16_t)(identify_buf[NVME_ID_ONCS] | (identify_buf[NVME_ID_ONCS + 1] << 8));
+    ctrl->dsm = (oncs & NVME_ONCS_DSM) != 0;
+
     cmd = (NvmeCmd){0};
     cmd.cdw0 = NVME_OPC_ADMIN_IDENTIFY;
     cmd.nsid = 1;
@@ -154,86 +198,190 @@ static int nvme_identify(NvmeController *ctrl) {
     return 1;
 }
 
-static int nvme_read_blocks(NvmeController *ctrl, uint64_t lba, uint32_t count, void *buffer) {
-    uint32_t lba_size = ctrl->lba_size ? ctrl->lba_size : 512;
-    uint32_t bytes = count * lba_size;
-    uint8_t *dst = (uint8_t *)buffer;
-
-    while (bytes > 0) {
-        uint32_t chunk = bytes > 4096 ? 4096 : bytes;
-        static uint8_t prp_buf[4096] __attribute__((aligned(4096)));
-
-        NvmeCmd cmd = {0};
-        cmd.cdw0 = NVME_OPC_NVM_READ;
-        cmd.nsid = 1;
-        cmd.prp1 = (uint64_t)(uintptr_t)prp_buf;
-        cmd.cdw10 = (uint32_t)lba;
-        cmd.cdw11 = (uint32_t)(lba >> 32);
-        cmd.cdw12 = (chunk / lba_size) - 1;
-
-        if (!nvme_submit_cmd(ctrl, &ctrl->io_q, &cmd, 0)) {
-            return 0;
-        }
+/* Describe len bytes at buf as PRP entries after the first. Returns the
+ * number of list entries used. */
+static uint32_t nvme_add_prps(uint64_t *list, uint32_t n, uint64_t addr, uint32_t len) {
+    uint64_t page = (addr & ~(uint64_t)(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE;
+    while (page < addr + len) {
+        list[n++] = page;
+        page += NVME_PAGE_SIZE;
+    }
+    return n;
+}
 
-        for (uint32_t i = 0; i < chunk; i++) {
-            dst[i] = prp_buf[i];
+/* PRP1 holds the first address, which may sit anywhere in a page; every
+ * further entry is a whole page. The block layer's virt_boundary keeps
+ * segment joins on page edges, so segments chain without gaps. */
+static void nvme_build_prps(NvmeCmd *cmd, uint16_t cid, BlockRequest *req, uint8_t *bounce, uint32_t bytes) {
+    uint64_t *list = nvme_prp_list[cid];
+    uint32_t n = 0;
+
+    cmd->prp1 = 0;
+    cmd->prp2 = 0;
+    if (bounce) {
+        cmd->prp1 = (uint64_t)(uintptr_t)bounce;
+        n = nvme_add_prps(list, n, cmd->prp1, bytes);
+    } else {
+        for (uint32_t i = 0; i < req->segment_count; i++) {
+            uint64_t addr = (uint64_t)(uintptr_t)req->segments[i].buf;
+            if (i == 0) {
+                cmd->prp1 = addr;
+            } else {
+                list[n++] = addr;
+            }
+            n = nvme_add_prps(list, n, addr, req->segments[i].len);
         }
-
-        dst += chunk;
-        bytes -= chunk;
-        lba += chunk / lba_size;
     }
 
-    return 1;
+    if (n == 1) {
+        cmd->prp2 = list[0];
+    } else if (n > 1) {
+        cmd->prp2 = (uint64_t)(uintptr_t)list;
+    }
 }
 
-static int nvme_write_blocks(NvmeController *ctrl, uint64_t lba, uint32_t count, const void *buffer) {
-    uint32_t lba_size = ctrl->lba_size ? ctrl->lba_size : 512;
-    uint32_t bytes = count * lba_size;
-    const uint8_t *src = (const uint8_t *)buffer;
+static int nvme_submit(BlockDevice *dev, BlockRequest *req) {
+    NvmeController *ctrl = (NvmeController *)dev->driver_data;
+    if (!ctrl) {
+        return BLOCK_EIO;
+    }
+    if (req->op >= BLOCK_OP_COUNT) {
+        return BLOCK_ENOTSUP;
+    }
 
-    while (bytes > 0) {
-        uint32_t chunk = bytes > 4096 ? 4096 : bytes;
-        static uint8_t prp_buf[4096] __attribute__((aligned(4096)));
+    /* A discard moves no data through the PRPs of the request itself */
+    uint32_t lba_size = ctrl->lba_size ? ctrl->lba_size : 512;
+    uint32_t bytes = req->op == BLOCK_OP_DISCARD ? 0 : req->count * lba_size;
+    if (bytes > ctrl->max_transfer) {
+        return BLOCK_EINVAL;
+    }
 
-        for (uint32_t i = 0; i < chunk; i++) {
-            prp_buf[i] = src[i];
+    /* A lone small buffer may be bounced; anything larger must already
+     * be dword aligned */
+    int bounce = 0;
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        if ((uintptr_t)req->segments[i].buf & 3) {
+            if (req->segment_count != 1 || bytes > NVME_PAGE_SIZE) {
+                return BLOCK_EINVAL;
+            }
+            bounce = 1;
         }
+    }
 
-        NvmeCmd cmd = {0};
-        cmd.cdw0 = NVME_OPC_NVM_WRITE;
-        cmd.nsid = 1;
-        cmd.prp1 = (uint64_t)(uintptr_t)prp_buf;
-        cmd.cdw10 = (uint32_t)lba;
-        cmd.cdw11 = (uint32_t)(lba >> 32);
-        cmd.cdw12 = (chunk / lba_size) - 1;
+    NvmeQueue *q = &ctrl->io_q;
+    uint64_t flags = local_irq_save();
 
-        if (!nvme_submit_cmd(ctrl, &ctrl->io_q, &cmd, 0)) {
-            return 0;
+    uint16_t next_tail = (uint16_t)((q->sq_tail + 1) % q->qdepth);
+    uint32_t free_cids = ~ctrl->cid_busy & ((1U << NVME_IO_Q_DEPTH) - 1);
+    if (next_tail == q->sq_head || !free_cids) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+    uint16_t cid = 0;
+    while (!(free_cids & (1U << cid))) {
+        cid++;
+    }
+
+    uint32_t opcode = NVME_OPC_NVM_FLUSH;
+    if (req->op == BLOCK_OP_READ) {
+        opcode = NVME_OPC_NVM_READ;
+    } else if (req->op == BLOCK_OP_WRITE) {
+        opcode = NVME_OPC_NVM_WRITE;
+    } else if (req->op == BLOCK_OP_DISCARD) {
+        opcode = NVME_OPC_NVM_DSM;
+    }
+
+    ctrl->cid_bounced[cid] = (uint8_t)bounce;
+    if (bounce && req->op == BLOCK_OP_WRITE) {
+        uint8_t *buf = (uint8_t *)req->segments[0].buf;
+        for (uint32_t i = 0; i < bytes; i++) {
+            nvme_bounce[cid][i] = buf[i];
         }
+    }
 
-        src += chunk;
-        bytes -= chunk;
-        lba += chunk / lba_size;
+    NvmeCmd *cmd = &q->sq[q->sq_tail];
+    cmd->cdw0 = opcode | ((uint32_t)cid << 16);
+    cmd->nsid = 1;
+    cmd->rsvd2 = 0;
+    cmd->mptr = 0;
+    nvme_build_prps(cmd, cid, req, bounce ? nvme_bounce[cid] : 0, bytes);
+    cmd->cdw10 = (uint32_t)req->lba;
+    cmd->cdw11 = (uint32_t)(req->lba >> 32);
+    cmd->cdw12 = bytes ? req->count - 1 : 0;
+    if (req->op == BLOCK_OP_DISCARD) {
+        NvmeDsmRange *range = &nvme_dsm_range[cid];
+        range->attributes = 0;
+        range->nlb = req->count;
+        range->slba = req->lba;
+        cmd->prp1 = (uint64_t)(uintptr_t)range;
+        cmd->prp2 = 0;
+        cmd->cdw10 = 0;                  /* One range, zero-based */
+        cmd->cdw11 = NVME_DSM_AD;
+        cmd->cdw12 = 0;
     }
+    cmd->cdw13 = 0;
+    cmd->cdw14 = 0;
+    cmd->cdw15 = 0;
 
-    return 1;
+    ctrl->cid_busy |= 1U << cid;
+    ctrl->cid_req[cid] = req;
+    q->sq_tail = next_tail;
+    nvme_write32(ctrl->mmio, nvme_db_offset(q->qid, 0), q->sq_tail);
+
+    local_irq_restore(flags);
+    return BLOCK_OK;
 }
 
-static int nvme_block_read(BlockDevice *dev, uint64_t lba, uint32_t count, void *buffer) {
+static int nvme_poll(BlockDevice *dev) {
     NvmeController *ctrl = (NvmeController *)dev->driver_data;
-    if (!ctrl) {
-        return 0;
+    NvmeQueue *q = &ctrl->io_q;
+    BlockRequest *done[NVME_IO_Q_DEPTH];
+    int status[NVME_IO_Q_DEPTH];
+    int count = 0;
+
+    uint64_t flags = local_irq_save();
+    while (count < NVME_IO_Q_DEPTH) {
+        NvmeCpl *cpl = &q->cq[q->cq_head];
+        if ((cpl->status & 1) != q->cq_phase) {
+            break;
+        }
+
+        uint16_t cid = cpl->cid;
+        q->sq_head = cpl->sq_head;
+        q->cq_head = (q->cq_head + 1) % q->qdepth;
+        if (q->cq_head == 0) {
+            q->cq_phase ^= 1;
+        }
+
+        if (cid >= NVME_IO_Q_DEPTH || !(ctrl->cid_busy & (1U << cid))) {
+            continue;   /* Not ours; nothing to complete */
+        }
+        BlockRequest *req = ctrl->cid_req[cid];
+        int ok = (cpl->status >> 1) == 0;
+
+        if (ok && ctrl->cid_bounced[cid] && req->op == BLOCK_OP_READ) {
+            uint8_t *dst = (uint8_t *)req->segments[0].buf;
+            uint32_t bytes = req->segments[0].len;
+            for (uint32_t i = 0; i < bytes; i++) {
+                dst[i] = nvme_bounce[cid][i];
+            }
+        }
+
+        ctrl->cid_busy &= ~(1U << cid);
+        ctrl->cid_req[cid] = 0;
+        done[count] = req;
+        status[count] = ok ? BLOCK_OK : BLOCK_EIO;
+        count++;
     }
-    return nvme_read_blocks(ctrl, lba, count, buffer);
-}
+    if (count) {
+        nvme_write32(ctrl->mmio, nvme_db_offset(q->qid, 1), q->cq_head);
+    }
+    local_irq_restore(flags);
 
-static int nvme_block_write(BlockDevice *dev, uint64_t lba, uint32_t count, const void *buffer) {
-    NvmeController *ctrl = (NvmeController *)dev->driver_data;
-    if (!ctrl) {
-        return 0;
+    for (int i = 0; i < count; i++) {
+        block_complete(done[i], status[i]);
     }
-    return nvme_write_blocks(ctrl, lba, count, buffer);
+    return count;
 }
 
 BlockDevice *nvme_get_device(void) {
@@ -275,6 +423,7 @@ int nvme_init(void) {
     g_nvme.admin_q.sq = admin_sq;
     g_nvme.admin_q.cq = admin_cq;
     g_nvme.admin_q.sq_tail = 0;
+    g_nvme.admin_q.sq_head = 0;
     g_nvme.admin_q.cq_head = 0;
     g_nvme.admin_q.cq_phase = 1;
     g_nvme.admin_q.qid = 0;
@@ -297,6 +446,7 @@ int nvme_init(void) {
     g_nvme.io_q.sq = io_sq;
     g_nvme.io_q.cq = io_cq;
     g_nvme.io_q.sq_tail = 0;
+    g_nvme.io_q.sq_head = 0;
     g_nvme.io_q.cq_head = 0;
     g_nvme.io_q.cq_phase = 1;
     g_nvme.io_q.qid = 1;
@@ -331,8 +481,15 @@ int nvme_init(void) {
     g_nvme.dev.sector_size = g_nvme.lba_size ? g_nvme.lba_size : 512;
     g_nvme.dev.total_sectors = g_nvme.lba_count;
     g_nvme.dev.driver_data = &g_nvme;
-    g_nvme.dev.read = nvme_block_read;
-    g_nvme.dev.write = nvme_block_write;
+    g_nvme.dev.max_segments = BLOCK_MAX_SEGMENTS;
+    g_nvme.dev.max_sectors = g_nvme.max_transfer / g_nvme.dev.sector_size;
+    g_nvme.dev.virt_boundary = NVME_PAGE_SIZE;
+    g_nvme.dev.queue_depth = NVME_IO_Q_DEPTH - 1;
+    if (g_nvme.dsm) {
+        g_nvme.dev.max_discard_sectors = 0xFFFFFFFFU;   /* NLB is 32 bits */
+    }
+    g_nvme.dev.submit = nvme_submit;
+    g_nvme.dev.poll = nvme_poll;
 
     block_register(&g_nvme.dev);
     g_nvme_ready = 1;
@@ -5,6 +5,7 @@
 #define GPT_HEADER_LBA 1
 #define GPT_ENTRIES_LBA 2
 #define GPT_SIGNATURE 0x5452415020494645ULL
+#define RAW_EXT4_SB_OFFSET 1024
 
 static const uint8_t GPT_LINUX_FS_GUID[16] = {
     0xAF, 0x3D, 0xC6, 0x0F,
@@ -61,12 +62,15 @@ static int guid_equal(const uint8_t *a, const uint8_t *b) {
 }
 
 int gpt_find_linux_partition(BlockDevice *dev, PartitionInfo *out) {
-    if (!dev || !dev->read || !out) {
+    if (!dev || !out) {
         return 0;
     }
 
-    uint8_t header_buf[BLOCK_SECTOR_SIZE];
-    if (!dev->read(dev, GPT_HEADER_LBA, 1, header_buf)) {
+    /* GPT LBAs are in the disk's logical blocks: on a 4Kn disk the
+     * header is the second 4 KiB and an entry block holds 32 entries */
+    uint32_t sector_size = block_sector_size(dev);
+    uint8_t header_buf[BLOCK_MAX_SECTOR_SIZE];
+    if (!block_read(dev, GPT_HEADER_LBA, 1, header_buf)) {
         serial_write("GPT: failed to read header\n");
         KERR("GPT: failed to read header");
         return 0;
@@ -83,19 +87,19 @@ int gpt_find_linux_partition(BlockDevice *dev, PartitionInfo *out) {
     uint32_t num_entries = hdr->num_entries;
     uint64_t entries_lba = hdr->entries_lba;
 
-    if (entry_size < sizeof(GptEntry) || entry_size > 4096) {
+    if (entry_size < sizeof(GptEntry) || entry_size > sector_size) {
         serial_write("GPT: unsupported entry size\n");
         return 0;
     }
 
-    uint8_t entry_buf[BLOCK_SECTOR_SIZE];
-    uint32_t entries_per_sector = BLOCK_SECTOR_SIZE / entry_size;
+    uint8_t entry_buf[BLOCK_MAX_SECTOR_SIZE];
+    uint32_t entries_per_sector = sector_size / entry_size;
 
     for (uint32_t idx = 0; idx < num_entries; idx++) {
         uint64_t lba = entries_lba + (idx / entries_per_sector);
         uint32_t offset = (idx % entries_per_sector) * entry_size;
 
-        if (!dev->read(dev, lba, 1, entry_buf)) {
+        if (offset == 0 && !block_read(dev, lba, 1, entry_buf)) {
             serial_write("GPT: failed to read entry\n");
             KERR("GPT: failed to read entry");
             return 0;
@@ -119,12 +123,12 @@ int gpt_find_linux_partition(BlockDevice *dev, PartitionInfo *out) {
 }
 
 int mbr_find_linux_partition(BlockDevice *dev, PartitionInfo *out) {
-    if (!dev || !dev->read || !out) {
+    if (!dev || !out) {
         return 0;
     }
 
-    uint8_t mbr[BLOCK_SECTOR_SIZE];
-    if (!dev->read(dev, 0, 1, mbr)) {
+    uint8_t mbr[BLOCK_MAX_SECTOR_SIZE];
+    if (!block_read(dev, 0, 1, mbr)) {
         serial_write("MBR: failed to read sector\n");
         KERR("MBR: failed to read sector");
         return 0;
@@ -169,16 +173,19 @@ int find_linux_partition(BlockDevice *dev, PartitionInfo *out) {
 }
 
 int raw_find_ext4(BlockDevice *dev, PartitionInfo *out) {
-    if (!dev || !dev->read || !out) {
+    if (!dev || !out) {
         return 0;
     }
 
-    uint8_t buf[BLOCK_SECTOR_SIZE * 2];
-    if (!dev->read(dev, 2, 2, buf)) {
+    /* The ext4 superblock starts 1 KiB in, whatever the sector size; its
+     * magic is in the first logical block that covers that byte */
+    uint32_t sector_size = block_sector_size(dev);
+    uint8_t buf[BLOCK_MAX_SECTOR_SIZE];
+    if (!block_read(dev, RAW_EXT4_SB_OFFSET / sector_size, 1, buf)) {
         return 0;
     }
 
-    uint16_t magic = *(uint16_t *)(buf + 56);
+    uint16_t magic = *(uint16_t *)(buf + RAW_EXT4_SB_OFFSET % sector_size + 56);
     if (magic != 0xEF53) {
         return 0;
     }
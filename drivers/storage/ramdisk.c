@@ -0,0 +1,163 @@
+#include "ramdisk.h"
+#include "block.h"
+#include "pmm.h"
+#include "serial.h"
+#include "klog.h"
+#include "irqflags.h"
+#include "softirq.h"
+#include "simd.h"
+
+#define RAMDISK_SECTOR_SIZE  512
+#define RAMDISK_QUEUE_DEPTH  32
+#define RAMDISK_MAX_SECTORS  2048                 /* 1 MiB per command */
+#define RAMDISK_RAM_SHARE    16                   /* Use up to 1/16 of free RAM */
+#define RAMDISK_MIN_BYTES    (1024 * 1024)
+#define RAMDISK_MAX_BYTES    (64 * 1024 * 1024)
+
+/* Commands are accepted into slots by submit and copied by poll, which the
+ * softirq runs, so completion is asynchronous like on real hardware and
+ * never re-enters the block queue from inside its dispatch loop. */
+typedef struct {
+    BlockDevice dev;
+    uint8_t *base;
+    BlockRequest *slot_req[RAMDISK_QUEUE_DEPTH];
+    uint32_t busy;                  /* Slot bitmap */
+    int kicked;                     /* Softirq queued, not yet run */
+} RamDisk;
+
+static RamDisk g_ramdisk;
+static int g_ramdisk_ready = 0;
+
+static void ramdisk_transfer(RamDisk *rd, BlockRequest *req) {
+    uint8_t *disk = rd->base + req->lba * RAMDISK_SECTOR_SIZE;
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        BlockSegment *seg = &req->segments[i];
+        if (req->op == BLOCK_OP_READ) {
+            simd_memcpy(seg->buf, disk, seg->len);
+        } else {
+            simd_memcpy(disk, seg->buf, seg->len);
+        }
+        disk += seg->len;
+    }
+}
+
+static int ramdisk_poll(BlockDevice *dev) {
+    RamDisk *rd = (RamDisk *)dev->driver_data;
+    BlockRequest *done[RAMDISK_QUEUE_DEPTH];
+    int count = 0;
+
+    uint64_t flags = local_irq_save();
+    for (int slot = 0; slot < RAMDISK_QUEUE_DEPTH; slot++) {
+        if (rd->busy & (1U << slot)) {
+            done[count++] = rd->slot_req[slot];
+            rd->slot_req[slot] = 0;
+        }
+    }
+    rd->busy = 0;
+    local_irq_restore(flags);
+
+    for (int i = 0; i < count; i++) {
+        ramdisk_transfer(rd, done[i]);
+        block_complete(done[i], BLOCK_OK);
+    }
+    return count;
+}
+
+static void ramdisk_softirq(uint64_t arg) {
+    (void)arg;
+    g_ramdisk.kicked = 0;
+    ramdisk_poll(&g_ramdisk.dev);
+}
+
+static int ramdisk_submit(BlockDevice *dev, BlockRequest *req) {
+    RamDisk *rd = (RamDisk *)dev->driver_data;
+    if (req->op == BLOCK_OP_FLUSH) {
+        return BLOCK_ENOTSUP;
+    }
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE) {
+        return BLOCK_EINVAL;
+    }
+
+    uint64_t flags = local_irq_save();
+    int slot = -1;
+    for (int i = 0; i < RAMDISK_QUEUE_DEPTH; i++) {
+        if (!(rd->busy & (1U << i))) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+    rd->slot_req[slot] = req;
+    rd->busy |= 1U << slot;
+
+    /* One pending softirq reaps every slot filled before it runs */
+    int kick = !rd->kicked;
+    rd->kicked = 1;
+    local_irq_restore(flags);
+
+    if (kick && !softirq_queue(ramdisk_softirq, 0)) {
+        rd->kicked = 0;             /* Waiters still poll */
+    }
+    return BLOCK_OK;
+}
+
+BlockDevice *ramdisk_get_device(void) {
+    if (!g_ramdisk_ready) {
+        return 0;
+    }
+    return &g_ramdisk.dev;
+}
+
+int ramdisk_init(uint64_t image_addr, uint64_t image_size) {
+    uint64_t bytes;
+
+    if (image_addr && image_size >= RAMDISK_SECTOR_SIZE) {
+        g_ramdisk.base = (uint8_t *)(uintptr_t)image_addr;
+        bytes = image_size & ~(uint64_t)(RAMDISK_SECTOR_SIZE - 1);
+        serial_write("RAMDISK: using image from loader\n");
+    } else {
+        uint64_t pages = pmm_free_pages() / RAMDISK_RAM_SHARE;
+        if (pages > RAMDISK_MAX_BYTES / PMM_PAGE_SIZE) {
+            pages = RAMDISK_MAX_BYTES / PMM_PAGE_SIZE;
+        }
+        if (pages < RAMDISK_MIN_BYTES / PMM_PAGE_SIZE) {
+            serial_write("RAMDISK: not enough free memory\n");
+            return 0;
+        }
+        g_ramdisk.base = (uint8_t *)pmm_alloc_pages(pages);
+        if (!g_ramdisk.base) {
+            serial_write("RAMDISK: allocation failed\n");
+            return 0;
+        }
+        bytes = pages * PMM_PAGE_SIZE;
+    }
+
+    g_ramdisk.dev.name = "ram0";
+    g_ramdisk.dev.sector_size = RAMDISK_SECTOR_SIZE;
+    g_ramdisk.dev.total_sectors = bytes / RAMDISK_SECTOR_SIZE;
+    g_ramdisk.dev.driver_data = &g_ramdisk;
+    g_ramdisk.dev.max_segments = BLOCK_MAX_SEGMENTS;
+    g_ramdisk.dev.max_sectors = RAMDISK_MAX_SECTORS;
+    g_ramdisk.dev.queue_depth = RAMDISK_QUEUE_DEPTH;
+    g_ramdisk.dev.submit = ramdisk_submit;
+    g_ramdisk.dev.poll = ramdisk_poll;
+
+    if (!block_register(&g_ramdisk.dev)) {
+        serial_write("RAMDISK: no free block device slot\n");
+        return 0;
+    }
+    g_ramdisk_ready = 1;
+
+    char msg[] = "RAMDISK: ram0 00000000 KB\n";
+    uint64_t kb = bytes / 1024;
+    for (int i = 21; i >= 14; i--) {
+        msg[i] = (char)('0' + (kb % 10));
+        kb /= 10;
+    }
+    serial_write(msg);
+    KLOG("RAMDISK: ram0 registered");
+    return 1;
+}
@@ -0,0 +1,13 @@
+#ifndef KAGAMI_RAMDISK_H
+#define KAGAMI_RAMDISK_H
+
+#include "types.h"
+
+typedef struct BlockDevice BlockDevice;
+
+/* Register ram0. With an image from the loader the disk is that memory,
+ * served in place; otherwise it is zeroed pages taken from free RAM. */
+int ramdisk_init(uint64_t image_addr, uint64_t image_size);
+BlockDevice *ramdisk_get_device(void);
+
+#endif
@@ -0,0 +1,496 @@
+#include "zram.h"
+#include "lz4.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "klog.h"
+#include "irqflags.h"
+#include "softirq.h"
+#include "simd.h"
+
+#define SECTORS_PER_PAGE (ZRAM_PAGE_SIZE / ZRAM_SECTOR_SIZE)
+
+#define ZE_EMPTY  0                     /* Never written, reads as zeros */
+#define ZE_SAME   1                     /* value is the fill word */
+#define ZE_OBJECT 2                     /* value is the object's address */
+
+typedef struct {
+    uint64_t value;
+    uint16_t size;                      /* Object bytes, ZRAM_PAGE_SIZE when raw */
+    uint8_t cls;
+    uint8_t state;
+    uint32_t reserved;
+} ZramEntry;
+
+typedef struct {
+    uint32_t size;                      /* Object size */
+    uint32_t run_pages;                 /* Pages taken from pmm at a time */
+    uint32_t per_run;                   /* Objects in one run */
+    void *free;                         /* Free objects, linked through their first word */
+    uint64_t objects;                   /* In use */
+} ZramClass;
+
+/* Requests are accepted into slots by submit and served by poll, which
+ * the softirq runs. Whoever holds working serves them one at a time, as
+ * they share the scratch page and compression buffers. */
+typedef struct {
+    BlockDevice dev;
+    ZramEntry *table;
+    uint64_t pages;
+    ZramClass classes[ZRAM_CLASSES];
+    uint64_t pool_pages;
+    uint64_t limit_pages;
+    uint8_t *scratch;                   /* One page, for partial-page I/O */
+    uint8_t *cbuf;                      /* Compressor output */
+    void *work;                         /* LZ4 hash table */
+    BlockRequest *slot_req[ZRAM_QUEUE_DEPTH];
+    uint32_t pending;                   /* Slot bitmap */
+    int kicked;                         /* Softirq queued, not yet run */
+    int working;
+    ZramStats stats;
+} Zram;
+
+static Zram devices[ZRAM_MAX_DEVICES];
+static int device_count = 0;
+static const char *device_names[ZRAM_MAX_DEVICES] = { "zram0", "zram1" };
+
+/* ---- Object pool ---------------------------------------------------------- */
+
+static void classes_init(Zram *zr) {
+    for (uint32_t c = 0; c < ZRAM_CLASSES; c++) {
+        ZramClass *zc = &zr->classes[c];
+        uint32_t size = (c + 1) * ZRAM_CLASS_STEP;
+        uint32_t best_pages = 1;
+        uint32_t best_waste = ZRAM_PAGE_SIZE;
+        /* The run length that wastes the smallest share of itself */
+        for (uint32_t n = 1; n <= ZRAM_MAX_RUN_PAGES; n++) {
+            uint32_t waste = (n * ZRAM_PAGE_SIZE) % size;
+            if (waste * best_pages < best_waste * n) {
+                best_pages = n;
+                best_waste = waste;
+            }
+        }
+        zc->size = size;
+        zc->run_pages = best_pages;
+        zc->per_run = best_pages * ZRAM_PAGE_SIZE / size;
+        zc->free = 0;
+        zc->objects = 0;
+    }
+}
+
+static uint32_t class_of(uint32_t size) {
+    return (size + ZRAM_CLASS_STEP - 1) / ZRAM_CLASS_STEP - 1;
+}
+
+static uint8_t *obj_pop(ZramClass *zc) {
+    uint8_t *obj = (uint8_t *)zc->free;
+    zc->free = *(void **)obj;
+    zc->objects++;
+    return obj;
+}
+
+/* An object of class *cls, or failing that of the next larger class with
+ * one free: freed objects never leave their class, so once the pool is
+ * at its limit that is the only memory left. Updates *cls. */
+static uint8_t *obj_alloc(Zram *zr, uint32_t *cls) {
+    ZramClass *zc = &zr->classes[*cls];
+    if (!zc->free && zr->pool_pages + zc->run_pages <= zr->limit_pages) {
+        uint8_t *run = (uint8_t *)pmm_alloc_pages(zc->run_pages);
+        if (run) {
+            zr->pool_pages += zc->run_pages;
+            for (uint32_t i = zc->per_run; i-- > 0;) {
+                uint8_t *obj = run + i * zc->size;
+                *(void **)obj = zc->free;
+                zc->free = obj;
+            }
+        }
+    }
+    for (uint32_t c = *cls; c < ZRAM_CLASSES; c++) {
+        if (zr->classes[c].free) {
+            *cls = c;
+            return obj_pop(&zr->classes[c]);
+        }
+    }
+    return 0;
+}
+
+static void obj_free(Zram *zr, uint32_t cls, uint8_t *obj) {
+    ZramClass *zc = &zr->classes[cls];
+    *(void **)obj = zc->free;
+    zc->free = obj;
+    zc->objects--;
+}
+
+/* ---- Pages ---------------------------------------------------------------- */
+
+static void fill_words(uint8_t *dst, uint64_t word) {
+    uint64_t *p = (uint64_t *)dst;
+    for (uint32_t i = 0; i < ZRAM_PAGE_SIZE / 8; i++) {
+        p[i] = word;
+    }
+}
+
+/* The page as one repeated word, if it is one */
+static int same_filled(const uint8_t *src, uint64_t *word) {
+    const uint64_t *p = (const uint64_t *)src;
+    for (uint32_t i = 1; i < ZRAM_PAGE_SIZE / 8; i++) {
+        if (p[i] != p[0]) {
+            return 0;
+        }
+    }
+    *word = p[0];
+    return 1;
+}
+
+static int page_load(Zram *zr, uint64_t index, uint8_t *dst) {
+    ZramEntry *e = &zr->table[index];
+    if (e->state == ZE_EMPTY) {
+        fill_words(dst, 0);
+        return 1;
+    }
+    if (e->state == ZE_SAME) {
+        fill_words(dst, e->value);
+        return 1;
+    }
+    const uint8_t *obj = (const uint8_t *)(uintptr_t)e->value;
+    if (e->size == ZRAM_PAGE_SIZE) {
+        simd_memcpy(dst, obj, ZRAM_PAGE_SIZE);
+        return 1;
+    }
+    uint64_t start = rdtsc();
+    uint32_t n = lz4_decompress(obj, e->size, dst, ZRAM_PAGE_SIZE);
+    zr->stats.decompress_cycles += rdtsc() - start;
+    zr->stats.decompress_out += n;
+    if (n != ZRAM_PAGE_SIZE) {
+        serial_write("ZRAM: corrupt page\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void entry_release(Zram *zr, ZramEntry *e) {
+    if (e->state == ZE_EMPTY) {
+        return;
+    }
+    zr->stats.pages_stored--;
+    if (e->state == ZE_SAME) {
+        zr->stats.same_pages--;
+    } else {
+        if (e->size == ZRAM_PAGE_SIZE) {
+            zr->stats.huge_pages--;
+        }
+        zr->stats.compressed_bytes -= e->size;
+        obj_free(zr, e->cls, (uint8_t *)(uintptr_t)e->value);
+    }
+    e->state = ZE_EMPTY;
+}
+
+/* On failure the page keeps its old contents */
+static int page_store(Zram *zr, uint64_t index, const uint8_t *src) {
+    ZramEntry *e = &zr->table[index];
+    uint64_t word;
+
+    if (same_filled(src, &word)) {
+        entry_release(zr, e);
+        e->state = ZE_SAME;
+        e->value = word;
+        zr->stats.pages_stored++;
+        zr->stats.same_pages++;
+        return 1;
+    }
+
+    uint64_t start = rdtsc();
+    uint32_t size = lz4_compress(src, ZRAM_PAGE_SIZE, zr->cbuf, ZRAM_HUGE_SIZE, zr->work);
+    zr->stats.compress_cycles += rdtsc() - start;
+    zr->stats.compress_in += ZRAM_PAGE_SIZE;
+    const uint8_t *data = zr->cbuf;
+    if (size == 0) {
+        size = ZRAM_PAGE_SIZE;
+        data = src;
+    }
+
+    uint32_t cls = class_of(size);
+    uint8_t *obj = obj_alloc(zr, &cls);
+    if (!obj) {
+        zr->stats.failed_writes++;
+        return 0;
+    }
+    simd_memcpy(obj, data, size);
+
+    entry_release(zr, e);
+    e->state = ZE_OBJECT;
+    e->value = (uint64_t)(uintptr_t)obj;
+    e->size = (uint16_t)size;
+    e->cls = (uint8_t)cls;
+    zr->stats.pages_stored++;
+    zr->stats.compressed_bytes += size;
+    if (size == ZRAM_PAGE_SIZE) {
+        zr->stats.huge_pages++;
+    }
+    return 1;
+}
+
+static int zram_rw(Zram *zr, BlockRequest *req) {
+    uint64_t pos = req->lba * ZRAM_SECTOR_SIZE;
+
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        uint8_t *buf = (uint8_t *)req->segments[i].buf;
+        uint32_t len = req->segments[i].len;
+        while (len) {
+            uint64_t index = pos / ZRAM_PAGE_SIZE;
+            uint32_t off = (uint32_t)(pos % ZRAM_PAGE_SIZE);
+            uint32_t n = ZRAM_PAGE_SIZE - off;
+            if (n > len) {
+                n = len;
+            }
+
+            int ok;
+            if (n == ZRAM_PAGE_SIZE) {
+                ok = req->op == BLOCK_OP_READ ? page_load(zr, index, buf) : page_store(zr, index, buf);
+            } else {
+                /* Partial page: whole page through the scratch buffer */
+                ok = page_load(zr, index, zr->scratch);
+                if (ok && req->op == BLOCK_OP_READ) {
+                    simd_memcpy(buf, zr->scratch + off, n);
+                } else if (ok) {
+                    simd_memcpy(zr->scratch + off, buf, n);
+                    ok = page_store(zr, index, zr->scratch);
+                }
+            }
+            if (!ok) {
+                return BLOCK_EIO;
+            }
+            pos += n;
+            buf += n;
+            len -= n;
+        }
+    }
+    return BLOCK_OK;
+}
+
+/* Only pages the range covers whole are forgotten; the edges of an
+ * unaligned discard keep their data */
+static int zram_discard(Zram *zr, BlockRequest *req) {
+    uint64_t first = (req->lba + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+    uint64_t end = (req->lba + req->count) / SECTORS_PER_PAGE;
+    for (uint64_t index = first; index < end; index++) {
+        entry_release(zr, &zr->table[index]);
+    }
+    return BLOCK_OK;
+}
+
+/* ---- Queue ---------------------------------------------------------------- */
+
+static int zram_acquire(Zram *zr) {
+    uint64_t flags = local_irq_save();
+    int got = !zr->working;
+    zr->working = 1;
+    local_irq_restore(flags);
+    return got;
+}
+
+static void zram_release(Zram *zr) {
+    uint64_t flags = local_irq_save();
+    zr->working = 0;
+    local_irq_restore(flags);
+}
+
+static int zram_poll(BlockDevice *dev) {
+    Zram *zr = (Zram *)dev->driver_data;
+    int completed = 0;
+
+    /* Whoever holds working drains the queue, including requests that
+     * arrive meanwhile; the recheck covers one queued as it let go */
+    while (zr->pending && zram_acquire(zr)) {
+        for (;;) {
+            BlockRequest *req = 0;
+            uint64_t flags = local_irq_save();
+            for (uint32_t i = 0; i < ZRAM_QUEUE_DEPTH; i++) {
+                if (zr->pending & (1U << i)) {
+                    req = zr->slot_req[i];
+                    zr->slot_req[i] = 0;
+                    zr->pending &= ~(1U << i);
+                    break;
+                }
+            }
+            local_irq_restore(flags);
+            if (!req) {
+                break;
+            }
+            block_complete(req, req->op == BLOCK_OP_DISCARD ? zram_discard(zr, req) : zram_rw(zr, req));
+            completed++;
+        }
+        zram_release(zr);
+    }
+    return completed;
+}
+
+static void zram_softirq(uint64_t arg) {
+    Zram *zr = (Zram *)(uintptr_t)arg;
+    zr->kicked = 0;
+    zram_poll(&zr->dev);
+}
+
+static int zram_submit(BlockDevice *dev, BlockRequest *req) {
+    Zram *zr = (Zram *)dev->driver_data;
+    if (req->op == BLOCK_OP_FLUSH) {
+        return BLOCK_ENOTSUP;
+    }
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE && req->op != BLOCK_OP_DISCARD) {
+        return BLOCK_EINVAL;
+    }
+
+    uint64_t flags = local_irq_save();
+    int slot = -1;
+    for (int i = 0; i < ZRAM_QUEUE_DEPTH; i++) {
+        if (!(zr->pending & (1U << i))) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        local_irq_restore(flags);
+        return BLOCK_EBUSY;
+    }
+    zr->slot_req[slot] = req;
+    zr->pending |= 1U << slot;
+
+    int kick = !zr->kicked;
+    zr->kicked = 1;
+    local_irq_restore(flags);
+
+    if (kick && !softirq_queue(zram_softirq, (uint64_t)(uintptr_t)zr)) {
+        zr->kicked = 0;             /* Waiters still poll */
+    }
+    return BLOCK_OK;
+}
+
+/* ---- Setup ---------------------------------------------------------------- */
+
+static BlockDevice *zram_reject(const char *why) {
+    serial_write("ZRAM: ");
+    serial_write(why);
+    serial_write("\n");
+    KERR("ZRAM: device not created");
+    return 0;
+}
+
+static void append_dec(char *buf, int *pos, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n) {
+        buf[(*pos)++] = digits[--n];
+    }
+}
+
+BlockDevice *zram_create(uint64_t disk_bytes, uint64_t mem_limit) {
+    if (device_count >= ZRAM_MAX_DEVICES) {
+        return zram_reject("no free device");
+    }
+    if (disk_bytes == 0) {
+        disk_bytes = ZRAM_DEFAULT_BYTES;
+    }
+    uint64_t pages = disk_bytes / ZRAM_PAGE_SIZE;
+    if (pages == 0 || disk_bytes > ZRAM_MAX_BYTES) {
+        return zram_reject("size must be from 4k to 4g");
+    }
+    uint64_t limit_pages = mem_limit ? mem_limit / PMM_PAGE_SIZE : pmm_free_pages() / ZRAM_RAM_SHARE;
+    if (limit_pages == 0) {
+        return zram_reject("memory limit below one page");
+    }
+
+    uint64_t table_pages = (pages * sizeof(ZramEntry) + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+    ZramEntry *table = (ZramEntry *)pmm_alloc_pages(table_pages);
+    uint8_t *buffers = (uint8_t *)pmm_alloc_pages((2 * ZRAM_PAGE_SIZE + LZ4_WORKMEM_SIZE) / PMM_PAGE_SIZE);
+    if (!table || !buffers) {
+        return zram_reject("out of memory");
+    }
+
+    Zram *zr = &devices[device_count];
+    zr->table = table;
+    zr->pages = pages;
+    classes_init(zr);
+    zr->pool_pages = 0;
+    zr->limit_pages = limit_pages;
+    zr->scratch = buffers;
+    zr->cbuf = buffers + ZRAM_PAGE_SIZE;
+    zr->work = buffers + 2 * ZRAM_PAGE_SIZE;
+    zr->pending = 0;
+    zr->kicked = 0;
+    zr->working = 0;
+    for (uint32_t i = 0; i < ZRAM_QUEUE_DEPTH; i++) {
+        zr->slot_req[i] = 0;
+    }
+    uint8_t *stats = (uint8_t *)&zr->stats;
+    for (uint32_t i = 0; i < sizeof(zr->stats); i++) {
+        stats[i] = 0;
+    }
+    zr->stats.table_bytes = table_pages * PMM_PAGE_SIZE;
+
+    BlockDevice *dev = &zr->dev;
+    dev->name = device_names[device_count];
+    dev->sector_size = ZRAM_SECTOR_SIZE;
+    dev->total_sectors = pages * SECTORS_PER_PAGE;
+    dev->driver_data = zr;
+    dev->max_segments = BLOCK_MAX_SEGMENTS;
+    dev->max_sectors = ZRAM_MAX_SECTORS;
+    dev->max_discard_sectors = ZRAM_MAX_DISCARD;
+    dev->queue_depth = ZRAM_QUEUE_DEPTH;
+    dev->submit = zram_submit;
+    dev->poll = zram_poll;
+
+    if (!block_register(dev)) {
+        return zram_reject("no free block device slot");
+    }
+    device_count++;
+
+    char num[24];
+    int pos = 0;
+    serial_write("ZRAM: ");
+    serial_write(dev->name);
+    serial_write(" ");
+    append_dec(num, &pos, pages * ZRAM_PAGE_SIZE >> 20);
+    num[pos] = 0;
+    serial_write(num);
+    serial_write(" MB, pool limit ");
+    pos = 0;
+    append_dec(num, &pos, limit_pages * PMM_PAGE_SIZE >> 20);
+    num[pos] = 0;
+    serial_write(num);
+    serial_write(" MB\n");
+    KLOG("ZRAM: device registered");
+    return dev;
+}
+
+int zram_count(void) {
+    return device_count;
+}
+
+BlockDevice *zram_get(int index) {
+    if (index < 0 || index >= device_count) {
+        return 0;
+    }
+    return &devices[index].dev;
+}
+
+int zram_get_stats(BlockDevice *dev, ZramStats *out) {
+    if (!dev || !out || dev->submit != zram_submit) {
+        return 0;
+    }
+    Zram *zr = (Zram *)dev->driver_data;
+    uint64_t flags = local_irq_save();
+    const uint8_t *src = (const uint8_t *)&zr->stats;
+    uint8_t *dst = (uint8_t *)out;
+    for (uint32_t i = 0; i < sizeof(*out); i++) {
+        dst[i] = src[i];
+    }
+    local_irq_restore(flags);
+    out->disk_bytes = zr->pages * ZRAM_PAGE_SIZE;
+    out->mem_limit = zr->limit_pages * PMM_PAGE_SIZE;
+    out->pool_bytes = zr->pool_pages * PMM_PAGE_SIZE;
+    return 1;
+}
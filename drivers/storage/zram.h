@@ -0,0 +1,63 @@
+#ifndef KAGAMI_ZRAM_H
+#define KAGAMI_ZRAM_H
+
+#include "types.h"
+#include "block.h"
+
+/* Compressed RAM disk: zram0, zram1, ... keep each 4 KiB page of the
+ * disk LZ4-compressed in memory, so a disk larger than the RAM it uses
+ * can hold scratch filesystems and spilled caches.
+ *
+ * A page filled with one repeated 64-bit word is stored as that word
+ * alone. Other pages are compressed and kept in objects from size
+ * classes 64 bytes apart, carved from runs of one to four pages, so a
+ * 1.2 KiB page takes 1.25 KiB rather than a whole page; pages that
+ * compress worse than ZRAM_HUGE_SIZE are kept uncompressed. Objects
+ * freed by overwrites go back to their class for reuse (the page
+ * allocator has no free). Once the pool reaches the device's memory
+ * limit a page may take a free object of a larger class, and writes
+ * fail when there is none. Discarding whole pages hands their objects
+ * back the same way, and they read as zeros again.
+ */
+
+#define ZRAM_MAX_DEVICES    2
+#define ZRAM_PAGE_SIZE      4096
+#define ZRAM_SECTOR_SIZE    512
+#define ZRAM_QUEUE_DEPTH    32
+#define ZRAM_MAX_SECTORS    256                    /* 128 KiB per request */
+#define ZRAM_MAX_DISCARD    (1U << 21)             /* 1 GiB per discard */
+#define ZRAM_CLASS_STEP     64
+#define ZRAM_CLASSES        (ZRAM_PAGE_SIZE / ZRAM_CLASS_STEP)
+#define ZRAM_MAX_RUN_PAGES  4                      /* Pages a class carves objects from */
+#define ZRAM_HUGE_SIZE      (ZRAM_PAGE_SIZE * 3 / 4)
+#define ZRAM_DEFAULT_BYTES  (256ULL * 1024 * 1024)
+#define ZRAM_MAX_BYTES      (4ULL * 1024 * 1024 * 1024)
+#define ZRAM_RAM_SHARE      4                      /* Default limit: 1/4 of free RAM */
+
+typedef struct {
+    uint64_t disk_bytes;
+    uint64_t mem_limit;                 /* Bytes the pool may grow to */
+    uint64_t pages_stored;              /* Written pages, same-filled included */
+    uint64_t same_pages;
+    uint64_t huge_pages;                /* Kept uncompressed */
+    uint64_t compressed_bytes;          /* Sum of stored object sizes */
+    uint64_t pool_bytes;                /* Taken from the page allocator */
+    uint64_t table_bytes;
+    uint64_t failed_writes;             /* Over the memory limit */
+    uint64_t compress_in;               /* Bytes fed to LZ4 */
+    uint64_t compress_cycles;
+    uint64_t decompress_out;            /* Bytes LZ4 produced */
+    uint64_t decompress_cycles;
+} ZramStats;
+
+/* Create and register a device of disk_bytes (0: ZRAM_DEFAULT_BYTES,
+ * rounded down to pages) whose pool may use mem_limit bytes (0: a
+ * quarter of free RAM). Returns the device or 0 (and logs why). */
+BlockDevice *zram_create(uint64_t disk_bytes, uint64_t mem_limit);
+
+int zram_count(void);
+BlockDevice *zram_get(int index);
+/* Returns 0 if dev is not a zram device */
+int zram_get_stats(BlockDevice *dev, ZramStats *out);
+
+#endif
@@ -1,12 +1,15 @@
 #include "ext4.h"
+#include "drivers/storage/bufcache.h"
 #include "serial.h"
 #include "klog.h"
+#include "rcu.h"
+#include "irqflags.h"
 
-#define EXT4_SUPERBLOCK_OFFSET 1024
 #define EXT4_EXTENTS_FL 0x00080000
 #define EXT4_FT_DIR 2
 #define EXT4_FT_REG_FILE 1
 #define EXT4_EXTENT_HEADER_MAGIC 0xF30A
+#define EXT4_BG_BLOCK_UNINIT 0x0002     /* Block bitmap never written */
 
 #pragma pack(push, 1)
 typedef struct {
@@ -124,39 +127,56 @@ static uint32_t align4(uint32_t v) {
     return (v + 3) & ~3U;
 }
 
-static int ext4_read_block(Ext4Fs *fs, uint64_t block, void *buffer) {
-    uint32_t sectors = fs->sb.block_size / BLOCK_SECTOR_SIZE;
-    uint64_t lba = fs->partition_lba + block * sectors;
-    return fs->device->read(fs->device, lba, sectors, buffer);
+static uint64_t ext4_block_lba(Ext4Fs *fs, uint64_t block) {
+    return fs->partition_lba + block * fs->sectors_per_block;
 }
 
-static int ext4_write_block(Ext4Fs *fs, uint64_t block, const void *buffer) {
-    if (!fs->device->write) {
+/* Referenced cache buffer for a filesystem block; ext4_brelse() when done */
+static Buffer *ext4_bread(Ext4Fs *fs, uint64_t block) {
+    return bufcache_read(fs->device, ext4_block_lba(fs, block), fs->sb.block_size);
+}
+
+static void ext4_brelse(Buffer *buf) {
+    bufcache_release(buf);
+}
+
+static int ext4_read_block(Ext4Fs *fs, uint64_t block, void *buffer) {
+    Buffer *buf = ext4_bread(fs, block);
+    if (!buf) {
         return 0;
     }
-    uint32_t sectors = fs->sb.block_size / BLOCK_SECTOR_SIZE;
-    uint64_t lba = fs->partition_lba + block * sectors;
-    return fs->device->write(fs->device, lba, sectors, buffer);
+    uint8_t *dst = (uint8_t *)buffer;
+    for (uint32_t i = 0; i < fs->sb.block_size; i++) {
+        dst[i] = buf->data[i];
+    }
+    ext4_brelse(buf);
+    return 1;
 }
 
+static int ext4_write_block(Ext4Fs *fs, uint64_t block, const void *buffer) {
+    return bufcache_write(fs->device, ext4_block_lba(fs, block), fs->sb.block_size, buffer);
+}
+
+/* The superblock sits at byte 1024 of the partition, inside block 0 or 1.
+ * Going through that block keeps the cached copy coherent. */
 static int ext4_read_super_raw(Ext4Fs *fs, Ext4SuperblockRaw *raw) {
-    uint8_t buf[BLOCK_SECTOR_SIZE * 2];
-    if (!fs->device->read(fs->device, fs->partition_lba + EXT4_SUPERBLOCK_LBA, 2, buf)) {
+    Buffer *buf = ext4_bread(fs, 1024 / fs->sb.block_size);
+    if (!buf) {
         return 0;
     }
-    Ext4SuperblockRaw *sb = (Ext4SuperblockRaw *)buf;
-    *raw = *sb;
+    *raw = *(Ext4SuperblockRaw *)(buf->data + 1024 % fs->sb.block_size);
+    ext4_brelse(buf);
     return 1;
 }
 
 static int ext4_write_super_raw(Ext4Fs *fs, Ext4SuperblockRaw *raw) {
-    uint8_t buf[BLOCK_SECTOR_SIZE * 2];
-    for (int i = 0; i < (int)sizeof(buf); i++) {
-        buf[i] = 0;
+    uint8_t block_buf[4096];
+    uint64_t block = 1024 / fs->sb.block_size;
+    if (!ext4_read_block(fs, block, block_buf)) {
+        return 0;
     }
-    Ext4SuperblockRaw *sb = (Ext4SuperblockRaw *)buf;
-    *sb = *raw;
-    return fs->device->write && fs->device->write(fs->device, fs->partition_lba + EXT4_SUPERBLOCK_LBA, 2, buf);
+    *(Ext4SuperblockRaw *)(block_buf + 1024 % fs->sb.block_size) = *raw;
+    return ext4_write_block(fs, block, block_buf);
 }
 
 static int ext4_read_group_desc(Ext4Fs *fs, uint32_t group, Ext4GroupDesc *out, uint8_t *block_buf) {
@@ -193,11 +213,15 @@ static int ext4_read_inode(Ext4Fs *fs, uint32_t inode_num, Ext4Inode *out_inode,
     uint32_t index_in_group = inode_index % fs->sb.inodes_per_group;
 
     uint32_t block_size = fs->sb.block_size;
-    uint8_t gd_buf[4096];
-    Ext4GroupDesc gd;
-    if (!ext4_read_group_desc(fs, group, &gd, gd_buf)) {
+    uint32_t group_desc_block = (block_size == 1024) ? 2 : 1;
+    uint32_t group_desc_offset = group * fs->sb.group_desc_size;
+
+    Buffer *gd_buf = ext4_bread(fs, group_desc_block + (group_desc_offset / block_size));
+    if (!gd_buf) {
         return 0;
     }
+    Ext4GroupDesc gd = *(Ext4GroupDesc *)(gd_buf->data + (group_desc_offset % block_size));
+    ext4_brelse(gd_buf);
 
     uint32_t inode_table_block = gd.bg_inode_table_lo;
     uint32_t inode_size = fs->sb.inode_size;
@@ -205,13 +229,13 @@ static int ext4_read_inode(Ext4Fs *fs, uint32_t inode_num, Ext4Inode *out_inode,
     uint32_t inode_block = inode_table_block + (inode_offset / block_size);
     uint32_t inode_offset_in_block = inode_offset % block_size;
 
-    uint8_t inode_buf[4096];
-    if (!ext4_read_block(fs, inode_block, inode_buf)) {
+    Buffer *inode_buf = ext4_bread(fs, inode_block);
+    if (!inode_buf) {
         return 0;
     }
+    *out_inode = *(Ext4Inode *)(inode_buf->data + inode_offset_in_block);
+    ext4_brelse(inode_buf);
 
-    Ext4Inode *inode = (Ext4Inode *)(inode_buf + inode_offset_in_block);
-    *out_inode = *inode;
     if (out_gd) {
         *out_gd = gd;
     }
@@ -251,6 +275,102 @@ static uint64_t extent_start_block(const Ext4Extent *ext) {
     return ((uint64_t)ext->ee_start_hi << 32) | ext->ee_start_lo;
 }
 
+/* Extent reads fill the cache buffers of uncached blocks with one
+ * vectored request per contiguous run, each buffer a segment, so a run
+ * becomes a single command. Cached blocks are copied at once. */
+#define EXT4_READ_BATCH 32
+
+typedef struct {
+    BlockRequest reqs[EXT4_READ_BATCH];   /* One per run; the last may be open */
+    Buffer *bufs[EXT4_READ_BATCH];
+    uint8_t *dst[EXT4_READ_BATCH];
+    uint32_t copy_start[EXT4_READ_BATCH];
+    uint32_t copy_len[EXT4_READ_BATCH];
+    uint32_t run[EXT4_READ_BATCH];        /* Request each block is read by */
+    uint32_t count;
+    uint32_t runs;
+    int open;                             /* reqs[runs - 1] still takes blocks */
+    uint64_t next_lba;                    /* LBA that would extend the open run */
+} Ext4ReadBatch;
+
+static Ext4ReadBatch ext4_batch;
+
+static void ext4_copy_out(Buffer *buf, uint8_t *dst, uint32_t start, uint32_t len) {
+    for (uint32_t k = 0; k < len; k++) {
+        dst[k] = buf->data[start + k];
+    }
+}
+
+static int ext4_batch_submit(Ext4ReadBatch *batch) {
+    if (!batch->open) {
+        return 1;
+    }
+    batch->open = 0;
+    return block_submit(&batch->reqs[batch->runs - 1]);
+}
+
+/* Copy a block that is cached, or add it to the read of its run */
+static int ext4_batch_add(Ext4Fs *fs, Ext4ReadBatch *batch, uint64_t block,
+                          uint8_t *dst, uint32_t copy_start, uint32_t copy_len) {
+    uint32_t block_size = fs->sb.block_size;
+    uint64_t lba = ext4_block_lba(fs, block);
+    Buffer *buf = bufcache_get(fs->device, lba, block_size);
+    if (!buf) {
+        return 0;
+    }
+    if (buf->flags & BUF_VALID) {
+        ext4_copy_out(buf, dst, copy_start, copy_len);
+        ext4_brelse(buf);
+        return 1;
+    }
+
+    uint32_t n = batch->count++;
+    batch->bufs[n] = buf;
+    batch->dst[n] = dst;
+    batch->copy_start[n] = copy_start;
+    batch->copy_len[n] = copy_len;
+
+    if (batch->open && lba == batch->next_lba &&
+        block_request_add(&batch->reqs[batch->runs - 1], buf->data, block_size)) {
+        batch->run[n] = batch->runs - 1;
+        batch->next_lba += fs->sectors_per_block;
+        return 1;
+    }
+
+    int ok = ext4_batch_submit(batch);
+    BlockRequest *req = &batch->reqs[batch->runs];
+    batch->run[n] = batch->runs++;
+    block_request_init(req, fs->device, BLOCK_OP_READ, lba);
+    if (!block_request_add(req, buf->data, block_size)) {
+        req->status = BLOCK_EINVAL;
+        return 0;
+    }
+    batch->open = 1;
+    batch->next_lba = lba + fs->sectors_per_block;
+    return ok;
+}
+
+/* Send the open run, wait for every read, then copy the wanted bytes out */
+static int ext4_batch_finish(Ext4ReadBatch *batch) {
+    int ok = ext4_batch_submit(batch);
+    for (uint32_t r = 0; r < batch->runs; r++) {
+        block_wait(&batch->reqs[r]);
+    }
+    for (uint32_t i = 0; i < batch->count; i++) {
+        Buffer *buf = batch->bufs[i];
+        if (batch->reqs[batch->run[i]].status == BLOCK_OK) {
+            buf->flags |= BUF_VALID;
+            ext4_copy_out(buf, batch->dst[i], batch->copy_start[i], batch->copy_len[i]);
+        } else {
+            ok = 0;
+        }
+        ext4_brelse(buf);
+    }
+    batch->count = 0;
+    batch->runs = 0;
+    return ok;
+}
+
 static int ext4_read_extent_blocks(Ext4Fs *fs, Ext4Inode *inode, uint64_t offset, void *buffer, uint32_t size, uint32_t *out_read) {
     Ext4ExtentHeader *hdr = (Ext4ExtentHeader *)inode->i_block;
     if (hdr->eh_magic != EXT4_EXTENT_HEADER_MAGIC || hdr->eh_depth != 0) {
@@ -260,24 +380,26 @@ static int ext4_read_extent_blocks(Ext4Fs *fs, Ext4Inode *inode, uint64_t offset
     uint32_t block_size = fs->sb.block_size;
     uint32_t remaining = size;
     uint32_t total_read = 0;
+    Ext4ReadBatch *batch = &ext4_batch;
+    int ok = 1;
+
+    batch->count = 0;
+    batch->runs = 0;
+    batch->open = 0;
+    block_plug(fs->device);
 
     Ext4Extent *ext = (Ext4Extent *)(hdr + 1);
-    for (uint16_t i = 0; i < hdr->eh_entries && remaining > 0; i++) {
+    for (uint16_t i = 0; ok && i < hdr->eh_entries && remaining > 0; i++) {
         uint64_t start_block = extent_start_block(&ext[i]);
         uint32_t block_count = ext[i].ee_len & 0x7FFF;
 
-        for (uint32_t b = 0; b < block_count && remaining > 0; b++) {
+        for (uint32_t b = 0; ok && b < block_count && remaining > 0; b++) {
             uint64_t file_block = ext[i].ee_block + b;
             uint64_t byte_start = file_block * block_size;
             if (byte_start + block_size <= offset) {
                 continue;
             }
 
-            uint8_t block_buf[4096];
-            if (!ext4_read_block(fs, start_block + b, block_buf)) {
-                return 0;
-            }
-
             uint32_t copy_start = 0;
             if (offset > byte_start) {
                 copy_start = (uint32_t)(offset - byte_start);
@@ -288,21 +410,171 @@ static int ext4_read_extent_blocks(Ext4Fs *fs, Ext4Inode *inode, uint64_t offset
             }
 
             uint8_t *dst = (uint8_t *)buffer + total_read;
-            for (uint32_t k = 0; k < copy_len; k++) {
-                dst[k] = block_buf[copy_start + k];
+            if (!ext4_batch_add(fs, batch, start_block + b, dst, copy_start, copy_len)) {
+                ok = 0;
             }
 
             remaining -= copy_len;
             total_read += copy_len;
+
+            if (batch->count == EXT4_READ_BATCH) {
+                ok = ext4_batch_finish(batch) && ok;
+            }
         }
     }
 
+    ok = ext4_batch_finish(batch) && ok;
+    block_unplug(fs->device);
+    if (!ok) {
+        return 0;
+    }
+
     if (out_read) {
         *out_read = total_read;
     }
     return 1;
 }
 
+/* Sequential readahead.
+ * Each inode being read in order gets a stream that remembers where the
+ * next read should start. A read that starts there grows the window ahead
+ * of it (doubling up to EXT4_RA_MAX_BYTES); one that does not halves it,
+ * and below EXT4_RA_MIN_BYTES prefetching stops until the reader is
+ * sequential again. The window is topped up asynchronously once half of
+ * it has been consumed, so the disk stays busy while the caller copies.
+ */
+#define EXT4_RA_STREAMS   8
+#define EXT4_RA_MIN_BYTES (16 * 1024)
+#define EXT4_RA_MAX_BYTES (256 * 1024)
+
+typedef struct {
+    const Ext4Fs *fs;
+    uint32_t inode;
+    uint32_t window;                /* Blocks; 0 while the reader looks random */
+    uint64_t next_offset;           /* Where a sequential read would start */
+    uint64_t ra_end;                /* First file block not yet prefetched */
+    uint32_t stamp;                 /* For recycling the least recent stream */
+} Ext4RaStream;
+
+static Ext4RaStream ra_streams[EXT4_RA_STREAMS];
+static uint32_t ra_clock;
+
+static Ext4RaStream *ext4_ra_stream(const Ext4Fs *fs, uint32_t inode_num) {
+    Ext4RaStream *oldest = &ra_streams[0];
+    for (uint32_t i = 0; i < EXT4_RA_STREAMS; i++) {
+        Ext4RaStream *ra = &ra_streams[i];
+        if (ra->fs == fs && ra->inode == inode_num) {
+            ra->stamp = ++ra_clock;
+            return ra;
+        }
+        if (ra->stamp < oldest->stamp) {
+            oldest = ra;
+        }
+    }
+
+    oldest->fs = fs;
+    oldest->inode = inode_num;
+    oldest->window = 0;
+    oldest->next_offset = 0;
+    oldest->ra_end = 0;
+    oldest->stamp = ++ra_clock;
+    return oldest;
+}
+
+static void ext4_ra_forget(const Ext4Fs *fs) {
+    for (uint32_t i = 0; i < EXT4_RA_STREAMS; i++) {
+        if (ra_streams[i].fs == fs) {
+            ra_streams[i].fs = 0;
+            ra_streams[i].stamp = 0;
+        }
+    }
+}
+
+/* Physical block backing a file block and how many follow it contiguously
+ * within the same extent */
+static int ext4_map_block(Ext4Inode *inode, uint64_t file_block, uint64_t *out_block, uint32_t *out_run) {
+    Ext4ExtentHeader *hdr = (Ext4ExtentHeader *)inode->i_block;
+    if (hdr->eh_magic != EXT4_EXTENT_HEADER_MAGIC || hdr->eh_depth != 0) {
+        return 0;
+    }
+
+    Ext4Extent *ext = (Ext4Extent *)(hdr + 1);
+    for (uint16_t i = 0; i < hdr->eh_entries; i++) {
+        uint32_t len = ext[i].ee_len & 0x7FFF;
+        if (file_block >= ext[i].ee_block && file_block < (uint64_t)ext[i].ee_block + len) {
+            uint32_t skip = (uint32_t)(file_block - ext[i].ee_block);
+            *out_block = extent_start_block(&ext[i]) + skip;
+            *out_run = len - skip;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Account for a read of [offset, offset + size) and prefetch past it */
+static void ext4_readahead(Ext4Fs *fs, uint32_t inode_num, Ext4Inode *inode,
+                           uint64_t file_size, uint64_t offset, uint32_t size) {
+    uint32_t block_size = fs->sb.block_size;
+    uint32_t min_window = EXT4_RA_MIN_BYTES / block_size;
+    uint32_t max_window = EXT4_RA_MAX_BYTES / block_size;
+    Ext4RaStream *ra = ext4_ra_stream(fs, inode_num);
+
+    if (offset == ra->next_offset) {
+        if (ra->window == 0) {
+            /* Start at a few times the read size, as a reader that asks
+             * for little at a time tends to ask often */
+            ra->window = ((size / block_size) + 1) * 4;
+            if (ra->window < min_window) {
+                ra->window = min_window;
+            }
+        } else {
+            ra->window *= 2;
+        }
+        if (ra->window > max_window) {
+            ra->window = max_window;
+        }
+    } else {
+        ra->window /= 2;
+        if (ra->window < min_window) {
+            ra->window = 0;
+        }
+        ra->ra_end = 0;
+    }
+    ra->next_offset = offset + size;
+    if (ra->window == 0) {
+        return;
+    }
+
+    uint64_t file_blocks = (file_size + block_size - 1) / block_size;
+    uint64_t start = (offset + size + block_size - 1) / block_size;
+    uint64_t end = start + ra->window;
+    if (end > file_blocks) {
+        end = file_blocks;
+    }
+    /* Still more than half a window prefetched ahead: nothing to do yet */
+    if (ra->ra_end > start + ra->window / 2 || ra->ra_end >= end) {
+        return;
+    }
+    if (ra->ra_end > start) {
+        start = ra->ra_end;
+    }
+    ra->ra_end = end;
+
+    while (start < end) {
+        uint64_t block = 0;
+        uint32_t run = 0;
+        if (!ext4_map_block(inode, start, &block, &run)) {
+            start++;            /* Hole: nothing to read */
+            continue;
+        }
+        if (run > end - start) {
+            run = (uint32_t)(end - start);
+        }
+        bufcache_readahead(fs->device, ext4_block_lba(fs, block), block_size, run);
+        start += run;
+    }
+}
+
 static int ext4_write_extent_blocks(Ext4Fs *fs, Ext4Inode *inode, uint64_t offset, const void *buffer, uint32_t size) {
     Ext4ExtentHeader *hdr = (Ext4ExtentHeader *)inode->i_block;
     if (hdr->eh_magic != EXT4_EXTENT_HEADER_MAGIC || hdr->eh_depth != 0) {
@@ -402,11 +674,7 @@ static int ext4_find_in_dir(Ext4Fs *fs, Ext4Inode *dir_inode, const char *name,
     return 0;
 }
 
-static int ext4_resolve_path(Ext4Fs *fs, const char *path, uint32_t *out_inode, uint8_t *out_type) {
-    if (!fs || !path || path[0] != '/') {
-        return 0;
-    }
-
+static int ext4_walk_path(Ext4Fs *fs, const char *path, uint32_t *out_inode, uint8_t *out_type) {
     uint32_t current_inode_num = 2;
     uint8_t current_type = EXT4_FT_DIR;
 
@@ -450,6 +718,188 @@ static int ext4_resolve_path(Ext4Fs *fs, const char *path, uint32_t *out_inode,
     return 1;
 }
 
+/* Path lookup cache.
+ * Resolved paths map to (inode, type) in an RCU hash table so repeated
+ * lookups skip the directory walk and take no locks. Only hits are cached
+ * (files can appear later) and paths never change target because there is
+ * no unlink/rename, so entries only go away on eviction or remount.
+ */
+#define EXT4_PATH_CACHE_BUCKETS  32
+#define EXT4_PATH_CACHE_POOL     64
+#define EXT4_PATH_CACHE_LIVE     48   /* Rest of the pool covers grace periods */
+#define EXT4_PATH_CACHE_MAX_PATH 96
+
+#define PATH_ENTRY_FREE    0
+#define PATH_ENTRY_LIVE    1
+#define PATH_ENTRY_RETIRED 2
+
+typedef struct Ext4PathEntry Ext4PathEntry;
+struct Ext4PathEntry {
+    Ext4PathEntry *next;
+    const Ext4Fs *fs;
+    uint32_t hash;
+    uint32_t inode;
+    uint8_t type;
+    uint8_t state;
+    uint16_t len;
+    char path[EXT4_PATH_CACHE_MAX_PATH];
+    RcuHead rcu;
+};
+
+static Ext4PathEntry *path_buckets[EXT4_PATH_CACHE_BUCKETS];
+static Ext4PathEntry path_pool[EXT4_PATH_CACHE_POOL];
+static uint32_t path_live = 0;
+static uint32_t path_clock = 0;
+
+static uint32_t path_hash(const char *path, uint32_t len) {
+    uint32_t h = 2166136261U;   /* FNV-1a */
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t)path[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void path_entry_free_rcu(RcuHead *head) {
+    Ext4PathEntry *entry = rcu_container_of(head, Ext4PathEntry, rcu);
+    entry->state = PATH_ENTRY_FREE;
+}
+
+/* Caller has interrupts disabled */
+static void path_cache_retire(Ext4PathEntry *entry) {
+    Ext4PathEntry **link = &path_buckets[entry->hash % EXT4_PATH_CACHE_BUCKETS];
+    while (*link && *link != entry) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        return;
+    }
+    rcu_assign_pointer(*link, entry->next);
+    entry->state = PATH_ENTRY_RETIRED;
+    path_live--;
+    rcu_call(&entry->rcu, path_entry_free_rcu);
+}
+
+static int path_cache_lookup(const Ext4Fs *fs, const char *path, uint32_t len, uint32_t hash,
+                             uint32_t *out_inode, uint8_t *out_type) {
+    int found = 0;
+
+    rcu_read_lock();
+    Ext4PathEntry *e = rcu_dereference(path_buckets[hash % EXT4_PATH_CACHE_BUCKETS]);
+    for (; e; e = rcu_dereference(e->next)) {
+        if (e->fs == fs && e->hash == hash && e->len == len && str_eq(e->path, path, len)) {
+            *out_inode = e->inode;
+            *out_type = e->type;
+            found = 1;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return found;
+}
+
+static void path_cache_insert(const Ext4Fs *fs, const char *path, uint32_t len, uint32_t hash,
+                              uint32_t inode, uint8_t type) {
+    uint64_t flags = local_irq_save();
+
+    Ext4PathEntry **bucket = &path_buckets[hash % EXT4_PATH_CACHE_BUCKETS];
+    for (Ext4PathEntry *e = *bucket; e; e = e->next) {
+        if (e->fs == fs && e->hash == hash && e->len == len && str_eq(e->path, path, len)) {
+            local_irq_restore(flags);
+            return;
+        }
+    }
+
+    /* Keep headroom so retired entries can wait out their grace period */
+    if (path_live >= EXT4_PATH_CACHE_LIVE) {
+        for (uint32_t n = 0; n < EXT4_PATH_CACHE_POOL; n++) {
+            Ext4PathEntry *victim = &path_pool[path_clock];
+            path_clock = (path_clock + 1) % EXT4_PATH_CACHE_POOL;
+            if (victim->state == PATH_ENTRY_LIVE) {
+                path_cache_retire(victim);
+                break;
+            }
+        }
+    }
+
+    Ext4PathEntry *entry = 0;
+    for (uint32_t i = 0; i < EXT4_PATH_CACHE_POOL; i++) {
+        if (path_pool[i].state == PATH_ENTRY_FREE) {
+            entry = &path_pool[i];
+            break;
+        }
+    }
+    if (!entry) {
+        local_irq_restore(flags);
+        return;
+    }
+
+    entry->fs = fs;
+    entry->hash = hash;
+    entry->inode = inode;
+    entry->type = type;
+    entry->len = (uint16_t)len;
+    for (uint32_t i = 0; i < len; i++) {
+        entry->path[i] = path[i];
+    }
+    entry->state = PATH_ENTRY_LIVE;
+    entry->next = *bucket;
+    rcu_assign_pointer(*bucket, entry);
+    path_live++;
+
+    local_irq_restore(flags);
+}
+
+static void path_cache_flush(const Ext4Fs *fs) {
+    uint64_t flags = local_irq_save();
+    for (uint32_t i = 0; i < EXT4_PATH_CACHE_POOL; i++) {
+        if (path_pool[i].state == PATH_ENTRY_LIVE && path_pool[i].fs == fs) {
+            path_cache_retire(&path_pool[i]);
+        }
+    }
+    local_irq_restore(flags);
+}
+
+static int ext4_resolve_path(Ext4Fs *fs, const char *path, uint32_t *out_inode, uint8_t *out_type) {
+    if (!fs || !path || path[0] != '/') {
+        return 0;
+    }
+
+    uint32_t len = str_len(path);
+    uint32_t hash = 0;
+    uint32_t inode = 0;
+    uint8_t type = 0;
+    int cacheable = len < EXT4_PATH_CACHE_MAX_PATH;
+
+    if (cacheable) {
+        hash = path_hash(path, len);
+        if (path_cache_lookup(fs, path, len, hash, &inode, &type)) {
+            if (out_inode) {
+                *out_inode = inode;
+            }
+            if (out_type) {
+                *out_type = type;
+            }
+            return 1;
+        }
+    }
+
+    if (!ext4_walk_path(fs, path, &inode, &type)) {
+        return 0;
+    }
+    if (cacheable) {
+        path_cache_insert(fs, path, len, hash, inode, type);
+    }
+
+    if (out_inode) {
+        *out_inode = inode;
+    }
+    if (out_type) {
+        *out_type = type;
+    }
+    return 1;
+}
+
 static int ext4_alloc_block_run(Ext4Fs *fs, uint32_t count, uint32_t *out_block) {
     uint8_t gd_buf[4096];
     Ext4GroupDesc gd;
@@ -508,6 +958,102 @@ static int ext4_alloc_block_run(Ext4Fs *fs, uint32_t count, uint32_t *out_block)
     return 0;
 }
 
+/* Runs freed by a write, merged while they touch and discarded together
+ * once the inode no longer points at them. Nothing can be allocated from
+ * them in between, as the batch never outlives the write. */
+#define EXT4_DISCARD_BATCH 8
+
+typedef struct {
+    uint64_t block;
+    uint32_t count;
+} Ext4FreedRun;
+
+static Ext4FreedRun discard_runs[EXT4_DISCARD_BATCH];
+static uint32_t discard_count;
+
+static void ext4_discard_flush(Ext4Fs *fs) {
+    for (uint32_t i = 0; i < discard_count; i++) {
+        if (!bufcache_discard(fs->device, ext4_block_lba(fs, discard_runs[i].block),
+                              (uint64_t)discard_runs[i].count * fs->sectors_per_block)) {
+            serial_write("EXT4: discard failed\n");
+        }
+    }
+    discard_count = 0;
+}
+
+static void ext4_discard_queue(Ext4Fs *fs, uint64_t block, uint32_t count) {
+    if (!fs->device->max_discard_sectors || count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < discard_count; i++) {
+        Ext4FreedRun *r = &discard_runs[i];
+        if (r->block + r->count == block) {
+            r->count += count;
+            return;
+        }
+        if (block + count == r->block) {
+            r->block = block;
+            r->count += count;
+            return;
+        }
+    }
+    if (discard_count == EXT4_DISCARD_BATCH) {
+        ext4_discard_flush(fs);
+    }
+    discard_runs[discard_count].block = block;
+    discard_runs[discard_count].count = count;
+    discard_count++;
+}
+
+/* Clear count blocks from start in the block bitmaps, a group at a time,
+ * and queue them for discard. Blocks already free are left alone. */
+static int ext4_free_block_run(Ext4Fs *fs, uint64_t start, uint32_t count) {
+    while (count > 0) {
+        if (start < fs->sb.first_data_block || start + count > fs->sb.total_blocks) {
+            return 0;
+        }
+        uint32_t group = (uint32_t)((start - fs->sb.first_data_block) / fs->sb.blocks_per_group);
+        uint32_t first = (uint32_t)((start - fs->sb.first_data_block) % fs->sb.blocks_per_group);
+        uint32_t n = fs->sb.blocks_per_group - first;
+        if (n > count) {
+            n = count;
+        }
+
+        uint8_t gd_buf[4096];
+        Ext4GroupDesc gd;
+        if (!ext4_read_group_desc(fs, group, &gd, gd_buf)) {
+            return 0;
+        }
+        uint8_t bitmap[4096];
+        if (!ext4_read_block(fs, gd.bg_block_bitmap_lo, bitmap)) {
+            return 0;
+        }
+        uint32_t freed = 0;
+        for (uint32_t i = first; i < first + n; i++) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                bitmap[i / 8] &= (uint8_t)~(1 << (i % 8));
+                freed++;
+            }
+        }
+        if (!ext4_write_block(fs, gd.bg_block_bitmap_lo, bitmap)) {
+            return 0;
+        }
+        gd.bg_free_blocks_count_lo += (uint16_t)freed;
+        ext4_write_group_desc(fs, group, &gd, gd_buf);
+
+        Ext4SuperblockRaw sbr;
+        if (ext4_read_super_raw(fs, &sbr)) {
+            sbr.s_free_blocks_count_lo += freed;
+            ext4_write_super_raw(fs, &sbr);
+        }
+
+        ext4_discard_queue(fs, start, n);
+        start += n;
+        count -= n;
+    }
+    return 1;
+}
+
 static int ext4_alloc_inode(Ext4Fs *fs, uint32_t *out_inode) {
     uint8_t gd_buf[4096];
     Ext4GroupDesc gd;
@@ -617,23 +1163,36 @@ static int ext4_add_dir_entry(Ext4Fs *fs, uint32_t dir_inode_num, const char *na
     return 0;
 }
 
+/* The superblock sits at a byte offset, so which logical block holds it,
+ * and where in it, depends on the device: LBAs 2-3 of a 512-byte-sector
+ * disk, the second KiB of LBA 0 on a 4Kn one */
 static int read_superblock(BlockDevice *dev, uint64_t partition_lba, Ext4SuperblockInfo *out_sb) {
-    uint8_t buf[BLOCK_SECTOR_SIZE * 2];
+    uint8_t buf[BLOCK_MAX_SECTOR_SIZE];
 
-    if (!dev || !dev->read) {
+    if (!dev) {
         return 0;
     }
 
-    if (!dev->read(dev, partition_lba + EXT4_SUPERBLOCK_LBA, 2, buf)) {
+    uint32_t sector_size = block_sector_size(dev);
+    uint32_t skip = EXT4_SUPERBLOCK_OFFSET % sector_size;
+    uint32_t count = (skip + EXT4_SUPERBLOCK_SIZE + sector_size - 1) / sector_size;
+    if (!block_read(dev, partition_lba + EXT4_SUPERBLOCK_OFFSET / sector_size, count, buf)) {
         return 0;
     }
 
-    Ext4SuperblockRaw *raw = (Ext4SuperblockRaw *)buf;
+    Ext4SuperblockRaw *raw = (Ext4SuperblockRaw *)(buf + skip);
     if (raw->s_magic != EXT4_SUPER_MAGIC) {
         return 0;
     }
 
     uint32_t block_size = 1024U << raw->s_log_block_size;
+    /* Each ext4 block must be whole logical blocks so that it is exactly
+     * one command; a 1 KiB-block filesystem cannot live on a 4Kn disk */
+    if (raw->s_log_block_size > 2 || block_size < sector_size) {
+        serial_write("EXT4: block size unsupported on this device\n");
+        KERR("EXT4: block size unsupported on this device");
+        return 0;
+    }
 
     out_sb->block_size = block_size;
     out_sb->inodes_per_group = raw->s_inodes_per_group;
@@ -655,14 +1214,20 @@ int ext4_mount(Ext4Fs *fs, BlockDevice *dev, uint64_t partition_lba) {
         return 0;
     }
 
+    /* Write back anything a previous mount left dirty before reading the
+     * superblock straight from the disk */
+    bufcache_invalidate(dev);
     if (!read_superblock(dev, partition_lba, &fs->sb)) {
         serial_write("EXT4: invalid superblock\n");
         KERR("EXT4: invalid superblock");
         return 0;
     }
 
+    path_cache_flush(fs);
+    ext4_ra_forget(fs);
     fs->device = dev;
     fs->partition_lba = partition_lba;
+    fs->sectors_per_block = fs->sb.block_size / block_sector_size(dev);
 
     serial_write("EXT4: superblock loaded\n");
     KLOG("EXT4: superblock loaded");
@@ -670,42 +1235,61 @@ int ext4_mount(Ext4Fs *fs, BlockDevice *dev, uint64_t partition_lba) {
 }
 
 int ext4_read_file(Ext4Fs *fs, const char *path, void *buffer, uint32_t max_size, uint32_t *out_size) {
+    return ext4_read_file_at(fs, path, 0, buffer, max_size, out_size);
+}
+
+/* Regular file's inode, with its size, for the read paths */
+static int ext4_open_file(Ext4Fs *fs, const char *path, uint32_t *out_num, Ext4Inode *out_inode, uint64_t *out_size) {
     if (!fs || !path || path[0] != '/') {
         return 0;
     }
 
-    uint32_t inode_num = 0;
     uint8_t type = 0;
-    if (!ext4_resolve_path(fs, path, &inode_num, &type) || type != EXT4_FT_REG_FILE) {
+    if (!ext4_resolve_path(fs, path, out_num, &type) || type != EXT4_FT_REG_FILE) {
         return 0;
     }
-
-    Ext4Inode file_inode;
-    if (!ext4_read_inode(fs, inode_num, &file_inode, 0)) {
+    if (!ext4_read_inode(fs, *out_num, out_inode, 0)) {
         return 0;
     }
-
-    if (!(file_inode.i_flags & EXT4_EXTENTS_FL)) {
+    if (!(out_inode->i_flags & EXT4_EXTENTS_FL)) {
         return 0;
     }
 
-    uint64_t size = ((uint64_t)file_inode.i_size_high << 32) | file_inode.i_size_lo;
-    if (size > max_size) {
-        size = max_size;
+    *out_size = ((uint64_t)out_inode->i_size_high << 32) | out_inode->i_size_lo;
+    return 1;
+}
+
+int ext4_read_file_at(Ext4Fs *fs, const char *path, uint64_t offset, void *buffer, uint32_t size, uint32_t *out_size) {
+    uint32_t inode_num = 0;
+    Ext4Inode file_inode;
+    uint64_t file_size = 0;
+    if (!ext4_open_file(fs, path, &inode_num, &file_inode, &file_size)) {
+        return 0;
     }
 
     uint32_t read_size = 0;
-    if (!ext4_read_extent_blocks(fs, &file_inode, 0, buffer, (uint32_t)size, &read_size)) {
-        return 0;
+    if (offset < file_size) {
+        if (size > file_size - offset) {
+            size = (uint32_t)(file_size - offset);
+        }
+        if (!ext4_read_extent_blocks(fs, &file_inode, offset, buffer, size, &read_size)) {
+            return 0;
+        }
+        ext4_readahead(fs, inode_num, &file_inode, file_size, offset, read_size);
     }
 
     if (out_size) {
         *out_size = read_size;
     }
-
     return 1;
 }
 
+int ext4_file_size(Ext4Fs *fs, const char *path, uint64_t *out_size) {
+    uint32_t inode_num = 0;
+    Ext4Inode file_inode;
+    return ext4_open_file(fs, path, &inode_num, &file_inode, out_size);
+}
+
 int ext4_list_dir(Ext4Fs *fs, const char *path, char *out, uint32_t max_size) {
     if (!fs || !out || max_size == 0) {
         return 0;
@@ -872,19 +1456,41 @@ int ext4_write_file(Ext4Fs *fs, const char *path, const void *buffer, uint32_t s
     uint32_t block_size = fs->sb.block_size;
     uint32_t blocks_needed = (size + block_size - 1) / block_size;
 
+    /* Blocks the file stops using once the new inode is written: the
+     * extents of a replaced mapping, or what lies past blocks_needed */
+    Ext4FreedRun old_runs[4];
+    uint32_t old_count = 0;
+    Ext4ExtentHeader *old_hdr = (Ext4ExtentHeader *)file_inode.i_block;
+    int old_mapped = (file_inode.i_flags & EXT4_EXTENTS_FL) && old_hdr->eh_magic == EXT4_EXTENT_HEADER_MAGIC &&
+                     old_hdr->eh_depth == 0;
+    if (old_mapped) {
+        Ext4Extent *ext = (Ext4Extent *)(old_hdr + 1);
+        for (uint16_t i = 0; i < old_hdr->eh_entries && i < 4; i++) {
+            old_runs[old_count].block = extent_start_block(&ext[i]);
+            old_runs[old_count].count = ext[i].ee_len & 0x7FFF;
+            old_count++;
+        }
+    }
+
+    if (blocks_needed == 0 && old_mapped) {
+        old_hdr->eh_entries = 0;
+    }
+
     if (blocks_needed > 0) {
         int reused = 0;
-        if ((file_inode.i_flags & EXT4_EXTENTS_FL) && ((Ext4ExtentHeader *)file_inode.i_block)->eh_magic == EXT4_EXTENT_HEADER_MAGIC) {
-            Ext4ExtentHeader *hdr = (Ext4ExtentHeader *)file_inode.i_block;
-            if (hdr->eh_depth == 0 && hdr->eh_entries >= 1) {
-                Ext4Extent *ext = (Ext4Extent *)(hdr + 1);
-                uint32_t existing_len = ext[0].ee_len & 0x7FFF;
-                if (existing_len >= blocks_needed) {
-                    if (!ext4_write_extent_blocks(fs, &file_inode, 0, buffer, size)) {
-                        return 0;
-                    }
-                    reused = 1;
+        if (old_mapped && old_hdr->eh_entries >= 1) {
+            Ext4Extent *ext = (Ext4Extent *)(old_hdr + 1);
+            uint32_t existing_len = ext[0].ee_len & 0x7FFF;
+            if (existing_len >= blocks_needed) {
+                /* Keep the head of the first extent, drop the rest */
+                ext[0].ee_len = (uint16_t)blocks_needed;
+                old_hdr->eh_entries = 1;
+                old_runs[0].block += blocks_needed;
+                old_runs[0].count -= blocks_needed;
+                if (!ext4_write_extent_blocks(fs, &file_inode, 0, buffer, size)) {
+                    return 0;
                 }
+                reused = 1;
             }
         }
 
@@ -919,5 +1525,64 @@ int ext4_write_file(Ext4Fs *fs, const char *path, const void *buffer, uint32_t s
     file_inode.i_size_high = 0;
     file_inode.i_blocks_lo = blocks_needed * (block_size / 512);
 
-    return ext4_write_inode(fs, inode_num, &file_inode);
+    if (!ext4_write_inode(fs, inode_num, &file_inode)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < old_count; i++) {
+        if (old_runs[i].count && !ext4_free_block_run(fs, old_runs[i].block, old_runs[i].count)) {
+            serial_write("EXT4: could not free replaced blocks\n");
+        }
+    }
+    ext4_discard_flush(fs);
+    return 1;
+}
+
+int ext4_trim(Ext4Fs *fs, uint64_t *out_bytes) {
+    if (!fs || !fs->device->max_discard_sectors) {
+        return 0;
+    }
+
+    uint64_t trimmed = 0;
+    uint64_t data_blocks = fs->sb.total_blocks - fs->sb.first_data_block;
+    uint32_t groups = (uint32_t)((data_blocks + fs->sb.blocks_per_group - 1) / fs->sb.blocks_per_group);
+    for (uint32_t group = 0; group < groups; group++) {
+        uint8_t gd_buf[4096];
+        Ext4GroupDesc gd;
+        if (!ext4_read_group_desc(fs, group, &gd, gd_buf)) {
+            return 0;
+        }
+        /* An uninitialised bitmap reads as all free, backup superblock
+         * included; such a group is skipped rather than computed */
+        if (gd.bg_flags & EXT4_BG_BLOCK_UNINIT) {
+            continue;
+        }
+        uint8_t bitmap[4096];
+        if (!ext4_read_block(fs, gd.bg_block_bitmap_lo, bitmap)) {
+            return 0;
+        }
+
+        uint64_t base = fs->sb.first_data_block + (uint64_t)group * fs->sb.blocks_per_group;
+        uint32_t in_group = fs->sb.blocks_per_group;
+        if (base + in_group > fs->sb.total_blocks) {
+            in_group = (uint32_t)(fs->sb.total_blocks - base);
+        }
+        uint32_t run = 0;
+        for (uint32_t i = 0; i <= in_group; i++) {
+            if (i < in_group && !(bitmap[i / 8] & (1 << (i % 8)))) {
+                run++;
+                continue;
+            }
+            if (run) {
+                ext4_discard_queue(fs, base + i - run, run);
+                trimmed += (uint64_t)run * fs->sb.block_size;
+                run = 0;
+            }
+        }
+        ext4_discard_flush(fs);
+    }
+
+    if (out_bytes) {
+        *out_bytes = trimmed;
+    }
+    return 1;
 }
@@ -4,7 +4,8 @@
 #include "types.h"
 #include "drivers/storage/block.h"
 
-#define EXT4_SUPERBLOCK_LBA 2
+#define EXT4_SUPERBLOCK_OFFSET 1024    /* Bytes from the start of the partition */
+#define EXT4_SUPERBLOCK_SIZE 1024
 #define EXT4_SUPER_MAGIC 0xEF53
 
 typedef struct {
@@ -24,12 +25,22 @@ typedef struct {
 typedef struct {
     BlockDevice *device;
     Ext4SuperblockInfo sb;
-    uint64_t partition_lba;
+    uint64_t partition_lba;         /* In the device's logical blocks */
+    uint32_t sectors_per_block;     /* Device logical blocks per ext4 block */
 } Ext4Fs;
 
 int ext4_mount(Ext4Fs *fs, BlockDevice *dev, uint64_t partition_lba);
 int ext4_read_file(Ext4Fs *fs, const char *path, void *buffer, uint32_t max_size, uint32_t *out_size);
+/* Read up to size bytes from offset; *out_size is short at end of file.
+ * Sequential callers get the following blocks prefetched. */
+int ext4_read_file_at(Ext4Fs *fs, const char *path, uint64_t offset, void *buffer, uint32_t size, uint32_t *out_size);
+int ext4_file_size(Ext4Fs *fs, const char *path, uint64_t *out_size);
 int ext4_list_dir(Ext4Fs *fs, const char *path, char *out, uint32_t max_size);
+/* Blocks a rewrite no longer needs are freed and, on a device that
+ * takes discards, discarded */
 int ext4_write_file(Ext4Fs *fs, const char *path, const void *buffer, uint32_t size);
+/* Discard every free block (fstrim). *out_bytes gets the amount. Returns
+ * 0 if the device cannot discard or a bitmap could not be read. */
+int ext4_trim(Ext4Fs *fs, uint64_t *out_bytes);
 
 #endif
@@ -25,9 +25,30 @@ int vfs_read_file(const char *path, void *buffer, uint32_t max_size, uint32_t *o
     return ext4_read_file(g_ext4, path, buffer, max_size, out_size);
 }
 
+int vfs_read_file_at(const char *path, uint64_t offset, void *buffer, uint32_t size, uint32_t *out_size) {
+    if (!g_ext4) {
+        return 0;
+    }
+    return ext4_read_file_at(g_ext4, path, offset, buffer, size, out_size);
+}
+
+int vfs_file_size(const char *path, uint64_t *out_size) {
+    if (!g_ext4) {
+        return 0;
+    }
+    return ext4_file_size(g_ext4, path, out_size);
+}
+
 int vfs_write_file(const char *path, const void *buffer, uint32_t size) {
     if (!g_ext4) {
         return 0;
     }
     return ext4_write_file(g_ext4, path, buffer, size);
 }
+
+int vfs_trim(uint64_t *out_bytes) {
+    if (!g_ext4) {
+        return 0;
+    }
+    return ext4_trim(g_ext4, out_bytes);
+}
@@ -9,6 +9,9 @@ int vfs_is_mounted(void);
 
 int vfs_list_dir(const char *path, char *out, uint32_t max_size);
 int vfs_read_file(const char *path, void *buffer, uint32_t max_size, uint32_t *out_size);
+int vfs_read_file_at(const char *path, uint64_t offset, void *buffer, uint32_t size, uint32_t *out_size);
+int vfs_file_size(const char *path, uint64_t *out_size);
 int vfs_write_file(const char *path, const void *buffer, uint32_t size);
+int vfs_trim(uint64_t *out_bytes);
 
 #endif
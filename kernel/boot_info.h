@@ -9,6 +9,8 @@
 
 #define BOOT_INFO_MAGIC        0x4B414741  /* "KAGA" in ASCII */
 #define BOOT_INFO_ADDR         0x90500
+#define MEMORY_MAP_ADDR        0x90600     /* MEMORY_MAP_ENTRY array from the loader */
+#define MEMORY_MAP_MAX         128
 
 typedef struct {
     uint32_t magic;              /* Magic number for validation (0x4B414741) */
@@ -39,6 +41,13 @@ typedef struct {
     uint32_t framebuffer_height; /* Height in pixels */
     uint32_t framebuffer_pitch;  /* Bytes per scanline */
     uint32_t framebuffer_bpp;    /* Bits per pixel (usually 32) */
+    
+    /* ACPI (UEFI only) */
+    uint64_t acpi_rsdp;          /* Physical address of the RSDP, 0 if none */
+
+    /* Ramdisk image (UEFI only) */
+    uint64_t ramdisk_addr;       /* Physical address of ramdisk.img, 0 if none */
+    uint64_t ramdisk_size;       /* Bytes */
 } __attribute__((packed)) BOOT_INFO;
 
 /* Bootloader types */
@@ -49,10 +58,15 @@ typedef struct {
 typedef struct {
     uint64_t base_addr;
     uint64_t length;
-    uint32_t type;               /* 1=usable, 2=reserved, 3=ACPI, 4=NVS */
+    uint32_t type;               /* MEMORY_TYPE_* */
     uint32_t acpi_attr;
 } __attribute__((packed)) MEMORY_MAP_ENTRY;
 
+#define MEMORY_TYPE_USABLE     1
+#define MEMORY_TYPE_RESERVED   2
+#define MEMORY_TYPE_ACPI       3
+#define MEMORY_TYPE_NVS        4
+
 /* Get boot info pointer */
 static inline BOOT_INFO* get_boot_info(void) {
     return (BOOT_INFO*)0x90500;
@@ -0,0 +1,369 @@
+#include "acpi.h"
+#include "serial.h"
+#include "klog.h"
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    /* ACPI 2.0+ */
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    AcpiSdtHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) AcpiMadt;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) AcpiMadtEntry;
+
+typedef struct {
+    AcpiMadtEntry h;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) AcpiMadtLapic;
+
+typedef struct {
+    AcpiMadtEntry h;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed)) AcpiMadtIoApic;
+
+typedef struct {
+    AcpiMadtEntry h;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed)) AcpiMadtOverride;
+
+typedef struct {
+    AcpiMadtEntry h;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed)) AcpiMadtLapicOverride;
+
+typedef struct {
+    AcpiMadtEntry h;
+    uint16_t reserved;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t acpi_uid;
+} __attribute__((packed)) AcpiMadtX2Apic;
+
+typedef struct {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed)) AcpiMcfgEntry;
+
+typedef struct {
+    AcpiSdtHeader header;
+    uint32_t event_timer_block_id;
+    uint8_t address_space_id;
+    uint8_t register_bit_width;
+    uint8_t register_bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} __attribute__((packed)) AcpiHpet;
+
+#define MADT_LAPIC           0
+#define MADT_IOAPIC          1
+#define MADT_OVERRIDE        2
+#define MADT_LAPIC_OVERRIDE  5
+#define MADT_X2APIC          9
+
+#define MADT_CPU_ENABLED         0x1
+#define MADT_CPU_ONLINE_CAPABLE  0x2
+
+static AcpiInfo acpi_info;
+static int acpi_ready = 0;
+static uint64_t root_table = 0;     /* XSDT or RSDT */
+static int root_is_xsdt = 0;
+
+static int sig_eq(const char *a, const char *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int checksum_ok(const void *ptr, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)ptr;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        sum = (uint8_t)(sum + p[i]);
+    }
+    return sum == 0;
+}
+
+static void log_hex(const char *label, uint64_t value) {
+    const char *hex = "0123456789ABCDEF";
+    char buf[64];
+    int pos = 0;
+    while (*label && pos < 40) {
+        buf[pos++] = *label++;
+    }
+    buf[pos++] = '0';
+    buf[pos++] = 'x';
+    int started = 0;
+    for (int i = 15; i >= 0; i--) {
+        uint8_t nibble = (value >> (i * 4)) & 0xF;
+        if (nibble || started || i == 0) {
+            buf[pos++] = hex[nibble];
+            started = 1;
+        }
+    }
+    buf[pos] = 0;
+    KLOG(buf);
+    buf[pos++] = '\n';
+    buf[pos] = 0;
+    serial_write(buf);
+}
+
+static void parse_madt(const AcpiMadt *madt) {
+    acpi_info.lapic_address = madt->lapic_address;
+    acpi_info.pic_compat = (madt->flags & 1) ? 1 : 0;
+
+    const uint8_t *p = (const uint8_t *)madt + sizeof(AcpiMadt);
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+
+    while (p + sizeof(AcpiMadtEntry) <= end) {
+        const AcpiMadtEntry *e = (const AcpiMadtEntry *)p;
+        if (e->length < sizeof(AcpiMadtEntry) || p + e->length > end) {
+            break;
+        }
+
+        switch (e->type) {
+        case MADT_LAPIC: {
+            const AcpiMadtLapic *l = (const AcpiMadtLapic *)e;
+            if ((l->flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)) &&
+                acpi_info.cpu_count < ACPI_MAX_CPUS) {
+                AcpiCpu *cpu = &acpi_info.cpus[acpi_info.cpu_count++];
+                cpu->apic_id = l->apic_id;
+                cpu->acpi_uid = l->acpi_id;
+                cpu->enabled = (l->flags & MADT_CPU_ENABLED) ? 1 : 0;
+            }
+            break;
+        }
+        case MADT_X2APIC: {
+            const AcpiMadtX2Apic *x = (const AcpiMadtX2Apic *)e;
+            if ((x->flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)) &&
+                acpi_info.cpu_count < ACPI_MAX_CPUS) {
+                AcpiCpu *cpu = &acpi_info.cpus[acpi_info.cpu_count++];
+                cpu->apic_id = x->x2apic_id;
+                cpu->acpi_uid = x->acpi_uid;
+                cpu->enabled = (x->flags & MADT_CPU_ENABLED) ? 1 : 0;
+            }
+            break;
+        }
+        case MADT_IOAPIC: {
+            const AcpiMadtIoApic *io = (const AcpiMadtIoApic *)e;
+            if (acpi_info.ioapic_count < ACPI_MAX_IOAPICS) {
+                AcpiIoApic *dst = &acpi_info.ioapics[acpi_info.ioapic_count++];
+                dst->id = io->id;
+                dst->address = io->address;
+                dst->gsi_base = io->gsi_base;
+            }
+            break;
+        }
+        case MADT_OVERRIDE: {
+            const AcpiMadtOverride *o = (const AcpiMadtOverride *)e;
+            if (o->bus == 0 && acpi_info.override_count < ACPI_MAX_OVERRIDES) {
+                AcpiIrqOverride *dst = &acpi_info.overrides[acpi_info.override_count++];
+                dst->source_irq = o->source;
+                dst->gsi = o->gsi;
+                dst->flags = o->flags;
+            }
+            break;
+        }
+        case MADT_LAPIC_OVERRIDE: {
+            const AcpiMadtLapicOverride *lo = (const AcpiMadtLapicOverride *)e;
+            acpi_info.lapic_address = lo->address;
+            break;
+        }
+        default:
+            break;
+        }
+
+        p += e->length;
+    }
+}
+
+static void parse_mcfg(const AcpiSdtHeader *mcfg) {
+    /* 8 reserved bytes follow the header */
+    const uint8_t *p = (const uint8_t *)mcfg + sizeof(AcpiSdtHeader) + 8;
+    const uint8_t *end = (const uint8_t *)mcfg + mcfg->length;
+
+    while (p + sizeof(AcpiMcfgEntry) <= end && acpi_info.ecam_count < ACPI_MAX_ECAM) {
+        const AcpiMcfgEntry *e = (const AcpiMcfgEntry *)p;
+        AcpiEcam *dst = &acpi_info.ecam[acpi_info.ecam_count++];
+        dst->base = e->base;
+        dst->segment = e->segment;
+        dst->start_bus = e->start_bus;
+        dst->end_bus = e->end_bus;
+        p += sizeof(AcpiMcfgEntry);
+    }
+}
+
+static void parse_hpet(const AcpiHpet *hpet) {
+    if (hpet->address_space_id != 0) {
+        return;  /* Only memory-mapped HPETs are usable */
+    }
+    acpi_info.hpet_address = hpet->address;
+    acpi_info.hpet_number = hpet->hpet_number;
+    acpi_info.hpet_min_tick = hpet->minimum_tick;
+}
+
+static uint32_t root_entry_count(void) {
+    const AcpiSdtHeader *root = (const AcpiSdtHeader *)(uintptr_t)root_table;
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    return (root->length - sizeof(AcpiSdtHeader)) / entry_size;
+}
+
+static const AcpiSdtHeader *root_entry(uint32_t index) {
+    const uint8_t *entries = (const uint8_t *)(uintptr_t)root_table + sizeof(AcpiSdtHeader);
+    uint64_t addr;
+    if (root_is_xsdt) {
+        const uint8_t *e = entries + index * 8;
+        addr = 0;
+        for (int i = 7; i >= 0; i--) {
+            addr = (addr << 8) | e[i];   /* XSDT entries are only 4-byte aligned */
+        }
+    } else {
+        addr = ((const uint32_t *)entries)[index];
+    }
+    return (const AcpiSdtHeader *)(uintptr_t)addr;
+}
+
+const AcpiSdtHeader *acpi_find_table(const char *signature) {
+    if (!root_table || !signature) {
+        return 0;
+    }
+
+    uint32_t count = root_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        const AcpiSdtHeader *h = root_entry(i);
+        if (!h || !sig_eq(h->signature, signature, 4)) {
+            continue;
+        }
+        if (!checksum_ok(h, h->length)) {
+            serial_write("ACPI: bad table checksum, skipped\n");
+            continue;
+        }
+        return h;
+    }
+    return 0;
+}
+
+int acpi_init(uint64_t rsdp_addr) {
+    acpi_ready = 0;
+    root_table = 0;
+
+    uint8_t *clear = (uint8_t *)&acpi_info;
+    for (uint32_t i = 0; i < sizeof(acpi_info); i++) {
+        clear[i] = 0;
+    }
+
+    if (rsdp_addr == 0) {
+        KERR("ACPI: no RSDP from loader");
+        return 0;
+    }
+
+    const AcpiRsdp *rsdp = (const AcpiRsdp *)(uintptr_t)rsdp_addr;
+    if (!sig_eq(rsdp->signature, "RSD PTR ", 8) || !checksum_ok(rsdp, 20)) {
+        KERR("ACPI: invalid RSDP");
+        return 0;
+    }
+
+    acpi_info.revision = rsdp->revision;
+    for (int i = 0; i < 6; i++) {
+        acpi_info.oem_id[i] = rsdp->oem_id[i];
+    }
+    acpi_info.oem_id[6] = 0;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0 && checksum_ok(rsdp, rsdp->length)) {
+        root_table = rsdp->xsdt_address;
+        root_is_xsdt = 1;
+    } else {
+        root_table = rsdp->rsdt_address;
+        root_is_xsdt = 0;
+    }
+
+    const AcpiSdtHeader *root = (const AcpiSdtHeader *)(uintptr_t)root_table;
+    if (!root_table ||
+        !sig_eq(root->signature, root_is_xsdt ? "XSDT" : "RSDT", 4) ||
+        !checksum_ok(root, root->length)) {
+        KERR("ACPI: invalid root table");
+        root_table = 0;
+        return 0;
+    }
+
+    const AcpiSdtHeader *madt = acpi_find_table("APIC");
+    if (madt) {
+        parse_madt((const AcpiMadt *)madt);
+    }
+    const AcpiSdtHeader *mcfg = acpi_find_table("MCFG");
+    if (mcfg) {
+        parse_mcfg(mcfg);
+    }
+    const AcpiSdtHeader *hpet = acpi_find_table("HPET");
+    if (hpet) {
+        parse_hpet((const AcpiHpet *)hpet);
+    }
+
+    acpi_ready = 1;
+
+    log_hex(root_is_xsdt ? "ACPI: XSDT at " : "ACPI: RSDT at ", root_table);
+    log_hex("ACPI: CPUs ", acpi_info.cpu_count);
+    log_hex("ACPI: IOAPICs ", acpi_info.ioapic_count);
+    if (acpi_info.ecam_count) {
+        log_hex("ACPI: ECAM at ", acpi_info.ecam[0].base);
+    }
+    if (acpi_info.hpet_address) {
+        log_hex("ACPI: HPET at ", acpi_info.hpet_address);
+    }
+    return 1;
+}
+
+int acpi_available(void) {
+    return acpi_ready;
+}
+
+const AcpiInfo *acpi_get_info(void) {
+    return acpi_ready ? &acpi_info : 0;
+}
+
+uint32_t acpi_irq_to_gsi(uint8_t irq, uint16_t *flags) {
+    if (flags) {
+        *flags = 0;
+    }
+    for (uint32_t i = 0; i < acpi_info.override_count; i++) {
+        if (acpi_info.overrides[i].source_irq == irq) {
+            if (flags) {
+                *flags = acpi_info.overrides[i].flags;
+            }
+            return acpi_info.overrides[i].gsi;
+        }
+    }
+    return irq;  /* Identity mapped, ISA defaults (edge, active high) */
+}
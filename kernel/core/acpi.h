@@ -0,0 +1,95 @@
+#ifndef KAGAMI_ACPI_H
+#define KAGAMI_ACPI_H
+
+#include "types.h"
+
+/* ACPI table discovery.
+ * The UEFI loader hands over the RSDP; acpi_init() walks the XSDT (or RSDT
+ * on ACPI 1.0 firmware) and caches what SMP bring-up, interrupt routing and
+ * PCIe config access need from MADT, MCFG and HPET.
+ */
+
+#define ACPI_MAX_CPUS       64
+#define ACPI_MAX_IOAPICS    8
+#define ACPI_MAX_OVERRIDES  16
+#define ACPI_MAX_ECAM       4
+
+/* MPS INTI flags (interrupt source overrides) */
+#define ACPI_INTI_POLARITY_MASK  0x3
+#define ACPI_INTI_ACTIVE_HIGH    0x1
+#define ACPI_INTI_ACTIVE_LOW     0x3
+#define ACPI_INTI_TRIGGER_MASK   0xC
+#define ACPI_INTI_EDGE           0x4
+#define ACPI_INTI_LEVEL          0xC
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiSdtHeader;
+
+typedef struct {
+    uint32_t apic_id;
+    uint32_t acpi_uid;
+    uint8_t enabled;        /* 0 = online-capable only */
+} AcpiCpu;
+
+typedef struct {
+    uint8_t id;
+    uint64_t address;
+    uint32_t gsi_base;
+} AcpiIoApic;
+
+typedef struct {
+    uint8_t source_irq;     /* ISA IRQ */
+    uint32_t gsi;
+    uint16_t flags;         /* ACPI_INTI_* */
+} AcpiIrqOverride;
+
+typedef struct {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+} AcpiEcam;
+
+typedef struct {
+    uint8_t revision;           /* RSDP revision: 0 = ACPI 1.0, 2+ = XSDT */
+    char oem_id[7];
+    uint64_t lapic_address;
+    uint8_t pic_compat;         /* MADT PCAT_COMPAT: legacy 8259s present */
+
+    uint32_t cpu_count;
+    AcpiCpu cpus[ACPI_MAX_CPUS];
+
+    uint32_t ioapic_count;
+    AcpiIoApic ioapics[ACPI_MAX_IOAPICS];
+
+    uint32_t override_count;
+    AcpiIrqOverride overrides[ACPI_MAX_OVERRIDES];
+
+    uint32_t ecam_count;
+    AcpiEcam ecam[ACPI_MAX_ECAM];
+
+    uint64_t hpet_address;      /* 0 if no HPET table */
+    uint8_t hpet_number;
+    uint16_t hpet_min_tick;
+} AcpiInfo;
+
+int acpi_init(uint64_t rsdp_addr);
+int acpi_available(void);
+const AcpiInfo *acpi_get_info(void);
+
+/* Locate a table by signature (e.g. "FACP"); NULL-equivalent 0 if absent */
+const AcpiSdtHeader *acpi_find_table(const char *signature);
+
+/* ISA IRQ -> GSI using MADT overrides; flags gets ACPI_INTI_* (may be 0) */
+uint32_t acpi_irq_to_gsi(uint8_t irq, uint16_t *flags);
+
+#endif
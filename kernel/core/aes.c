@@ -0,0 +1,495 @@
+#include "aes.h"
+#include "fpu.h"
+#include "serial.h"
+#include "klog.h"
+
+/* Built with -mno-sse, so the compiler never touches the xmm registers and
+ * the AES-NI asm below needs no xmm clobbers (see simd.c). */
+
+/* Tables are generated on first use rather than spelled out */
+static uint8_t sbox[256];
+static uint8_t inv_sbox[256];
+static uint32_t te[4][256];             /* SubBytes + ShiftRows + MixColumns */
+static uint32_t td[4][256];             /* The inverse */
+static int ready = 0;
+static int aesni_ok = 0;
+
+static inline uint32_t ror32(uint32_t v, int n) {
+    return (v >> n) | (v << (32 - n));
+}
+
+static inline uint8_t rol8(uint8_t v, int n) {
+    return (uint8_t)((v << n) | (v >> (8 - n)));
+}
+
+static inline uint8_t xtime(uint8_t v) {
+    return (uint8_t)((v << 1) ^ ((v & 0x80) ? 0x1B : 0));
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint8_t p = 0;
+    while (b) {
+        if (b & 1) {
+            p ^= a;
+        }
+        a = xtime(a);
+        b >>= 1;
+    }
+    return p;
+}
+
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void build_tables(void) {
+    /* p runs through the powers of 3 and q through those of 1/3, so q is
+     * the inverse of p; the S-box is the affine map of the inverse */
+    uint8_t p = 1;
+    uint8_t q = 1;
+    do {
+        p = (uint8_t)(p ^ xtime(p));
+        q ^= (uint8_t)(q << 1);
+        q ^= (uint8_t)(q << 2);
+        q ^= (uint8_t)(q << 4);
+        if (q & 0x80) {
+            q ^= 0x09;
+        }
+        sbox[p] = (uint8_t)(q ^ rol8(q, 1) ^ rol8(q, 2) ^ rol8(q, 3) ^ rol8(q, 4) ^ 0x63);
+    } while (p != 1);
+    sbox[0] = 0x63;
+
+    for (int i = 0; i < 256; i++) {
+        inv_sbox[sbox[i]] = (uint8_t)i;
+    }
+    for (int i = 0; i < 256; i++) {
+        uint8_t s = sbox[i];
+        uint8_t si = inv_sbox[i];
+        te[0][i] = ((uint32_t)xtime(s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) |
+                   (uint32_t)(uint8_t)(xtime(s) ^ s);
+        td[0][i] = ((uint32_t)gf_mul(si, 14) << 24) | ((uint32_t)gf_mul(si, 9) << 16) |
+                   ((uint32_t)gf_mul(si, 13) << 8) | gf_mul(si, 11);
+        for (int t = 1; t < 4; t++) {
+            te[t][i] = ror32(te[t - 1][i], 8);
+            td[t][i] = ror32(td[t - 1][i], 8);
+        }
+    }
+}
+
+static inline uint32_t sub_word(uint32_t w) {
+    return ((uint32_t)sbox[w >> 24] << 24) | ((uint32_t)sbox[(w >> 16) & 0xFF] << 16) |
+           ((uint32_t)sbox[(w >> 8) & 0xFF] << 8) | sbox[w & 0xFF];
+}
+
+static inline uint32_t inv_mix_word(uint32_t w) {
+    return td[0][sbox[w >> 24]] ^ td[1][sbox[(w >> 16) & 0xFF]] ^
+           td[2][sbox[(w >> 8) & 0xFF]] ^ td[3][sbox[w & 0xFF]];
+}
+
+static void expand_key(AesKey *k, const uint8_t *key, uint32_t key_len) {
+    uint32_t nk = key_len / 4;
+    uint32_t words = 4 * (nk + 7);
+    uint32_t *w = k->enc;
+    uint8_t rcon = 1;
+
+    k->rounds = nk + 6;
+    for (uint32_t i = 0; i < nk; i++) {
+        w[i] = load_be32(key + 4 * i);
+    }
+    for (uint32_t i = nk; i < words; i++) {
+        uint32_t t = w[i - 1];
+        if (i % nk == 0) {
+            t = sub_word(ror32(t, 24)) ^ ((uint32_t)rcon << 24);
+            rcon = xtime(rcon);
+        } else if (nk > 6 && i % nk == 4) {
+            t = sub_word(t);
+        }
+        w[i] = w[i - nk] ^ t;
+    }
+
+    /* Decryption runs the rounds backwards with InvMixColumns folded into
+     * the inner round keys - the layout aesdec expects as well */
+    for (uint32_t r = 0; r <= k->rounds; r++) {
+        for (uint32_t c = 0; c < 4; c++) {
+            uint32_t v = w[4 * (k->rounds - r) + c];
+            if (r != 0 && r != k->rounds) {
+                v = inv_mix_word(v);
+            }
+            k->dec[4 * r + c] = v;
+        }
+    }
+    for (uint32_t i = 0; i < words; i++) {
+        store_be32(k->ni_enc + 4 * i, k->enc[i]);
+        store_be32(k->ni_dec + 4 * i, k->dec[i]);
+    }
+}
+
+/* ---- Software cipher ------------------------------------------------------ */
+
+static void soft_encrypt(const AesKey *k, uint8_t *out, const uint8_t *in) {
+    const uint32_t *rk = k->enc;
+    uint32_t s0 = load_be32(in) ^ rk[0];
+    uint32_t s1 = load_be32(in + 4) ^ rk[1];
+    uint32_t s2 = load_be32(in + 8) ^ rk[2];
+    uint32_t s3 = load_be32(in + 12) ^ rk[3];
+
+    for (uint32_t r = 1; r < k->rounds; r++) {
+        rk += 4;
+        uint32_t t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xFF] ^ te[2][(s2 >> 8) & 0xFF] ^ te[3][s3 & 0xFF] ^ rk[0];
+        uint32_t t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xFF] ^ te[2][(s3 >> 8) & 0xFF] ^ te[3][s0 & 0xFF] ^ rk[1];
+        uint32_t t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xFF] ^ te[2][(s0 >> 8) & 0xFF] ^ te[3][s1 & 0xFF] ^ rk[2];
+        uint32_t t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xFF] ^ te[2][(s1 >> 8) & 0xFF] ^ te[3][s2 & 0xFF] ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 4;
+
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; c++) {
+        uint32_t v = ((uint32_t)sbox[s[c] >> 24] << 24) |
+                     ((uint32_t)sbox[(s[(c + 1) & 3] >> 16) & 0xFF] << 16) |
+                     ((uint32_t)sbox[(s[(c + 2) & 3] >> 8) & 0xFF] << 8) |
+                     sbox[s[(c + 3) & 3] & 0xFF];
+        store_be32(out + 4 * c, v ^ rk[c]);
+    }
+}
+
+static void soft_decrypt(const AesKey *k, uint8_t *out, const uint8_t *in) {
+    const uint32_t *rk = k->dec;
+    uint32_t s0 = load_be32(in) ^ rk[0];
+    uint32_t s1 = load_be32(in + 4) ^ rk[1];
+    uint32_t s2 = load_be32(in + 8) ^ rk[2];
+    uint32_t s3 = load_be32(in + 12) ^ rk[3];
+
+    for (uint32_t r = 1; r < k->rounds; r++) {
+        rk += 4;
+        uint32_t t0 = td[0][s0 >> 24] ^ td[1][(s3 >> 16) & 0xFF] ^ td[2][(s2 >> 8) & 0xFF] ^ td[3][s1 & 0xFF] ^ rk[0];
+        uint32_t t1 = td[0][s1 >> 24] ^ td[1][(s0 >> 16) & 0xFF] ^ td[2][(s3 >> 8) & 0xFF] ^ td[3][s2 & 0xFF] ^ rk[1];
+        uint32_t t2 = td[0][s2 >> 24] ^ td[1][(s1 >> 16) & 0xFF] ^ td[2][(s0 >> 8) & 0xFF] ^ td[3][s3 & 0xFF] ^ rk[2];
+        uint32_t t3 = td[0][s3 >> 24] ^ td[1][(s2 >> 16) & 0xFF] ^ td[2][(s1 >> 8) & 0xFF] ^ td[3][s0 & 0xFF] ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 4;
+
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; c++) {
+        uint32_t v = ((uint32_t)inv_sbox[s[c] >> 24] << 24) |
+                     ((uint32_t)inv_sbox[(s[(c + 3) & 3] >> 16) & 0xFF] << 16) |
+                     ((uint32_t)inv_sbox[(s[(c + 2) & 3] >> 8) & 0xFF] << 8) |
+                     inv_sbox[s[(c + 1) & 3] & 0xFF];
+        store_be32(out + 4 * c, v ^ rk[c]);
+    }
+}
+
+/* ---- AES-NI --------------------------------------------------------------- */
+
+/* One block, rk in memory order. Caller holds the FPU. */
+static void ni_block(uint8_t *out, const uint8_t *in, const uint8_t *rk, uint64_t rounds, int encrypt) {
+    const uint8_t *p;
+    uint64_t n;
+    if (encrypt) {
+        __asm__ __volatile__(
+            "movdqu (%[in]), %%xmm0\n\t"
+            "movdqu (%[rk]), %%xmm1\n\t"
+            "pxor %%xmm1, %%xmm0\n\t"
+            "lea 16(%[rk]), %[p]\n\t"
+            "mov %[r], %[n]\n\t"
+            "1:\n\t"
+            "movdqu (%[p]), %%xmm1\n\t"
+            "aesenc %%xmm1, %%xmm0\n\t"
+            "add $16, %[p]\n\t"
+            "dec %[n]\n\t"
+            "jnz 1b\n\t"
+            "movdqu (%[p]), %%xmm1\n\t"
+            "aesenclast %%xmm1, %%xmm0\n\t"
+            "movdqu %%xmm0, (%[out])\n\t"
+            : [p] "=&r"(p), [n] "=&r"(n)
+            : [out] "r"(out), [in] "r"(in), [rk] "r"(rk), [r] "r"(rounds - 1)
+            : "memory", "cc");
+    } else {
+        __asm__ __volatile__(
+            "movdqu (%[in]), %%xmm0\n\t"
+            "movdqu (%[rk]), %%xmm1\n\t"
+            "pxor %%xmm1, %%xmm0\n\t"
+            "lea 16(%[rk]), %[p]\n\t"
+            "mov %[r], %[n]\n\t"
+            "1:\n\t"
+            "movdqu (%[p]), %%xmm1\n\t"
+            "aesdec %%xmm1, %%xmm0\n\t"
+            "add $16, %[p]\n\t"
+            "dec %[n]\n\t"
+            "jnz 1b\n\t"
+            "movdqu (%[p]), %%xmm1\n\t"
+            "aesdeclast %%xmm1, %%xmm0\n\t"
+            "movdqu %%xmm0, (%[out])\n\t"
+            : [p] "=&r"(p), [n] "=&r"(n)
+            : [out] "r"(out), [in] "r"(in), [rk] "r"(rk), [r] "r"(rounds - 1)
+            : "memory", "cc");
+    }
+}
+
+/* Eight XTS blocks: data ^ tweak, the cipher on xmm0-7 in lockstep, then
+ * ^ tweak again. tw holds the eight tweaks. Caller holds the FPU. */
+#define XTS8_IN(i, off) \
+    "movdqu " #off "(%[in]), %%xmm" #i "\n\t" \
+    "movdqu " #off "(%[tw]), %%xmm9\n\t" \
+    "pxor %%xmm9, %%xmm" #i "\n\t" \
+    "pxor %%xmm8, %%xmm" #i "\n\t"
+#define XTS8_OUT(i, off) \
+    "movdqu " #off "(%[tw]), %%xmm9\n\t" \
+    "pxor %%xmm9, %%xmm" #i "\n\t" \
+    "movdqu %%xmm" #i ", " #off "(%[out])\n\t"
+#define XTS8_ROUND(insn) \
+    insn " %%xmm8, %%xmm0\n\t" insn " %%xmm8, %%xmm1\n\t" \
+    insn " %%xmm8, %%xmm2\n\t" insn " %%xmm8, %%xmm3\n\t" \
+    insn " %%xmm8, %%xmm4\n\t" insn " %%xmm8, %%xmm5\n\t" \
+    insn " %%xmm8, %%xmm6\n\t" insn " %%xmm8, %%xmm7\n\t"
+#define XTS8_ASM(round, last) \
+    "movdqu (%[rk]), %%xmm8\n\t" \
+    XTS8_IN(0, 0) XTS8_IN(1, 16) XTS8_IN(2, 32) XTS8_IN(3, 48) \
+    XTS8_IN(4, 64) XTS8_IN(5, 80) XTS8_IN(6, 96) XTS8_IN(7, 112) \
+    "lea 16(%[rk]), %[p]\n\t" \
+    "mov %[r], %[n]\n\t" \
+    "1:\n\t" \
+    "movdqu (%[p]), %%xmm8\n\t" \
+    XTS8_ROUND(round) \
+    "add $16, %[p]\n\t" \
+    "dec %[n]\n\t" \
+    "jnz 1b\n\t" \
+    "movdqu (%[p]), %%xmm8\n\t" \
+    XTS8_ROUND(last) \
+    XTS8_OUT(0, 0) XTS8_OUT(1, 16) XTS8_OUT(2, 32) XTS8_OUT(3, 48) \
+    XTS8_OUT(4, 64) XTS8_OUT(5, 80) XTS8_OUT(6, 96) XTS8_OUT(7, 112)
+
+static void ni_xts8(uint8_t *out, const uint8_t *in, const uint64_t *tw, const uint8_t *rk,
+                    uint64_t rounds, int encrypt) {
+    const uint8_t *p;
+    uint64_t n;
+    if (encrypt) {
+        __asm__ __volatile__(XTS8_ASM("aesenc", "aesenclast")
+            : [p] "=&r"(p), [n] "=&r"(n)
+            : [out] "r"(out), [in] "r"(in), [tw] "r"(tw), [rk] "r"(rk), [r] "r"(rounds - 1)
+            : "memory", "cc");
+    } else {
+        __asm__ __volatile__(XTS8_ASM("aesdec", "aesdeclast")
+            : [p] "=&r"(p), [n] "=&r"(n)
+            : [out] "r"(out), [in] "r"(in), [tw] "r"(tw), [rk] "r"(rk), [r] "r"(rounds - 1)
+            : "memory", "cc");
+    }
+}
+
+/* ---- XTS ------------------------------------------------------------------ */
+
+/* Multiply the tweak by x in GF(2^128), little-endian as IEEE 1619 has it */
+static inline void tweak_next(uint64_t *t) {
+    uint64_t carry = t[1] >> 63;
+    t[1] = (t[1] << 1) | (t[0] >> 63);
+    t[0] = (t[0] << 1) ^ (carry ? 0x87 : 0);
+}
+
+static inline void xor_block(uint8_t *out, const uint8_t *in, const uint64_t *t) {
+    ((uint64_t *)out)[0] = ((const uint64_t *)in)[0] ^ t[0];
+    ((uint64_t *)out)[1] = ((const uint64_t *)in)[1] ^ t[1];
+}
+
+static void xts_unit_soft(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                          uint64_t sector, int encrypt) {
+    uint64_t t[2] = { sector, 0 };
+    uint8_t block[AES_BLOCK_SIZE];
+
+    soft_encrypt(&key->tweak, (uint8_t *)t, (const uint8_t *)t);
+    for (uint32_t off = 0; off < bytes; off += AES_BLOCK_SIZE) {
+        xor_block(block, src + off, t);
+        if (encrypt) {
+            soft_encrypt(&key->data, block, block);
+        } else {
+            soft_decrypt(&key->data, block, block);
+        }
+        xor_block(dst + off, block, t);
+        tweak_next(t);
+    }
+}
+
+static void xts_unit_ni(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                        uint64_t sector, int encrypt) {
+    const uint8_t *rk = encrypt ? key->data.ni_enc : key->data.ni_dec;
+    uint64_t rounds = key->data.rounds;
+    uint64_t t[2] = { sector, 0 };
+    uint64_t tw[16];
+    uint32_t off = 0;
+
+    ni_block((uint8_t *)t, (const uint8_t *)t, key->tweak.ni_enc, key->tweak.rounds, 1);
+    while (bytes - off >= 8 * AES_BLOCK_SIZE) {
+        for (int i = 0; i < 8; i++) {
+            tw[2 * i] = t[0];
+            tw[2 * i + 1] = t[1];
+            tweak_next(t);
+        }
+        ni_xts8(dst + off, src + off, tw, rk, rounds, encrypt);
+        off += 8 * AES_BLOCK_SIZE;
+    }
+    while (off < bytes) {
+        uint8_t block[AES_BLOCK_SIZE];
+        xor_block(block, src + off, t);
+        ni_block(block, block, rk, rounds, encrypt);
+        xor_block(dst + off, block, t);
+        tweak_next(t);
+        off += AES_BLOCK_SIZE;
+    }
+}
+
+static void xts_run(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                    uint64_t sector, uint32_t unit_size, int encrypt) {
+    if (unit_size == 0 || unit_size % AES_BLOCK_SIZE) {
+        return;
+    }
+    int ni = key->aesni && aesni_ok;
+    if (ni) {
+        kernel_fpu_begin();
+    }
+    for (uint32_t off = 0; off + unit_size <= bytes; off += unit_size) {
+        if (ni) {
+            xts_unit_ni(key, dst + off, src + off, unit_size, sector++, encrypt);
+        } else {
+            xts_unit_soft(key, dst + off, src + off, unit_size, sector++, encrypt);
+        }
+    }
+    if (ni) {
+        kernel_fpu_end();
+    }
+}
+
+void xts_encrypt(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                 uint64_t sector, uint32_t unit_size) {
+    xts_run(key, dst, src, bytes, sector, unit_size, 1);
+}
+
+void xts_decrypt(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                 uint64_t sector, uint32_t unit_size) {
+    xts_run(key, dst, src, bytes, sector, unit_size, 0);
+}
+
+/* ---- Setup ---------------------------------------------------------------- */
+
+static int bytes_equal(const uint8_t *a, const uint8_t *b, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void set_keys(XtsKey *key, const uint8_t *bytes, uint32_t key_len) {
+    expand_key(&key->data, bytes, key_len / 2);
+    expand_key(&key->tweak, bytes + key_len / 2, key_len / 2);
+}
+
+/* IEEE 1619 vector 1 through the software cipher, then AES-NI checked
+ * against it on a whole sector, both ways */
+static int self_test(int ni) {
+    static const uint8_t vector1[32] = {
+        0x91, 0x7c, 0xf6, 0x9e, 0xbd, 0x68, 0xb2, 0xec, 0x9b, 0x9f, 0xe9, 0xa3, 0xea, 0xdd, 0xa6, 0x92,
+        0xcd, 0x43, 0xd2, 0xf5, 0x95, 0x98, 0xed, 0x85, 0x8c, 0x02, 0xc2, 0x65, 0x2f, 0xbf, 0x92, 0x2e,
+    };
+    static XtsKey key;
+    static uint8_t bytes[64];
+    static uint8_t plain[512];
+    static uint8_t soft[512];
+    static uint8_t out[512];
+
+    for (uint32_t i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = 0;
+    }
+    for (uint32_t i = 0; i < 32; i++) {
+        plain[i] = 0;
+    }
+    set_keys(&key, bytes, 32);
+    key.aesni = ni;
+    xts_encrypt(&key, out, plain, 32, 0, 32);
+    if (!bytes_equal(out, vector1, 32)) {
+        return 0;
+    }
+    if (!ni) {
+        return 1;
+    }
+
+    for (uint32_t key_len = 32; key_len <= 64; key_len += 32) {
+        for (uint32_t i = 0; i < key_len; i++) {
+            bytes[i] = (uint8_t)(i * 7 + 1);
+        }
+        for (uint32_t i = 0; i < sizeof(plain); i++) {
+            plain[i] = (uint8_t)(i * 13 + (i >> 8));
+        }
+        set_keys(&key, bytes, key_len);
+        key.aesni = 0;
+        xts_encrypt(&key, soft, plain, sizeof(plain), 0x123456789ULL, sizeof(plain));
+        key.aesni = 1;
+        xts_encrypt(&key, out, plain, sizeof(plain), 0x123456789ULL, sizeof(plain));
+        if (!bytes_equal(out, soft, sizeof(out))) {
+            return 0;
+        }
+        xts_decrypt(&key, out, out, sizeof(out), 0x123456789ULL, sizeof(out));
+        if (!bytes_equal(out, plain, sizeof(out))) {
+            return 0;
+        }
+    }
+    xts_wipe(&key);
+    return 1;
+}
+
+static void aes_init(void) {
+    if (ready) {
+        return;
+    }
+    build_tables();
+    ready = 1;
+
+    if (!self_test(0)) {
+        serial_write("AES: software cipher failed its self test\n");
+        KERR("AES: self test failed");
+    }
+    if (fpu_features() & FPU_FEAT_AESNI) {
+        aesni_ok = 1;
+        if (!self_test(1)) {
+            aesni_ok = 0;
+            serial_write("AES: AES-NI disagrees with the software cipher, not used\n");
+            KERR("AES: AES-NI self test failed");
+        }
+    }
+    serial_write(aesni_ok ? "AES: using AES-NI\n" : "AES: using the software cipher\n");
+}
+
+int aes_has_aesni(void) {
+    aes_init();
+    return aesni_ok;
+}
+
+int xts_setkey(XtsKey *key, const uint8_t *bytes, uint32_t key_len) {
+    if (!key || !bytes || (key_len != 32 && key_len != 64)) {
+        return 0;
+    }
+    aes_init();
+    set_keys(key, bytes, key_len);
+    key->aesni = aesni_ok;
+    return 1;
+}
+
+void xts_wipe(XtsKey *key) {
+    volatile uint8_t *p = (volatile uint8_t *)key;
+    for (uint32_t i = 0; i < sizeof(*key); i++) {
+        p[i] = 0;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef KAGAMI_AES_H
+#define KAGAMI_AES_H
+
+#include "types.h"
+
+/* AES and the XTS mode used for disk encryption (IEEE 1619).
+ *
+ * With AES-NI each sector is processed eight blocks at a time, so the
+ * aesenc latency of one block hides behind the others; the instructions
+ * run inside kernel_fpu_begin/end. Without it a table-driven software
+ * cipher is used, which is correct but several times slower and not
+ * constant time.
+ */
+
+#define AES_BLOCK_SIZE  16
+#define AES_MAX_ROUNDS  14
+
+typedef struct {
+    uint32_t rounds;                              /* 10 for AES-128, 14 for AES-256 */
+    uint32_t enc[4 * (AES_MAX_ROUNDS + 1)];       /* Round keys, big-endian words */
+    uint32_t dec[4 * (AES_MAX_ROUNDS + 1)];       /* Equivalent inverse cipher */
+    uint8_t ni_enc[16 * (AES_MAX_ROUNDS + 1)];    /* The same in memory order, for AES-NI */
+    uint8_t ni_dec[16 * (AES_MAX_ROUNDS + 1)];
+} AesKey;
+
+typedef struct {
+    AesKey data;
+    AesKey tweak;
+    int aesni;                  /* Cleared to force the software cipher */
+} XtsKey;
+
+/* AES-NI present and passing the self test */
+int aes_has_aesni(void);
+
+/* key_len is 32 (XTS-AES-128) or 64 (XTS-AES-256) bytes: the data key
+ * followed by the tweak key. Returns 1 on success. */
+int xts_setkey(XtsKey *key, const uint8_t *bytes, uint32_t key_len);
+void xts_wipe(XtsKey *key);
+
+/* bytes is a whole number of data units of unit_size bytes (a multiple of
+ * 16); unit i is tweaked with sector + i. dst may equal src. */
+void xts_encrypt(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                 uint64_t sector, uint32_t unit_size);
+void xts_decrypt(const XtsKey *key, uint8_t *dst, const uint8_t *src, uint32_t bytes,
+                 uint64_t sector, uint32_t unit_size);
+
+#endif
@@ -0,0 +1,214 @@
+#include "fpu.h"
+#include "irqflags.h"
+#include "serial.h"
+#include "klog.h"
+
+#define CR0_MP (1ULL << 1)
+#define CR0_EM (1ULL << 2)
+#define CR0_TS (1ULL << 3)
+#define CR0_NE (1ULL << 5)
+
+#define CR4_OSFXSR     (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+#define CR4_OSXSAVE    (1ULL << 18)
+
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+
+static uint8_t fpu_area[FPU_MAX_NEST][FPU_AREA_MAX] __attribute__((aligned(64)));
+static volatile uint32_t fpu_depth = 0;
+static uint32_t features = 0;
+static uint64_t xcr0 = 0;
+static uint32_t area_size = 0;
+static uint64_t nested_saves = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t sub, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline void xsetbv(uint32_t index, uint64_t value) {
+    __asm__ __volatile__("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void clts(void) {
+    __asm__ __volatile__("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static void fpu_save(void *area) {
+    if (features & FPU_FEAT_XSAVE) {
+        __asm__ __volatile__("xsave64 (%0)" : : "r"(area), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    } else {
+        __asm__ __volatile__("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(const void *area) {
+    if (features & FPU_FEAT_XSAVE) {
+        __asm__ __volatile__("xrstor64 (%0)" : : "r"(area), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    } else {
+        __asm__ __volatile__("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void append_hex(char *buf, int *pos, uint64_t value, int digits) {
+    const char *hex = "0123456789ABCDEF";
+    for (int i = digits - 1; i >= 0; i--) {
+        buf[(*pos)++] = hex[(value >> (i * 4)) & 0xF];
+    }
+}
+
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+
+    if (!(d & (1U << 24)) || !(d & (1U << 26))) {
+        KERR("FPU: no FXSR/SSE2, SIMD disabled");
+        return;
+    }
+
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    int has_xsave = (c & (1U << 26)) != 0;
+    if (has_xsave) {
+        cr4 |= CR4_OSXSAVE;
+    }
+    write_cr4(cr4);
+
+    __asm__ __volatile__("fninit");
+    uint32_t mxcsr = 0x1F80;   /* All exceptions masked, round to nearest */
+    __asm__ __volatile__("ldmxcsr %0" : : "m"(mxcsr));
+
+    features = FPU_FEAT_FXSR | FPU_FEAT_SSE2;
+    area_size = 512;
+    if (c & (1U << 25)) {
+        features |= FPU_FEAT_AESNI;
+    }
+
+    if (has_xsave) {
+        uint32_t xa, xb, xc, xd;
+        cpuid(0xD, 0, &xa, &xb, &xc, &xd);
+        uint64_t supported = ((uint64_t)xd << 32) | xa;
+
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        if ((c & (1U << 28)) && (supported & XCR0_AVX)) {
+            xcr0 |= XCR0_AVX;
+        }
+        xsetbv(0, xcr0);
+
+        /* EBX reports the area size for the features enabled in XCR0 */
+        cpuid(0xD, 0, &xa, &xb, &xc, &xd);
+        if (xb > FPU_AREA_MAX && (xcr0 & XCR0_AVX)) {
+            xcr0 &= ~XCR0_AVX;
+            xsetbv(0, xcr0);
+            cpuid(0xD, 0, &xa, &xb, &xc, &xd);
+        }
+        if (xb <= FPU_AREA_MAX) {
+            features |= FPU_FEAT_XSAVE;
+            if (xcr0 & XCR0_AVX) {
+                features |= FPU_FEAT_AVX;
+            }
+            area_size = xb;
+        }
+    }
+
+    /* Nobody owns the registers until the first kernel_fpu_begin() */
+    stts();
+
+    char line[64];
+    int pos = 0;
+    const char *prefix = (features & FPU_FEAT_XSAVE) ? "FPU: XSAVE xcr0=0x" : "FPU: FXSAVE xcr0=0x";
+    while (*prefix) {
+        line[pos++] = *prefix++;
+    }
+    append_hex(line, &pos, xcr0, 2);
+    const char *mid = " area=0x";
+    while (*mid) {
+        line[pos++] = *mid++;
+    }
+    append_hex(line, &pos, area_size, 4);
+    line[pos] = 0;
+    KLOG(line);
+    line[pos++] = '\n';
+    line[pos] = 0;
+    serial_write(line);
+}
+
+uint32_t fpu_features(void) {
+    return features;
+}
+
+uint64_t fpu_xcr0(void) {
+    return xcr0;
+}
+
+uint32_t fpu_area_size(void) {
+    return area_size;
+}
+
+uint64_t fpu_nested_saves(void) {
+    return nested_saves;
+}
+
+void kernel_fpu_begin(void) {
+    uint64_t flags = local_irq_save();
+
+    clts();
+    if (fpu_depth > 0) {
+        /* Interrupted another section: its registers are still live */
+        if (fpu_depth > FPU_MAX_NEST) {
+            serial_write("FPU: sections nested too deep\n");
+            while (1) {
+                __asm__ __volatile__("cli; hlt");
+            }
+        }
+        fpu_save(fpu_area[fpu_depth - 1]);
+        nested_saves++;
+    }
+    fpu_depth++;
+
+    local_irq_restore(flags);
+}
+
+void kernel_fpu_end(void) {
+    uint64_t flags = local_irq_save();
+
+    if (fpu_depth > 0) {
+        fpu_depth--;
+        if (fpu_depth > 0) {
+            fpu_restore(fpu_area[fpu_depth - 1]);
+        } else {
+            stts();
+        }
+    }
+
+    local_irq_restore(flags);
+}
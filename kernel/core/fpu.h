@@ -0,0 +1,37 @@
+#ifndef KAGAMI_FPU_H
+#define KAGAMI_FPU_H
+
+#include "types.h"
+
+/* FPU/SIMD context management.
+ * The kernel is built with -mno-sse/-mno-mmx, so the compiler never touches
+ * vector registers on its own. Code that wants SSE/AVX wraps it in
+ * kernel_fpu_begin()/kernel_fpu_end(). Outside such sections CR0.TS is set,
+ * so a stray SIMD instruction traps with #NM instead of silently corrupting
+ * another section's registers. State is only saved when a section is
+ * interrupted by another one (IRQ/softirq nesting) - the lazy part.
+ */
+
+#define FPU_MAX_NEST   4      /* Sections that can be live at once */
+#define FPU_AREA_MAX   4096   /* Per-level save area, bytes */
+
+#define FPU_FEAT_FXSR   (1U << 0)
+#define FPU_FEAT_SSE2   (1U << 1)
+#define FPU_FEAT_XSAVE  (1U << 2)
+#define FPU_FEAT_AVX    (1U << 3)
+#define FPU_FEAT_AESNI  (1U << 4)
+
+void fpu_init(void);
+
+/* FPU_FEAT_* bits usable right now (0 before fpu_init) */
+uint32_t fpu_features(void);
+uint64_t fpu_xcr0(void);
+uint32_t fpu_area_size(void);
+
+/* Nested sections whose registers had to be saved */
+uint64_t fpu_nested_saves(void);
+
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif
@@ -1,4 +1,5 @@
 #include "heap.h"
+#include "pmm.h"
 #include "include/serial.h"
 
 /* Define NULL if not available */
@@ -14,15 +15,23 @@ typedef struct {
     size_t used;
 } HEAP_STATE;
 
+/* Used when the loader passed no memory map */
+static uint8_t heap_fallback[HEAP_FALLBACK_SIZE] __attribute__((aligned(16)));
+
 static HEAP_STATE heap = {
-    .heap_start = (uint8_t*)HEAP_START,
-    .heap_ptr = (uint8_t*)HEAP_START,
-    .heap_size = HEAP_SIZE,
+    .heap_start = heap_fallback,
+    .heap_ptr = heap_fallback,
+    .heap_size = HEAP_FALLBACK_SIZE,
     .used = 0
 };
 
 void heap_init(void) {
-    /* Avoid touching unmapped memory early; just reset pointers */
+    /* The arena comes from free RAM, clear of the kernel image */
+    uint8_t *arena = (uint8_t*)pmm_alloc_pages(HEAP_SIZE / PMM_PAGE_SIZE);
+    if (arena) {
+        heap.heap_start = arena;
+        heap.heap_size = HEAP_SIZE;
+    }
     heap.heap_ptr = heap.heap_start;
     heap.used = 0;
 }
@@ -99,7 +108,7 @@ void heap_stats(void) {
     buf[pos++] = ' ';
 
     /* Total heap size in KB */
-    size_t total_kb = HEAP_SIZE / 1024;
+    size_t total_kb = heap.heap_size / 1024;
     append_uint_dec(buf, &pos, total_kb);
     buf[pos++] = 'K';
     buf[pos++] = 'B';
@@ -5,10 +5,10 @@
 
 /* Memory allocator - simple bump allocator for now */
 
-#define HEAP_START   0x110000   /* Kernel heap starts at 1.1MB */
-#define HEAP_SIZE    0x100000   /* 1MB heap */
+#define HEAP_SIZE           0x100000   /* 1MB heap, carved from free RAM */
+#define HEAP_FALLBACK_SIZE  0x10000    /* Static arena without a memory map */
 
-/* Initialize heap */
+/* Initialize heap (after pmm_init) */
 void heap_init(void);
 
 /* Allocate memory from heap */
@@ -1,5 +1,8 @@
 #include "idt.h"
 #include "keyboard.h"
+#include "softirq.h"
+#include "tsc.h"
+#include "io.h"
 #include "include/serial.h"
 
 /* IDT table - 256 entries for 256 possible interrupt vectors */
@@ -9,6 +12,11 @@ static IDT_REGISTER idt_reg;
 /* Keyboard handler counter (for demonstration) */
 static volatile uint32_t keyboard_presses = 0;
 
+/* Registered top halves, indexed by PIC line. PCI INTx lines are
+ * level-triggered and routinely shared, so every handler on a line runs and
+ * each one checks its own device's status register. */
+static irq_handler_t irq_handlers[IRQ_LINES][IRQ_SHARED_MAX];
+
 /* Interrupt debug hook (serial-safe) */
 static void debug_show_keypress(void) {
     /* Keep minimal to avoid heavy I/O in ISR */
@@ -33,7 +41,28 @@ extern void isr_floating_point(void);
 extern void isr_alignment(void);
 extern void isr_machine_check(void);
 extern void isr_simd(void);
-extern void isr_keyboard(void);
+extern void isr_irq0(void);
+extern void isr_irq1(void);
+extern void isr_irq2(void);
+extern void isr_irq3(void);
+extern void isr_irq4(void);
+extern void isr_irq5(void);
+extern void isr_irq6(void);
+extern void isr_irq7(void);
+extern void isr_irq8(void);
+extern void isr_irq9(void);
+extern void isr_irq10(void);
+extern void isr_irq11(void);
+extern void isr_irq12(void);
+extern void isr_irq13(void);
+extern void isr_irq14(void);
+extern void isr_irq15(void);
+extern void isr_spurious(void);
+
+static void (*const irq_stubs[IRQ_LINES])(void) = {
+    isr_irq0, isr_irq1, isr_irq2, isr_irq3, isr_irq4, isr_irq5, isr_irq6, isr_irq7,
+    isr_irq8, isr_irq9, isr_irq10, isr_irq11, isr_irq12, isr_irq13, isr_irq14, isr_irq15
+};
 
 static void append_hex64(char *buf, int *pos, uint64_t value) {
     const char *hex = "0123456789ABCDEF";
@@ -88,17 +117,80 @@ void default_exception_handler(uint8_t vector, uint64_t error_code, uint64_t rip
 
 /* Entry point for all exception handlers (called from interrupts.asm) */
 void exception_handler(uint8_t vector, uint64_t error_code, uint64_t rip) {
+    if (vector == 7) {
+        serial_write("EXCEPTION: SIMD/FPU use outside kernel_fpu_begin/end\n");
+    }
     default_exception_handler(vector, error_code, rip);
 }
 
-/* Keyboard interrupt handler (PS/2 controller) */
-void keyboard_isr(void) {
+/* Keyboard bottom half - scancode decoding runs with interrupts enabled */
+static void keyboard_bh(uint64_t scancode) {
+    keyboard_push_scancode((uint8_t)scancode);
+}
+
+/* Keyboard interrupt top half (PS/2 controller) */
+static void keyboard_isr(uint8_t irq) {
+    (void)irq;
     uint8_t scancode;
     __asm__ __volatile__("inb $0x60, %0" : "=a"(scancode));
     
     keyboard_presses++;
     debug_show_keypress();
-    keyboard_process_scancode(scancode);
+    softirq_queue(keyboard_bh, scancode);
+}
+
+/* A spurious IRQ7/IRQ15 has no in-service bit set and must not be EOI'd */
+static int irq_is_spurious(uint8_t irq) {
+    uint16_t port = (irq == 7) ? 0x20 : 0xA0;
+    outb(port, 0x0B);  /* OCW3: read ISR */
+    return (inb(port) & 0x80) == 0;
+}
+
+/* Common entry for hardware IRQs (called from interrupts.asm) */
+void irq_dispatch(uint64_t irq) {
+    uint64_t start = rdtsc();
+
+    if ((irq == 7 || irq == 15) && irq_is_spurious((uint8_t)irq)) {
+        if (irq == 15) {
+            outb(0x20, 0x20);  /* Master still saw the cascade */
+        }
+        return;
+    }
+
+    if (irq < IRQ_LINES) {
+        for (int i = 0; i < IRQ_SHARED_MAX && irq_handlers[irq][i]; i++) {
+            irq_handlers[irq][i]((uint8_t)irq);
+        }
+    }
+
+    if (irq >= 8) {
+        outb(0xA0, 0x20);  /* EOI to slave PIC */
+    }
+    outb(0x20, 0x20);      /* EOI to master PIC */
+
+    softirq_irq_exit(rdtsc() - start);
+}
+
+int irq_register(uint8_t irq, irq_handler_t handler) {
+    if (irq >= IRQ_LINES || !handler) {
+        return 0;
+    }
+
+    int slot = 0;
+    while (slot < IRQ_SHARED_MAX && irq_handlers[irq][slot] && irq_handlers[irq][slot] != handler) {
+        slot++;
+    }
+    if (slot == IRQ_SHARED_MAX) {
+        return 0;
+    }
+    irq_handlers[irq][slot] = handler;
+
+    if (irq >= 8) {
+        outb(0xA1, inb(0xA1) & (uint8_t)~(1 << (irq - 8)));
+        irq = 2;  /* Cascade line on the master */
+    }
+    outb(0x21, inb(0x21) & (uint8_t)~(1 << irq));
+    return 1;
 }
 
 void idt_set_descriptor(uint8_t vector, uint64_t handler, uint8_t flags) {
@@ -158,18 +250,22 @@ void idt_init(void) {
     /* Set up hardware interrupts (IRQs remapped to 32+) */
     /* IRQ0 (timer) - vector 32 */
     /* IRQ1 (keyboard) - vector 33 */
-    idt_set_descriptor(33, (uint64_t)isr_keyboard, 
-                       IDT_FLAGS_PRESENT | IDT_FLAGS_INTERRUPT);
+    for (int i = 0; i < IRQ_LINES; i++) {
+        idt_set_descriptor(IRQ_BASE_VECTOR + i, (uint64_t)irq_stubs[i],
+                           IDT_FLAGS_PRESENT | IDT_FLAGS_INTERRUPT);
+    }
+    irq_handlers[1][0] = keyboard_isr;
+
+    /* Stray vectors (e.g. a LAPIC left armed by firmware) must not fault */
+    for (int i = IRQ_BASE_VECTOR + IRQ_LINES; i < 256; i++) {
+        idt_set_descriptor((uint8_t)i, (uint64_t)isr_spurious,
+                           IDT_FLAGS_PRESENT | IDT_FLAGS_INTERRUPT);
+    }
     
     idt_reg.base = (uint64_t)&idt;
     idt_reg.limit = sizeof(idt) - 1;
 }
 
-/* I/O wait - small delay for old hardware */
-static inline void io_wait(void) {
-    __asm__ __volatile__("outb %%al, $0x80" : : "a"(0));
-}
-
 /* Initialize PIC (Programmable Interrupt Controller) */
 static void pic_init(void) {
     uint8_t mask1, mask2;
@@ -23,12 +23,25 @@ typedef struct {
 /* Exception handler prototype */
 typedef void (*exception_handler_t)(void);
 
+/* Hardware IRQ top half - acknowledge the device, queue a softirq */
+typedef void (*irq_handler_t)(uint8_t irq);
+
 /* Public function declarations */
 void idt_init(void);
 void idt_set_descriptor(uint8_t vector, uint64_t handler, uint8_t flags);
 void idt_load(void);
 void idt_enable_interrupts(void);
 
+/* Install a top half for a PIC line (0-15) and unmask it. Up to
+ * IRQ_SHARED_MAX handlers may share a line; all of them run on every
+ * interrupt. */
+int irq_register(uint8_t irq, irq_handler_t handler);
+void irq_dispatch(uint64_t irq);
+
+#define IRQ_BASE_VECTOR 32
+#define IRQ_LINES       16
+#define IRQ_SHARED_MAX  4
+
 /* Exception codes */
 #define IDT_FLAGS_PRESENT     0x80
 #define IDT_FLAGS_RING0       0x00
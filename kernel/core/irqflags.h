@@ -0,0 +1,34 @@
+#ifndef KAGAMI_IRQFLAGS_H
+#define KAGAMI_IRQFLAGS_H
+
+#include "types.h"
+
+#define RFLAGS_IF (1ULL << 9)
+
+static inline uint64_t local_irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void local_irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) {
+        __asm__ __volatile__("sti" : : : "memory");
+    }
+}
+
+static inline void local_irq_enable(void) {
+    __asm__ __volatile__("sti" : : : "memory");
+}
+
+static inline void local_irq_disable(void) {
+    __asm__ __volatile__("cli" : : : "memory");
+}
+
+static inline int irqs_enabled(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; popq %0" : "=r"(flags));
+    return (flags & RFLAGS_IF) != 0;
+}
+
+#endif
@@ -0,0 +1,218 @@
+#include "lz4.h"
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5           /* A match ends at least this far from the end */
+#define MF_LIMIT      12          /* and starts at least this far */
+
+static inline uint32_t read32(const uint8_t *p) {
+    return *(const uint32_t *)p;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    return *(const uint64_t *)p;
+}
+
+static inline void write64(uint8_t *p, uint64_t v) {
+    *(uint64_t *)p = v;
+}
+
+static inline uint32_t hash4(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Byte copy that moves eight at a time; the areas must not overlap */
+static inline void copy_bytes(uint8_t *dst, const uint8_t *src, uint32_t n) {
+    while (n >= 8) {
+        write64(dst, read64(src));
+        dst += 8;
+        src += 8;
+        n -= 8;
+    }
+    while (n--) {
+        *dst++ = *src++;
+    }
+}
+
+static inline uint8_t *put_length(uint8_t *op, uint32_t rest) {
+    while (rest >= 255) {
+        *op++ = 255;
+        rest -= 255;
+    }
+    *op++ = (uint8_t)rest;
+    return op;
+}
+
+/* One sequence: literals, then a match unless match_len is 0 (the last
+ * sequence). Returns 0 when it does not fit. */
+static int put_sequence(uint8_t **opp, uint8_t *oend, const uint8_t *lit, uint32_t lit_len,
+                        uint32_t offset, uint32_t match_len) {
+    uint8_t *op = *opp;
+    uint64_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + match_len / 255 + 1 : 0);
+    if (need > (uint64_t)(oend - op)) {
+        return 0;
+    }
+
+    uint8_t *token = op++;
+    uint8_t t;
+    if (lit_len >= 15) {
+        t = 15 << 4;
+        op = put_length(op, lit_len - 15);
+    } else {
+        t = (uint8_t)(lit_len << 4);
+    }
+    copy_bytes(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        uint32_t m = match_len - MIN_MATCH;
+        if (m >= 15) {
+            t |= 15;
+            op = put_length(op, m - 15);
+        } else {
+            t |= (uint8_t)m;
+        }
+    }
+    *token = t;
+    *opp = op;
+    return 1;
+}
+
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap, void *work) {
+    uint16_t *table = (uint16_t *)work;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    uint32_t anchor = 0;
+
+    if (len > LZ4_MAX_INPUT) {
+        return 0;
+    }
+    if (len > MF_LIMIT) {
+        /* Stale entries are harmless - every candidate is verified - but
+         * they would point past the input */
+        for (uint32_t i = 0; i < (1U << LZ4_HASH_BITS); i++) {
+            table[i] = 0;
+        }
+        uint32_t mflimit = len - MF_LIMIT;
+        uint32_t matchlimit = len - LAST_LITERALS;
+        uint32_t ip = 1;
+
+        while (ip < mflimit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            uint32_t ref = table[h];
+            table[h] = (uint16_t)ip;
+            if (read32(src + ref) != seq) {
+                /* Skip faster the longer nothing has matched */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            uint32_t match_len = MIN_MATCH;
+            while (ip + match_len + 8 <= matchlimit) {
+                uint64_t diff = read64(src + ip + match_len) ^ read64(src + ref + match_len);
+                if (diff) {
+                    match_len += (uint32_t)__builtin_ctzll(diff) >> 3;
+                    break;
+                }
+                match_len += 8;
+            }
+            if (ip + match_len + 8 > matchlimit) {
+                while (ip + match_len < matchlimit && src[ip + match_len] == src[ref + match_len]) {
+                    match_len++;
+                }
+            }
+
+            if (!put_sequence(&op, oend, src + anchor, ip - anchor, ip - ref, match_len)) {
+                return 0;
+            }
+            ip += match_len;
+            anchor = ip;
+            if (ip < mflimit) {
+                table[hash4(read32(src + ip - 2))] = (uint16_t)(ip - 2);
+            }
+        }
+    }
+
+    if (!put_sequence(&op, oend, src + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return (uint32_t)(op - dst);
+}
+
+uint32_t lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+
+    while (ip < iend) {
+        uint32_t token = *ip++;
+        uint64_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return 0;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (uint64_t)(iend - ip) || lit > (uint64_t)(oend - op)) {
+            return 0;
+        }
+        copy_bytes(op, ip, (uint32_t)lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) {
+            break;                      /* The last sequence has no match */
+        }
+
+        if (iend - ip < 2) {
+            return 0;
+        }
+        uint32_t offset = ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint64_t)(op - dst)) {
+            return 0;
+        }
+        uint64_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return 0;
+                }
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+        if (match_len > (uint64_t)(oend - op)) {
+            return 0;
+        }
+
+        /* The match may overlap what it produces; eight at a time only
+         * when the source stays eight bytes behind */
+        const uint8_t *ref = op - offset;
+        uint32_t m = (uint32_t)match_len;
+        if (offset >= 8) {
+            while (m >= 8) {
+                write64(op, read64(ref));
+                op += 8;
+                ref += 8;
+                m -= 8;
+            }
+        }
+        while (m--) {
+            *op++ = *ref++;
+        }
+    }
+    return (uint32_t)(op - dst);
+}
@@ -0,0 +1,27 @@
+#ifndef KAGAMI_LZ4_H
+#define KAGAMI_LZ4_H
+
+#include "types.h"
+
+/* LZ4 block format (no frame): greedy single-pass compressor with a 4K
+ * entry hash table, and a decompressor that checks every length and
+ * offset against both buffers, so corrupt input fails instead of
+ * overrunning. Inputs are at most LZ4_MAX_INPUT bytes. */
+
+#define LZ4_MAX_INPUT     65535
+#define LZ4_HASH_BITS     12
+#define LZ4_WORKMEM_SIZE  ((1U << LZ4_HASH_BITS) * sizeof(uint16_t))
+
+/* Worst-case output for len bytes of incompressible input */
+#define LZ4_BOUND(len)    ((len) + (len) / 255 + 16)
+
+/* Compress src into dst. Returns the compressed size, or 0 if it would
+ * not fit in cap (the caller then stores the data raw). work is
+ * LZ4_WORKMEM_SIZE bytes of scratch. */
+uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap, void *work);
+
+/* Decompress src into dst. Returns the decompressed size, or 0 if the
+ * input is malformed or needs more than cap bytes. */
+uint32_t lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap);
+
+#endif
@@ -0,0 +1,93 @@
+#include "pmm.h"
+#include "include/serial.h"
+#include "klog.h"
+
+typedef struct {
+    uint64_t next;    /* First unallocated byte */
+    uint64_t end;
+} PmmRange;
+
+static PmmRange ranges[PMM_MAX_RANGES];
+static uint32_t range_count = 0;
+static uint64_t total_pages = 0;
+
+void pmm_init(const MEMORY_MAP_ENTRY *map, uint32_t count) {
+    range_count = 0;
+    total_pages = 0;
+    if (!map) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < count && range_count < PMM_MAX_RANGES; i++) {
+        if (map[i].type != MEMORY_TYPE_USABLE) {
+            continue;
+        }
+
+        /* Low memory holds the boot info and real-mode leftovers */
+        uint64_t start = map[i].base_addr;
+        uint64_t end = map[i].base_addr + map[i].length;
+        if (start < 0x100000) {
+            start = 0x100000;
+        }
+        if (end > PMM_LIMIT) {
+            end = PMM_LIMIT;
+        }
+        start = (start + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+        end &= ~(uint64_t)(PMM_PAGE_SIZE - 1);
+        if (end <= start) {
+            continue;
+        }
+
+        ranges[range_count].next = start;
+        ranges[range_count].end = end;
+        range_count++;
+        total_pages += (end - start) / PMM_PAGE_SIZE;
+    }
+
+    char msg[] = "PMM: 000000 MB usable\n";
+    uint64_t mb = total_pages / (1024 * 1024 / PMM_PAGE_SIZE);
+    for (int i = 10; i >= 5; i--) {
+        msg[i] = (char)('0' + (mb % 10));
+        mb /= 10;
+    }
+    serial_write(msg);
+    KLOG("PMM: memory map loaded");
+}
+
+void *pmm_alloc_pages(uint64_t pages) {
+    uint64_t bytes = pages * PMM_PAGE_SIZE;
+    if (!bytes) {
+        return 0;
+    }
+
+    /* Best fit keeps the big ranges whole for the big callers */
+    PmmRange *best = 0;
+    for (uint32_t i = 0; i < range_count; i++) {
+        uint64_t avail = ranges[i].end - ranges[i].next;
+        if (avail >= bytes && (!best || avail < best->end - best->next)) {
+            best = &ranges[i];
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+
+    uint8_t *p = (uint8_t *)(uintptr_t)best->next;
+    best->next += bytes;
+    for (uint64_t i = 0; i < bytes; i += 8) {
+        *(uint64_t *)(p + i) = 0;
+    }
+    return p;
+}
+
+uint64_t pmm_free_pages(void) {
+    uint64_t pages = 0;
+    for (uint32_t i = 0; i < range_count; i++) {
+        pages += (ranges[i].end - ranges[i].next) / PMM_PAGE_SIZE;
+    }
+    return pages;
+}
+
+uint64_t pmm_total_pages(void) {
+    return total_pages;
+}
@@ -0,0 +1,26 @@
+#ifndef KAGAMI_PMM_H
+#define KAGAMI_PMM_H
+
+#include "types.h"
+#include "boot_info.h"
+
+/* Physical page allocator over the loader's memory map.
+ * Pages are handed out once and never returned; it backs the heap and the
+ * long-lived caches that are sized from how much RAM the machine has.
+ * Only memory below 4 GiB is used so every page is a valid 32-bit DMA
+ * address for the storage drivers.
+ */
+
+#define PMM_PAGE_SIZE   4096
+#define PMM_MAX_RANGES  32
+#define PMM_LIMIT       0x100000000ULL
+
+void pmm_init(const MEMORY_MAP_ENTRY *map, uint32_t count);
+
+/* Contiguous, page-aligned, zeroed; 0 when no range is large enough */
+void *pmm_alloc_pages(uint64_t pages);
+
+uint64_t pmm_free_pages(void);
+uint64_t pmm_total_pages(void);
+
+#endif
@@ -0,0 +1,113 @@
+#include "profile.h"
+#include "tsc.h"
+#include "include/serial.h"
+
+#define NO_INSTR __attribute__((no_instrument_function))
+
+#define PROFILE_EXIT_BIT (1ULL << 63)
+
+typedef struct {
+    uint64_t fn;      /* Function address, bit 63 set on exit */
+    uint64_t tsc;
+} ProfileEvent;
+
+static ProfileEvent ring[PROFILE_RING_SIZE];
+static volatile uint64_t ring_head = 0;
+static volatile int recording = 1;
+
+void __cyg_profile_func_enter(void *fn, void *call_site) NO_INSTR;
+void __cyg_profile_func_exit(void *fn, void *call_site) NO_INSTR;
+
+static inline NO_INSTR void profile_record(uint64_t fn) {
+    if (!recording) {
+        return;
+    }
+    uint64_t slot = ring_head++ & (PROFILE_RING_SIZE - 1);
+    ring[slot].fn = fn;
+    ring[slot].tsc = rdtsc();
+}
+
+void __cyg_profile_func_enter(void *fn, void *call_site) {
+    (void)call_site;
+    profile_record((uint64_t)(uintptr_t)fn);
+}
+
+void __cyg_profile_func_exit(void *fn, void *call_site) {
+    (void)call_site;
+    profile_record((uint64_t)(uintptr_t)fn | PROFILE_EXIT_BIT);
+}
+
+NO_INSTR int profile_compiled_in(void) {
+#ifdef KAGAMI_PROFILE_CALLS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+NO_INSTR void profile_enable(int enabled) {
+    recording = enabled ? 1 : 0;
+}
+
+NO_INSTR int profile_enabled(void) {
+    return recording;
+}
+
+NO_INSTR void profile_reset(void) {
+    ring_head = 0;
+}
+
+NO_INSTR uint64_t profile_event_count(void) {
+    return ring_head;
+}
+
+NO_INSTR uint64_t profile_dropped(void) {
+    return ring_head > PROFILE_RING_SIZE ? ring_head - PROFILE_RING_SIZE : 0;
+}
+
+static NO_INSTR void append_hex64(char *buf, int *pos, uint64_t value) {
+    const char *hex = "0123456789ABCDEF";
+    for (int i = 15; i >= 0; i--) {
+        buf[(*pos)++] = hex[(value >> (i * 4)) & 0xF];
+    }
+}
+
+/* Format:  PROF BEGIN <events>
+ *          E|X <fn> <tsc>      (hex, oldest first)
+ *          PROF END
+ */
+NO_INSTR void profile_dump_serial(void) {
+    int was_recording = recording;
+    recording = 0;
+
+    uint64_t head = ring_head;
+    uint64_t count = head > PROFILE_RING_SIZE ? PROFILE_RING_SIZE : head;
+    uint64_t start = head - count;
+
+    char line[48];
+    int pos = 0;
+    const char *begin = "PROF BEGIN ";
+    while (*begin) {
+        line[pos++] = *begin++;
+    }
+    append_hex64(line, &pos, count);
+    line[pos++] = '\n';
+    line[pos] = 0;
+    serial_write(line);
+
+    for (uint64_t i = start; i < head; i++) {
+        ProfileEvent *ev = &ring[i & (PROFILE_RING_SIZE - 1)];
+        pos = 0;
+        line[pos++] = (ev->fn & PROFILE_EXIT_BIT) ? 'X' : 'E';
+        line[pos++] = ' ';
+        append_hex64(line, &pos, ev->fn & ~PROFILE_EXIT_BIT);
+        line[pos++] = ' ';
+        append_hex64(line, &pos, ev->tsc);
+        line[pos++] = '\n';
+        line[pos] = 0;
+        serial_write(line);
+    }
+
+    serial_write("PROF END\n");
+    recording = was_recording;
+}
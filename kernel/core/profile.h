@@ -0,0 +1,29 @@
+#ifndef KAGAMI_PROFILE_H
+#define KAGAMI_PROFILE_H
+
+#include "types.h"
+
+/* Per-function call tracing for `make PROFILE=calls` builds.
+ * -finstrument-functions makes every kernel function call the
+ * __cyg_profile_func_* hooks, which log TSC stamps into a ring buffer.
+ * tools/profreport.py turns a serial dump into per-function cycles.
+ */
+
+#ifdef KAGAMI_PROFILE_CALLS
+#define PROFILE_RING_SIZE 32768   /* Events, must be a power of two */
+#else
+#define PROFILE_RING_SIZE 1
+#endif
+
+void profile_enable(int enabled);
+int profile_enabled(void);
+void profile_reset(void);
+int profile_compiled_in(void);
+
+uint64_t profile_event_count(void);
+uint64_t profile_dropped(void);
+
+/* Write the ring buffer over serial for tools/profreport.py */
+void profile_dump_serial(void);
+
+#endif /* KAGAMI_PROFILE_H */
@@ -0,0 +1,148 @@
+#include "rcu.h"
+#include "irqflags.h"
+
+typedef struct {
+    volatile uint32_t nesting;     /* rcu_read_lock depth */
+    volatile uint64_t qs_seq;      /* Last grace period this CPU reported */
+} RcuCpu;
+
+static RcuCpu cpus[RCU_MAX_CPUS];
+static uint32_t cpus_online = 1;   /* Only the boot CPU runs kernel code yet */
+
+static volatile uint64_t gp_seq = 0;      /* == gp_completed: idle */
+static volatile uint64_t gp_completed = 0;
+static uint64_t gp_requested = 0;   /* Highest period a synchronize_rcu() waits on */
+
+static RcuHead *cb_head = 0;
+static RcuHead **cb_tail = &cb_head;
+static uint64_t cb_queued = 0;
+static uint64_t cb_invoked = 0;
+static uint64_t cb_pending = 0;
+static int cb_running = 0;
+
+static inline uint32_t rcu_this_cpu(void) {
+    return 0;
+}
+
+void rcu_read_lock(void) {
+    cpus[rcu_this_cpu()].nesting++;
+    rcu_barrier();
+}
+
+void rcu_read_unlock(void) {
+    rcu_barrier();
+    cpus[rcu_this_cpu()].nesting--;
+}
+
+/* Complete the current grace period if every online CPU has reported it.
+ * Caller has interrupts disabled. */
+static int rcu_try_advance(void) {
+    for (uint32_t i = 0; i < cpus_online; i++) {
+        if (cpus[i].qs_seq < gp_seq) {
+            return 0;
+        }
+    }
+
+    gp_completed = gp_seq;
+    if (cb_head || gp_requested > gp_seq) {
+        gp_seq++;   /* Someone still waiting: open the next period */
+    }
+    return 1;
+}
+
+/* Run callbacks whose grace period is over. Queue is FIFO and epochs are
+ * monotonic, so the ready ones form a prefix. */
+static void rcu_invoke_callbacks(void) {
+    if (cb_running) {
+        return;
+    }
+    cb_running = 1;
+
+    while (1) {
+        uint64_t flags = local_irq_save();
+        RcuHead *head = cb_head;
+        if (!head || head->epoch > gp_completed) {
+            local_irq_restore(flags);
+            break;
+        }
+        cb_head = head->next;
+        if (!cb_head) {
+            cb_tail = &cb_head;
+        }
+        cb_pending--;
+        cb_invoked++;
+        local_irq_restore(flags);
+
+        head->func(head);
+    }
+
+    cb_running = 0;
+}
+
+void rcu_quiescent_state(void) {
+    RcuCpu *cpu = &cpus[rcu_this_cpu()];
+    if (cpu->nesting != 0) {
+        return;
+    }
+
+    uint64_t flags = local_irq_save();
+    cpu->qs_seq = gp_seq;
+    int advanced = rcu_try_advance();
+    local_irq_restore(flags);
+
+    if (advanced) {
+        rcu_invoke_callbacks();
+    }
+}
+
+void rcu_call(RcuHead *head, rcu_callback_t func) {
+    if (!head || !func) {
+        return;
+    }
+
+    uint64_t flags = local_irq_save();
+    /* Readers may already have reported the current period while still
+     * holding the old pointer, so wait for the next full one. */
+    head->epoch = gp_seq + 1;
+    head->func = func;
+    head->next = 0;
+    *cb_tail = head;
+    cb_tail = &head->next;
+    cb_queued++;
+    cb_pending++;
+    if (gp_completed == gp_seq) {
+        gp_seq++;
+    }
+    local_irq_restore(flags);
+}
+
+/* Must not be called from inside a read section. */
+void synchronize_rcu(void) {
+    uint64_t flags = local_irq_save();
+    uint64_t target = gp_seq + 1;
+    if (target > gp_requested) {
+        gp_requested = target;
+    }
+    if (gp_completed == gp_seq) {
+        gp_seq++;
+    }
+    local_irq_restore(flags);
+
+    while (gp_completed < target) {
+        rcu_quiescent_state();
+        __asm__ __volatile__("pause");
+    }
+}
+
+void rcu_get_stats(RcuStats *out) {
+    if (!out) {
+        return;
+    }
+    uint64_t flags = local_irq_save();
+    out->gp_seq = gp_seq;
+    out->completed = gp_completed;
+    out->callbacks_queued = cb_queued;
+    out->callbacks_invoked = cb_invoked;
+    out->pending = cb_pending;
+    local_irq_restore(flags);
+}
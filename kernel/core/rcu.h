@@ -0,0 +1,59 @@
+#ifndef KAGAMI_RCU_H
+#define KAGAMI_RCU_H
+
+#include "types.h"
+
+/* RCU-lite: epoch based reclamation for read-mostly structures.
+ *
+ * Readers bracket lookups with rcu_read_lock()/rcu_read_unlock() and load
+ * shared pointers through rcu_dereference(); they never block or write.
+ * Updaters publish new versions with rcu_assign_pointer() and hand the old
+ * object to rcu_call() (or wait in synchronize_rcu()). The callback runs
+ * once every online CPU has passed a quiescent state - a point outside any
+ * read section, reported from the idle loop via rcu_quiescent_state().
+ *
+ * Updaters still serialize among themselves (irq-off sections today).
+ */
+
+#define RCU_MAX_CPUS 16
+
+typedef struct RcuHead RcuHead;
+typedef void (*rcu_callback_t)(RcuHead *head);
+
+struct RcuHead {
+    RcuHead *next;
+    rcu_callback_t func;
+    uint64_t epoch;     /* Grace period that must complete first */
+};
+
+typedef struct {
+    uint64_t gp_seq;        /* Current grace period */
+    uint64_t completed;     /* Last completed grace period */
+    uint64_t callbacks_queued;
+    uint64_t callbacks_invoked;
+    uint64_t pending;
+} RcuStats;
+
+#define rcu_barrier() __asm__ __volatile__("" : : : "memory")
+
+/* x86 is TSO: a compiler barrier orders the stores before publication and
+ * the dependent loads after it. */
+#define rcu_assign_pointer(p, v) do { rcu_barrier(); (p) = (v); } while (0)
+#define rcu_dereference(p) ({ __typeof__(p) _p = *(__typeof__(p) volatile *)&(p); rcu_barrier(); _p; })
+
+/* Recover the enclosing object from its embedded RcuHead */
+#define rcu_container_of(ptr, type, member) \
+    ((type *)((uint8_t *)(ptr) - (uintptr_t)&((type *)0)->member))
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/* Called by the current CPU when it holds no RCU references */
+void rcu_quiescent_state(void);
+
+void rcu_call(RcuHead *head, rcu_callback_t func);
+void synchronize_rcu(void);
+
+void rcu_get_stats(RcuStats *out);
+
+#endif
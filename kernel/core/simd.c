@@ -0,0 +1,74 @@
+#include "simd.h"
+#include "fpu.h"
+
+/* Built with -mno-sse like the rest of the kernel, so the compiler never
+ * allocates vector registers here and the asm blocks below need no xmm
+ * clobbers (gcc rejects them for this target anyway). xmm0 stays valid
+ * between separate asm statements for the same reason. */
+
+/* Below this, toggling CR0.TS costs more than the loop saves */
+#define SIMD_MIN_BYTES 256
+
+static int simd_usable(size_t bytes) {
+    return bytes >= SIMD_MIN_BYTES && (fpu_features() & FPU_FEAT_SSE2);
+}
+
+void simd_memcpy(void *dst, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+
+    if (simd_usable(n)) {
+        kernel_fpu_begin();
+        while (n >= 64) {
+            __asm__ __volatile__(
+                "movdqu   (%1), %%xmm0\n\t"
+                "movdqu 16(%1), %%xmm1\n\t"
+                "movdqu 32(%1), %%xmm2\n\t"
+                "movdqu 48(%1), %%xmm3\n\t"
+                "movdqu %%xmm0,   (%0)\n\t"
+                "movdqu %%xmm1, 16(%0)\n\t"
+                "movdqu %%xmm2, 32(%0)\n\t"
+                "movdqu %%xmm3, 48(%0)\n\t"
+                : : "r"(d), "r"(s) : "memory");
+            d += 64;
+            s += 64;
+            n -= 64;
+        }
+        kernel_fpu_end();
+    }
+
+    while (n >= 8) {
+        *(uint64_t *)d = *(const uint64_t *)s;
+        d += 8;
+        s += 8;
+        n -= 8;
+    }
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+void simd_memset32(uint32_t *dst, uint32_t value, size_t count) {
+    if (simd_usable(count * 4)) {
+        kernel_fpu_begin();
+        __asm__ __volatile__(
+            "movd %0, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            : : "r"(value));
+        while (count >= 16) {
+            __asm__ __volatile__(
+                "movdqu %%xmm0,   (%0)\n\t"
+                "movdqu %%xmm0, 16(%0)\n\t"
+                "movdqu %%xmm0, 32(%0)\n\t"
+                "movdqu %%xmm0, 48(%0)\n\t"
+                : : "r"(dst) : "memory");
+            dst += 16;
+            count -= 16;
+        }
+        kernel_fpu_end();
+    }
+
+    while (count--) {
+        *dst++ = value;
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef KAGAMI_SIMD_H
+#define KAGAMI_SIMD_H
+
+#include "types.h"
+
+/* Bulk memory kernels. Use SSE2 inside a kernel_fpu_begin/end section
+ * when the FPU is set up and the size is worth it, plain loops otherwise. */
+
+void simd_memcpy(void *dst, const void *src, size_t n);
+void simd_memset32(uint32_t *dst, uint32_t value, size_t count);
+
+#endif
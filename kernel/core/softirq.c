@@ -0,0 +1,106 @@
+#include "softirq.h"
+#include "irqflags.h"
+#include "tsc.h"
+
+typedef struct {
+    softirq_fn_t fn;
+    uint64_t arg;
+} SoftirqWork;
+
+static SoftirqWork queue[SOFTIRQ_QUEUE_SIZE];
+static volatile uint32_t queue_head = 0;
+static volatile uint32_t queue_tail = 0;
+static volatile int in_softirq = 0;
+static SoftirqStats stats;
+
+int softirq_queue(softirq_fn_t fn, uint64_t arg) {
+    if (!fn) {
+        return 0;
+    }
+
+    uint64_t flags = local_irq_save();
+    uint32_t next = (queue_head + 1) % SOFTIRQ_QUEUE_SIZE;
+    if (next == queue_tail) {
+        stats.dropped++;
+        local_irq_restore(flags);
+        return 0;
+    }
+
+    queue[queue_head].fn = fn;
+    queue[queue_head].arg = arg;
+    queue_head = next;
+    stats.queued++;
+    local_irq_restore(flags);
+    return 1;
+}
+
+int softirq_pending(void) {
+    return queue_head != queue_tail;
+}
+
+int softirq_active(void) {
+    return in_softirq;
+}
+
+/* Runs with interrupts disabled on entry and exit. */
+static void softirq_drain(int enable_irqs) {
+    if (in_softirq) {
+        return;
+    }
+    in_softirq = 1;
+
+    while (queue_tail != queue_head) {
+        SoftirqWork batch[SOFTIRQ_BATCH];
+        uint32_t n = 0;
+        while (n < SOFTIRQ_BATCH && queue_tail != queue_head) {
+            batch[n++] = queue[queue_tail];
+            queue_tail = (queue_tail + 1) % SOFTIRQ_QUEUE_SIZE;
+        }
+
+        if (enable_irqs) {
+            local_irq_enable();
+        }
+
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < n; i++) {
+            batch[i].fn(batch[i].arg);
+        }
+        uint64_t cycles = rdtsc() - start;
+
+        local_irq_disable();
+        stats.items += n;
+        stats.batches++;
+        stats.bh_cycles += cycles;
+    }
+
+    in_softirq = 0;
+}
+
+void softirq_run(void) {
+    if (queue_tail == queue_head) {
+        return;
+    }
+    uint64_t flags = local_irq_save();
+    softirq_drain((flags & RFLAGS_IF) != 0);
+    local_irq_restore(flags);
+}
+
+void softirq_irq_exit(uint64_t top_half_cycles) {
+    stats.irq_count++;
+    stats.irq_cycles += top_half_cycles;
+    if (top_half_cycles > stats.irq_max_cycles) {
+        stats.irq_max_cycles = top_half_cycles;
+    }
+
+    /* Still inside the interrupt gate: IF=0 here and iretq restores it. */
+    softirq_drain(1);
+}
+
+void softirq_get_stats(SoftirqStats *out) {
+    if (!out) {
+        return;
+    }
+    uint64_t flags = local_irq_save();
+    *out = stats;
+    local_irq_restore(flags);
+}
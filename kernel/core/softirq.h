@@ -0,0 +1,45 @@
+#ifndef KAGAMI_SOFTIRQ_H
+#define KAGAMI_SOFTIRQ_H
+
+#include "types.h"
+
+/* Bottom-half deferred work.
+ * Interrupt top halves only acknowledge the device and queue a work item;
+ * softirq_run() drains the queue in batches with interrupts enabled, either
+ * on interrupt exit or from an idle loop.
+ */
+
+#define SOFTIRQ_QUEUE_SIZE 256
+#define SOFTIRQ_BATCH      16
+
+typedef void (*softirq_fn_t)(uint64_t arg);
+
+typedef struct {
+    uint64_t irq_count;       /* Top halves executed */
+    uint64_t irq_cycles;      /* TSC cycles spent in top halves (IF=0) */
+    uint64_t irq_max_cycles;
+    uint64_t queued;          /* Work items accepted */
+    uint64_t dropped;         /* Work items lost to a full queue */
+    uint64_t items;           /* Work items executed */
+    uint64_t batches;
+    uint64_t bh_cycles;       /* TSC cycles spent in bottom halves (IF=1) */
+} SoftirqStats;
+
+/* Queue fn(arg) for deferred execution. Safe from interrupt context. */
+int softirq_queue(softirq_fn_t fn, uint64_t arg);
+
+/* Drain pending work. Interrupts are enabled while items run only if the
+ * caller had them enabled. */
+void softirq_run(void);
+
+/* Called by the interrupt dispatcher after EOI. */
+void softirq_irq_exit(uint64_t top_half_cycles);
+
+int softirq_pending(void);
+
+/* Nonzero while bottom halves run; work that may block defers to task
+ * context when it is set. */
+int softirq_active(void);
+void softirq_get_stats(SoftirqStats *out);
+
+#endif
@@ -0,0 +1,60 @@
+#include "tsc.h"
+#include "io.h"
+#include "include/serial.h"
+#include "klog.h"
+
+#define PIT_HZ            1193182
+#define TSC_CAL_MS        10
+#define TSC_DEFAULT_KHZ   2000000
+
+static uint64_t g_tsc_khz = 0;
+
+/* Gate channel 2 on with the speaker off, load a one-shot count and time
+ * how long OUT2 (port 0x61 bit 5) takes to go high. */
+static uint64_t tsc_measure_pit(void) {
+    uint16_t latch = (uint16_t)(PIT_HZ * TSC_CAL_MS / 1000);
+
+    outb(0x61, (uint8_t)((inb(0x61) & ~0x02) | 0x01));
+    outb(0x43, 0xB0);   /* Channel 2, lobyte/hibyte, mode 0 */
+    outb(0x42, (uint8_t)(latch & 0xFF));
+    outb(0x42, (uint8_t)(latch >> 8));
+
+    uint64_t start = rdtsc();
+    uint64_t limit = start + (uint64_t)TSC_DEFAULT_KHZ * 10 * TSC_CAL_MS;
+    while ((inb(0x61) & 0x20) == 0) {
+        if (rdtsc() > limit) {
+            return 0;   /* No PIT behind the ports */
+        }
+    }
+    return rdtsc() - start;
+}
+
+void tsc_calibrate(void) {
+    /* Best of three rejects a run stretched by an SMI or host preemption */
+    uint64_t best = 0;
+    for (int i = 0; i < 3; i++) {
+        uint64_t cycles = tsc_measure_pit();
+        if (cycles && (!best || cycles < best)) {
+            best = cycles;
+        }
+    }
+
+    if (!best) {
+        serial_write("TSC: PIT calibration failed, assuming 2 GHz\n");
+        KERR("TSC: PIT calibration failed");
+        return;
+    }
+    g_tsc_khz = best / TSC_CAL_MS;
+
+    char msg[] = "TSC: 00000 MHz\n";
+    uint64_t mhz = g_tsc_khz / 1000;
+    for (int i = 9; i >= 5; i--) {
+        msg[i] = (char)('0' + (mhz % 10));
+        mhz /= 10;
+    }
+    serial_write(msg);
+}
+
+uint64_t tsc_khz(void) {
+    return g_tsc_khz ? g_tsc_khz : TSC_DEFAULT_KHZ;
+}
@@ -0,0 +1,27 @@
+#ifndef KAGAMI_TSC_H
+#define KAGAMI_TSC_H
+
+#include "types.h"
+
+/* Read the time stamp counter */
+static inline __attribute__((no_instrument_function)) uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Measure the TSC against PIT channel 2. Call once at boot. */
+void tsc_calibrate(void);
+
+/* TSC ticks per millisecond; a 2 GHz guess until calibrated */
+uint64_t tsc_khz(void);
+
+static inline uint64_t tsc_to_us(uint64_t cycles) {
+    return cycles * 1000 / tsc_khz();
+}
+
+static inline uint64_t tsc_from_us(uint64_t us) {
+    return us * tsc_khz() / 1000;
+}
+
+#endif
@@ -5,7 +5,7 @@ BITS 64
 
 ; External C handlers
 EXTERN exception_handler
-EXTERN keyboard_isr
+EXTERN irq_dispatch
 
 ; Exception handler macro - for exceptions with error code
 %macro ISR_ERROR 2
@@ -93,9 +93,11 @@ ISR_NOERR alignment,          17  ; 17 - Alignment check
 ISR_NOERR machine_check,      18  ; 18 - Machine check
 ISR_NOERR simd,               19  ; 19 - SIMD floating point
 
-; Interrupt Handlers (32+)
-GLOBAL isr_keyboard
-isr_keyboard:
+; Hardware IRQ handler macro - PIC lines 0-15 remapped to vectors 32-47
+; irq_dispatch() runs the top half, sends EOI and drains softirqs
+%macro IRQ 1
+GLOBAL isr_irq%1
+isr_irq%1:
     push rax
     push rcx
     push rdx
@@ -105,13 +107,10 @@ isr_keyboard:
     push r9
     push r10
     push r11
-    
-    call keyboard_isr
-    
-    ; Send EOI (End of Interrupt) to PIC
-    mov al, 0x20
-    out 0x20, al       ; EOI to master PIC
-    
+
+    mov rdi, %1        ; IRQ line as first arg (RDI)
+    call irq_dispatch
+
     pop r11
     pop r10
     pop r9
@@ -122,3 +121,27 @@ isr_keyboard:
     pop rcx
     pop rax
     iretq
+%endmacro
+
+; Interrupt Handlers (32+)
+IRQ 0
+IRQ 1
+IRQ 2
+IRQ 3
+IRQ 4
+IRQ 5
+IRQ 6
+IRQ 7
+IRQ 8
+IRQ 9
+IRQ 10
+IRQ 11
+IRQ 12
+IRQ 13
+IRQ 14
+IRQ 15
+
+; Catch-all for vectors nobody owns (48-255)
+GLOBAL isr_spurious
+isr_spurious:
+    iretq
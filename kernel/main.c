@@ -2,10 +2,18 @@
 #include "boot_info.h"
 #include "shell/shell.h"
 #include "core/heap.h"
+#include "core/pmm.h"
+#include "core/fpu.h"
+#include "core/tsc.h"
+#include "core/acpi.h"
+#include "drivers/bus/pci.h"
 #include "drivers/input/keyboard.h"
 #include "drivers/storage/ahci.h"
 #include "drivers/storage/nvme.h"
+#include "drivers/storage/ramdisk.h"
+#include "drivers/storage/bcache.h"
 #include "drivers/storage/block.h"
+#include "drivers/storage/bufcache.h"
 #include "drivers/storage/partition.h"
 #include "fs/ext4/ext4.h"
 #include "fs/vfs.h"
@@ -87,6 +95,7 @@ void kernel_main(void) {
     KLOG("Kernel: Waiting for ENTER to boot...");
     
     /* Initialize kernel subsystems */
+    pmm_init((const MEMORY_MAP_ENTRY*)(uintptr_t)boot_info->memory_map_addr, boot_info->memory_regions);
     heap_init();
     serial_write("Kernel: Heap initialized\n");
     KLOG("Kernel: Heap initialized");
@@ -98,15 +107,39 @@ void kernel_main(void) {
     idt_load();
     serial_write("Kernel: IDT loaded\n");
     KLOG("Kernel: IDT loaded");
+
+    fpu_init();
+    tsc_calibrate();
+
+    if (acpi_init(boot_info->acpi_rsdp)) {
+        const AcpiInfo* acpi = acpi_get_info();
+        for (uint32_t i = 0; i < acpi->ecam_count; i++) {
+            if (acpi->ecam[i].segment == 0) {
+                pci_set_ecam(acpi->ecam[i].base, acpi->ecam[i].start_bus, acpi->ecam[i].end_bus);
+                KLOG("PCI: using ECAM config access");
+                break;
+            }
+        }
+    }
     
     keyboard_init();
     serial_write("Kernel: Keyboard driver initialized\n");
     KLOG("Kernel: Keyboard driver initialized");
 
+    bufcache_init();
+
     KLOG("Storage: AHCI init");
     ahci_init();
     KLOG("Storage: NVMe init");
     nvme_init();
+    KLOG("Storage: ramdisk init");
+    if (boot_info->bootloader_type == BOOTLOADER_UEFI) {
+        ramdisk_init(boot_info->ramdisk_addr, boot_info->ramdisk_size);
+    } else {
+        ramdisk_init(0, 0);
+    }
+    KLOG("Storage: bcache probe");
+    bcache_probe();
 
     KLOG("Network: init");
     net_init();
@@ -114,6 +147,11 @@ void kernel_main(void) {
     static Ext4Fs root_fs;
     if (block_count() > 0) {
         BlockDevice *dev = block_get(0);
+        /* Go through the cache when one sits in front of the boot disk */
+        BlockDevice *cached = bcache_for_backing(dev);
+        if (cached) {
+            dev = cached;
+        }
         PartitionInfo part;
         if (find_linux_partition(dev, &part)) {
             if (ext4_mount(&root_fs, dev, part.first_lba)) {
@@ -144,6 +182,10 @@ void kernel_main(void) {
     serial_write("Framebuffer: Active\n");
     serial_write("Display: Starting interactive shell...\n\n");
     
+    /* From here on keyboard and NIC are interrupt driven (top half + softirq) */
+    idt_enable_interrupts();
+    serial_write("Interrupts: enabled\n");
+    
     /* Start interactive framebuffer shell with GPU rendering */
     /* Shell will display ASCII art logo and fantasy welcome message */
     shell_run();
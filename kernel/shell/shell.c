@@ -6,25 +6,29 @@
 #include "drivers/input/keyboard.h"
 #include "boot_info.h"
 #include "core/heap.h"
+#include "core/pmm.h"
 #include "fs/vfs.h"
 #include "drivers/storage/block.h"
+#include "drivers/storage/ahci.h"
+#include "drivers/storage/bufcache.h"
 #include "drivers/storage/partition.h"
+#include "drivers/storage/blkbench.h"
+#include "drivers/storage/blktrace.h"
+#include "drivers/storage/md.h"
+#include "drivers/storage/bcache.h"
+#include "drivers/storage/crypt.h"
+#include "drivers/storage/zram.h"
 #include "drivers/bus/pci.h"
+#include "core/acpi.h"
 #include "net/net.h"
+#include "core/profile.h"
+#include "core/softirq.h"
+#include "core/rcu.h"
+#include "core/fpu.h"
+#include "core/simd.h"
+#include "core/tsc.h"
 #include "klog.h"
 
-/* Simple macros for memory access */
-#define inb(port) ({ \
-    unsigned char ret; \
-    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "d"(port)); \
-    ret; \
-})
-
-/* PS/2 Controller port definitions */
-#define PS2_STATUS_PORT  0x64
-#define PS2_DATA_PORT    0x60
-#define PS2_STATUS_OUTPUT_BUFFER 0x01
-
 /* Scancode to ASCII mapping (US QWERTY, for printable characters) */
 static const char scancode_ascii[] = {
     0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', 0, 0,
@@ -85,6 +89,12 @@ static int file_count = 0;
 static int file_capacity = 0;
 static int fs_initialized = 0;
 
+/* copy on a mounted volume streams the source through this buffer in
+ * chunks, so sequential readahead keeps the disk busy */
+#define COPY_MAX_BYTES (1024 * 1024)
+#define COPY_CHUNK     (16 * 1024)
+static uint8_t *copy_buf = 0;
+
 static void build_full_path(const char *name, char *out, int max_len) {
     if (!name || !out || max_len <= 0) {
         return;
@@ -123,6 +133,40 @@ static void build_full_path(const char *name, char *out, int max_len) {
     out[pos] = 0;
 }
 
+/* Copy a file on the mounted volume. Returns 1 on success, 0 if the source
+ * cannot be read, -1 if it is too large, -2 if the write fails. */
+static int copy_mounted_file(const char *src, const char *dest, uint64_t *out_size) {
+    uint64_t size = 0;
+    if (!vfs_file_size(src, &size)) {
+        return 0;
+    }
+    if (size > COPY_MAX_BYTES) {
+        return -1;
+    }
+    if (!copy_buf) {
+        copy_buf = (uint8_t *)pmm_alloc_pages(COPY_MAX_BYTES / PMM_PAGE_SIZE);
+        if (!copy_buf) {
+            return -1;
+        }
+    }
+
+    uint64_t done = 0;
+    while (done < size) {
+        uint32_t chunk = (size - done > COPY_CHUNK) ? COPY_CHUNK : (uint32_t)(size - done);
+        uint32_t got = 0;
+        if (!vfs_read_file_at(src, done, copy_buf + done, chunk, &got) || got == 0) {
+            return 0;
+        }
+        done += got;
+    }
+
+    if (!vfs_write_file(dest, copy_buf, (uint32_t)size)) {
+        return -2;
+    }
+    *out_size = size;
+    return 1;
+}
+
 static char hex_digit(uint8_t v) {
     return (v < 10) ? (char)('0' + v) : (char)('A' + (v - 10));
 }
@@ -134,6 +178,18 @@ static void append_hex(char *buf, int *pos, uint32_t value, int digits) {
     }
 }
 
+static void append_dec(char *buf, int *pos, uint64_t value) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+    while (n > 0) {
+        buf[(*pos)++] = tmp[--n];
+    }
+}
+
 static void append_str(char *buf, int *pos, const char *s) {
     while (*s) {
         buf[(*pos)++] = *s++;
@@ -146,6 +202,155 @@ static int str_len(const char* s) {
     return n;
 }
 
+/* Turn cumulative counters into the activity between two snapshots */
+static void iostat_delta(BlockIoStats *now, const BlockIoStats *then) {
+    for (uint32_t op = 0; op < BLOCK_OP_COUNT; op++) {
+        now->ops[op] -= then->ops[op];
+        now->sectors[op] -= then->sectors[op];
+        now->service_cycles[op] -= then->service_cycles[op];
+        for (uint32_t b = 0; b < BLOCK_LAT_BUCKETS; b++) {
+            now->latency[op][b] -= then->latency[op][b];
+        }
+    }
+    now->errors -= then->errors;
+    now->busy_cycles -= then->busy_cycles;
+}
+
+static int token_is(const char *tok, int len, const char *word) {
+    int i = 0;
+    while (i < len && word[i] && tok[i] == word[i]) {
+        i++;
+    }
+    return i == len && word[i] == 0;
+}
+
+/* Decimal with an optional k/m suffix (KiB, MiB) */
+static int parse_size(const char *s, int len, uint64_t *out) {
+    uint64_t v = 0;
+    int i = 0;
+    while (i < len && s[i] >= '0' && s[i] <= '9') {
+        v = v * 10 + (uint64_t)(s[i] - '0');
+        i++;
+    }
+    if (i == 0) {
+        return 0;
+    }
+    if (i < len && (s[i] == 'k' || s[i] == 'K')) {
+        v <<= 10;
+        i++;
+    } else if (i < len && (s[i] == 'm' || s[i] == 'M')) {
+        v <<= 20;
+        i++;
+    }
+    *out = v;
+    return i == len;
+}
+
+/* Block device by name or block_get() index */
+static BlockDevice *find_block_device(const char *tok, int len) {
+    for (int i = 0; i < block_count(); i++) {
+        BlockDevice *dev = block_get(i);
+        if (dev && ((dev->name && token_is(tok, len, dev->name)) ||
+                    (len == 1 && tok[0] == (char)('0' + i)))) {
+            return dev;
+        }
+    }
+    return 0;
+}
+
+/* Hex digits, two per byte, into out (at most max bytes); returns the
+ * byte count or 0 */
+static uint32_t parse_hex_bytes(const char *s, int len, uint8_t *out, uint32_t max) {
+    if (len == 0 || (len & 1) || (uint32_t)len / 2 > max) {
+        return 0;
+    }
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        uint8_t v;
+        if (c >= '0' && c <= '9') {
+            v = (uint8_t)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            v = (uint8_t)(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            v = (uint8_t)(c - 'A' + 10);
+        } else {
+            return 0;
+        }
+        out[i / 2] = (uint8_t)((i & 1) ? (out[i / 2] | v) : (v << 4));
+    }
+    return (uint32_t)len / 2;
+}
+
+/* "<dev> [mode] [bs=] [qd=] [start=] [span=] [time=] [force]"; returns an
+ * error message or 0 */
+static const char *blkbench_parse(const char *arg, BlkBenchConfig *cfg, int *force) {
+    cfg->dev = 0;
+    cfg->op = BLOCK_OP_READ;
+    cfg->random = 0;
+    cfg->block_size = 4096;
+    cfg->queue_depth = 1;
+    cfg->start_lba = 0;
+    cfg->sectors = 0;
+    cfg->seconds = 5;
+    *force = 0;
+
+    uint64_t span_bytes = 0;
+    while (*arg) {
+        while (*arg == ' ') arg++;
+        const char *tok = arg;
+        while (*arg && *arg != ' ') arg++;
+        int len = (int)(arg - tok);
+        if (len == 0) {
+            break;
+        }
+
+        int eq = 0;
+        while (eq < len && tok[eq] != '=') eq++;
+        const char *val = tok + eq + 1;
+        int val_len = len - eq - 1;
+        uint64_t v = 0;
+
+        if (!cfg->dev) {
+            cfg->dev = find_block_device(tok, len);
+            if (!cfg->dev) {
+                return "Unknown device (see disks)";
+            }
+        } else if (token_is(tok, len, "read") || token_is(tok, len, "randread")) {
+            cfg->op = BLOCK_OP_READ;
+            cfg->random = tok[0] == 'r' && tok[1] == 'a';
+        } else if (token_is(tok, len, "write") || token_is(tok, len, "randwrite")) {
+            cfg->op = BLOCK_OP_WRITE;
+            cfg->random = tok[0] == 'r';
+        } else if (token_is(tok, len, "force")) {
+            *force = 1;
+        } else if (eq < len && parse_size(val, val_len, &v)) {
+            if (token_is(tok, eq, "bs")) {
+                cfg->block_size = (uint32_t)v;
+            } else if (token_is(tok, eq, "qd")) {
+                cfg->queue_depth = (uint32_t)v;
+            } else if (token_is(tok, eq, "start")) {
+                cfg->start_lba = v;
+            } else if (token_is(tok, eq, "span")) {
+                span_bytes = v;
+            } else if (token_is(tok, eq, "time")) {
+                cfg->seconds = (uint32_t)v;
+            } else {
+                return "Unknown option";
+            }
+        } else {
+            return "Bad argument";
+        }
+    }
+
+    if (!cfg->dev) {
+        return "Usage: blkbench <dev> [randread|randwrite|read|write] [bs=4k] [qd=1] [start=lba] [span=64m] [time=5] [force]";
+    }
+    if (span_bytes) {
+        cfg->sectors = span_bytes / (cfg->dev->sector_size ? cfg->dev->sector_size : BLOCK_SECTOR_SIZE);
+    }
+    return 0;
+}
+
 static void fs_load_manual(void) {
     int manual_idx = -1;
     for (int i = 0; i < file_count; i++) {
@@ -297,13 +502,14 @@ static struct {
     unsigned int scroll_offset;  /* Lines scrolled up */
 } shell_state = {0};
 
-/* Poll PS/2 keyboard for any available scancode */
+/* Fetch the next scancode; also the idle point where deferred work runs
+ * and where this CPU reports an RCU quiescent state */
 static unsigned char poll_keyboard(void) {
-    unsigned char status = inb(PS2_STATUS_PORT);
-    if (status & PS2_STATUS_OUTPUT_BUFFER) {
-        return inb(PS2_DATA_PORT);
-    }
-    return 0;
+    softirq_run();
+    rcu_quiescent_state();
+    bufcache_writeback();
+    bcache_background();
+    return keyboard_poll_scancode();
 }
 
 /* Convert scancode to ASCII character */
@@ -352,13 +558,14 @@ static char scancode_to_char(unsigned char scancode, int shift) {
 static void fb_clear_rect(unsigned int* fb, unsigned int pitch, unsigned int width,
                           unsigned int x, unsigned int y, unsigned int w, unsigned int h,
                           unsigned int color) {
+    if (x >= width) {
+        return;
+    }
+    if (x + w > width) {
+        w = width - x;
+    }
     for (unsigned int row = 0; row < h; row++) {
-        for (unsigned int col = 0; col < w; col++) {
-            if (x + col < width) {
-                unsigned int* pixel = fb + (y + row) * (pitch / 4) + (x + col);
-                *pixel = color;
-            }
-        }
+        simd_memset32(fb + (y + row) * (pitch / 4) + x, color, w);
     }
 }
 
@@ -882,12 +1089,42 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
             shell_state.cursor_y += shell_state.line_height + 2;
             fb_print(fb, pitch, 90, shell_state.cursor_y, "partcheck  - Verify partitions", 0x00CCCCCC);
             shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "bufstat    - Buffer cache stats", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "sync       - Write cached data to disk", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "fstrim     - Discard free space on disk", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "iostat [s] - Per-disk I/O stats", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "blkbench   - Raw disk benchmark", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "blktrace   - Record block requests", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "blkreplay  - Replay a block trace", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "md         - Software RAID-0/1 arrays", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "mount <d>  - Mount ext4 from a disk", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "bcache     - SSD cache in front of a disk", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "crypt      - AES-XTS encrypted disks", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "zram       - Compressed RAM disks", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
             fb_print(fb, pitch, 90, shell_state.cursor_y, "pci        - List PCI devices", 0x00CCCCCC);
             shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "acpi       - CPUs, IOAPICs, ECAM, HPET", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
             fb_print(fb, pitch, 90, shell_state.cursor_y, "ip         - Show/set IP config", 0x00CCCCCC);
             shell_state.cursor_y += shell_state.line_height + 2;
             fb_print(fb, pitch, 90, shell_state.cursor_y, "ping <ip>  - ICMP echo", 0x00CCCCCC);
             shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "prof       - Call profiler (PROFILE=calls)", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+            fb_print(fb, pitch, 90, shell_state.cursor_y, "irqstat    - Interrupt/softirq stats", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
             fb_print(fb, pitch, 90, shell_state.cursor_y, "whoami     - Your identity", 0x00CCCCCC);
         shell_state.cursor_y += shell_state.line_height + 3;
         fb_print(fb, pitch, 70, shell_state.cursor_y, "Tip: Use '<cmd> -h' or '<cmd> --help' for detailed info", 0x00FFAA00);
@@ -963,6 +1200,57 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
             if (dev && dev->name) {
                 fb_print(fb, pitch, 70, shell_state.cursor_y, dev->name, 0x0088FF88);
                 shell_state.cursor_y += shell_state.line_height + 3;
+
+                char line[112];
+                int pos = 0;
+                AhciInfo ai;
+                if (ahci_get_info(dev, &ai)) {
+                    append_str(line, &pos, "  ");
+                    append_str(line, &pos, ai.model);
+                    append_str(line, &pos, " ");
+                    append_dec(line, &pos, ai.sectors * ai.logical_sector_size >> 20);
+                    append_str(line, &pos, " MB ");
+                    append_dec(line, &pos, ai.logical_sector_size);
+                    append_str(line, &pos, "/");
+                    append_dec(line, &pos, ai.physical_sector_size);
+                    append_str(line, &pos, " ncq=");
+                    append_dec(line, &pos, ai.ncq_depth);
+                    append_str(line, &pos, ai.write_cache ? " wcache" : "");
+                    append_str(line, &pos, ai.trim ? " trim" : "");
+                    line[pos] = 0;
+                    fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+                    shell_state.cursor_y += shell_state.line_height + 2;
+                    pos = 0;
+                }
+
+                BlockQueueStats qs;
+                block_queue_stats(dev, &qs);
+                append_str(line, &pos, "  req=0x");
+                append_hex(line, &pos, (uint32_t)qs.submitted, 8);
+                append_str(line, &pos, " merged=0x");
+                append_hex(line, &pos, (uint32_t)(qs.merges + qs.piggybacks), 8);
+                append_str(line, &pos, " cmds=0x");
+                append_hex(line, &pos, (uint32_t)qs.dispatched, 8);
+                append_str(line, &pos, " batches=0x");
+                append_hex(line, &pos, (uint32_t)qs.batches, 8);
+                line[pos] = 0;
+                fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+                shell_state.cursor_y += shell_state.line_height + 2;
+
+                pos = 0;
+                append_str(line, &pos, "  depth=0x");
+                append_hex(line, &pos, qs.depth, 2);
+                append_str(line, &pos, " max=0x");
+                append_hex(line, &pos, qs.max_depth, 2);
+                append_str(line, &pos, " inflight=0x");
+                append_hex(line, &pos, qs.in_flight, 2);
+                append_str(line, &pos, " max=0x");
+                append_hex(line, &pos, qs.max_in_flight, 2);
+                append_str(line, &pos, " expired=0x");
+                append_hex(line, &pos, (uint32_t)qs.expired, 4);
+                line[pos] = 0;
+                fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+                shell_state.cursor_y += shell_state.line_height + 3;
             }
         }
         return;
@@ -995,6 +1283,134 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
         return;
     }
 
+    /* === BUFSTAT COMMAND (block buffer cache) === */
+    if (cmd[0] == 'b' && cmd[1] == 'u' && cmd[2] == 'f' && cmd[3] == 's' && cmd[4] == 't' &&
+        cmd[5] == 'a' && cmd[6] == 't') {
+        BufCacheStats bs;
+        bufcache_get_stats(&bs);
+
+        char line[80];
+        int pos = 0;
+        append_str(line, &pos, "cache ");
+        append_dec(line, &pos, bs.capacity);
+        append_str(line, &pos, " buffers, ");
+        append_dec(line, &pos, (uint64_t)bs.capacity * BUFCACHE_BLOCK_MAX / 1024);
+        append_str(line, &pos, " KB");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        uint64_t lookups = bs.hits + bs.misses;
+        pos = 0;
+        append_str(line, &pos, "hits ");
+        append_dec(line, &pos, bs.hits);
+        append_str(line, &pos, " misses ");
+        append_dec(line, &pos, bs.misses);
+        append_str(line, &pos, " (");
+        append_dec(line, &pos, lookups ? bs.hits * 100 / lookups : 0);
+        append_str(line, &pos, "% hit)");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "evictions ");
+        append_dec(line, &pos, bs.evictions);
+        append_str(line, &pos, " ghost hits ");
+        append_dec(line, &pos, bs.ghost_hits);
+        append_str(line, &pos, " read errors ");
+        append_dec(line, &pos, bs.read_errors);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "ARC p=");
+        append_dec(line, &pos, bs.target);
+        append_str(line, &pos, " T1=");
+        append_dec(line, &pos, bs.recent);
+        append_str(line, &pos, " T2=");
+        append_dec(line, &pos, bs.frequent);
+        append_str(line, &pos, " B1=");
+        append_dec(line, &pos, bs.ghost_recent);
+        append_str(line, &pos, " B2=");
+        append_dec(line, &pos, bs.ghost_frequent);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "dirty ");
+        append_dec(line, &pos, bs.dirty);
+        append_str(line, &pos, " coalesced ");
+        append_dec(line, &pos, bs.coalesced);
+        append_str(line, &pos, " written ");
+        append_dec(line, &pos, bs.writebacks);
+        append_str(line, &pos, " errors ");
+        append_dec(line, &pos, bs.write_errors);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "readahead ");
+        append_dec(line, &pos, bs.ra_issued);
+        append_str(line, &pos, " hit ");
+        append_dec(line, &pos, bs.ra_hits);
+        append_str(line, &pos, " wasted ");
+        append_dec(line, &pos, bs.ra_waste);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === SYNC COMMAND === */
+    if (cmd[0] == 's' && cmd[1] == 'y' && cmd[2] == 'n' && cmd[3] == 'c') {
+        BufCacheStats before;
+        BufCacheStats after;
+        bufcache_get_stats(&before);
+        int ok = bufcache_sync(0);
+        bufcache_get_stats(&after);
+
+        char line[64];
+        int pos = 0;
+        append_str(line, &pos, ok ? "Synced, " : "Sync failed, ");
+        append_dec(line, &pos, after.writebacks - before.writebacks);
+        append_str(line, &pos, " buffers written");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, ok ? 0x0088FF88 : 0x00FF9999);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === FSTRIM COMMAND (discard the mounted volume's free blocks) === */
+    if (cmd[0] == 'f' && cmd[1] == 's' && cmd[2] == 't' && cmd[3] == 'r' && cmd[4] == 'i' &&
+        cmd[5] == 'm' && (cmd[6] == 0 || cmd[6] == ' ')) {
+        if (!vfs_is_mounted()) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No filesystem mounted", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        uint64_t bytes = 0;
+        if (!vfs_trim(&bytes)) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Trim failed (does the disk support discard?)",
+                     0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        char line[64];
+        int pos = 0;
+        append_str(line, &pos, "Trimmed ");
+        append_dec(line, &pos, bytes >> 20);
+        append_str(line, &pos, " MB of free space");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
     /* === PCI COMMAND === */
     if (cmd[0] == 'p' && cmd[1] == 'c' && cmd[2] == 'i') {
         PciDevice list[64];
@@ -1039,6 +1455,102 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
         return;
     }
 
+    /* === ACPI COMMAND (MADT/MCFG/HPET summary) === */
+    if (cmd[0] == 'a' && cmd[1] == 'c' && cmd[2] == 'p' && cmd[3] == 'i') {
+        const AcpiInfo* acpi = acpi_get_info();
+        if (!acpi) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "ACPI tables not available", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        char line[80];
+        int pos = 0;
+        append_str(line, &pos, "OEM ");
+        append_str(line, &pos, acpi->oem_id);
+        append_str(line, &pos, " rev=");
+        append_hex(line, &pos, acpi->revision, 2);
+        append_str(line, &pos, " LAPIC=");
+        append_hex(line, &pos, (uint32_t)acpi->lapic_address, 8);
+        append_str(line, &pos, acpi->pic_compat ? " 8259" : "");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "CPUs=");
+        append_hex(line, &pos, acpi->cpu_count, 2);
+        append_str(line, &pos, " apic ids:");
+        for (uint32_t i = 0; i < acpi->cpu_count && pos < 72; i++) {
+            line[pos++] = ' ';
+            append_hex(line, &pos, acpi->cpus[i].apic_id, 2);
+            if (!acpi->cpus[i].enabled) {
+                line[pos++] = '*';
+            }
+        }
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        for (uint32_t i = 0; i < acpi->ioapic_count; i++) {
+            pos = 0;
+            append_str(line, &pos, "IOAPIC id=");
+            append_hex(line, &pos, acpi->ioapics[i].id, 2);
+            append_str(line, &pos, " addr=");
+            append_hex(line, &pos, (uint32_t)acpi->ioapics[i].address, 8);
+            append_str(line, &pos, " gsi=");
+            append_hex(line, &pos, acpi->ioapics[i].gsi_base, 2);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+
+        for (uint32_t i = 0; i < acpi->override_count; i++) {
+            uint16_t flags = acpi->overrides[i].flags;
+            pos = 0;
+            append_str(line, &pos, "IRQ");
+            append_hex(line, &pos, acpi->overrides[i].source_irq, 2);
+            append_str(line, &pos, " -> GSI");
+            append_hex(line, &pos, acpi->overrides[i].gsi, 2);
+            append_str(line, &pos, ((flags & ACPI_INTI_TRIGGER_MASK) == ACPI_INTI_LEVEL) ? " level" : " edge");
+            append_str(line, &pos, ((flags & ACPI_INTI_POLARITY_MASK) == ACPI_INTI_ACTIVE_LOW) ? " low" : " high");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+
+        for (uint32_t i = 0; i < acpi->ecam_count; i++) {
+            pos = 0;
+            append_str(line, &pos, "ECAM seg=");
+            append_hex(line, &pos, acpi->ecam[i].segment, 4);
+            append_str(line, &pos, " bus ");
+            append_hex(line, &pos, acpi->ecam[i].start_bus, 2);
+            line[pos++] = '-';
+            append_hex(line, &pos, acpi->ecam[i].end_bus, 2);
+            append_str(line, &pos, " base=");
+            append_hex(line, &pos, (uint32_t)(acpi->ecam[i].base >> 32), 8);
+            append_hex(line, &pos, (uint32_t)acpi->ecam[i].base, 8);
+            append_str(line, &pos, pci_using_ecam() && i == 0 ? " (in use)" : "");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+
+        pos = 0;
+        if (acpi->hpet_address) {
+            append_str(line, &pos, "HPET addr=");
+            append_hex(line, &pos, (uint32_t)acpi->hpet_address, 8);
+            append_str(line, &pos, " min tick=");
+            append_hex(line, &pos, acpi->hpet_min_tick, 4);
+        } else {
+            append_str(line, &pos, "HPET not present");
+        }
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
     /* === IP COMMAND === */
     if (cmd[0] == 'i' && cmd[1] == 'p') {
         char* arg = cmd + 2;
@@ -1119,6 +1631,1019 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
         return;
     }
 
+    /* === PROF COMMAND (call profiler, make PROFILE=calls) === */
+    if (cmd[0] == 'p' && cmd[1] == 'r' && cmd[2] == 'o' && cmd[3] == 'f') {
+        char* arg = cmd + 4;
+        while (*arg == ' ') arg++;
+
+        if (!profile_compiled_in()) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Profiler not built in (make PROFILE=calls)", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        if (arg[0] == 'o' && arg[1] == 'n') {
+            profile_enable(1);
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Profiling on", 0x0088FF88);
+        } else if (arg[0] == 'o' && arg[1] == 'f' && arg[2] == 'f') {
+            profile_enable(0);
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Profiling off", 0x0088FF88);
+        } else if (arg[0] == 'r' && arg[1] == 'e' && arg[2] == 's' && arg[3] == 'e' && arg[4] == 't') {
+            profile_reset();
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Profile buffer cleared", 0x0088FF88);
+        } else if (arg[0] == 'd' && arg[1] == 'u' && arg[2] == 'm' && arg[3] == 'p') {
+            profile_dump_serial();
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Profile dumped to serial", 0x0088FF88);
+        } else if (arg[0] == 0) {
+            char line[64];
+            int pos = 0;
+            append_str(line, &pos, profile_enabled() ? "on, events=0x" : "off, events=0x");
+            append_hex(line, &pos, (uint32_t)profile_event_count(), 8);
+            append_str(line, &pos, " dropped=0x");
+            append_hex(line, &pos, (uint32_t)profile_dropped(), 8);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        } else {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: prof [on|off|reset|dump]", 0x00FFAA00);
+        }
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === BLKBENCH COMMAND (raw device load generator) === */
+    if (cmd[0] == 'b' && cmd[1] == 'l' && cmd[2] == 'k' && cmd[3] == 'b' && cmd[4] == 'e' &&
+        cmd[5] == 'n' && cmd[6] == 'c' && cmd[7] == 'h' && (cmd[8] == 0 || cmd[8] == ' ')) {
+        BlkBenchConfig cfg;
+        BlkBenchResult res;
+        int force = 0;
+        const char *err = blkbench_parse(cmd + 8, &cfg, &force);
+        if (err) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, err, 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (cfg.op == BLOCK_OP_WRITE && !force) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Write tests destroy data on the disk; add 'force'", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        char line[96];
+        int pos = 0;
+        append_str(line, &pos, "Running ");
+        append_str(line, &pos, cfg.random ? "rand" : "seq ");
+        append_str(line, &pos, cfg.op == BLOCK_OP_WRITE ? "write" : "read");
+        append_str(line, &pos, " on ");
+        append_str(line, &pos, cfg.dev->name ? cfg.dev->name : "?");
+        append_str(line, &pos, " bs=");
+        append_dec(line, &pos, cfg.block_size);
+        append_str(line, &pos, " qd=");
+        append_dec(line, &pos, cfg.queue_depth);
+        append_str(line, &pos, " for ");
+        append_dec(line, &pos, cfg.seconds);
+        append_str(line, &pos, " s...");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        if (!blkbench_run(&cfg, &res)) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Invalid bs/qd/range/time for this device", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (cfg.op == BLOCK_OP_WRITE) {
+            /* Cached blocks of the range no longer match the disk */
+            bufcache_invalidate(cfg.dev);
+        }
+
+        pos = 0;
+        append_dec(line, &pos, res.iops);
+        append_str(line, &pos, " IOPS  ");
+        append_dec(line, &pos, res.kb_per_sec / 1024);
+        append_str(line, &pos, ".");
+        append_dec(line, &pos, (res.kb_per_sec % 1024) * 10 / 1024);
+        append_str(line, &pos, " MB/s  ");
+        append_dec(line, &pos, res.ios);
+        append_str(line, &pos, " ios  ");
+        append_dec(line, &pos, res.errors);
+        append_str(line, &pos, " errors");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "lat us avg ");
+        append_dec(line, &pos, res.lat_avg_ns / 1000);
+        append_str(line, &pos, "  p50 ");
+        append_dec(line, &pos, res.lat_p50_ns / 1000);
+        append_str(line, &pos, "  p99 ");
+        append_dec(line, &pos, res.lat_p99_ns / 1000);
+        append_str(line, &pos, "  p99.9 ");
+        append_dec(line, &pos, res.lat_p999_ns / 1000);
+        append_str(line, &pos, "  max ");
+        append_dec(line, &pos, res.lat_max_ns / 1000);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        blkbench_report_serial(&cfg, &res);
+        fb_print(fb, pitch, 70, shell_state.cursor_y, "CSV written to serial", 0x00CCCCCC);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === BLKTRACE COMMAND (block request recorder) === */
+    if (cmd[0] == 'b' && cmd[1] == 'l' && cmd[2] == 'k' && cmd[3] == 't' && cmd[4] == 'r' &&
+        cmd[5] == 'a' && cmd[6] == 'c' && cmd[7] == 'e' && (cmd[8] == 0 || cmd[8] == ' ')) {
+        char* arg = cmd + 8;
+        while (*arg == ' ') arg++;
+
+        if (arg[0] == 'o' && arg[1] == 'n') {
+            if (blktrace_enable(1)) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "Block tracing on", 0x0088FF88);
+            } else {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "No memory for the trace ring", 0x00FF9999);
+            }
+        } else if (arg[0] == 'o' && arg[1] == 'f' && arg[2] == 'f') {
+            blktrace_enable(0);
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Block tracing off", 0x0088FF88);
+        } else if (arg[0] == 'r' && arg[1] == 'e' && arg[2] == 's' && arg[3] == 'e' && arg[4] == 't') {
+            blktrace_reset();
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Block trace cleared", 0x0088FF88);
+        } else if (arg[0] == 'd' && arg[1] == 'u' && arg[2] == 'm' && arg[3] == 'p') {
+            blktrace_dump_serial();
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Block trace dumped to serial", 0x0088FF88);
+        } else if (arg[0] == 0) {
+            char line[64];
+            int pos = 0;
+            append_str(line, &pos, blktrace_enabled() ? "on, events=" : "off, events=");
+            append_dec(line, &pos, blktrace_event_count());
+            append_str(line, &pos, " dropped=");
+            append_dec(line, &pos, blktrace_dropped());
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        } else {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: blktrace [on|off|reset|dump]", 0x00FFAA00);
+        }
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === BLKREPLAY COMMAND (re-issue a captured block trace) === */
+    if (cmd[0] == 'b' && cmd[1] == 'l' && cmd[2] == 'k' && cmd[3] == 'r' && cmd[4] == 'e' &&
+        cmd[5] == 'p' && cmd[6] == 'l' && cmd[7] == 'a' && cmd[8] == 'y' && (cmd[9] == 0 || cmd[9] == ' ')) {
+        const char *arg = cmd + 9;
+        BlockDevice *dev = 0;
+        BlockDevice *from = 0;
+        int fast = 0;
+        int force = 0;
+        int bad = 0;
+        while (*arg) {
+            while (*arg == ' ') arg++;
+            const char *tok = arg;
+            while (*arg && *arg != ' ') arg++;
+            int len = (int)(arg - tok);
+            if (len == 0) {
+                break;
+            }
+            if (!dev) {
+                dev = find_block_device(tok, len);
+                bad |= !dev;
+            } else if (len > 5 && token_is(tok, 5, "from=")) {
+                from = find_block_device(tok + 5, len - 5);
+                bad |= !from;
+            } else if (token_is(tok, len, "fast")) {
+                fast = 1;
+            } else if (token_is(tok, len, "force")) {
+                force = 1;
+            } else {
+                bad = 1;
+            }
+        }
+        if (!dev || bad) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: blkreplay <dev> [from=<dev>] [fast] [force]", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (!from) {
+            from = dev;
+        }
+        int writes = blktrace_has_writes(from);
+        if (writes && !force) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Trace has writes that destroy data on the disk; add 'force'", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        BlkReplayResult res;
+        if (!blktrace_replay(dev, from, fast, &res)) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Nothing traced on that device (blktrace on, then run a workload)", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (writes) {
+            bufcache_invalidate(dev);
+        }
+
+        char line[96];
+        int pos = 0;
+        append_dec(line, &pos, res.events);
+        append_str(line, &pos, " events as ");
+        append_dec(line, &pos, res.ios);
+        append_str(line, &pos, " ios, ");
+        append_dec(line, &pos, res.bytes >> 10);
+        append_str(line, &pos, " KB, ");
+        append_dec(line, &pos, res.errors);
+        append_str(line, &pos, " errors");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "took ");
+        append_dec(line, &pos, res.elapsed_us / 1000);
+        append_str(line, &pos, " ms (trace ");
+        append_dec(line, &pos, res.trace_us / 1000);
+        append_str(line, &pos, " ms)");
+        if (!fast) {
+            append_str(line, &pos, ", late ");
+            append_dec(line, &pos, res.late);
+        }
+        append_str(line, &pos, ", lat us avg ");
+        append_dec(line, &pos, res.lat_avg_us);
+        append_str(line, &pos, " max ");
+        append_dec(line, &pos, res.lat_max_us);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === MD COMMAND (software RAID arrays) === */
+    if (cmd[0] == 'm' && cmd[1] == 'd' && (cmd[2] == 0 || cmd[2] == ' ')) {
+        const char *arg = cmd + 2;
+        while (*arg == ' ') arg++;
+
+        if (arg[0] == 'c' && arg[1] == 'r' && arg[2] == 'e' && arg[3] == 'a' && arg[4] == 't' &&
+            arg[5] == 'e' && (arg[6] == 0 || arg[6] == ' ')) {
+            arg += 6;
+            BlockDevice *members[MD_MAX_MEMBERS];
+            uint32_t count = 0;
+            uint32_t level = 0;
+            uint64_t chunk = 0;
+            int have_level = 0;
+            const char *err = 0;
+            while (*arg && !err) {
+                while (*arg == ' ') arg++;
+                const char *tok = arg;
+                while (*arg && *arg != ' ') arg++;
+                int len = (int)(arg - tok);
+                if (len == 0) {
+                    break;
+                }
+                if (!have_level) {
+                    if (token_is(tok, len, "raid0") || token_is(tok, len, "raid1")) {
+                        level = tok[4] == '1' ? MD_RAID1 : MD_RAID0;
+                        have_level = 1;
+                    } else {
+                        err = "Level must be raid0 or raid1";
+                    }
+                } else if (len > 6 && token_is(tok, 6, "chunk=")) {
+                    if (!parse_size(tok + 6, len - 6, &chunk)) {
+                        err = "Bad chunk size";
+                    }
+                } else if (count < MD_MAX_MEMBERS) {
+                    members[count] = find_block_device(tok, len);
+                    if (!members[count++]) {
+                        err = "Unknown device (see disks)";
+                    }
+                } else {
+                    err = "Too many members";
+                }
+            }
+            if (!err && (!have_level || count < 2)) {
+                err = "Usage: md create raid0|raid1 [chunk=64k] <dev> <dev> ...";
+            }
+            if (err) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, err, 0x00FFAA00);
+                shell_state.cursor_y += shell_state.line_height + 3;
+                return;
+            }
+            BlockDevice *md = md_create(level, (uint32_t)chunk, members, count);
+            if (!md) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "Array not created (reason on serial)", 0x00FF9999);
+                shell_state.cursor_y += shell_state.line_height + 3;
+                return;
+            }
+            char line[64];
+            int pos = 0;
+            append_str(line, &pos, md->name);
+            append_str(line, &pos, " created, ");
+            append_dec(line, &pos, md->total_sectors * md->sector_size >> 20);
+            append_str(line, &pos, " MB");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (arg[0] != 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: md [create raid0|raid1 [chunk=64k] <dev> <dev> ...]", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (md_count() == 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No arrays", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        for (int a = 0; a < md_count(); a++) {
+            BlockDevice *md = md_get(a);
+            MdInfo info;
+            if (!md_get_info(md, &info)) {
+                continue;
+            }
+            char line[80];
+            int pos = 0;
+            append_str(line, &pos, md->name);
+            append_str(line, &pos, info.level == MD_RAID1 ? " raid1 " : " raid0 ");
+            append_dec(line, &pos, md->total_sectors * md->sector_size >> 20);
+            append_str(line, &pos, " MB");
+            if (info.level == MD_RAID0) {
+                append_str(line, &pos, " chunk ");
+                append_dec(line, &pos, info.chunk_bytes >> 10);
+                append_str(line, &pos, "K");
+            } else {
+                append_str(line, &pos, info.failed ? " degraded" : " clean");
+                append_str(line, &pos, " retries ");
+                append_dec(line, &pos, info.retries);
+            }
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            for (uint32_t i = 0; i < info.members; i++) {
+                pos = 0;
+                append_str(line, &pos, "  ");
+                append_str(line, &pos, info.member[i]->name ? info.member[i]->name : "?");
+                append_str(line, &pos, " ios ");
+                append_dec(line, &pos, info.member_ios[i]);
+                append_str(line, &pos, " errors ");
+                append_dec(line, &pos, info.member_errors[i]);
+                if (info.failed & (1U << i)) {
+                    append_str(line, &pos, " FAILED");
+                }
+                line[pos] = 0;
+                fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+                shell_state.cursor_y += shell_state.line_height + 2;
+            }
+        }
+        shell_state.cursor_y += 1;
+        return;
+    }
+
+    /* === BCACHE COMMAND (SSD cache tier) === */
+    if (cmd[0] == 'b' && cmd[1] == 'c' && cmd[2] == 'a' && cmd[3] == 'c' && cmd[4] == 'h' &&
+        cmd[5] == 'e' && (cmd[6] == 0 || cmd[6] == ' ')) {
+        const char *arg = cmd + 6;
+        const char *tok[5];
+        int len[5];
+        int argc = 0;
+        while (*arg && argc < 5) {
+            while (*arg == ' ') arg++;
+            tok[argc] = arg;
+            while (*arg && *arg != ' ') arg++;
+            len[argc] = (int)(arg - tok[argc]);
+            if (len[argc]) {
+                argc++;
+            }
+        }
+        while (*arg == ' ') arg++;
+
+        const char *err = 0;
+        const char *done = 0;
+        BlockDevice *created = 0;
+        BcacheStats probe;
+        if (argc == 0) {
+            /* Listing below */
+        } else if (*arg) {
+            err = "Too many arguments";
+        } else if (token_is(tok[0], len[0], "create") && argc >= 3) {
+            BlockDevice *backing = find_block_device(tok[1], len[1]);
+            BlockDevice *cache = find_block_device(tok[2], len[2]);
+            uint32_t mode = BCACHE_WRITETHROUGH;
+            int force = 0;
+            for (int i = 3; i < argc && !err; i++) {
+                if (token_is(tok[i], len[i], "writethrough")) {
+                    mode = BCACHE_WRITETHROUGH;
+                } else if (token_is(tok[i], len[i], "writeback")) {
+                    mode = BCACHE_WRITEBACK;
+                } else if (token_is(tok[i], len[i], "force")) {
+                    force = 1;
+                } else {
+                    err = "Mode must be writethrough or writeback";
+                }
+            }
+            if (!err && (!backing || !cache)) {
+                err = "Unknown device (see disks)";
+            }
+            if (!err) {
+                created = bcache_create(backing, cache, mode, force);
+                if (!created) {
+                    err = "Cache not attached (reason on serial)";
+                }
+            }
+        } else if (token_is(tok[0], len[0], "mode") && argc == 3) {
+            BlockDevice *dev = find_block_device(tok[1], len[1]);
+            int wb = token_is(tok[2], len[2], "writeback");
+            if (!dev || !bcache_get_stats(dev, &probe)) {
+                err = "Not a cached device";
+            } else if (!wb && !token_is(tok[2], len[2], "writethrough")) {
+                err = "Mode must be writethrough or writeback";
+            } else if (!bcache_set_mode(dev, wb ? BCACHE_WRITEBACK : BCACHE_WRITETHROUGH)) {
+                err = "Dirty blocks could not be written back";
+            } else {
+                done = wb ? "Write-back" : "Write-through";
+            }
+        } else if (token_is(tok[0], len[0], "flush") && argc == 2) {
+            BlockDevice *dev = find_block_device(tok[1], len[1]);
+            if (!dev || !bcache_get_stats(dev, &probe)) {
+                err = "Not a cached device";
+            } else if (!bcache_flush_dirty(dev)) {
+                err = "Dirty blocks could not be written back";
+            } else {
+                done = "Dirty blocks written back";
+            }
+        } else {
+            err = "Usage: bcache [create <disk> <cache> [writethrough|writeback] [force] | mode <dev> <mode> | flush <dev>]";
+        }
+
+        if (err) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, err, 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (done) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, done, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (created) {
+            char line[64];
+            int pos = 0;
+            append_str(line, &pos, created->name);
+            append_str(line, &pos, " created, ");
+            append_dec(line, &pos, created->total_sectors * created->sector_size >> 20);
+            append_str(line, &pos, " MB");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (bcache_count() == 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No cached devices", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        for (int c = 0; c < bcache_count(); c++) {
+            BlockDevice *dev = bcache_get(c);
+            BcacheStats st;
+            if (!bcache_get_stats(dev, &st)) {
+                continue;
+            }
+            char line[96];
+            int pos = 0;
+            append_str(line, &pos, dev->name);
+            append_str(line, &pos, st.mode == BCACHE_WRITEBACK ? " write-back " : " write-through ");
+            append_dec(line, &pos, (uint64_t)st.blocks * BCACHE_BLOCK_SIZE >> 20);
+            append_str(line, &pos, " MB cache");
+            append_str(line, &pos, st.warm ? " (warm)" : "");
+            append_str(line, &pos, " valid ");
+            append_dec(line, &pos, st.valid);
+            append_str(line, &pos, " dirty ");
+            append_dec(line, &pos, st.dirty);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            uint64_t reads = st.read_hits + st.read_misses;
+            uint64_t writes = st.write_hits + st.write_misses;
+            pos = 0;
+            append_str(line, &pos, "  read hits ");
+            append_dec(line, &pos, st.read_hits);
+            append_str(line, &pos, "/");
+            append_dec(line, &pos, reads);
+            append_str(line, &pos, " (");
+            append_dec(line, &pos, reads ? st.read_hits * 100 / reads : 0);
+            append_str(line, &pos, "%)  write hits ");
+            append_dec(line, &pos, st.write_hits);
+            append_str(line, &pos, "/");
+            append_dec(line, &pos, writes);
+            append_str(line, &pos, " (");
+            append_dec(line, &pos, writes ? st.write_hits * 100 / writes : 0);
+            append_str(line, &pos, "%)");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            pos = 0;
+            append_str(line, &pos, "  bypassed ");
+            append_dec(line, &pos, st.bypassed);
+            append_str(line, &pos, " fills ");
+            append_dec(line, &pos, st.fills);
+            append_str(line, &pos, " evictions ");
+            append_dec(line, &pos, st.evictions);
+            append_str(line, &pos, " writebacks ");
+            append_dec(line, &pos, st.writebacks);
+            append_str(line, &pos, " errors ");
+            append_dec(line, &pos, st.errors);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+        shell_state.cursor_y += 1;
+        return;
+    }
+
+    /* === CRYPT COMMAND (AES-XTS encrypted devices) === */
+    if (cmd[0] == 'c' && cmd[1] == 'r' && cmd[2] == 'y' && cmd[3] == 'p' && cmd[4] == 't' &&
+        (cmd[5] == 0 || cmd[5] == ' ')) {
+        const char *arg = cmd + 5;
+        while (*arg == ' ') arg++;
+
+        if (arg[0] == 'o' && arg[1] == 'p' && arg[2] == 'e' && arg[3] == 'n' && arg[4] == ' ') {
+            arg += 4;
+            while (*arg == ' ') arg++;
+            const char *name = arg;
+            while (*arg && *arg != ' ') arg++;
+            int name_len = (int)(arg - name);
+            while (*arg == ' ') arg++;
+            const char *hex = arg;
+            while (*arg && *arg != ' ') arg++;
+            int hex_len = (int)(arg - hex);
+
+            uint8_t key[64];
+            uint32_t key_len = parse_hex_bytes(hex, hex_len, key, sizeof(key));
+            BlockDevice *lower = find_block_device(name, name_len);
+            BlockDevice *dev = 0;
+            const char *err = 0;
+            if (!lower) {
+                err = "Usage: crypt open <dev> <64 or 128 hex digit key>";
+            } else if (key_len != 32 && key_len != 64) {
+                err = "Key must be 64 (AES-128) or 128 (AES-256) hex digits";
+            } else {
+                dev = crypt_create(lower, key, key_len);
+                if (!dev) {
+                    err = "Device not created (reason on serial)";
+                }
+            }
+            for (uint32_t i = 0; i < sizeof(key); i++) {
+                ((volatile uint8_t *)key)[i] = 0;
+            }
+            if (err) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, err, 0x00FFAA00);
+                shell_state.cursor_y += shell_state.line_height + 3;
+                return;
+            }
+            char line[64];
+            int pos = 0;
+            append_str(line, &pos, dev->name);
+            append_str(line, &pos, " created, ");
+            append_dec(line, &pos, dev->total_sectors * dev->sector_size >> 20);
+            append_str(line, &pos, " MB");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        if (arg[0] == 'b' && arg[1] == 'e' && arg[2] == 'n' && arg[3] == 'c' && arg[4] == 'h' && arg[5] == 0) {
+            CryptBenchResult res[4];
+            int n = crypt_bench(res, 4);
+            if (n == 0) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "Out of memory", 0x00FF9999);
+                shell_state.cursor_y += shell_state.line_height + 3;
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                char line[96];
+                int pos = 0;
+                append_str(line, &pos, res[i].key_bits == 512 ? "aes-256-xts " : "aes-128-xts ");
+                append_str(line, &pos, res[i].aesni ? "aes-ni   " : "software ");
+                append_str(line, &pos, " encrypt ");
+                append_dec(line, &pos, res[i].encrypt_kb_per_sec >> 10);
+                append_str(line, &pos, " MB/s  decrypt ");
+                append_dec(line, &pos, res[i].decrypt_kb_per_sec >> 10);
+                append_str(line, &pos, " MB/s");
+                line[pos] = 0;
+                fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+                shell_state.cursor_y += shell_state.line_height + 2;
+            }
+            shell_state.cursor_y += 1;
+            return;
+        }
+
+        if (arg[0] != 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: crypt [open <dev> <hex key> | bench]", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (crypt_count() == 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No encrypted devices", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        for (int c = 0; c < crypt_count(); c++) {
+            BlockDevice *dev = crypt_get(c);
+            CryptInfo info;
+            if (!crypt_get_info(dev, &info)) {
+                continue;
+            }
+            char line[96];
+            int pos = 0;
+            append_str(line, &pos, dev->name);
+            append_str(line, &pos, info.key_bits == 512 ? " aes-256-xts over " : " aes-128-xts over ");
+            append_str(line, &pos, info.lower->name ? info.lower->name : "?");
+            append_str(line, &pos, info.aesni ? " (aes-ni)" : " (software)");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            uint64_t bytes = info.bytes_encrypted + info.bytes_decrypted;
+            uint64_t us = tsc_to_us(info.cipher_cycles);
+            pos = 0;
+            append_str(line, &pos, "  reads ");
+            append_dec(line, &pos, info.reads);
+            append_str(line, &pos, " writes ");
+            append_dec(line, &pos, info.writes);
+            append_str(line, &pos, " errors ");
+            append_dec(line, &pos, info.errors);
+            append_str(line, &pos, " cipher ");
+            append_dec(line, &pos, bytes >> 20);
+            append_str(line, &pos, " MB in ");
+            append_dec(line, &pos, us / 1000);
+            append_str(line, &pos, " ms");
+            if (us) {
+                append_str(line, &pos, " (");
+                append_dec(line, &pos, bytes / us);
+                append_str(line, &pos, " MB/s)");
+            }
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+        shell_state.cursor_y += 1;
+        return;
+    }
+
+    /* === ZRAM COMMAND (LZ4-compressed RAM disks) === */
+    if (cmd[0] == 'z' && cmd[1] == 'r' && cmd[2] == 'a' && cmd[3] == 'm' && (cmd[4] == 0 || cmd[4] == ' ')) {
+        const char *arg = cmd + 4;
+        while (*arg == ' ') arg++;
+
+        if (arg[0] == 'c' && arg[1] == 'r' && arg[2] == 'e' && arg[3] == 'a' && arg[4] == 't' &&
+            arg[5] == 'e' && (arg[6] == 0 || arg[6] == ' ')) {
+            arg += 6;
+            uint64_t disk_bytes = 0;
+            uint64_t limit = 0;
+            const char *err = 0;
+            while (*arg && !err) {
+                while (*arg == ' ') arg++;
+                const char *tok = arg;
+                while (*arg && *arg != ' ') arg++;
+                int len = (int)(arg - tok);
+                if (len == 0) {
+                    break;
+                }
+                if (len > 6 && token_is(tok, 6, "limit=")) {
+                    if (!parse_size(tok + 6, len - 6, &limit) || limit == 0) {
+                        err = "Bad limit";
+                    }
+                } else if (!parse_size(tok, len, &disk_bytes) || disk_bytes == 0) {
+                    err = "Usage: zram create [size] [limit=size]";
+                }
+            }
+            BlockDevice *dev = err ? 0 : zram_create(disk_bytes, limit);
+            if (!dev && !err) {
+                err = "Device not created (reason on serial)";
+            }
+            if (err) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, err, 0x00FFAA00);
+                shell_state.cursor_y += shell_state.line_height + 3;
+                return;
+            }
+            char line[64];
+            int pos = 0;
+            append_str(line, &pos, dev->name);
+            append_str(line, &pos, " created, ");
+            append_dec(line, &pos, dev->total_sectors * dev->sector_size >> 20);
+            append_str(line, &pos, " MB");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (arg[0] != 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: zram [create [size] [limit=size]]", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        if (zram_count() == 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No zram devices", 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        for (int z = 0; z < zram_count(); z++) {
+            BlockDevice *dev = zram_get(z);
+            ZramStats st;
+            if (!zram_get_stats(dev, &st)) {
+                continue;
+            }
+            /* Ratio over the pages that take pool memory, in hundredths */
+            uint64_t orig = (st.pages_stored - st.same_pages) * ZRAM_PAGE_SIZE;
+            uint64_t ratio = st.compressed_bytes ? orig * 100 / st.compressed_bytes : 0;
+            char line[96];
+            int pos = 0;
+            append_str(line, &pos, dev->name);
+            append_str(line, &pos, " ");
+            append_dec(line, &pos, st.disk_bytes >> 20);
+            append_str(line, &pos, " MB disk, pages ");
+            append_dec(line, &pos, st.pages_stored);
+            append_str(line, &pos, " (same ");
+            append_dec(line, &pos, st.same_pages);
+            append_str(line, &pos, ", huge ");
+            append_dec(line, &pos, st.huge_pages);
+            append_str(line, &pos, ") ratio ");
+            append_dec(line, &pos, ratio / 100);
+            append_str(line, &pos, ".");
+            append_dec(line, &pos, ratio / 10 % 10);
+            append_dec(line, &pos, ratio % 10);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            pos = 0;
+            append_str(line, &pos, "  memory ");
+            append_dec(line, &pos, (st.pool_bytes + st.table_bytes) >> 10);
+            append_str(line, &pos, " KB (data ");
+            append_dec(line, &pos, st.compressed_bytes >> 10);
+            append_str(line, &pos, " KB, limit ");
+            append_dec(line, &pos, st.mem_limit >> 20);
+            append_str(line, &pos, " MB) failed writes ");
+            append_dec(line, &pos, st.failed_writes);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            uint64_t c_us = tsc_to_us(st.compress_cycles);
+            uint64_t d_us = tsc_to_us(st.decompress_cycles);
+            pos = 0;
+            append_str(line, &pos, "  compress ");
+            append_dec(line, &pos, c_us ? st.compress_in / c_us : 0);
+            append_str(line, &pos, " MB/s  decompress ");
+            append_dec(line, &pos, d_us ? st.decompress_out / d_us : 0);
+            append_str(line, &pos, " MB/s");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+        shell_state.cursor_y += 1;
+        return;
+    }
+
+    /* === MOUNT COMMAND (switch the root ext4 volume) === */
+    if (cmd[0] == 'm' && cmd[1] == 'o' && cmd[2] == 'u' && cmd[3] == 'n' && cmd[4] == 't' &&
+        (cmd[5] == 0 || cmd[5] == ' ')) {
+        /* Two so a failed mount leaves the current volume untouched */
+        static Ext4Fs mount_fs[2];
+        static int mount_next = 0;
+        const char *arg = cmd + 5;
+        while (*arg == ' ') arg++;
+        int len = 0;
+        while (arg[len] && arg[len] != ' ') len++;
+        BlockDevice *dev = len ? find_block_device(arg, len) : 0;
+        if (!dev) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: mount <dev> (see disks)", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        /* Partitioned disks use their Linux partition, bare ones start at 0 */
+        PartitionInfo part;
+        uint64_t first_lba = find_linux_partition(dev, &part) ? part.first_lba : 0;
+        bufcache_sync(0);
+        Ext4Fs *fs = &mount_fs[mount_next];
+        if (!ext4_mount(fs, dev, first_lba)) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No ext4 filesystem there", 0x00FF9999);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        vfs_mount_ext4(fs);
+        mount_next ^= 1;
+
+        char line[64];
+        int pos = 0;
+        append_str(line, &pos, "Mounted ");
+        append_str(line, &pos, dev->name ? dev->name : "?");
+        append_str(line, &pos, " at lba ");
+        append_dec(line, &pos, first_lba);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === IOSTAT COMMAND (per-disk throughput, utilisation, latency) === */
+    if (cmd[0] == 'i' && cmd[1] == 'o' && cmd[2] == 's' && cmd[3] == 't' && cmd[4] == 'a' &&
+        cmd[5] == 't' && (cmd[6] == 0 || cmd[6] == ' ')) {
+        static const char *op_names[BLOCK_OP_COUNT] = { "read ", "write", "flush", "trim " };
+        static BlockIoStats before[BLOCK_MAX_DEVICES];
+        char *arg = cmd + 6;
+        while (*arg == ' ') arg++;
+
+        uint32_t seconds = 0;
+        while (*arg >= '0' && *arg <= '9' && seconds < 3600) {
+            seconds = seconds * 10 + (uint32_t)(*arg - '0');
+            arg++;
+        }
+        if (*arg != 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Usage: iostat [seconds]", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        char line[96];
+        int pos;
+        int devices = block_count();
+        uint64_t start = rdtsc();
+        uint64_t elapsed_us = tsc_to_us(start);
+
+        if (seconds) {
+            for (int i = 0; i < devices && i < BLOCK_MAX_DEVICES; i++) {
+                BlockDevice *dev = block_get(i);
+                if (dev) {
+                    block_io_stats(dev, &before[i]);
+                }
+            }
+
+            pos = 0;
+            append_str(line, &pos, "Sampling ");
+            append_dec(line, &pos, seconds);
+            append_str(line, &pos, " s, any key stops...");
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            /* Keep deferred work and writeback running so the sample sees it */
+            uint64_t end = start + tsc_from_us((uint64_t)seconds * 1000000);
+            while (rdtsc() < end) {
+                unsigned char sc = poll_keyboard();
+                if (sc && !(sc & 0x80)) {
+                    break;
+                }
+            }
+            elapsed_us = tsc_to_us(rdtsc() - start);
+            if (elapsed_us == 0) {
+                elapsed_us = 1;
+            }
+        }
+
+        for (int i = 0; i < devices && i < BLOCK_MAX_DEVICES; i++) {
+            BlockDevice *dev = block_get(i);
+            if (!dev) {
+                continue;
+            }
+            BlockIoStats st;
+            BlockQueueStats qs;
+            block_io_stats(dev, &st);
+            block_queue_stats(dev, &qs);
+            if (seconds) {
+                iostat_delta(&st, &before[i]);
+            }
+
+            pos = 0;
+            append_str(line, &pos, dev->name ? dev->name : "?");
+            append_str(line, &pos, "  util ");
+            append_dec(line, &pos, tsc_to_us(st.busy_cycles) * 100 / elapsed_us);
+            append_str(line, &pos, "%  busy ");
+            append_dec(line, &pos, tsc_to_us(st.busy_cycles) / 1000);
+            append_str(line, &pos, " ms  qd ");
+            append_dec(line, &pos, qs.in_flight);
+            append_str(line, &pos, " (max ");
+            append_dec(line, &pos, qs.max_in_flight);
+            append_str(line, &pos, ")  errors ");
+            append_dec(line, &pos, st.errors);
+            line[pos] = 0;
+            fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            shell_state.cursor_y += shell_state.line_height + 2;
+
+            for (uint32_t op = 0; op < BLOCK_OP_COUNT; op++) {
+                if (st.ops[op] == 0) {
+                    continue;
+                }
+                uint64_t kb = st.sectors[op] * dev->sector_size / 1024;
+                pos = 0;
+                append_str(line, &pos, "  ");
+                append_str(line, &pos, op_names[op]);
+                append_str(line, &pos, " ");
+                if (seconds) {
+                    append_dec(line, &pos, st.ops[op] * 1000000 / elapsed_us);
+                    append_str(line, &pos, " ops/s ");
+                    append_dec(line, &pos, kb * 1000000 / elapsed_us);
+                    append_str(line, &pos, " KB/s");
+                } else {
+                    append_dec(line, &pos, st.ops[op]);
+                    append_str(line, &pos, " ops ");
+                    append_dec(line, &pos, kb);
+                    append_str(line, &pos, " KB");
+                }
+                append_str(line, &pos, "  avg ");
+                append_dec(line, &pos, tsc_to_us(st.service_cycles[op] / st.ops[op]));
+                append_str(line, &pos, " us  p50 <");
+                append_dec(line, &pos, block_latency_percentile(&st, op, 50));
+                append_str(line, &pos, "  p99 <");
+                append_dec(line, &pos, block_latency_percentile(&st, op, 99));
+                line[pos] = 0;
+                fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x00CCCCCC);
+                shell_state.cursor_y += shell_state.line_height + 2;
+            }
+        }
+        if (devices == 0) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "No block devices", 0x00FFAA00);
+            shell_state.cursor_y += shell_state.line_height + 2;
+        }
+
+        block_iostat_dump();
+        fb_print(fb, pitch, 70, shell_state.cursor_y, "Histograms written to serial", 0x00CCCCCC);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
+    /* === IRQSTAT COMMAND (top half vs bottom half cost) === */
+    if (cmd[0] == 'i' && cmd[1] == 'r' && cmd[2] == 'q' && cmd[3] == 's' && cmd[4] == 't' &&
+        cmd[5] == 'a' && cmd[6] == 't') {
+        SoftirqStats st;
+        softirq_get_stats(&st);
+
+        char line[80];
+        int pos = 0;
+        append_str(line, &pos, "IRQs=0x");
+        append_hex(line, &pos, (uint32_t)st.irq_count, 8);
+        append_str(line, &pos, " top avg=0x");
+        append_hex(line, &pos, (uint32_t)(st.irq_count ? st.irq_cycles / st.irq_count : 0), 8);
+        append_str(line, &pos, " max=0x");
+        append_hex(line, &pos, (uint32_t)st.irq_max_cycles, 8);
+        append_str(line, &pos, " cyc");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "softirq items=0x");
+        append_hex(line, &pos, (uint32_t)st.items, 8);
+        append_str(line, &pos, " batches=0x");
+        append_hex(line, &pos, (uint32_t)st.batches, 8);
+        append_str(line, &pos, " avg=0x");
+        append_hex(line, &pos, (uint32_t)(st.items ? st.bh_cycles / st.items : 0), 8);
+        append_str(line, &pos, " cyc");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, "queued=0x");
+        append_hex(line, &pos, (uint32_t)st.queued, 8);
+        append_str(line, &pos, " dropped=0x");
+        append_hex(line, &pos, (uint32_t)st.dropped, 8);
+        append_str(line, &pos, softirq_pending() ? " (pending)" : "");
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        pos = 0;
+        append_str(line, &pos, (fpu_features() & FPU_FEAT_XSAVE) ? "fpu xsave" : "fpu fxsave");
+        append_str(line, &pos, (fpu_features() & FPU_FEAT_AVX) ? "+avx" : "");
+        append_str(line, &pos, (fpu_features() & FPU_FEAT_AESNI) ? "+aesni" : "");
+        append_str(line, &pos, " nested saves=0x");
+        append_hex(line, &pos, (uint32_t)fpu_nested_saves(), 8);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 2;
+
+        RcuStats rs;
+        rcu_get_stats(&rs);
+        pos = 0;
+        append_str(line, &pos, "rcu gp=0x");
+        append_hex(line, &pos, (uint32_t)rs.completed, 8);
+        append_str(line, &pos, " callbacks=0x");
+        append_hex(line, &pos, (uint32_t)rs.callbacks_invoked, 8);
+        append_str(line, &pos, " pending=0x");
+        append_hex(line, &pos, (uint32_t)rs.pending, 4);
+        line[pos] = 0;
+        fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+        shell_state.cursor_y += shell_state.line_height + 3;
+        return;
+    }
+
     /* === LOGO COMMAND === */
     if (cmd[0] == 'l' && cmd[1] == 'o' && cmd[2] == 'g' && cmd[3] == 'o') {
         char* arg = cmd + 4;
@@ -1955,12 +3480,6 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
             return;
         }
         
-        if (!fs_ensure_capacity(1)) {
-            fb_print(fb, pitch, 70, shell_state.cursor_y, "Vault is full!", 0x00FF4444);
-            shell_state.cursor_y += shell_state.line_height + 3;
-            return;
-        }
-        
         /* Parse source and destination */
         char src[32], dest[32];
         int idx = 0;
@@ -1983,6 +3502,39 @@ static void execute_command(unsigned int* fb, unsigned int pitch, unsigned int w
             return;
         }
         
+        if (vfs_is_mounted()) {
+            char src_path[128];
+            char dest_path[128];
+            build_full_path(src, src_path, sizeof(src_path));
+            build_full_path(dest, dest_path, sizeof(dest_path));
+
+            uint64_t size = 0;
+            int rc = copy_mounted_file(src_path, dest_path, &size);
+            if (rc == 1) {
+                char line[64];
+                int pos = 0;
+                append_str(line, &pos, "Scroll duplicated, ");
+                append_dec(line, &pos, size);
+                append_str(line, &pos, " bytes");
+                line[pos] = 0;
+                fb_print(fb, pitch, 70, shell_state.cursor_y, line, 0x0088FF88);
+            } else if (rc == -1) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "Scroll too large to copy (1 MB max)", 0x00FF4444);
+            } else if (rc == -2) {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "Write failed", 0x00FF4444);
+            } else {
+                fb_print(fb, pitch, 70, shell_state.cursor_y, "Source scroll not found!", 0x00FF4444);
+            }
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+
+        if (!fs_ensure_capacity(1)) {
+            fb_print(fb, pitch, 70, shell_state.cursor_y, "Vault is full!", 0x00FF4444);
+            shell_state.cursor_y += shell_state.line_height + 3;
+            return;
+        }
+        
         /* Find source file */
         int src_idx = -1;
         for (int i = 0; i < file_count; i++) {
@@ -2436,10 +3988,7 @@ void fb_shell_run(BOOT_INFO* boot_info) {
     /* Clear framebuffer to black */
     serial_write("Shell: Clearing framebuffer...\n");
     for (unsigned int y = 0; y < height; y++) {
-        unsigned int* row = fb + y * stride;
-        for (unsigned int x = 0; x < width; x++) {
-            row[x] = 0x000000;
-        }
+        simd_memset32(fb + y * stride, 0x000000, width);
     }
     serial_write("Shell: Screen cleared\n");
     
@@ -2493,19 +4042,12 @@ void fb_shell_run(BOOT_INFO* boot_info) {
                 unsigned int scroll_lines = 100;  /* Pixels to scroll */
                 /* Copy each line up by scroll_lines pixels */
                 for (unsigned int y = scroll_lines; y < height; y++) {
-                    unsigned int* dst = fb + (y - scroll_lines) * stride;
-                    unsigned int* src = fb + y * stride;
-                    for (unsigned int x = 0; x < width; x++) {
-                        dst[x] = src[x];
-                    }
+                    simd_memcpy(fb + (y - scroll_lines) * stride, fb + y * stride, width * 4);
                 }
                 
                 /* Clear the bottom portion that was scrolled up */
                 for (unsigned int y = height - scroll_lines; y < height; y++) {
-                    unsigned int* row = fb + y * stride;
-                    for (unsigned int x = 0; x < width; x++) {
-                        row[x] = 0x000000;
-                    }
+                    simd_memset32(fb + y * stride, 0x000000, width);
                 }
                 
                 /* Adjust cursor position */
@@ -1,6 +1,10 @@
 #include "net.h"
 #include "drivers/net/rtl8139.h"
 #include "serial.h"
+#include "core/idt.h"
+#include "core/softirq.h"
+#include "core/rcu.h"
+#include "core/irqflags.h"
 
 #define ETH_TYPE_ARP 0x0806
 #define ETH_TYPE_IP  0x0800
@@ -13,6 +17,8 @@
 #define ICMP_ECHO_REQUEST 8
 #define ICMP_ECHO_REPLY   0
 
+#define NET_RX_BUDGET 32
+
 typedef struct {
     uint8_t dst[6];
     uint8_t src[6];
@@ -52,10 +58,19 @@ typedef struct {
     uint16_t seq;
 } __attribute__((packed)) IcmpHeader;
 
-typedef struct {
+#define ARP_CACHE_SIZE 8
+#define ARP_POOL_SIZE  16   /* Live entries plus ones waiting out a grace period */
+
+/* ARP cache is an RCU list: lookups on the TX path are lock-free, updates
+ * from the RX bottom half replace entries and free the old copy later. */
+typedef struct ArpEntry ArpEntry;
+struct ArpEntry {
+    ArpEntry *next;
     uint32_t ip;
     uint8_t mac[6];
-} ArpEntry;
+    uint8_t in_use;
+    RcuHead rcu;
+};
 
 static Rtl8139Device g_nic;
 static int g_net_ready = 0;
@@ -63,7 +78,8 @@ static int g_net_ready = 0;
 static uint32_t g_ip = 0;
 static uint32_t g_netmask = 0;
 static uint32_t g_gateway = 0;
-static ArpEntry g_arp[8];
+static ArpEntry g_arp_pool[ARP_POOL_SIZE];
+static ArpEntry *g_arp_list = 0;
 static int g_arp_count = 0;
 
 static uint16_t swap16(uint16_t v) {
@@ -90,34 +106,93 @@ static uint16_t checksum16(const void *data, uint32_t len) {
     return (uint16_t)~sum;
 }
 
+static ArpEntry *arp_entry_alloc(void) {
+    for (int i = 0; i < ARP_POOL_SIZE; i++) {
+        if (!g_arp_pool[i].in_use) {
+            g_arp_pool[i].in_use = 1;
+            return &g_arp_pool[i];
+        }
+    }
+    return 0;
+}
+
+static void arp_entry_free_rcu(RcuHead *head) {
+    ArpEntry *entry = rcu_container_of(head, ArpEntry, rcu);
+    entry->in_use = 0;
+}
+
 static void arp_cache_set(uint32_t ip, const uint8_t *mac) {
-    for (int i = 0; i < g_arp_count; i++) {
-        if (g_arp[i].ip == ip) {
-            for (int j = 0; j < 6; j++) {
-                g_arp[i].mac[j] = mac[j];
+    uint64_t flags = local_irq_save();
+
+    ArpEntry **link = &g_arp_list;
+    ArpEntry *old = g_arp_list;
+    while (old && old->ip != ip) {
+        link = &old->next;
+        old = old->next;
+    }
+
+    if (old) {
+        int same = 1;
+        for (int j = 0; j < 6; j++) {
+            if (old->mac[j] != mac[j]) {
+                same = 0;
             }
+        }
+        if (same) {
+            local_irq_restore(flags);
             return;
         }
     }
-    if (g_arp_count < 8) {
-        g_arp[g_arp_count].ip = ip;
-        for (int j = 0; j < 6; j++) {
-            g_arp[g_arp_count].mac[j] = mac[j];
+
+    ArpEntry *entry = arp_entry_alloc();
+    if (!entry) {
+        local_irq_restore(flags);
+        return;  /* Everything still in a grace period; best effort */
+    }
+    entry->ip = ip;
+    for (int j = 0; j < 6; j++) {
+        entry->mac[j] = mac[j];
+    }
+
+    if (old) {
+        entry->next = old->next;
+        rcu_assign_pointer(*link, entry);
+        rcu_call(&old->rcu, arp_entry_free_rcu);
+    } else {
+        if (g_arp_count >= ARP_CACHE_SIZE) {
+            /* Evict the oldest entry (list tail) */
+            ArpEntry **tail_link = &g_arp_list;
+            while ((*tail_link)->next) {
+                tail_link = &(*tail_link)->next;
+            }
+            ArpEntry *victim = *tail_link;
+            rcu_assign_pointer(*tail_link, (ArpEntry *)0);
+            rcu_call(&victim->rcu, arp_entry_free_rcu);
+            g_arp_count--;
         }
+        entry->next = g_arp_list;
+        rcu_assign_pointer(g_arp_list, entry);
         g_arp_count++;
     }
+
+    local_irq_restore(flags);
 }
 
 static int arp_cache_get(uint32_t ip, uint8_t *mac) {
-    for (int i = 0; i < g_arp_count; i++) {
-        if (g_arp[i].ip == ip) {
+    int found = 0;
+
+    rcu_read_lock();
+    for (ArpEntry *e = rcu_dereference(g_arp_list); e; e = rcu_dereference(e->next)) {
+        if (e->ip == ip) {
             for (int j = 0; j < 6; j++) {
-                mac[j] = g_arp[i].mac[j];
+                mac[j] = e->mac[j];
             }
-            return 1;
+            found = 1;
+            break;
         }
     }
-    return 0;
+    rcu_read_unlock();
+    return found;
 }
 
 static void net_send_frame(const uint8_t *dst, uint16_t type, const void *payload, uint32_t len) {
@@ -170,6 +245,14 @@ static void net_handle_arp(const uint8_t *pkt, uint32_t len) {
     }
 }
 
+/* Outstanding echo request, completed by the RX path */
+static volatile uint32_t g_ping_dest = 0;
+static volatile int g_ping_replied = 0;
+
+/* Set once the NIC interrupt is routed; RX then runs only as a bottom half */
+static int g_rx_irq = 0;
+static volatile int g_rx_pending = 0;
+
 static void net_handle_ip(const uint8_t *pkt, uint32_t len) {
     if (len < sizeof(EthHeader) + sizeof(Ipv4Header)) {
         return;
@@ -187,6 +270,10 @@ static void net_handle_ip(const uint8_t *pkt, uint32_t len) {
 
     if (ip->proto == 1) {
         const IcmpHeader *icmp = (const IcmpHeader *)((const uint8_t *)ip + ihl);
+        if (icmp->type == ICMP_ECHO_REPLY && g_ping_dest != 0 && ip->src == g_ping_dest) {
+            g_ping_replied = 1;
+            return;
+        }
         if (icmp->type == ICMP_ECHO_REQUEST && ip->dst == g_ip) {
             uint32_t payload_len = swap16(ip->total_len) - ihl - sizeof(IcmpHeader);
             uint8_t reply_buf[RTL8139_MAX_FRAME];
@@ -236,24 +323,61 @@ static void net_handle_ip(const uint8_t *pkt, uint32_t len) {
     }
 }
 
-static void net_poll(void) {
+static int net_poll(void) {
     uint8_t buf[RTL8139_MAX_FRAME];
     uint32_t len = 0;
 
-    if (rtl8139_poll(&g_nic, buf, sizeof(buf), &len)) {
-        if (len < sizeof(EthHeader)) {
-            return;
-        }
-        EthHeader *eth = (EthHeader *)buf;
-        uint16_t type = swap16(eth->type);
-        if (type == ETH_TYPE_ARP) {
-            net_handle_arp(buf, len);
-        } else if (type == ETH_TYPE_IP) {
-            net_handle_ip(buf, len);
+    if (!rtl8139_poll(&g_nic, buf, sizeof(buf), &len)) {
+        return 0;
+    }
+    if (len < sizeof(EthHeader)) {
+        return 1;
+    }
+    EthHeader *eth = (EthHeader *)buf;
+    uint16_t type = swap16(eth->type);
+    if (type == ETH_TYPE_ARP) {
+        net_handle_arp(buf, len);
+    } else if (type == ETH_TYPE_IP) {
+        net_handle_ip(buf, len);
+    }
+    return 1;
+}
+
+/* RX bottom half: drain a bounded number of frames, requeue if more remain */
+static void net_rx_softirq(uint64_t arg) {
+    (void)arg;
+    int budget = NET_RX_BUDGET;
+    while (budget > 0 && net_poll()) {
+        budget--;
+    }
+    if (budget == 0 && softirq_queue(net_rx_softirq, 0)) {
+        return;
+    }
+    g_rx_pending = 0;
+}
+
+/* RX top half: acknowledge the NIC and defer frame processing */
+static void net_irq(uint8_t irq) {
+    (void)irq;
+    uint16_t status = rtl8139_irq_ack(&g_nic);
+    if ((status & 0x03) && !g_rx_pending) {   /* ROK | RER */
+        g_rx_pending = 1;
+        if (!softirq_queue(net_rx_softirq, 0)) {
+            g_rx_pending = 0;
         }
     }
 }
 
+/* Make RX progress from a busy-wait loop */
+static void net_service(void) {
+    if (g_rx_irq) {
+        softirq_run();
+        __asm__ __volatile__("pause");
+    } else {
+        net_poll();
+    }
+}
+
 static int arp_resolve(uint32_t ip, uint8_t *mac_out) {
     if (arp_cache_get(ip, mac_out)) {
         return 1;
@@ -276,7 +400,7 @@ static int arp_resolve(uint32_t ip, uint8_t *mac_out) {
     net_send_frame(broadcast, ETH_TYPE_ARP, &req, sizeof(ArpPacket));
 
     for (int i = 0; i < 50000; i++) {
-        net_poll();
+        net_service();
         if (arp_cache_get(ip, mac_out)) {
             return 1;
         }
@@ -294,6 +418,10 @@ int net_init(void) {
     g_netmask = swap32(0xFFFFFF00); /* 255.255.255.0 */
     g_gateway = swap32(0x0A000202); /* 10.0.2.2 */
 
+    if (g_nic.irq_line < IRQ_LINES && irq_register(g_nic.irq_line, net_irq)) {
+        g_rx_irq = 1;
+    }
+
     g_net_ready = 1;
     return 1;
 }
@@ -454,30 +582,19 @@ int net_ping(const char *ip_str) {
     if (total_len < 60) {
         total_len = 60;
     }
+    g_ping_replied = 0;
+    g_ping_dest = dest_ip;
     rtl8139_send(&g_nic, packet, total_len);
 
+    int replied = 0;
     for (int i = 0; i < 200000; i++) {
-        uint8_t buf[RTL8139_MAX_FRAME];
-        uint32_t len = 0;
-        if (rtl8139_poll(&g_nic, buf, sizeof(buf), &len)) {
-            if (len < sizeof(EthHeader) + sizeof(Ipv4Header) + sizeof(IcmpHeader)) {
-                continue;
-            }
-            EthHeader *reth = (EthHeader *)buf;
-            if (swap16(reth->type) != ETH_TYPE_IP) {
-                continue;
-            }
-            Ipv4Header *rip = (Ipv4Header *)(buf + sizeof(EthHeader));
-            if (rip->proto != 1 || rip->src != dest_ip) {
-                continue;
-            }
-            IcmpHeader *ricmp = (IcmpHeader *)((uint8_t *)rip + sizeof(Ipv4Header));
-            if (ricmp->type == ICMP_ECHO_REPLY) {
-                return 1;
-            }
+        net_service();
+        if (g_ping_replied) {
+            replied = 1;
+            break;
         }
-        net_poll();
     }
 
-    return 0;
+    g_ping_dest = 0;
+    return replied;
 }
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include "fileblk.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int fileblk_transfer(FileBlk *fb, BlockRequest *req) {
+    if (req->op == BLOCK_OP_FLUSH) {
+        fb->syscalls++;
+        return fdatasync(fb->fd) == 0 ? BLOCK_OK : BLOCK_EIO;
+    }
+    if (req->op == BLOCK_OP_DISCARD) {
+        /* The hole reads back as zeros and gives the space back to the host */
+        fb->syscalls++;
+        return fallocate(fb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t)(req->lba * fb->dev.sector_size),
+                         (off_t)req->count * fb->dev.sector_size) == 0 ? BLOCK_OK : BLOCK_EIO;
+    }
+
+    struct iovec iov[BLOCK_MAX_SEGMENTS];
+    size_t total = 0;
+    for (uint32_t i = 0; i < req->segment_count; i++) {
+        iov[i].iov_base = req->segments[i].buf;
+        iov[i].iov_len = req->segments[i].len;
+        total += req->segments[i].len;
+    }
+
+    off_t offset = (off_t)(req->lba * fb->dev.sector_size);
+    ssize_t n;
+    fb->syscalls++;
+    if (req->op == BLOCK_OP_READ) {
+        n = preadv(fb->fd, iov, (int)req->segment_count, offset);
+    } else {
+        n = pwritev(fb->fd, iov, (int)req->segment_count, offset);
+    }
+    return n == (ssize_t)total ? BLOCK_OK : BLOCK_EIO;
+}
+
+static int fileblk_poll(BlockDevice *dev) {
+    FileBlk *fb = (FileBlk *)dev->driver_data;
+    BlockRequest *done[FILEBLK_QUEUE_DEPTH];
+    int count = 0;
+
+    for (int slot = 0; slot < FILEBLK_QUEUE_DEPTH; slot++) {
+        if (fb->busy & (1U << slot)) {
+            done[count++] = fb->slot_req[slot];
+            fb->slot_req[slot] = 0;
+        }
+    }
+    fb->busy = 0;
+
+    for (int i = 0; i < count; i++) {
+        block_complete(done[i], fileblk_transfer(fb, done[i]));
+    }
+    return count;
+}
+
+static int fileblk_submit(BlockDevice *dev, BlockRequest *req) {
+    FileBlk *fb = (FileBlk *)dev->driver_data;
+    for (int slot = 0; slot < FILEBLK_QUEUE_DEPTH; slot++) {
+        if (!(fb->busy & (1U << slot))) {
+            fb->slot_req[slot] = req;
+            fb->busy |= 1U << slot;
+            return BLOCK_OK;
+        }
+    }
+    return BLOCK_EBUSY;
+}
+
+int fileblk_open(FileBlk *fb, const char *path, int writable, uint32_t sector_size) {
+    fb->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fb->fd < 0) {
+        perror(path);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fb->fd, &st) != 0 || st.st_size < sector_size) {
+        fprintf(stderr, "%s: not a disk image\n", path);
+        close(fb->fd);
+        return 0;
+    }
+
+    fb->busy = 0;
+    fb->syscalls = 0;
+    fb->dev.name = "file0";
+    fb->dev.sector_size = sector_size;
+    fb->dev.total_sectors = (uint64_t)st.st_size / sector_size;
+    fb->dev.driver_data = fb;
+    fb->dev.max_segments = BLOCK_MAX_SEGMENTS;
+    fb->dev.max_sectors = (1024 * 1024) / sector_size;
+    fb->dev.max_discard_sectors = writable ? (1U << 30) / sector_size : 0;
+    fb->dev.queue_depth = FILEBLK_QUEUE_DEPTH;
+    fb->dev.submit = fileblk_submit;
+    fb->dev.poll = fileblk_poll;
+
+    if (!block_register(&fb->dev)) {
+        close(fb->fd);
+        return 0;
+    }
+    return 1;
+}
+
+void fileblk_close(FileBlk *fb) {
+    block_unregister(&fb->dev);
+    close(fb->fd);
+}
@@ -0,0 +1,24 @@
+#ifndef KAGAMI_HOSTFS_FILEBLK_H
+#define KAGAMI_HOSTFS_FILEBLK_H
+
+#include "drivers/storage/block.h"
+
+#define FILEBLK_QUEUE_DEPTH 32
+
+/* BlockDevice over a disk image. Submit takes a slot; poll does the
+ * preadv/pwritev and completes, the way hardware finishes later.
+ * Discards punch holes in the image. */
+typedef struct {
+    BlockDevice dev;
+    int fd;
+    BlockRequest *slot_req[FILEBLK_QUEUE_DEPTH];
+    uint32_t busy;                  /* Slot bitmap */
+    uint64_t syscalls;
+} FileBlk;
+
+/* Open path and register it as a block device with sector_size byte
+ * logical blocks (4096 stands in for a 4Kn disk). Returns 1 on success. */
+int fileblk_open(FileBlk *fb, const char *path, int writable, uint32_t sector_size);
+void fileblk_close(FileBlk *fb);
+
+#endif
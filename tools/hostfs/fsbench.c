@@ -0,0 +1,259 @@
+/* Filesystem benchmark on the host.
+ *
+ * Runs the kernel's ext4, partition, buffer cache and block layer code
+ * over a disk image so filesystem work can be measured in seconds
+ * instead of a QEMU boot. Reports path lookups/s and read/write MB/s,
+ * plus what the block layer and cache saw. "Cold" means the kernel buffer
+ * cache was dropped; the host page cache may still hold the image. The
+ * write test leaves /fsbench.tmp on the image, and since the kernel does
+ * not update metadata checksums, e2fsck will reject the image afterwards:
+ * run it on a scratch copy.
+ */
+#include "fileblk.h"
+#include "host.h"
+#include "drivers/storage/bufcache.h"
+#include "drivers/storage/partition.h"
+#include "fs/ext4/ext4.h"
+#include "tsc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FSBENCH_MAX_PATHS   4096
+#define FSBENCH_PATH_MAX    256
+#define FSBENCH_LIST_BYTES  65536
+#define FSBENCH_CHUNK       65536
+#define FSBENCH_READ_MAX    (256ULL << 20)   /* Bytes read per pass */
+#define FSBENCH_WRITE_PATH  "/fsbench.tmp"
+
+static char paths[FSBENCH_MAX_PATHS][FSBENCH_PATH_MAX];
+static int is_dir[FSBENCH_MAX_PATHS];
+static int path_count = 0;
+
+static double seconds_since(uint64_t start_ns) {
+    return (double)(host_now_ns() - start_ns) / 1e9;
+}
+
+/* Breadth-first walk from / collecting every path ext4_list_dir shows */
+static void collect_paths(Ext4Fs *fs) {
+    static char list[FSBENCH_LIST_BYTES];
+    strcpy(paths[0], "/");
+    is_dir[0] = 1;
+    path_count = 1;
+
+    for (int i = 0; i < path_count; i++) {
+        if (!is_dir[i] || !ext4_list_dir(fs, paths[i], list, sizeof(list))) {
+            continue;
+        }
+        for (char *name = list; *name; ) {
+            char *end = strchr(name, '\n');
+            if (!end) {
+                break;
+            }
+            *end = 0;
+            if (path_count < FSBENCH_MAX_PATHS) {
+                int n = snprintf(paths[path_count], FSBENCH_PATH_MAX, "%s%s%s",
+                                 paths[i], strcmp(paths[i], "/") ? "/" : "", name);
+                if (n > 0 && n < FSBENCH_PATH_MAX) {
+                    static char probe[64];
+                    is_dir[path_count] = ext4_list_dir(fs, paths[path_count], probe, sizeof(probe));
+                    path_count++;
+                }
+            }
+            name = end + 1;
+        }
+    }
+}
+
+/* Resolve every file path, all components each time */
+static void bench_lookups(Ext4Fs *fs, double duration) {
+    uint64_t lookups = 0;
+    uint64_t failed = 0;
+    int files = 0;
+    for (int i = 0; i < path_count; i++) {
+        files += !is_dir[i];
+    }
+    if (files == 0) {
+        printf("lookup   (no files on the image)\n");
+        return;
+    }
+
+    uint64_t start = host_now_ns();
+    while (seconds_since(start) < duration) {
+        for (int i = 0; i < path_count; i++) {
+            uint64_t size;
+            if (is_dir[i]) {
+                continue;
+            }
+            if (!ext4_file_size(fs, paths[i], &size)) {
+                failed++;
+            }
+            lookups++;
+        }
+    }
+    double secs = seconds_since(start);
+    printf("lookup   %10.0f lookups/s  (%d files, %llu failed)\n",
+           lookups / secs, files, (unsigned long long)failed);
+}
+
+/* Read every regular file front to back in FSBENCH_CHUNK pieces */
+static void bench_read(Ext4Fs *fs, const char *label) {
+    static uint8_t chunk[FSBENCH_CHUNK];
+    uint64_t bytes = 0;
+    int files = 0;
+    uint64_t start = host_now_ns();
+
+    for (int i = 0; i < path_count && bytes < FSBENCH_READ_MAX; i++) {
+        uint64_t size;
+        if (is_dir[i] || !ext4_file_size(fs, paths[i], &size) || size == 0) {
+            continue;
+        }
+        files++;
+        for (uint64_t off = 0; off < size && bytes < FSBENCH_READ_MAX; ) {
+            uint32_t got = 0;
+            if (!ext4_read_file_at(fs, paths[i], off, chunk, sizeof(chunk), &got) || got == 0) {
+                break;
+            }
+            off += got;
+            bytes += got;
+        }
+    }
+
+    double secs = seconds_since(start);
+    if (files == 0) {
+        printf("read     (no non-empty files on the image)\n");
+        return;
+    }
+    printf("read     %10.1f MB/s  %s (%d files, %.1f MB)\n",
+           bytes / secs / 1e6, label, files, bytes / 1e6);
+}
+
+static int bench_write(Ext4Fs *fs, BlockDevice *dev, uint32_t size, double duration) {
+    uint8_t *data = malloc(size);
+    uint8_t *check = malloc(size);
+    if (!data || !check) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 12));
+    }
+
+    uint64_t bytes = 0;
+    int rounds = 0;
+    uint64_t start = host_now_ns();
+    do {
+        data[0] = (uint8_t)rounds;
+        if (!ext4_write_file(fs, FSBENCH_WRITE_PATH, data, size) || !bufcache_sync(dev)) {
+            printf("write    failed\n");
+            return 0;
+        }
+        bytes += size;
+        rounds++;
+    } while (seconds_since(start) < duration);
+    double secs = seconds_since(start);
+
+    /* Read back cold so the data comes from the image, not the cache */
+    uint32_t got = 0;
+    bufcache_invalidate(dev);
+    int ok = ext4_read_file(fs, FSBENCH_WRITE_PATH, check, size, &got) && got == size &&
+             memcmp(data, check, size) == 0;
+    printf("write    %10.1f MB/s  (%d x %u KB + sync, readback %s)\n",
+           bytes / secs / 1e6, rounds, size / 1024, ok ? "ok" : "MISMATCH");
+    free(data);
+    free(check);
+    return ok;
+}
+
+static void print_stats(FileBlk *fb) {
+    BlockIoStats io;
+    BufCacheStats bs;
+    block_io_stats(&fb->dev, &io);
+    bufcache_get_stats(&bs);
+
+    static const char *names[BLOCK_OP_COUNT] = { "reads", "writes", "flushes", "discards" };
+    for (int op = 0; op < BLOCK_OP_COUNT; op++) {
+        if (io.ops[op]) {
+            printf("device   %-7s %8llu cmds %10.1f MB  avg %llu us\n", names[op],
+                   (unsigned long long)io.ops[op], (double)io.sectors[op] * fb->dev.sector_size / 1e6,
+                   (unsigned long long)tsc_to_us(io.service_cycles[op] / io.ops[op]));
+        }
+    }
+    printf("device   %llu syscalls\n", (unsigned long long)fb->syscalls);
+    printf("cache    %u buffers, %llu hits %llu misses, readahead %llu/%llu used\n",
+           bs.capacity, (unsigned long long)bs.hits, (unsigned long long)bs.misses,
+           (unsigned long long)bs.ra_hits, (unsigned long long)bs.ra_issued);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n] [-v] [-b bytes] [-m MB] [-s KB] [-t seconds] <image>\n"
+            "  -n  read-only, skip the write test (otherwise the image is modified)\n"
+            "  -v  show kernel serial/klog output\n"
+            "  -b  logical sector size of the image (default 512, 4096 for 4Kn)\n"
+            "  -m  RAM of the emulated machine (default 512), sizes the cache\n"
+            "  -s  size of the write test file (default 4096 KB)\n"
+            "  -t  seconds per timed test (default 2)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int read_only = 0;
+    uint32_t write_kb = 4096;
+    double duration = 2.0;
+    uint32_t sector_size = 512;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nvb:m:s:t:")) != -1) {
+        switch (opt) {
+            case 'n': read_only = 1; break;
+            case 'v': host_set_verbose(1); break;
+            case 'b': sector_size = (uint32_t)strtoul(optarg, 0, 10); break;
+            case 'm': host_set_ram(strtoull(optarg, 0, 10) << 20); break;
+            case 's': write_kb = (uint32_t)strtoul(optarg, 0, 10); break;
+            case 't': duration = atof(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 1 || write_kb == 0 || write_kb > 65536) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    static FileBlk fb;
+    if (!fileblk_open(&fb, argv[optind], !read_only, sector_size)) {
+        return 1;
+    }
+    bufcache_init();
+
+    PartitionInfo part;
+    static Ext4Fs fs;
+    if (!find_linux_partition(&fb.dev, &part)) {
+        fprintf(stderr, "%s: no ext4 partition found\n", argv[optind]);
+        return 1;
+    }
+    if (!ext4_mount(&fs, &fb.dev, part.first_lba)) {
+        fprintf(stderr, "%s: ext4 mount failed\n", argv[optind]);
+        return 1;
+    }
+    printf("image    %s, %u byte sectors, ext4 at LBA %llu, %u byte blocks\n", argv[optind],
+           fb.dev.sector_size, (unsigned long long)part.first_lba, fs.sb.block_size);
+
+    collect_paths(&fs);
+    bench_lookups(&fs, duration);
+
+    bufcache_invalidate(&fb.dev);
+    bench_read(&fs, "cold cache");
+    bench_read(&fs, "warm cache");
+
+    int ok = 1;
+    if (!read_only) {
+        ok = bench_write(&fs, &fb.dev, write_kb * 1024, duration);
+    }
+
+    print_stats(&fb);
+    bufcache_sync(&fb.dev);
+    fileblk_close(&fb);
+    return ok ? 0 : 1;
+}
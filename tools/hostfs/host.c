@@ -0,0 +1,150 @@
+#include "host.h"
+#include "pmm.h"
+#include "tsc.h"
+#include "serial.h"
+#include "klog.h"
+#include "rcu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t ram_pages = (512ULL << 20) / PMM_PAGE_SIZE;
+static uint64_t used_pages = 0;
+static int verbose = 0;
+static uint64_t khz = 0;
+static uint32_t rcu_depth = 0;
+static RcuHead *rcu_pending = 0;
+
+void host_set_ram(uint64_t bytes) {
+    ram_pages = bytes / PMM_PAGE_SIZE;
+}
+
+void host_set_verbose(int on) {
+    verbose = on;
+}
+
+uint64_t host_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void *pmm_alloc_pages(uint64_t pages) {
+    if (!pages || pages > ram_pages - used_pages) {
+        return 0;
+    }
+    void *p = aligned_alloc(PMM_PAGE_SIZE, pages * PMM_PAGE_SIZE);
+    if (!p) {
+        return 0;
+    }
+    memset(p, 0, pages * PMM_PAGE_SIZE);
+    used_pages += pages;
+    return p;
+}
+
+uint64_t pmm_free_pages(void) {
+    return ram_pages - used_pages;
+}
+
+uint64_t pmm_total_pages(void) {
+    return ram_pages;
+}
+
+/* The block layer only uses the TSC for deadlines and accounting; measure
+ * it against the monotonic clock once */
+uint64_t tsc_khz(void) {
+    if (!khz) {
+        uint64_t t0 = host_now_ns();
+        uint64_t c0 = rdtsc();
+        while (host_now_ns() - t0 < 20000000ULL) {
+        }
+        uint64_t cycles = rdtsc() - c0;
+        uint64_t ns = host_now_ns() - t0;
+        khz = cycles * 1000000ULL / ns;
+        if (!khz) {
+            khz = 1;
+        }
+    }
+    return khz;
+}
+
+void tsc_calibrate(void) {
+    tsc_khz();
+}
+
+void serial_init(void) {
+}
+
+void serial_write_char(char c) {
+    if (verbose) {
+        fputc(c, stderr);
+    }
+}
+
+void serial_write(const char *s) {
+    if (verbose) {
+        fputs(s, stderr);
+    }
+}
+
+void klog_init_fb(unsigned int *fb, unsigned int pitch, unsigned int width, unsigned int height) {
+    (void)fb;
+    (void)pitch;
+    (void)width;
+    (void)height;
+}
+
+void klog_enable(int enabled) {
+    (void)enabled;
+}
+
+void klog_info(const char *msg) {
+    if (verbose) {
+        fprintf(stderr, "[klog] %s\n", msg);
+    }
+}
+
+void klog_error(const char *msg) {
+    fprintf(stderr, "[klog error] %s\n", msg);
+}
+
+/* One thread: a grace period ends whenever no read section is open, so
+ * callbacks run at once or when the outermost section closes */
+static void rcu_run_pending(void) {
+    while (rcu_pending) {
+        RcuHead *head = rcu_pending;
+        rcu_pending = head->next;
+        head->func(head);
+    }
+}
+
+void rcu_read_lock(void) {
+    rcu_depth++;
+}
+
+void rcu_read_unlock(void) {
+    if (--rcu_depth == 0) {
+        rcu_run_pending();
+    }
+}
+
+void rcu_quiescent_state(void) {
+}
+
+void rcu_call(RcuHead *head, rcu_callback_t func) {
+    head->func = func;
+    head->next = rcu_pending;
+    rcu_pending = head;
+    if (rcu_depth == 0) {
+        rcu_run_pending();
+    }
+}
+
+void synchronize_rcu(void) {
+}
+
+void rcu_get_stats(RcuStats *out) {
+    memset(out, 0, sizeof(*out));
+}
@@ -0,0 +1,16 @@
+#ifndef KAGAMI_HOSTFS_HOST_H
+#define KAGAMI_HOSTFS_HOST_H
+
+#include "types.h"
+
+/* Kernel services the storage code links against (serial, klog, pmm,
+ * TSC, RCU), backed by libc */
+
+/* RAM the emulated machine has; bufcache_init() sizes the cache from it */
+void host_set_ram(uint64_t bytes);
+/* Echo serial and klog output to stderr */
+void host_set_verbose(int verbose);
+/* Monotonic wall clock */
+uint64_t host_now_ns(void);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef KAGAMI_IRQFLAGS_H
+#define KAGAMI_IRQFLAGS_H
+
+#include "types.h"
+
+/* Host build: one thread and no interrupts, so there is nothing to mask */
+
+#define RFLAGS_IF (1ULL << 9)
+
+static inline uint64_t local_irq_save(void) {
+    return 0;
+}
+
+static inline void local_irq_restore(uint64_t flags) {
+    (void)flags;
+}
+
+static inline void local_irq_enable(void) {
+}
+
+static inline void local_irq_disable(void) {
+}
+
+static inline int irqs_enabled(void) {
+    return 0;
+}
+
+#endif
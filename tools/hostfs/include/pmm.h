@@ -0,0 +1,14 @@
+#ifndef KAGAMI_PMM_H
+#define KAGAMI_PMM_H
+
+#include "types.h"
+
+/* Host build: pages come from the C heap and are never returned */
+
+#define PMM_PAGE_SIZE   4096
+
+void *pmm_alloc_pages(uint64_t pages);
+uint64_t pmm_free_pages(void);
+uint64_t pmm_total_pages(void);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef KERNEL_TYPES_H
+#define KERNEL_TYPES_H
+
+/* Host build: take the fixed-width types from libc so kernel code and
+ * the host driver agree on them */
+#include <stdint.h>
+#include <stddef.h>
+
+#endif
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Turn a `prof dump` serial capture into per-function cycle accounting.
+
+Usage: tools/profreport.py [--elf build/kernel.elf] [--sort excl|incl|calls]
+                           [--top N] [--only name,name] serial.log
+
+The kernel must be built with `make PROFILE=calls`. Addresses are resolved
+against the kernel ELF with nm, so pass the exact kernel.elf that was booted.
+"""
+
+import argparse
+import bisect
+import subprocess
+import sys
+
+
+def load_symbols(elf):
+    out = subprocess.run(["nm", "-n", "--defined-only", elf],
+                         check=True, capture_output=True, text=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) != 3 or parts[1] not in "tTwW":
+            continue
+        addrs.append(int(parts[0], 16))
+        names.append(parts[2])
+    return addrs, names
+
+
+def resolve(addrs, names, cache, addr):
+    name = cache.get(addr)
+    if name is None:
+        i = bisect.bisect_right(addrs, addr) - 1
+        name = names[i] if i >= 0 else "0x%x" % addr
+        cache[addr] = name
+    return name
+
+
+def read_events(path):
+    events = []
+    inside = False
+    with open(path, errors="replace") as f:
+        for raw in f:
+            line = raw.strip()
+            if line.startswith("PROF BEGIN"):
+                events = []
+                inside = True
+                continue
+            if line.startswith("PROF END"):
+                inside = False
+                continue
+            if not inside:
+                continue
+            parts = line.split()
+            if len(parts) != 3 or parts[0] not in ("E", "X"):
+                continue
+            events.append((parts[0] == "E", int(parts[1], 16), int(parts[2], 16)))
+    return events
+
+
+def account(events, symname):
+    # name -> [calls, inclusive, exclusive]
+    stats = {}
+    stack = []  # [fn, start_tsc, child_cycles]
+    for is_enter, fn, tsc in events:
+        if is_enter:
+            stack.append([fn, tsc, 0])
+            continue
+        # The ring may start mid-call: drop exits with no matching entry.
+        depth = len(stack) - 1
+        while depth >= 0 and stack[depth][0] != fn:
+            depth -= 1
+        if depth < 0:
+            continue
+        del stack[depth + 1:]
+        fn, start, child = stack.pop()
+        incl = tsc - start
+        entry = stats.setdefault(symname(fn), [0, 0, 0])
+        entry[0] += 1
+        entry[1] += incl
+        entry[2] += incl - child
+        if stack:
+            stack[-1][2] += incl
+    return stats
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("log", help="serial capture containing a prof dump")
+    ap.add_argument("--elf", default="build/kernel.elf")
+    ap.add_argument("--sort", choices=("excl", "incl", "calls"), default="excl")
+    ap.add_argument("--top", type=int, default=40)
+    ap.add_argument("--only", default="", help="comma separated function names")
+    args = ap.parse_args()
+
+    events = read_events(args.log)
+    if not events:
+        sys.exit("no PROF BEGIN/END block found in %s" % args.log)
+
+    addrs, names = load_symbols(args.elf)
+    cache = {}
+    stats = account(events, lambda a: resolve(addrs, names, cache, a))
+
+    key = {"calls": 0, "incl": 1, "excl": 2}[args.sort]
+    rows = sorted(stats.items(), key=lambda kv: kv[1][key], reverse=True)
+    if args.only:
+        wanted = set(args.only.split(","))
+        rows = [r for r in rows if r[0] in wanted]
+    else:
+        rows = rows[:args.top]
+
+    total = sum(v[2] for v in stats.values()) or 1
+    print("%-32s %10s %16s %16s %12s %6s" %
+          ("function", "calls", "incl cycles", "excl cycles", "excl/call", "excl%"))
+    for name, (calls, incl, excl) in rows:
+        print("%-32s %10d %16d %16d %12d %5.1f%%" %
+              (name[:32], calls, incl, excl, excl // max(calls, 1), 100.0 * excl / total))
+    print("\n%d events, %d functions" % (len(events), len(stats)))
+
+
+if __name__ == "__main__":
+    main()